@@ -98,6 +98,15 @@ contains(USE_IPV6, -) {
     DEFINES += USE_IPV6=$$USE_IPV6
 }
 
+# use: qmake "USE_SECP256K1=1" ( enabled by default; default)
+#  or: qmake "USE_SECP256K1=0" (verify signatures with OpenSSL)
+count(USE_SECP256K1, 0) {
+    USE_SECP256K1=1
+}
+contains(USE_SECP256K1, 1) {
+    DEFINES += USE_SECP256K1
+}
+
 contains(BITCOIN_NEED_QT_PLUGINS, 1) {
     DEFINES += BITCOIN_NEED_QT_PLUGINS
     QTPLUGIN += qcncodecs qjpcodecs qtwcodecs qkrcodecs qtaccessiblewidgets
@@ -159,6 +168,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/muhash.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
@@ -167,6 +177,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/db.h \
     src/walletdb.h \
     src/script.h \
+    src/sigcache.h \
+    src/secp256k1.h \
     src/init.h \
     src/bloom.h \
     src/mruset.h \
@@ -213,6 +225,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/ui_interface.h \
     src/qt/rpcconsole.h \
     src/scrypt.h \
+    src/stratum.h \
+    src/scrypt-smix.h \
     src/version.h \
     src/netbase.h \
     src/clientversion.h \
@@ -244,6 +258,8 @@ SOURCES += src/qt/bitcoin.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
+    src/sigcache.cpp \
+    src/secp256k1.cpp \
     src/main.cpp \
     src/init.cpp \
     src/net.cpp \
@@ -273,6 +289,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
+    src/stratum.cpp \
     src/rpcwallet.cpp \
     src/rpcblockchain.cpp \
     src/rpcrawtransaction.cpp \
@@ -333,6 +350,14 @@ gccsse2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
 gccsse2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -msse2 -mstackrealign
 QMAKE_EXTRA_COMPILERS += gccsse2
 SOURCES_SSE2 += src/scrypt-sse2.cpp
+contains(USE_AVX2, 1) {
+DEFINES += USE_AVX2
+gccavx2.input  = SOURCES_AVX2
+gccavx2.output = $$PWD/build/${QMAKE_FILE_BASE}.o
+gccavx2.commands = $(CXX) -c $(CXXFLAGS) $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_NAME} -mavx2 -mstackrealign
+QMAKE_EXTRA_COMPILERS += gccavx2
+SOURCES_AVX2 += src/scrypt-avx2.cpp
+}
 }
 
 # Todo: Remove this line when switching to Qt5, as that option was removed
@@ -448,6 +448,24 @@ public:
         return *this;
     }
 
+    // this = this * b mod m
+    CBigNum& MulMod(const CBigNum& b, const CBigNum& m, BN_CTX *pctx)
+    {
+        if (!BN_mod_mul(this, this, &b, &m, pctx))
+            throw bignum_error("CBigNum::MulMod : BN_mod_mul failed");
+        return *this;
+    }
+
+    // x such that this * x = 1 mod m
+    CBigNum InverseMod(const CBigNum& m) const
+    {
+        CAutoBN_CTX pctx;
+        CBigNum ret;
+        if (!BN_mod_inverse(&ret, this, &m, pctx))
+            throw bignum_error("CBigNum::InverseMod : BN_mod_inverse failed");
+        return ret;
+    }
+
     CBigNum& operator<<=(unsigned int shift)
     {
         if (!BN_lshift(this, this, shift))
@@ -213,6 +213,8 @@ static const CRPCCommand vRPCCommands[] =
     { "gethashespersec",        &gethashespersec,        true,      false,      false },
     { "getinfo",                &getinfo,                true,      false,      false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
+    { "getpowcacheinfo",        &getpowcacheinfo,        true,      true,       false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,      true,       false },
     { "getnewaddress",          &getnewaddress,          true,      false,      true },
     { "getaccountaddress",      &getaccountaddress,      true,      false,      true },
     { "setaccount",             &setaccount,             true,      false,      true },
@@ -261,7 +263,7 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "getnormalizedtxid",      &getnormalizedtxid,      true,      true,       false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      true,       false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
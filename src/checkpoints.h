@@ -4,10 +4,12 @@
 #ifndef BITCOIN_CHECKPOINT_H
 #define BITCOIN_CHECKPOINT_H
 
-#include <map>
+#include <boost/unordered_map.hpp>
 
 class uint256;
 class CBlockIndex;
+struct BlockHasher;
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
  * They are updated every release or three.
@@ -21,7 +23,7 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     double GuessVerificationProgress(CBlockIndex *pindex);
 }
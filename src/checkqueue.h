@@ -11,18 +11,38 @@
 #include <vector>
 #include <algorithm>
 
-template<typename T> class CCheckQueueControl;
+/** Batch type for checks that defer nothing */
+class CCheckQueueNoBatch {
+public:
+    bool Verify() { return true; }
+    void Clear() {}
+};
+
+template<typename T, typename B> inline bool CheckQueueRun(T &check, B &batch) {
+    return check(batch);
+}
+
+template<typename T> inline bool CheckQueueRun(T &check, CCheckQueueNoBatch &batch) {
+    return check();
+}
+
+template<typename T, typename B = CCheckQueueNoBatch> class CCheckQueueControl;
 
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
+  * With a batch type B, operator()(B&) is called instead, and checks may
+  * leave part of their work in the batch of their worker. After each batch
+  * of checks, the worker calls B::Verify(), which must do that work and
+  * return whether all of it succeeded.
+  *
   * One thread (the master) is assumed to push batches of verifications
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
   */
-template<typename T> class CCheckQueue {
+template<typename T, typename B = CCheckQueueNoBatch> class CCheckQueue {
 private:
     // Mutex to protect the inner state
     boost::mutex mutex;
@@ -62,6 +82,7 @@ private:
         boost::condition_variable &cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
+        B batch;
         unsigned int nNow = 0;
         bool fOk = true;
         do {
@@ -112,7 +133,11 @@ private:
             // execute work
             BOOST_FOREACH(T &check, vChecks)
                 if (fOk)
-                    fOk = check();
+                    fOk = CheckQueueRun(check, batch);
+            // and what the checks deferred
+            if (fOk)
+                fOk = batch.Verify();
+            batch.Clear();
             vChecks.clear();
         } while(true);
     }
@@ -149,19 +174,19 @@ public:
     ~CCheckQueue() {
     }
 
-    friend class CCheckQueueControl<T>;
+    friend class CCheckQueueControl<T, B>;
 };
 
 /** RAII-style controller object for a CCheckQueue that guarantees the passed
  *  queue is finished before continuing.
  */
-template<typename T> class CCheckQueueControl {
+template<typename T, typename B> class CCheckQueueControl {
 private:
-    CCheckQueue<T> *pqueue;
+    CCheckQueue<T, B> *pqueue;
     bool fDone;
 
 public:
-    CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
+    CCheckQueueControl(CCheckQueue<T, B> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
             assert(pqueue->nTotal == pqueue->nIdle);
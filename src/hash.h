@@ -40,6 +40,9 @@ public:
         Init();
     }
 
+    // Continue from a saved SHA256 state
+    CHashWriter(int nTypeIn, int nVersionIn, const SHA256_CTX &ctxIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
     CHashWriter& write(const char *pch, size_t size) {
         SHA256_Update(&ctx, pch, size);
         return (*this);
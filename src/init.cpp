@@ -6,10 +6,15 @@
 #include "txdb.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
+#include "stratum.h"
+#include "base58.h"
 #include "net.h"
 #include "init.h"
 #include "util.h"
 #include "ui_interface.h"
+#ifdef USE_SECP256K1
+#include "secp256k1.h"
+#endif
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -86,6 +91,7 @@ bool ShutdownRequested()
 }
 
 static CCoinsViewDB *pcoinsdbview;
+static CCoinsViewWriter *pcoinswriter;
 
 void Shutdown()
 {
@@ -97,6 +103,7 @@ void Shutdown()
     RenameThread("bitcoin-shutoff");
     nTransactionsUpdated++;
     StopRPCThreads();
+    StopStratumServer();
     ShutdownRPCMining();
     if (pwalletMain)
         bitdb.Flush(false);
@@ -110,7 +117,10 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        if (pcoinswriter && !pcoinswriter->Sync())
+            printf("Shutdown() : failed to write to coin database\n");
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinswriter; pcoinswriter = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
@@ -355,6 +365,12 @@ std::string HelpMessage()
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
 #endif
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -stratum               " + _("Accept stratum mining connections") + "\n" +
+        "  -stratumport=<port>    " + _("Listen for stratum connections on <port> (default: 3333)") + "\n" +
+        "  -stratumallowip=<ip>   " + _("Allow stratum connections from specified IP address") + "\n" +
+        "  -stratumaddress=<addr> " + _("Pay stratum block rewards to <addr> (default: a new wallet key)") + "\n" +
+        "  -stratumdifficulty=<n> " + _("Share difficulty of stratum clients (default: 0.00001)") + "\n" +
+        "  -stratumthreads=<n>    " + _("Set the number of threads to check stratum shares (default: number of cores)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -spendzeroconfchange   " + _("Spend unconfirmed change when sending transactions (default: 1)") + "\n" +
@@ -369,7 +385,13 @@ std::string HelpMessage()
         //"  -fullindexsearch               " + _("Perfom a full index search on getrawtransaction (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
+        "  -coinsperoutput        " + _("Store the coin database one record per unspent output, converting it on startup (default: 0)") + "\n" +
+        "  -importskippow         " + _("Do not recheck proof-of-work of blocks below the last checkpoint when importing or reindexing") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -scrypthugepages       " + _("Back scrypt scratch memory with huge pages when available (default: 0)") + "\n" +
+        "  -scryptpar=<n>         " + _("Set the number of threads evaluating the scrypt lanes of one proof-of-work hash in parallel (up to 16, 0 = auto, <0 = leave that many cores free, default: 1)") + "\n" +
+        "  -powpar=<n>            " + _("Set the number of threads checking the proof of work of received blocks (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -checksecp256k1        " + _("Check every signature with OpenSSL as well as the built-in secp256k1 code, logging any disagreement (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -555,6 +577,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fDebug = GetBoolArg("-debug");
     fBenchmark = GetBoolArg("-benchmark");
+    fCheckSecp256k1 = GetBoolArg("-checksecp256k1");
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", 0);
@@ -565,6 +588,24 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -scryptpar=1 runs the scrypt lanes serially on the hashing thread
+    nScryptLaneThreads = GetArg("-scryptpar", 1);
+    if (nScryptLaneThreads <= 0)
+        nScryptLaneThreads += boost::thread::hardware_concurrency();
+    if (nScryptLaneThreads <= 1)
+        nScryptLaneThreads = 0;
+    else if (nScryptLaneThreads > MAX_SCRYPTLANE_THREADS)
+        nScryptLaneThreads = MAX_SCRYPTLANE_THREADS;
+
+    // -powpar=1 checks received blocks on the message handler thread, still without cs_main
+    nBlockVerifyThreads = GetArg("-powpar", 0);
+    if (nBlockVerifyThreads <= 0)
+        nBlockVerifyThreads += boost::thread::hardware_concurrency();
+    if (nBlockVerifyThreads <= 1)
+        nBlockVerifyThreads = 0;
+    else if (nBlockVerifyThreads > MAX_BLOCKVERIFY_THREADS)
+        nBlockVerifyThreads = MAX_BLOCKVERIFY_THREADS;
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -653,6 +694,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("mediterraneancoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+#ifdef USE_SECP256K1
+    printf("Verifying signatures with the built-in secp256k1 code%s\n", fCheckSecp256k1 ? ", checked against OpenSSL" : "");
+    Secp256k1Init();
+#endif
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -667,6 +712,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsRead);
     }
 
     int64 nStart;
@@ -674,6 +721,20 @@ bool AppInit2(boost::thread_group& threadGroup)
 #if defined(USE_SSE2)
     scrypt_detect_sse2();
 #endif
+    scrypt_set_hugepages(GetBoolArg("-scrypthugepages", false));
+
+    if (nScryptLaneThreads) {
+        printf("Using %u threads for scrypt lanes\n", nScryptLaneThreads);
+        for (int i=0; i<nScryptLaneThreads-1; i++)
+            threadGroup.create_thread(&ThreadScryptLanes);
+    }
+    scrypt_set_lane_threads(nScryptLaneThreads);
+
+    if (nBlockVerifyThreads) {
+        printf("Using %u threads for block verification\n", nBlockVerifyThreads);
+        for (int i=0; i<nBlockVerifyThreads; i++)
+            threadGroup.create_thread(&ThreadBlockVerify);
+    }
 
     // ********************************************************* Step 5: verify wallet database integrity
 
@@ -824,6 +885,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     // ********************************************************* Step 7: load block chain
 
     fReindex = GetBoolArg("-reindex");
+    fImportSkipPoW = GetBoolArg("-importskippow");
 
     // Upgrading to 0.8; hard-link the old blknnnn.dat files into /blocks/
     filesystem::path blocksDir = GetDataDir() / "blocks";
@@ -862,7 +924,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest is for coins held in memory
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -876,12 +938,20 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinswriter;
                 delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                if (pcoinsdbview->IsPerOutput() != GetBoolArg("-coinsperoutput"))
+                    uiInterface.InitMessage(_("Converting coin database..."));
+                if (!pcoinsdbview->SetPerOutput(GetBoolArg("-coinsperoutput"))) {
+                    strLoadError = _("Error converting the coin database");
+                    break;
+                }
+                pcoinswriter = new CCoinsViewWriter(*pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(*pcoinswriter);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -960,7 +1030,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1139,6 +1209,34 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    if (GetBoolArg("-stratum"))
+    {
+        CScript scriptPayout;
+        if (mapArgs.count("-stratumaddress"))
+        {
+            CBitcoinAddress address(mapArgs["-stratumaddress"]);
+            if (!address.IsValid())
+                return InitError(strprintf(_("Invalid address for -stratumaddress=<addr>: '%s'"), mapArgs["-stratumaddress"].c_str()));
+            scriptPayout.SetDestination(address.Get());
+        }
+        else
+        {
+            CPubKey pubkey;
+            if (!pwalletMain || !pwalletMain->GetKeyFromPool(pubkey, false))
+                return InitError(_("Error: -stratum needs -stratumaddress or an unlocked wallet"));
+            scriptPayout << pubkey << OP_CHECKSIG;
+        }
+        double dDifficulty = atof(GetArg("-stratumdifficulty", "0.00001").c_str());
+        if (!(dDifficulty > 0))
+            return InitError(strprintf(_("Invalid amount for -stratumdifficulty=<n>: '%s'"), mapArgs["-stratumdifficulty"].c_str()));
+        int nThreads = GetArg("-stratumthreads", 0);
+        if (nThreads <= 0)
+            nThreads += boost::thread::hardware_concurrency();
+        int nPort = GetArg("-stratumport", 3333);
+        if (!StartStratumServer(scriptPayout, dDifficulty, nPort, nThreads))
+            return InitError(strprintf(_("Unable to bind to port %d for stratum connections"), nPort));
+    }
+
     // Generate coins in the background
     if (pwalletMain)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
@@ -7,6 +7,10 @@
 #include <openssl/obj_mac.h>
 
 #include "key.h"
+#include "util.h"
+#ifdef USE_SECP256K1
+#include "secp256k1.h"
+#endif
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
@@ -340,15 +344,26 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
     return true;
 }
 
+bool fCheckSecp256k1 = false;
+uint64 nSecp256k1Mismatches = 0;
+
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+#ifdef USE_SECP256K1
+    bool fValid = Secp256k1Verify(hash, vchSig, begin(), size());
+    if (!fCheckSecp256k1)
+        return fValid;
+#endif
     CECKey key;
-    if (!key.SetPubKey(*this))
-        return false;
-    if (!key.Verify(hash, vchSig))
-        return false;
-    return true;
+    bool fValidOpenSSL = !vchSig.empty() && key.SetPubKey(*this) && key.Verify(hash, vchSig);
+#ifdef USE_SECP256K1
+    if (fValid != fValidOpenSSL) {
+        __atomic_fetch_add(&nSecp256k1Mismatches, 1, __ATOMIC_RELAXED);
+        printf("ERROR: CPubKey::Verify() : secp256k1 and OpenSSL disagree on signature %s of %s\n", HexStr(vchSig).c_str(), hash.ToString().c_str());
+    }
+#endif
+    return fValidOpenSSL;
 }
 
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
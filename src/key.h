@@ -253,4 +253,10 @@ public:
     bool SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig) const;
 };
 
+// With USE_SECP256K1, CPubKey::Verify checks signatures with the code in
+// secp256k1.cpp. fCheckSecp256k1 makes it check them with OpenSSL as well,
+// counting (and logging) any disagreement; OpenSSL's result is used then.
+extern bool fCheckSecp256k1;
+extern uint64 nSecp256k1Mismatches;
+
 #endif
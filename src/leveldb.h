@@ -50,6 +50,10 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear() {
+        batch.Clear();
+    }
 };
 
 class CLevelDB
@@ -148,6 +152,22 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // A consistent view of the database as it is now; iterate over it with
+    // NewIterator(psnapshot) while the database keeps being written
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *psnapshot) {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
+
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *psnapshot) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = psnapshot;
+        return pdb->NewIterator(options);
+    }
 };
 
 #endif // BITCOIN_LEVELDB_H
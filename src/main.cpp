@@ -38,24 +38,31 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 uint256 hashGenesisBlock("0x61bcf5b118ff2a3e823d3b9822c9be915cef9b5cc429e859bb4d8c121a034eef");
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 23); // Mediterraneancoin: starting difficulty is 1 / 2^12 ; // ~uint256(0) >> 20
+static uint256 bnProofOfWorkLimit = ~uint256(0) >> 23; // Mediterraneancoin: starting difficulty is 1 / 2^12 ; // ~uint256(0) >> 20
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
 uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
+BlockMap mapHeaderIndex; // headers of blocks we don't have yet, see CBlockIndex
+CBlockIndex* pindexBestHeader = NULL; // tip of the valid header chain with the most work
+static CChain chainHeaders; // the chain ending in pindexBestHeader
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nScryptLaneThreads = 0;
+int nBlockVerifyThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
+bool fImportSkipPoW = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
 bool fFullIndexSearch = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 
@@ -66,9 +73,13 @@ int64 CTransaction::nMinRelayTxFee = 100000;
 
 CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes claim to have
 
+// Downloaded blocks waiting for their parent, only kept for known headers in the download window
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Blocks requested from peers, and the peer each was requested from
+static map<uint256, CNode*> mapBlocksInFlight;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -179,11 +190,17 @@ void static ResendWalletTransactions()
 //
 
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
+void CCoinsView::GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound) {
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), 0);
+    for (unsigned int i = 0; i < vTxids.size(); i++)
+        vFound[i] = GetCoins(vTxids[i], vCoins[i]);
+}
 bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -194,43 +211,124 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() {
+    uint256 salt = GetRandHash();
+    memcpy(&k0, salt.begin(), 8);
+    memcpy(&k1, salt.begin() + 8, 8);
+}
+
+// Memory taken by a cache entry besides its outputs: the hash table node and its bucket
+static const size_t nCoinsEntryOverhead = MallocUsage(sizeof(CCoinsMap::value_type) + sizeof(void*)) + sizeof(void*);
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), nCacheUsage(0) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->second.coins;
+    return true;
+}
+
+void CCoinsViewCache::GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound) {
+    PrefetchCoins(vTxids);
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), 0);
+    for (unsigned int i = 0; i < vTxids.size(); i++) {
+        CCoinsMap::const_iterator it = cacheCoins.find(vTxids[i]);
+        if (it != cacheCoins.end()) {
+            vCoins[i] = it->second.coins;
+            vFound[i] = 1;
+        }
     }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
+}
+
+void CCoinsViewCache::PrefetchCoins(const std::vector<uint256> &vTxids) {
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const uint256 &txid, vTxids)
+        if (!cacheCoins.count(txid))
+            vMissing.push_back(txid);
+    if (vMissing.empty())
+        return;
+    std::vector<CCoins> vCoins;
+    std::vector<char> vFound;
+    base->GetCoinsMulti(vMissing, vCoins, vFound);
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        if (!vFound[i] || cacheCoins.count(vMissing[i]))
+            continue;
+        CCoinsMap::iterator it = InsertCoins(vMissing[i]);
+        vCoins[i].swap(it->second.coins);
+        it->second.SetBase(it->second.coins);
+        if (it->second.coins.IsPruned())
+            it->second.flags = CCoinsCacheEntry::FRESH;
+        UpdateUsage(it->second);
     }
-    return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::InsertCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    nCacheUsage += nCoinsEntryOverhead;
+    return it;
+}
+
+void CCoinsViewCache::UpdateUsage(CCoinsCacheEntry &entry) {
+    size_t nUsage = entry.coins.DynamicMemoryUsage();
+    nCacheUsage = nCacheUsage - entry.nUsage + nUsage;
+    entry.nUsage = nUsage;
+}
+
+void CCoinsViewCache::UpdateModifiedUsage() {
+    // entries are only erased after this, so the pointers are still valid
+    BOOST_FOREACH(CCoinsCacheEntry *pentry, vModified)
+        UpdateUsage(*pentry);
+    vModified.clear();
+}
+
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = InsertCoins(txid);
+    tmp.swap(ret->second.coins);
+    ret->second.SetBase(ret->second.coins);
+    if (ret->second.coins.IsPruned())
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    UpdateUsage(ret->second);
     return ret;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    it->second.flags |= CCoinsCacheEntry::DIRTY;
+    vModified.push_back(&it->second);
+    return it->second.coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    return it->second.coins;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it == cacheCoins.end()) {
+        it = InsertCoins(txid);
+        // A non-coinbase transaction spends outputs that can only be spent
+        // once, so the view below cannot have unspent outputs for it
+        if (!coins.fCoinBase)
+            it->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    it->second.coins = coins;
+    it->second.flags |= CCoinsCacheEntry::DIRTY;
+    UpdateUsage(it->second);
     return true;
 }
 
@@ -249,17 +347,43 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    UpdateModifiedUsage();
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        bool fFreshPruned = (it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned();
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // created and spent above us: nothing to write
+            if (fFreshPruned)
+                continue;
+            itUs = InsertCoins(it->first);
+            itUs->second.flags = it->second.flags & CCoinsCacheEntry::FRESH;
+            // we never held it, so what the child saw below it is our base too
+            itUs->second.nBaseUnspent = it->second.nBaseUnspent;
+            itUs->second.nBaseOutputs = it->second.nBaseOutputs;
+        } else if (it->second.coins.IsPruned() && (itUs->second.flags & CCoinsCacheEntry::FRESH)) {
+            // spent before our base ever saw it
+            nCacheUsage -= nCoinsEntryOverhead + itUs->second.nUsage;
+            cacheCoins.erase(itUs);
+            continue;
+        }
+        itUs->second.coins.swap(it->second.coins);
+        itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+        UpdateUsage(itUs->second);
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        vModified.clear();
+        nCacheUsage = 0;
+    }
     return fOk;
 }
 
@@ -267,6 +391,152 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::GetCacheUsage() {
+    UpdateModifiedUsage();
+    return nCacheUsage + cacheCoins.bucket_count() * sizeof(void*);
+}
+
+CCoinsViewWriter::CCoinsViewWriter(CCoinsView &baseIn) : CCoinsViewBacked(baseIn), pindexWriting(NULL), fWriting(false), fFailed(false), fQuit(false),
+    thread(boost::bind(&CCoinsViewWriter::ThreadWrite, this)) { }
+
+CCoinsViewWriter::~CCoinsViewWriter() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    cond.notify_all();
+    // a pending batch is still written
+    thread.join();
+}
+
+void CCoinsViewWriter::ThreadWrite() {
+    RenameThread("bitcoin-coinswr");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    loop {
+        while (!fWriting && !fQuit)
+            cond.wait(lock);
+        if (!fWriting)
+            return;
+
+        // Readers only look up entries under the lock, and nothing else
+        // changes the batch while fWriting is set
+        lock.unlock();
+        int64 nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = base->BatchWrite(mapWriting, pindexWriting);
+        } catch (std::exception &e) {
+            printf("CCoinsViewWriter::ThreadWrite() : %s\n", e.what());
+        }
+        if (fBenchmark)
+            printf("- Write %u transactions: %.2fms\n", (unsigned int)mapWriting.size(), 0.001 * (GetTimeMicros() - nStart));
+        lock.lock();
+
+        if (fOk) {
+            mapWriting.clear();
+            pindexWriting = NULL;
+        } else {
+            // keep the batch readable; the next flush reports the failure
+            fFailed = true;
+        }
+        fWriting = false;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewWriter::WaitIdle(boost::unique_lock<boost::mutex> &lock) {
+    while (fWriting)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+bool CCoinsViewWriter::Sync() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return WaitIdle(lock);
+}
+
+bool CCoinsViewWriter::GetCoins(const uint256 &txid, CCoins &coins) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CCoinsMap::const_iterator it = mapWriting.find(txid);
+        if (it != mapWriting.end()) {
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+void CCoinsViewWriter::GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound) {
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), 0);
+    std::vector<unsigned int> vBase;
+    std::vector<uint256> vBaseTxids;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (unsigned int i = 0; i < vTxids.size(); i++) {
+            CCoinsMap::const_iterator it = mapWriting.find(vTxids[i]);
+            if (it != mapWriting.end()) {
+                vCoins[i] = it->second.coins;
+                vFound[i] = 1;
+            } else {
+                vBase.push_back(i);
+                vBaseTxids.push_back(vTxids[i]);
+            }
+        }
+    }
+    if (vBase.empty())
+        return;
+    std::vector<CCoins> vBaseCoins;
+    std::vector<char> vBaseFound;
+    base->GetCoinsMulti(vBaseTxids, vBaseCoins, vBaseFound);
+    for (unsigned int i = 0; i < vBase.size(); i++) {
+        vCoins[vBase[i]].swap(vBaseCoins[i]);
+        vFound[vBase[i]] = vBaseFound[i];
+    }
+}
+
+bool CCoinsViewWriter::SetCoins(const uint256 &txid, const CCoins &coins) {
+    return Sync() && base->SetCoins(txid, coins);
+}
+
+bool CCoinsViewWriter::HaveCoins(const uint256 &txid) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (mapWriting.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+CBlockIndex *CCoinsViewWriter::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (pindexWriting)
+            return pindexWriting;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriter::SetBestBlock(CBlockIndex *pindex) {
+    return Sync() && base->SetBestBlock(pindex);
+}
+
+bool CCoinsViewWriter::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!WaitIdle(lock))
+        return false;
+    mapWriting.swap(mapCoins);
+    pindexWriting = pindex;
+    fWriting = true;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewWriter::GetStats(CCoinsStats &stats) {
+    return Sync() && base->GetStats(stats);
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -289,6 +559,151 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// CCoinsStats
+//
+
+// Element of the unspent output set hash: an output with its coin metadata
+static uint256 GetOutputHash(const uint256 &txid, unsigned int n, const CCoins &coins)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << txid << n << coins.nHeight << coins.fCoinBase << coins.nVersion << coins.vout[n];
+    return ss.GetHash();
+}
+
+// Size of the record of coins in the per-transaction database layout
+static int64 GetCoinsRecordSize(const CCoins &coins)
+{
+    if (coins.IsPruned())
+        return 0;
+    return 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+}
+
+void CCoinsStatsDelta::Update(const uint256 &txid, const CCoins &coinsOld, const CCoins &coinsNew, BN_CTX *pctx)
+{
+    // an overwrite replaces every output
+    bool fSameMeta = coinsOld.nHeight == coinsNew.nHeight && coinsOld.fCoinBase == coinsNew.fCoinBase && coinsOld.nVersion == coinsNew.nVersion;
+    unsigned int nOutputs = std::max(coinsOld.vout.size(), coinsNew.vout.size());
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        bool fOld = coinsOld.IsAvailable(i);
+        bool fNew = coinsNew.IsAvailable(i);
+        if (fOld && fNew && fSameMeta && coinsOld.vout[i] == coinsNew.vout[i])
+            continue;
+        if (fOld) {
+            nTransactionOutputs--;
+            nTotalAmount -= coinsOld.vout[i].nValue;
+            hashSet.Remove(GetOutputHash(txid, i, coinsOld), pctx);
+        }
+        if (fNew) {
+            nTransactionOutputs++;
+            nTotalAmount += coinsNew.vout[i].nValue;
+            hashSet.Insert(GetOutputHash(txid, i, coinsNew), pctx);
+        }
+    }
+    nTransactions += (coinsNew.IsPruned() ? 0 : 1) - (coinsOld.IsPruned() ? 0 : 1);
+    nSerializedSize += GetCoinsRecordSize(coinsNew) - GetCoinsRecordSize(coinsOld);
+}
+
+CCoinsStatsDelta &CCoinsStatsDelta::Combine(const CCoinsStatsDelta &delta, BN_CTX *pctx)
+{
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nSerializedSize += delta.nSerializedSize;
+    nTotalAmount += delta.nTotalAmount;
+    hashSet.Combine(delta.hashSet, pctx);
+    return *this;
+}
+
+void CCoinsStats::Apply(const CCoinsStatsDelta &delta, BN_CTX *pctx)
+{
+    nTransactions += delta.nTransactions;
+    nTransactionOutputs += delta.nTransactionOutputs;
+    nSerializedSize += delta.nSerializedSize;
+    nTotalAmount += delta.nTotalAmount;
+    hashSet.Combine(delta.hashSet, pctx);
+}
+
+CCoinsStatsCache coinsstats;
+
+bool CCoinsStatsCache::IsTracking()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nState != STATS_NONE;
+}
+
+void CCoinsStatsCache::Update(const CCoinsStatsDelta &delta, CBlockIndex *pindexNew)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nState == STATS_SCANNING) {
+        vJournal.push_back(std::make_pair(pindexNew, delta));
+    } else if (nState == STATS_READY) {
+        CAutoBN_CTX pctx;
+        statsTip.Apply(delta, pctx);
+        statsTip.hashBlock = pindexNew->GetBlockHash();
+        statsTip.nHeight = pindexNew->nHeight;
+        fFinal = false;
+    }
+}
+
+bool CCoinsStatsCache::Get(CCoinsStats &stats)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nState == STATS_SCANNING)
+            cond.wait(lock);
+        if (nState == STATS_READY) {
+            if (!fFinal) {
+                statsTip.hashSerialized = statsTip.hashSet.Finalize();
+                fFinal = true;
+            }
+            stats = statsTip;
+            return true;
+        }
+        nState = STATS_SCANNING;
+    }
+
+    // Start recording changes from a tip that is entirely in the coin
+    // database, so the snapshot taken below is at one of the recorded tips
+    bool fFlushed;
+    {
+        LOCK(cs_main);
+        fFlushed = pcoinsTip->Flush();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vJournal.clear();
+        vJournal.push_back(std::make_pair(pcoinsTip->GetBestBlock(), CCoinsStatsDelta()));
+    }
+
+    int64 nStart = GetTimeMillis();
+    CCoinsStats statsScan;
+    bool fScanned = fFlushed && pcoinsTip->GetStats(statsScan);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // replay what was connected after the snapshot
+    int nJournal = vJournal.size() - 1;
+    while (nJournal >= 0 && (vJournal[nJournal].first == NULL || vJournal[nJournal].first->GetBlockHash() != statsScan.hashBlock))
+        nJournal--;
+    bool fRet = fScanned && nJournal >= 0;
+    if (fRet) {
+        CAutoBN_CTX pctx;
+        statsTip = statsScan;
+        for (unsigned int i = nJournal + 1; i < vJournal.size(); i++)
+            statsTip.Apply(vJournal[i].second, pctx);
+        statsTip.hashBlock = vJournal.back().first->GetBlockHash();
+        statsTip.nHeight = vJournal.back().first->nHeight;
+        statsTip.hashSerialized = statsTip.hashSet.Finalize();
+        fFinal = true;
+        stats = statsTip;
+        printf("Scanned unspent output set at height %d in %"PRI64d"ms, replayed %u blocks\n", statsScan.nHeight, GetTimeMillis() - nStart, (unsigned int)(vJournal.size() - nJournal - 1));
+    } else {
+        printf("CCoinsStatsCache::Get() : scanning the unspent output set failed\n");
+    }
+    vJournal.clear();
+    nState = fRet ? STATS_READY : STATS_NONE;
+    cond.notify_all();
+    return fRet;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -541,7 +956,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -847,11 +1262,102 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        removeInfo(hash);
+        addInfo(hash, tx);
+        // Spenders that were already here counted this one as confirmed (re-added after a reorg)
+        updateSpenders(hash, tx.vout.size());
         nTransactionsUpdated++;
     }
     return true;
 }
 
+void CTxMemPool::addInfo(const uint256& hash, const CTransaction& tx)
+{
+    CTxMemPoolInfo& info = mapInfo[hash];
+    info = CTxMemPoolInfo();
+    info.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Inputs from the pool count for the fee but not the priority
+    int64 nValueIn = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        std::map<uint256, CTransaction>::const_iterator mi = mapTx.find(txin.prevout.hash);
+        if (mi != mapTx.end())
+        {
+            if (txin.prevout.n < mi->second.vout.size())
+                nValueIn += mi->second.vout[txin.prevout.n].nValue;
+            continue;
+        }
+        CCoins coins;
+        if (pcoinsTip && pcoinsTip->GetCoins(txin.prevout.hash, coins) && coins.IsAvailable(txin.prevout.n))
+        {
+            int64 nValue = coins.vout[txin.prevout.n].nValue;
+            nValueIn += nValue;
+            info.dChainValue += nValue;
+            info.dChainValueHeight += (double)nValue * coins.nHeight;
+        }
+    }
+    int64 nValueOut = 0;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nValueOut += txout.nValue;
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions.
+    info.dFeePerKb = double(nValueIn - nValueOut) / (double(info.nTxSize)/1000.0);
+    setTxByFee.insert(make_pair(info.dFeePerKb, hash));
+    if (nPriorityHeight >= 0)
+    {
+        info.dPriority = info.GetPriority(nPriorityHeight);
+        setTxByPriority.insert(make_pair(info.dPriority, hash));
+    }
+}
+
+void CTxMemPool::removeInfo(const uint256& hash)
+{
+    std::map<uint256, CTxMemPoolInfo>::iterator mi = mapInfo.find(hash);
+    if (mi == mapInfo.end())
+        return;
+    setTxByFee.erase(make_pair(mi->second.dFeePerKb, hash));
+    if (nPriorityHeight >= 0)
+        setTxByPriority.erase(make_pair(mi->second.dPriority, hash));
+    mapInfo.erase(mi);
+}
+
+void CTxMemPool::updateSpenders(const uint256& hash, unsigned int nOutputs)
+{
+    // Recompute the pool transactions that spend hash, after it entered or left the pool
+    for (unsigned int i = 0; i < nOutputs; i++)
+    {
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it == mapNextTx.end())
+            continue;
+        const CTransaction& txSpender = *it->second.ptx;
+        uint256 hashSpender = txSpender.GetHash();
+        removeInfo(hashSpender);
+        addInfo(hashSpender, txSpender);
+    }
+}
+
+void CTxMemPool::UpdatePriorityIndex(int nHeight)
+{
+    // Priorities grow with the height at different rates, so their order
+    // only holds for one height; re-key once per block
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    std::vector<std::pair<double, uint256> > vIndex;
+    vIndex.reserve(mapInfo.size());
+    for (std::map<uint256, CTxMemPoolInfo>::iterator mi = mapInfo.begin(); mi != mapInfo.end(); ++mi)
+    {
+        mi->second.dPriority = mi->second.GetPriority(nHeight);
+        vIndex.push_back(make_pair(mi->second.dPriority, mi->first));
+    }
+    std::sort(vIndex.begin(), vIndex.end());
+    setTxByPriority = txindex_t(vIndex.begin(), vIndex.end());
+}
+
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -870,7 +1376,12 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            // tx may be the pool's own copy
+            unsigned int nOutputs = tx.vout.size();
+            removeInfo(hash);
             mapTx.erase(hash);
+            // Spenders left behind now find tx in the chain, if it was mined
+            updateSpenders(hash, nOutputs);
             nTransactionsUpdated++;
         }
     }
@@ -897,6 +1408,9 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapInfo.clear();
+    setTxByFee.clear();
+    setTxByPriority.clear();
     ++nTransactionsUpdated;
 }
 
@@ -919,7 +1433,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1060,41 +1574,140 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+/** Allocates block index entries in large chunks. Entries are never freed
+    one at a time, only all together when the index is unloaded. */
+class CBlockIndexArena
+{
+private:
+    static const unsigned int CHUNK_SIZE = 16384;
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed;     // entries handed out from the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex *New() {
+        if (nUsed == CHUNK_SIZE) {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    void Clear() {
+        BOOST_FOREACH(CBlockIndex *pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
+    }
+};
+
+static CBlockIndexArena blockindexarena;
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
+}
+
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// The height pskip points to for a block at nHeight. Any height is reached
+// from any block above it in O(log n) hops.
+static inline int GetSkipHeight(int nHeight) {
+    if (nHeight < 2)
+        return 0;
+    // Determine which height to jump back to. Any number strictly lower than
+    // nHeight is acceptable, but the following expression performs well in
+    // simulations (max 110 steps to go back up to 2**18 blocks).
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightIn) {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nHeightIn ||
+             (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 &&
+                                           nHeightSkipPrev >= nHeightIn)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+void CChain::SetTip(CBlockIndex *pindex)
+{
+    if (pindex == NULL) {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex) {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+CBlockIndex *CChain::FindFork(CBlockIndex *pindex) const
+{
+    if (pindex->nHeight > Height())
+        pindex = pindex->GetAncestor(Height());
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+CBlockIndex *LastCommonAncestor(CBlockIndex *pa, CBlockIndex *pb)
+{
+    if (pa->nHeight > pb->nHeight)
+        pa = pa->GetAncestor(pb->nHeight);
+    else if (pb->nHeight > pa->nHeight)
+        pb = pb->GetAncestor(pa->nHeight);
+    while (pa != pb && pa && pb) {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+    // both are in the same tree, so they meet at the genesis block at the latest
+    assert(pa == pb);
+    return pa;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
 {
-    if (!ReadFromDisk(pindex->GetBlockPos()))
+    // The index entry was only added after the block's proof-of-work was
+    // checked, and the hash check below ties the block to it
+    if (!ReadFromDisk(pindex->GetBlockPos(), false))
         return false;
     if (GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
     return true;
 }
 
-uint256 static GetOrphanRoot(const CBlockHeader* pblock)
-{
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
-}
-
 int static generateMTRandom(unsigned int s, int range)
 {
 	// if using boost 1.55:
@@ -1234,7 +1847,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     if (fTestNet && nTime > nTargetSpacing*2)
         return bnProofOfWorkLimit.GetCompact();
 
-    CBigNum bnResult;
+    uint256 bnResult;
     bnResult.SetCompact(nBase);
     while (nTime > 0 && bnResult < bnProofOfWorkLimit)
     {
@@ -1286,9 +1899,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
         blockstogoback = nInterval;
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1300,10 +1911,12 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
         nActualTimespan = nTargetTimespan*4;
 
     // Retarget
-    CBigNum bnNew;
+    // The target is at most bnProofOfWorkLimit and the timespan below 2^17,
+    // so the product always fits in 256 bits
+    uint256 bnNew;
     bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nTargetTimespan; // the smaller nTargetTimespan is, the larger is bnNew increase
+    bnNew *= uint256(nActualTimespan);
+    bnNew /= uint256(nTargetTimespan); // the smaller nTargetTimespan is, the larger is bnNew increase
 
     if (bnNew > bnProofOfWorkLimit)
         bnNew = bnProofOfWorkLimit;
@@ -1311,37 +1924,39 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
 
     return bnNew.GetCompact();
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit) {
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > bnProofOfWorkLimit) {
 
-    	if (bnTarget <= 0)
+    	if (fNegative || bnTarget == 0)
     		printf("bnTarget <= 0!!!\n");
 
-    	if (bnTarget > bnProofOfWorkLimit)
+    	if (fOverflow || bnTarget > bnProofOfWorkLimit)
     		printf("bnTarget > bnProofOfWorkLimit!!!\n");
 
     	printf("nBits=%x\n", nBits);
 
-    	printf("bnTarget=%s\n", bnTarget.ToString(16).c_str());
+    	printf("bnTarget=%s\n", bnTarget.GetHex().c_str());
 
-    	printf("bnProofOfWorkLimit=%s\n", bnProofOfWorkLimit.ToString(16).c_str());
+    	printf("bnProofOfWorkLimit=%s\n", bnProofOfWorkLimit.GetHex().c_str());
 
         return error("CheckProofOfWork() : nBits below minimum work");
     }
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1368,6 +1983,91 @@ bool IsInitialBlockDownload()
             pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
 }
 
+// The index entry of a block or of a header we have, or NULL
+CBlockIndex static *LookupBlockIndex(const uint256 &hash)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return mi->second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return mi->second;
+    return NULL;
+}
+
+void static UpdateBestHeader(CBlockIndex *pindex)
+{
+    if (pindexBestHeader == NULL || pindex->nChainWork > pindexBestHeader->nChainWork)
+    {
+        pindexBestHeader = pindex;
+        chainHeaders.SetTip(pindex);
+    }
+}
+
+void static EraseOrphanBlock(const uint256 &hash)
+{
+    map<uint256, CBlock*>::iterator it = mapOrphanBlocks.find(hash);
+    if (it == mapOrphanBlocks.end())
+        return;
+    CBlock* pblock = it->second;
+    multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(pblock->hashPrevBlock);
+    for (; mi != mapOrphanBlocksByPrev.upper_bound(pblock->hashPrevBlock); ++mi)
+    {
+        if (mi->second == pblock)
+        {
+            mapOrphanBlocksByPrev.erase(mi);
+            break;
+        }
+    }
+    mapOrphanBlocks.erase(it);
+    delete pblock;
+}
+
+// Drop the downloaded blocks whose header turned out to be invalid, and
+// those of branches that fell behind the active chain
+void static PruneOrphanBlocks()
+{
+    map<uint256, CBlock*>::iterator it = mapOrphanBlocks.begin();
+    while (it != mapOrphanBlocks.end())
+    {
+        uint256 hash = (it++)->first;
+        BlockMap::iterator mi = mapHeaderIndex.find(hash);
+        if (mi == mapHeaderIndex.end() || (mi->second->nStatus & BLOCK_FAILED_MASK) || mi->second->nHeight <= nBestHeight)
+            EraseOrphanBlock(hash);
+    }
+}
+
+// A block failed validation: rule out the headers built on it for the best
+// header chain. Their downloaded blocks are dropped by PruneOrphanBlocks.
+void static InvalidHeaderChainFound(CBlockIndex *pindexFailed)
+{
+    pindexBestHeader = pindexBest;
+    for (BlockMap::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); ++mi)
+    {
+        CBlockIndex *pindex = mi->second;
+        if (pindex != pindexFailed && pindex->GetAncestor(pindexFailed->nHeight) == pindexFailed)
+            pindex->nStatus |= BLOCK_FAILED_CHILD;
+        if (!(pindex->nStatus & BLOCK_FAILED_MASK) &&
+            (pindexBestHeader == NULL || pindex->nChainWork > pindexBestHeader->nChainWork))
+            pindexBestHeader = pindex;
+    }
+    chainHeaders.SetTip(pindexBestHeader);
+}
+
+// Same for a block that is only known by its header. Only call this once
+// CheckBlock passed: until then, the transactions may not be the ones the
+// header commits to, and say nothing about the block itself.
+void static InvalidHeaderFound(const uint256 &hash, CValidationState &state)
+{
+    if (!state.IsInvalid() || state.CorruptionPossible())
+        return;
+    BlockMap::iterator mi = mapHeaderIndex.find(hash);
+    if (mi == mapHeaderIndex.end())
+        return;
+    mi->second->nStatus |= BLOCK_FAILED_VALID;
+    InvalidHeaderChainFound(mi->second);
+}
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (pindexNew->nChainWork > nBestInvalidWork)
@@ -1383,7 +2083,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1396,6 +2096,7 @@ void static InvalidBlockFound(CBlockIndex *pindex) {
         CValidationState stateDummy;
         ConnectBestBlock(stateDummy); // reorganise away from the failed block
     }
+    InvalidHeaderChainFound(pindex);
 }
 
 bool ConnectBestBlock(CValidationState &state) {
@@ -1471,7 +2172,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1534,7 +2235,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1544,7 +2245,14 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pcache.get()))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
+    return true;
+}
+
+bool CScriptCheck::operator()(CSignatureBatch &batch) const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pcache.get(), &batch))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
@@ -1574,7 +2282,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1608,12 +2316,17 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // The signature hashes of the inputs share most of their work, do it once
+            boost::shared_ptr<const CSignatureHashCache> pcache;
+            if (vin.size() > 1)
+                pcache.reset(new CSignatureHashCache(*this));
+
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, pcache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1621,7 +2334,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, pcache);
                         if (check())
                             return state.Invalid();
                     }
@@ -1637,7 +2350,34 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 
 
 
-bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
+// Copies of the coins tx touches (its own and those it spends), to account for
+// their change in the statistics afterwards
+static void GetTouchedCoins(CCoinsViewCache &view, const CTransaction &tx, const uint256 &hash, std::vector<std::pair<uint256, CCoins> > &vCoins)
+{
+    std::set<uint256> setTxids;
+    setTxids.insert(hash);
+    if (!tx.IsCoinBase()) {
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            setTxids.insert(txin.prevout.hash);
+    }
+    vCoins.clear();
+    vCoins.reserve(setTxids.size());
+    BOOST_FOREACH(const uint256 &txid, setTxids) {
+        vCoins.push_back(std::make_pair(txid, CCoins()));
+        view.GetCoins(txid, vCoins.back().second);
+    }
+}
+
+static void UpdateTouchedCoins(CCoinsViewCache &view, const std::vector<std::pair<uint256, CCoins> > &vCoins, CCoinsStatsDelta &delta, BN_CTX *pctx)
+{
+    for (unsigned int i = 0; i < vCoins.size(); i++) {
+        CCoins coins;
+        view.GetCoins(vCoins[i].first, coins);
+        delta.Update(vCoins[i].first, vCoins[i].second, coins, pctx);
+    }
+}
+
+bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean, CCoinsStatsDelta *pdelta)
 {
     assert(pindex == view.GetBestBlock());
 
@@ -1656,10 +2396,15 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
     if (blockUndo.vtxundo.size() + 1 != vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    CAutoBN_CTX pctx;
+    std::vector<std::pair<uint256, CCoins> > vTouched;
+
     // undo transactions in reverse order
     for (int i = vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = vtx[i];
         uint256 hash = tx.GetHash();
+        if (pdelta)
+            GetTouchedCoins(view, tx, hash, vTouched);
 
         // check that all outputs are available
         if (!view.HaveCoins(hash)) {
@@ -1711,6 +2456,8 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                     return error("DisconnectBlock() : cannot restore coin inputs");
             }
         }
+        if (pdelta)
+            UpdateTouchedCoins(view, vTouched, *pdelta, pctx);
     }
 
     // move best block pointer to prevout block
@@ -1749,17 +2496,17 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck, CSignatureBatch> scriptcheckqueue(128);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, CCoinsStatsDelta *pdelta)
 {
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(state, !fJustCheck && !SkipImportPoW(pindex->nHeight), !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -1791,7 +2538,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1805,9 +2552,35 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
-
+    // Look up the coins of all inputs in one go, so that on a cold cache the
+    // database reads overlap instead of following each other
     int64 nStart = GetTimeMicros();
+    {
+        std::set<uint256> setCreated;
+        for (unsigned int i=0; i<vtx.size(); i++)
+            setCreated.insert(GetTxHash(i));
+        std::vector<uint256> vPrevouts;
+        BOOST_FOREACH(const CTransaction &tx, vtx) {
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                if (!setCreated.count(txin.prevout.hash))
+                    vPrevouts.push_back(txin.prevout.hash);
+            }
+        }
+        std::sort(vPrevouts.begin(), vPrevouts.end());
+        vPrevouts.erase(std::unique(vPrevouts.begin(), vPrevouts.end()), vPrevouts.end());
+        view.PrefetchCoins(vPrevouts);
+        if (fBenchmark)
+            printf("- Prefetch %u txids: %.2fms\n", (unsigned)vPrevouts.size(), 0.001 * (GetTimeMicros() - nStart));
+    }
+
+    CCheckQueueControl<CScriptCheck, CSignatureBatch> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    CAutoBN_CTX pctx;
+    std::vector<std::pair<uint256, CCoins> > vTouched;
+
+    nStart = GetTimeMicros();
     int64 nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
@@ -1846,8 +2619,12 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             control.Add(vChecks);
         }
 
+        if (pdelta)
+            GetTouchedCoins(view, tx, GetTxHash(i), vTouched);
         CTxUndo txundo;
         tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
+        if (pdelta)
+            UpdateTouchedCoins(view, vTouched, *pdelta, pctx);
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
@@ -1919,19 +2696,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     CCoinsViewCache view(*pcoinsTip, true);
 
     // Find the fork (typically, there is none)
-    CBlockIndex* pfork = view.GetBestBlock();
-    CBlockIndex* plonger = pindexNew;
-    while (pfork && pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight) {
-            plonger = plonger->pprev;
-            assert(plonger != NULL);
-        }
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-        assert(pfork != NULL);
-    }
+    CBlockIndex* pfork = view.GetBestBlock() ? LastCommonAncestor(view.GetBestBlock(), pindexNew) : NULL;
 
     // List of what to disconnect (typically nothing)
     vector<CBlockIndex*> vDisconnect;
@@ -1949,6 +2714,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         printf("REORGANIZE: Connect %"PRIszu" blocks; ..%s\n", vConnect.size(), pindexNew->GetBlockHash().ToString().c_str());
     }
 
+    // Change to the unspent output statistics, if they are being kept
+    CCoinsStatsDelta delta;
+    CCoinsStatsDelta *pdelta = coinsstats.IsTracking() ? &delta : NULL;
+
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
@@ -1956,7 +2725,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.DisconnectBlock(state, pindex, view))
+        if (!block.DisconnectBlock(state, pindex, view, NULL, pdelta))
             return error("SetBestBlock() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
         if (fBenchmark)
             printf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -1976,7 +2745,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, pdelta)) {
             if (state.IsInvalid()) {
                 InvalidChainFound(pindexNew);
                 InvalidBlockFound(pindex);
@@ -1995,13 +2764,16 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     int64 nStart = GetTimeMicros();
     int nModified = view.GetCacheSize();
     assert(view.Flush());
+    if (pdelta)
+        coinsstats.Update(delta, pindexNew);
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
         printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Hand the changes to the coin database writer before changing memory
+    // structure; it keeps them readable until they are on disk
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->GetCacheUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2015,8 +2787,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
             return state.Abort(_("Failed to write to coin database"));
     }
 
-    // At this point, all changes have been done to the database.
-    // Proceed by updating the memory structures.
+    // At this point, all changes have been done to the database, or are
+    // being written to it. Proceed by updating the memory structures.
 
     // Disconnect shorter branch
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
@@ -2027,6 +2799,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect) {
@@ -2052,7 +2825,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    UpdateBestHeader(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
@@ -2099,20 +2872,27 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
-    // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    // Construct new block index object, or take over the one of its header
+    CBlockIndex* pindexNew;
+    BlockMap::iterator miHeader = mapHeaderIndex.find(hash);
+    if (miHeader != mapHeaderIndex.end()) {
+        pindexNew = miHeader->second;
+        mapHeaderIndex.erase(miHeader);
+    } else
+        pindexNew = blockindexarena.New();
+    *pindexNew = CBlockIndex(*this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
     pindexNew->nTx = vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
+    pindexNew->BuildSkip();
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
@@ -2327,7 +3107,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2409,6 +3189,145 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     return true;
 }
 
+// Hash the headers in [nBegin, nEnd) and check them against their nBits. Runs
+// of headers with the same nBits, which is most of them, are hashed as one batch.
+void static ThreadCheckHeadersPoW(const vector<CBlockHeader> *pvHeaders, vector<char> *pvValid, unsigned int nBegin, unsigned int nEnd)
+{
+    const vector<CBlockHeader> &vHeaders = *pvHeaders;
+    vector<char> vchHeaders;
+    vector<uint256> vHashes;
+    unsigned int i = nBegin;
+    while (i < nEnd)
+    {
+        unsigned int j = i + 1;
+        while (j < nEnd && vHeaders[j].nBits == vHeaders[i].nBits)
+            j++;
+        vchHeaders.resize((j - i) * 80);
+        vHashes.resize(j - i);
+        for (unsigned int k = i; k < j; k++)
+            memcpy(&vchHeaders[(k - i) * 80], BEGIN(vHeaders[k].nVersion), 80);
+        // headers from peers would only evict useful entries from the PoW cache
+        hybridScryptHash256_batch(&vchHeaders[0], BEGIN(vHashes[0]), j - i, vHeaders[i].nBits, false);
+        for (unsigned int k = i; k < j; k++)
+            (*pvValid)[k] = CheckProofOfWork(vHashes[k - i], vHeaders[k].nBits);
+        i = j;
+    }
+}
+
+// Check the proof of work of the headers in [nBegin, nEnd), on all cores
+void static CheckHeadersPoW(const vector<CBlockHeader> &vHeaders, unsigned int nBegin, unsigned int nEnd, vector<char> &vValid)
+{
+    unsigned int nCount = nEnd - nBegin;
+    int nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, 8));
+    if (nCount < 32)
+        nThreads = 1;
+    if (nThreads == 1) {
+        ThreadCheckHeadersPoW(&vHeaders, &vValid, nBegin, nEnd);
+    } else {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadCheckHeadersPoW, &vHeaders, &vValid,
+                nBegin + i * nCount / nThreads, nBegin + (i + 1) * nCount / nThreads));
+        threadGroup.join_all();
+    }
+}
+
+// The checks of AcceptBlockHeader that need no proof of work, for the headers
+// from nBegin on, each building on the one before: the first one's parent must
+// be known, and each must carry the nBits and a timestamp its parent requires.
+// Done before hashing, so that a peer cannot make us hash headers that would
+// be rejected anyway, nor choose the scrypt parameters through their nBits.
+bool static CheckHeadersContext(CValidationState &state, const vector<CBlockHeader> &vHeaders, unsigned int nBegin)
+{
+    CBlockIndex* pindexPrev = LookupBlockIndex(vHeaders[nBegin].hashPrevBlock);
+    if (pindexPrev == NULL)
+        return state.DoS(10, error("CheckHeadersContext() : prev block not found"));
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("CheckHeadersContext() : prev block invalid"));
+
+    // Stand-in index entries for the headers not accepted yet, for the
+    // difficulty and median time of the ones after them
+    vector<uint256> vHashes(vHeaders.size() - nBegin);
+    vector<CBlockIndex> vIndex(vHeaders.size() - nBegin);
+    for (unsigned int n = nBegin; n < vHeaders.size(); n++)
+    {
+        const CBlockHeader &header = vHeaders[n];
+        if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+            return state.DoS(100, error("CheckHeadersContext() : incorrect proof of work"));
+        if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+            return state.Invalid(error("CheckHeadersContext() : block's timestamp is too early"));
+        if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+            return state.Invalid(error("CheckHeadersContext() : block timestamp too far in the future"));
+
+        CBlockIndex &index = vIndex[n - nBegin];
+        index = CBlockIndex(header);
+        vHashes[n - nBegin] = header.GetHash();
+        index.phashBlock = &vHashes[n - nBegin];
+        index.pprev = pindexPrev;
+        index.nHeight = pindexPrev->nHeight + 1;
+        index.BuildSkip();
+        pindexPrev = &index;
+    }
+    return true;
+}
+
+// Contextual checks of a header whose proof of work has been checked already,
+// the ones AcceptBlock does before looking at the transactions. A new header
+// goes to mapHeaderIndex.
+bool static AcceptBlockHeader(CValidationState &state, const CBlockHeader &header, CBlockIndex **ppindex)
+{
+    uint256 hash = header.GetHash();
+    CBlockIndex* pindex = LookupBlockIndex(hash);
+    if (pindex)
+    {
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString().c_str()));
+        *ppindex = pindex;
+        return true;
+    }
+
+    CBlockIndex* pindexPrev = LookupBlockIndex(header.hashPrevBlock);
+    if (pindexPrev == NULL)
+        return state.DoS(10, error("AcceptBlockHeader() : prev block not found"));
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"));
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Check proof of work
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return state.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
+
+    // Check timestamp
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("AcceptBlockHeader() : block's timestamp is too early"));
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("AcceptBlockHeader() : block timestamp too far in the future"));
+
+    // Check that the block chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+
+    // Don't accept any forks from the main chain prior to last checkpoint
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    pindex = blockindexarena.New();
+    *pindex = CBlockIndex(header);
+    BlockMap::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = nHeight;
+    pindex->nChainWork = pindexPrev->nChainWork + pindex->GetBlockWork();
+    pindex->BuildSkip();
+    pindex->nStatus = BLOCK_VALID_TREE;
+    UpdateBestHeader(pindex);
+
+    *ppindex = pindex;
+    return true;
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     // Mediterraneancoin: temporarily disable v2 block lockin until we are ready for v2 transition
@@ -2423,7 +3342,7 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2433,7 +3352,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    if (!fChecked && !pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
@@ -2445,37 +3364,47 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         {
             return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"));
         }
-        CBigNum bnNewBlock;
-        bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        // A negative target passes here, as it did with CBigNum; CheckBlock
+        // has rejected it already
+        bool fNegative;
+        bool fOverflow;
+        uint256 bnNewBlock;
+        bnNewBlock.SetCompact(pblock->nBits, &fNegative, &fOverflow);
+        uint256 bnRequired;
         bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
-        if (bnNewBlock > bnRequired)
+        if (fOverflow || (!fNegative && bnNewBlock > bnRequired))
         {
             return state.DoS(100, error("ProcessBlock() : block with too little proof-of-work"));
         }
     }
 
 
-    // If we don't already have its previous block, shunt it off to holding area until we get it
+    // If we don't already have its previous block, shunt it off to holding area until we get it.
+    // Only blocks of known headers in the download window are held, which bounds the memory
+    // this takes; for any other block, ask for the headers that lead to it.
     if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().c_str());
 
-        // Accept orphans as long as there is a node to request its parents from
         if (pfrom) {
-            CBlock* pblock2 = new CBlock(*pblock);
-            mapOrphanBlocks.insert(make_pair(hash, pblock2));
-            mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
-
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            BlockMap::iterator mi = mapHeaderIndex.find(hash);
+            if (mi != mapHeaderIndex.end() && mi->second->nHeight <= nBestHeight + BLOCK_DOWNLOAD_WINDOW) {
+                CBlock* pblock2 = new CBlock(*pblock);
+                mapOrphanBlocks.insert(make_pair(hash, pblock2));
+                mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+            } else if (mi == mapHeaderIndex.end()) {
+                pfrom->PushGetHeaders(pindexBestHeader, hash);
+            }
         }
         return true;
     }
 
     // Store to disk
     if (!pblock->AcceptBlock(state, dbp))
+    {
+        InvalidHeaderFound(hash, state);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -2492,11 +3421,14 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             CValidationState stateDummy;
             if (pblockOrphan->AcceptBlock(stateDummy))
                 vWorkQueue.push_back(pblockOrphan->GetHash());
+            else
+                InvalidHeaderFound(pblockOrphan->GetHash(), stateDummy);
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
             delete pblockOrphan;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
     }
+    PruneOrphanBlocks();
 
     printf("ProcessBlock: ACCEPTED\n");
     return true;
@@ -2722,14 +3654,12 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockindexarena.New();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -2755,8 +3685,9 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        pindex->BuildSkip();
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
     }
@@ -2796,6 +3727,8 @@ bool static LoadBlockIndexDB()
          pindexPrev->pnext = pindex;
          pindex = pindexPrev;
     }
+    chainActive.SetTip(pindexBest);
+    UpdateBestHeader(pindexBest);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2848,7 +3781,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && coins.GetCacheUsage() + pcoinsTip->GetCacheUsage() <= 2*nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2885,6 +3818,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
+    blockindexarena.Clear();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2892,6 +3826,10 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    chainActive.SetTip(NULL);
+    mapHeaderIndex.clear();
+    pindexBestHeader = NULL;
+    chainHeaders.SetTip(NULL);
 }
 
 bool LoadBlockIndex()
@@ -2976,7 +3914,7 @@ bool InitBlockIndex() {
             printf("Searching for genesis block...\n");
             // This will figure out a valid hash and Nonce if you're
             // creating a different genesis block:
-            uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+            uint256 hashTarget = uint256().SetCompact(block.nBits);
             uint256 thash;
             char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
 
@@ -3039,7 +3977,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3105,12 +4043,182 @@ void PrintBlockTree()
     }
 }
 
+bool SkipImportPoW(int nHeight)
+{
+    // Blocks below the last checkpoint are tied to it by their hashes, so
+    // when importing from local files their scrypt work is only rechecked
+    // if the user asks for it
+    return fImportSkipPoW && (fImporting || fReindex) && nHeight < Checkpoints::GetTotalBlocksEstimate();
+}
+
+// Blocks read ahead of the one being connected during an import; enough to
+// keep every worker busy, and few enough that the PoW hashes the workers
+// computed are still in the scrypt result cache when ConnectBlock asks again
+static const unsigned int IMPORT_MAX_INFLIGHT = 64;
+
+/** A block read from an external file, waiting to be checked and connected */
+struct CImportBlock
+{
+    uint64 nBlockPos;
+    uint64 nRewind;         // where to rescan from if it does not deserialize
+    std::vector<char> vchBlock;
+    CBlock block;
+    CValidationState state;
+    bool fCheckPoW;         // false if the expected height is below the last checkpoint
+    bool fDone;
+    bool fDeserialized;
+    bool fChecked;          // CheckBlock passed
+
+    CImportBlock() : nBlockPos(0), nRewind(0), fCheckPoW(true), fDone(false), fDeserialized(false), fChecked(false) {}
+};
+
+/**
+ * Deserializes and runs CheckBlock (including the hybrid PoW hash) on
+ * imported blocks on a set of worker threads, while the import thread takes
+ * them back in file order to connect them.
+ */
+class CBlockImportQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+    // Blocks in file order; the first nTaken have been handed to workers
+    std::deque<CImportBlock*> queue;
+    unsigned int nTaken;
+    bool fQuit;
+    boost::thread_group threadGroup;
+
+    static void Check(CImportBlock &item)
+    {
+        try {
+            CDataStream ss(&item.vchBlock[0], &item.vchBlock[0] + item.vchBlock.size(), SER_DISK, CLIENT_VERSION);
+            ss >> item.block;
+            item.fDeserialized = true;
+        } catch (std::exception &e) {
+            return;
+        }
+        std::vector<char>().swap(item.vchBlock);
+        item.fChecked = item.block.CheckBlock(item.state, item.fCheckPoW);
+    }
+
+    void Thread()
+    {
+        RenameThread("bitcoin-loadblk");
+        loop {
+            CImportBlock* pitem;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nTaken == queue.size())
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                pitem = queue[nTaken++];
+            }
+            Check(*pitem);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pitem->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+    // Wait until no worker holds a block; mutex must be held
+    void WaitIdle(boost::unique_lock<boost::mutex> &lock)
+    {
+        for (unsigned int i = 0; i < nTaken; i++)
+            while (!queue[i]->fDone)
+                condDone.wait(lock);
+    }
+
+public:
+    CBlockImportQueue(int nThreads) : nTaken(0), fQuit(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImportQueue::Thread, this));
+    }
+
+    ~CBlockImportQueue()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(CImportBlock* pitem, queue)
+            delete pitem;
+    }
+
+    void Push(CImportBlock* pitem)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(pitem);
+        }
+        condWorker.notify_one();
+    }
+
+    size_t Size()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    /** Wait for the oldest block to be checked and take it; the caller owns it */
+    CImportBlock* Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        assert(!queue.empty());
+        while (nTaken == 0 || !queue.front()->fDone)
+            condDone.wait(lock);
+        CImportBlock* pitem = queue.front();
+        queue.pop_front();
+        nTaken--;
+        return pitem;
+    }
+
+    /** Drop all blocks, after the workers are done with them */
+    void Clear()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        WaitIdle(lock);
+        BOOST_FOREACH(CImportBlock* pitem, queue)
+            delete pitem;
+        queue.clear();
+        nTaken = 0;
+    }
+};
+
+// Connect a checked block; returns false if the import must stop
+static bool ConnectImportBlock(CImportBlock &item, CDiskBlockPos *dbp, int &nLoaded)
+{
+    LOCK(cs_main);
+    if (dbp)
+        dbp->nPos = item.nBlockPos;
+    CValidationState &state = item.state;
+    if (item.fChecked && !item.fCheckPoW)
+    {
+        // The height was a guess made while reading; check the work now if the
+        // block did not end up below the last checkpoint
+        BlockMap::iterator mi = mapBlockIndex.find(item.block.hashPrevBlock);
+        if (mi != mapBlockIndex.end() && !SkipImportPoW(mi->second->nHeight + 1) &&
+            !CheckProofOfWork(item.block.GetPoWHash(), item.block.nBits))
+            item.fChecked = state.DoS(50, error("LoadExternalBlockFile() : proof of work failed"));
+    }
+    if (item.fChecked && ProcessBlock(state, NULL, &item.block, dbp, true))
+        nLoaded++;
+    return !state.IsError();
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
+        CBlockImportQueue queue(std::max((int)boost::thread::hardware_concurrency(), 1));
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
         if (dbp) {
@@ -3122,9 +4230,40 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             }
         }
         uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
+        bool fScan = true;
+        // Hash and height of the last block queued, to guess the height of the next
+        uint256 hashLastQueued = 0;
+        int nHeightLastQueued = -1;
+        loop {
             boost::this_thread::interruption_point();
 
+            if (fScan && !(blkdat.good() && !blkdat.eof()))
+                fScan = false;
+            if (!fScan && queue.Size() == 0)
+                break;
+
+            if (!fScan || queue.Size() >= IMPORT_MAX_INFLIGHT) {
+                // connect the oldest block
+                CImportBlock* pitem = queue.Pop();
+                if (!pitem->fDeserialized) {
+                    printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+                    // rescan from just after its header, as the blocks read
+                    // after it may have been found inside it
+                    queue.Clear();
+                    nRewind = pitem->nRewind;
+                    fScan = blkdat.Seek(nRewind);
+                    hashLastQueued = 0;
+                    nHeightLastQueued = -1;
+                    delete pitem;
+                    continue;
+                }
+                bool fContinue = ConnectImportBlock(*pitem, dbp, nLoaded);
+                delete pitem;
+                if (!fContinue)
+                    break;
+                continue;
+            }
+
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
@@ -3143,26 +4282,42 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     continue;
             } catch (std::exception &e) {
                 // no valid block header found; don't complain
-                break;
+                fScan = false;
+                continue;
             }
             try {
                 // read block
                 uint64 nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                std::auto_ptr<CImportBlock> pitem(new CImportBlock());
+                pitem->nBlockPos = nBlockPos;
+                pitem->nRewind = nRewind;
+                pitem->vchBlock.resize(nSize);
+                blkdat.read(&pitem->vchBlock[0], nSize);
                 nRewind = blkdat.GetPos();
 
-                // process block
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+                    // the header is the first 80 bytes
+                    uint256 hash = Hash(&pitem->vchBlock[0], &pitem->vchBlock[0] + 80);
+                    uint256 hashPrev;
+                    memcpy(hashPrev.begin(), &pitem->vchBlock[4], 32);
+                    int nHeight = -1;
+                    {
+                        LOCK(cs_main);
+                        if (mapBlockIndex.count(hash))
+                            continue;
+                        BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+                        if (mi != mapBlockIndex.end())
+                            nHeight = mi->second->nHeight + 1;
+                        else if (hashPrev == 0)
+                            nHeight = 0;
+                        else if (hashPrev == hashLastQueued && nHeightLastQueued >= 0)
+                            nHeight = nHeightLastQueued + 1;
+                    }
+                    pitem->fCheckPoW = (nHeight < 0 || !SkipImportPoW(nHeight));
+                    hashLastQueued = hash;
+                    nHeightLastQueued = nHeight;
+                    queue.Push(pitem.release());
                 }
             } catch (std::exception &e) {
                 printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
@@ -3214,7 +4369,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3255,6 +4410,65 @@ string GetWarnings(string strFor)
 //
 
 
+void static MarkBlockAsInFlight(CNode* pnode, const uint256 &hash)
+{
+    mapBlocksInFlight[hash] = pnode;
+    pnode->mapBlocksInTransit[hash] = GetTime();
+}
+
+void static MarkBlockAsReceived(const uint256 &hash)
+{
+    map<uint256, CNode*>::iterator it = mapBlocksInFlight.find(hash);
+    if (it != mapBlocksInFlight.end())
+    {
+        it->second->mapBlocksInTransit.erase(hash);
+        mapBlocksInFlight.erase(it);
+    }
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    for (map<uint256, int64>::iterator it = pnode->mapBlocksInTransit.begin(); it != pnode->mapBlocksInTransit.end(); ++it)
+        mapBlocksInFlight.erase(it->first);
+    pnode->mapBlocksInTransit.clear();
+}
+
+void static UpdateBlockAvailability(CNode* pnode, CBlockIndex* pindex)
+{
+    if (pnode->pindexBestKnownBlock == NULL || pindex->nChainWork > pnode->pindexBestKnownBlock->nChainWork)
+        pnode->pindexBestKnownBlock = pindex;
+}
+
+// Find up to nCount blocks of the best header chain, lowest first, that pnode
+// can serve and that nobody has been asked for yet
+void static FindNextBlocksToDownload(CNode* pnode, unsigned int nCount, vector<CBlockIndex*> &vBlocks)
+{
+    if (nCount == 0 || pindexBest == NULL || pindexBestHeader == NULL)
+        return;
+
+    // Only ask a peer for blocks once it told us about one through an inv or
+    // headers message; a peer on another fork does not have ours, and older
+    // peers leave getdata for unknown blocks unanswered until they time out
+    if (pnode->pindexBestKnownBlock == NULL)
+        return;
+
+    // The window starts where the active chain leaves the header chain
+    CBlockIndex* pindexFork = chainHeaders.FindFork(pindexBest);
+    int nEnd = std::min(pindexFork->nHeight + BLOCK_DOWNLOAD_WINDOW, chainHeaders.Height());
+
+    // The peer has the header chain up to where its best block leaves it
+    nEnd = std::min(nEnd, chainHeaders.FindFork(pnode->pindexBestKnownBlock)->nHeight);
+
+    for (int nHeight = pindexFork->nHeight + 1; nHeight <= nEnd && vBlocks.size() < nCount; nHeight++)
+    {
+        CBlockIndex* pindex = chainHeaders[nHeight];
+        const uint256 &hash = pindex->GetBlockHash();
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) || mapOrphanBlocks.count(hash) || mapBlocksInFlight.count(hash))
+            continue;
+        vBlocks.push_back(pindex);
+    }
+}
+
 bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type)
@@ -3311,7 +4525,7 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = true;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 pfrom->nBlocksRequested++;
                 if (mi != mapBlockIndex.end())
                 {
@@ -3421,6 +4635,174 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** A block received from a peer, waiting for its context-free checks */
+struct CVerifyBlock
+{
+    CNode* pfrom;           // holds a reference until the block is processed
+    CBlock block;
+    CValidationState state;
+    bool fDone;
+    bool fChecked;          // CheckBlock passed
+
+    CVerifyBlock(CNode* pfromIn) : pfrom(pfromIn), fDone(false), fChecked(false) {}
+
+    void Check()
+    {
+        // Don't spend a PoW hash on blocks from a peer that is being dropped
+        if (pfrom->fDisconnect)
+            return;
+        try {
+            fChecked = block.CheckBlock(state);
+        } catch (std::exception &e) {
+            PrintExceptionContinue(&e, "CVerifyBlock::Check()");
+        }
+    }
+};
+
+/**
+ * Runs CheckBlock, which is dominated by the hybrid PoW hash and the merkle
+ * root, on blocks received from peers without holding cs_main. The message
+ * handler takes the blocks back in arrival order and hands them to
+ * ProcessBlock, so checking a block no longer stalls other peers' messages
+ * and RPC calls.
+ */
+class CBlockVerifyQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+    // Blocks in arrival order; the first nTaken have been handed to workers
+    std::deque<CVerifyBlock*> queue;
+    unsigned int nTaken;
+
+public:
+    CBlockVerifyQueue() : nTaken(0) {}
+
+    ~CBlockVerifyQueue()
+    {
+        BOOST_FOREACH(CVerifyBlock* pitem, queue)
+            delete pitem;
+    }
+
+    void Thread()
+    {
+        loop {
+            CVerifyBlock* pitem;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nTaken == queue.size())
+                    condWorker.wait(lock);
+                pitem = queue[nTaken++];
+            }
+            pitem->Check();
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pitem->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+    /** Queue a block; without verification threads it is checked right away */
+    void Push(CVerifyBlock* pitem)
+    {
+        bool fInline = (nBlockVerifyThreads == 0);
+        if (fInline) {
+            pitem->Check();
+            pitem->fDone = true;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(pitem);
+            if (fInline)
+                nTaken++;
+        }
+        if (!fInline)
+            condWorker.notify_one();
+    }
+
+    /** Take the oldest block if it has been checked; the caller owns it */
+    CVerifyBlock* Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nTaken == 0 || !queue.front()->fDone)
+            return NULL;
+        CVerifyBlock* pitem = queue.front();
+        queue.pop_front();
+        nTaken--;
+        return pitem;
+    }
+
+    /** Wait up to nMilliseconds for the oldest block to be checked */
+    void Wait(int64 nMilliseconds)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nTaken == 0 || !queue.front()->fDone)
+            condDone.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+    }
+};
+
+static CBlockVerifyQueue blockverifyqueue;
+
+void ThreadBlockVerify() {
+    RenameThread("bitcoin-blkverify");
+    blockverifyqueue.Thread();
+}
+
+// requires LOCK(cs_main)
+void static ProcessVerifiedBlock(CVerifyBlock &item)
+{
+    CNode* pfrom = item.pfrom;
+    CValidationState &state = item.state;
+
+    CInv inv(MSG_BLOCK, item.block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockAsReceived(inv.hash);
+    CBlockIndex* pindex = LookupBlockIndex(inv.hash);
+    if (pindex)
+        UpdateBlockAvailability(pfrom, pindex);
+
+    if (!item.fChecked)
+        error("ProcessVerifiedBlock() : CheckBlock FAILED");
+    if ((item.fChecked && ProcessBlock(state, pfrom, &item.block, NULL, true)) || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
+bool ProcessVerifiedBlocks()
+{
+    bool fProcessed = false;
+    CVerifyBlock* pitem;
+    while ((pitem = blockverifyqueue.Pop()) != NULL)
+    {
+        fProcessed = true;
+        if (!pitem->pfrom->fDisconnect)
+        {
+            LOCK(cs_main);
+            ProcessVerifiedBlock(*pitem);
+        }
+        {
+            LOCK(cs_vNodes);
+            pitem->pfrom->nBlocksVerifying--;
+            pitem->pfrom->Release();
+        }
+        delete pitem;
+        boost::this_thread::interruption_point();
+    }
+    return fProcessed;
+}
+
+void WaitForVerifiedBlocks(int64 nMilliseconds)
+{
+    blockverifyqueue.Wait(nMilliseconds);
+}
+
+// requires LOCK(cs_main), except for "block" messages, see CBlockVerifyQueue,
+// and "headers" messages, which take it around their checks but not while hashing
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3649,18 +5031,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave) {
+            if (inv.type == MSG_BLOCK) {
+                CBlockIndex* pindex = LookupBlockIndex(inv.hash);
+                if (pindex) {
+                    UpdateBlockAvailability(pfrom, pindex);
+                } else if (nInv == nLastBlock && !fImporting && !fReindex && pindexBestHeader &&
+                           pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 24 * 60 * 60) {
+                    // Ask for the headers leading up to it; the block download takes it
+                    // from there. While our headers are far behind, the sync node is
+                    // still sending them, and nobody else is asked.
+                    pfrom->PushGetHeaders(pindexBestHeader, inv.hash);
+                }
+                // A new block at the tip is fetched right away
+                if (!fAlreadyHave && !fImporting && !fReindex && !IsInitialBlockDownload())
+                    pfrom->AskFor(inv);
+            } else if (!fAlreadyHave) {
                 if (!fImporting && !fReindex)
                     pfrom->AskFor(inv);
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
-                // In case we are on a very long side-chain, it is possible that we already have
-                // the last block in an inv bundle sent in response to getblocks. Try to detect
-                // this situation and push another getblocks to continue.
-                pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
             }
 
             // Track requests for our stuff
@@ -3738,7 +5125,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3753,7 +5140,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3765,6 +5152,91 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
+    {
+        // Each header is sent as a block without transactions; read the headers
+        // alone rather than deserializing up to 2000 blocks
+        vector<CBlockHeader> vHeaders;
+        unsigned int nCount = ReadCompactSize(vRecv);
+        if (nCount > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", nCount);
+        }
+        vHeaders.resize(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            vRecv >> vHeaders[n];
+            ReadCompactSize(vRecv); // the transaction count, always 0
+        }
+
+        if (nCount == 0)
+            return true;
+
+        // Check everything that needs no proof of work first
+        for (unsigned int n = 1; n < nCount; n++)
+        {
+            if (vHeaders[n].hashPrevBlock != vHeaders[n - 1].GetHash())
+            {
+                pfrom->Misbehaving(20);
+                return error("ProcessMessage() : non-continuous headers sequence");
+            }
+        }
+        unsigned int nFirstNew = 0;
+        {
+            LOCK(cs_main);
+            while (nFirstNew < nCount && LookupBlockIndex(vHeaders[nFirstNew].GetHash()))
+                nFirstNew++;
+            CValidationState state;
+            if (nFirstNew < nCount && !CheckHeadersContext(state, vHeaders, nFirstNew))
+            {
+                int nDoS = 0;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                return error("ProcessMessage() : invalid header %s", vHeaders[nFirstNew].GetHash().ToString().c_str());
+            }
+        }
+
+        // The hybrid proof of work is by far the most expensive check; do it
+        // for all new headers at once, without holding cs_main. The first new
+        // header is hashed on its own, so a bogus message costs a single hash.
+        vector<char> vPoWValid(nCount, true);
+        if (nFirstNew < nCount)
+        {
+            CheckHeadersPoW(vHeaders, nFirstNew, nFirstNew + 1, vPoWValid);
+            if (vPoWValid[nFirstNew])
+                CheckHeadersPoW(vHeaders, nFirstNew + 1, nCount, vPoWValid);
+        }
+
+        LOCK(cs_main);
+        CBlockIndex *pindexLast = NULL;
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            const CBlockHeader &header = vHeaders[n];
+            CValidationState state;
+            if (!vPoWValid[n])
+                state.DoS(50, error("ProcessMessage() : header proof of work failed"));
+            else
+                AcceptBlockHeader(state, header, &pindexLast);
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS))
+            {
+                if (nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                return error("ProcessMessage() : invalid header %s", header.GetHash().ToString().c_str());
+            }
+        }
+        UpdateBlockAvailability(pfrom, pindexLast);
+
+        // A full message means the peer probably has more
+        if (nCount == MAX_HEADERS_RESULTS)
+        {
+            printf("more getheaders (%d) from %s\n", pindexLast->nHeight, pfrom->addr.ToString().c_str());
+            pfrom->PushGetHeaders(pindexLast, uint256(0));
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3848,22 +5320,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
-        CBlock block;
-        vRecv >> block;
+        std::auto_ptr<CVerifyBlock> pitem(new CVerifyBlock(pfrom));
+        vRecv >> pitem->block;
 
-        printf("received block %s\n", block.GetHash().ToString().c_str());
+        printf("received block %s\n", pitem->block.GetHash().ToString().c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
-
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+        {
+            LOCK(cs_vNodes);
+            pfrom->AddRef();
+            pfrom->nBlocksVerifying++;
+        }
+        blockverifyqueue.Push(pitem.release());
     }
 
 
@@ -4061,6 +5529,10 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // leave further blocks unread while too many of this peer's blocks wait for verification
+        if (pfrom->nBlocksVerifying >= MAX_BLOCKS_VERIFYING_PER_PEER && msg.hdr.GetCommand() == "block")
+            break;
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -4099,7 +5571,9 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            {
+            if (strCommand == "block" || strCommand == "headers")
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
@@ -4163,10 +5637,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 pto->PushMessage("ping");
         }
 
-        // Start block sync
+        // Start header sync; blocks are downloaded from all peers along the headers
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            pto->PushGetHeaders(pindexBestHeader, uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4287,17 +5761,51 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
 
         //
-        // Message: getdata
+        // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
+        if (!fImporting && !fReindex && !pto->fClient && !pto->fDisconnect &&
+            (pto->nVersion < NOBLKS_VERSION_START || pto->nVersion >= NOBLKS_VERSION_END))
+        {
+            // A peer that sits on a block we asked for holds up the download window
+            bool fStalling = false;
+            for (map<uint256, int64>::iterator it = pto->mapBlocksInTransit.begin(); it != pto->mapBlocksInTransit.end(); ++it)
+                if (it->second < GetTime() - BLOCK_DOWNLOAD_TIMEOUT)
+                    fStalling = true;
+            if (fStalling)
+            {
+                printf("Timeout downloading blocks from %s, disconnecting\n", pto->addr.ToString().c_str());
+                FinalizeNode(pto);
+                pto->fDisconnect = true;
+            }
+            else if ((int)pto->mapBlocksInTransit.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+            {
+                vector<CBlockIndex*> vToDownload;
+                FindNextBlocksToDownload(pto, MAX_BLOCKS_IN_TRANSIT_PER_PEER - pto->mapBlocksInTransit.size(), vToDownload);
+                BOOST_FOREACH(CBlockIndex *pindex, vToDownload)
+                {
+                    if (fDebugNet)
+                        printf("requesting block %s (%d) from %s\n", pindex->GetBlockHash().ToString().c_str(),
+                               pindex->nHeight, pto->addr.ToString().c_str());
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pto, pindex->GetBlockHash());
+                }
+            }
+        }
+
+        //
+        // Message: getdata
+        //
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(inv))
+            if (!AlreadyHave(inv) && !(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
+                if (inv.type == MSG_BLOCK)
+                    MarkBlockAsInFlight(pto, inv.hash);
                 vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
@@ -4394,6 +5902,7 @@ public:
 
 
 uint64 nLastBlockTx = 0;
+uint64 nLastBlockTxSeen = 0; // pool transactions looked at for the last template
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
@@ -4462,115 +5971,111 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         CBlockIndex* pindexPrev = pindexBest;
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
+        // Candidates come from the memory pool's priority and fee indexes,
+        // best first, so only about a block's worth of transactions is looked
+        // at.  Transactions that spend pool transactions not yet in the
+        // block wait in vOrphan until all of those are added.
+        mempool.UpdatePriorityIndex(pindexPrev->nHeight);
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
+        set<uint256> setSeen;
+        set<uint256> setInBlock;
         bool fPrintPriority = GetBoolArg("-printpriority");
+        int64 nStart = GetTimeMicros();
 
-        // This vector will be sorted into a priority queue:
+        // Orphans whose dependencies are all in the block; sorted into a priority queue
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+
+        // Collect transactions into block
+        uint64 nBlockSize = 1000;
+        uint64 nBlockTx = 0;
+        int nBlockSigOps = 100;
+        int nTooLarge = 0;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+        TxPriorityCompare comparer(fSortedByFee);
+        const CTxMemPool::txindex_t* pindex = fSortedByFee ? &mempool.setTxByFee : &mempool.setTxByPriority;
+        CTxMemPool::txindex_t::const_reverse_iterator rit = pindex->rbegin();
+
+        loop
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
+            // Take the better of the next index entry and the best ready orphan
+            while (rit != pindex->rend() && setSeen.count(rit->second))
+                ++rit;
+            TxPriority txNext;
+            bool fFromIndex = (rit != pindex->rend());
+            if (fFromIndex)
+            {
+                const CTxMemPoolInfo& info = mempool.mapInfo[rit->second];
+                txNext = TxPriority(info.dPriority, info.dFeePerKb, &mempool.mapTx[rit->second]);
+            }
+            if (!vecPriority.empty() && (!fFromIndex || comparer(txNext, vecPriority.front())))
+            {
+                txNext = vecPriority.front();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+                fFromIndex = false;
+            }
+            else if (fFromIndex)
+                ++rit;
+            else
+                break;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            double dPriority = txNext.get<0>();
+            double dFeePerKb = txNext.get<1>();
+            CTransaction& tx = *(txNext.get<2>());
+            uint256 hash = tx.GetHash();
+
+            if (fFromIndex)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                setSeen.insert(hash);
+                if (tx.IsCoinBase() || !tx.IsFinal())
+                    continue;
 
-                    // Has to wait for dependencies
+                // Has to wait for dependencies
+                COrphan* porphan = NULL;
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    if (!mempool.mapTx.count(txin.prevout.hash) || setInBlock.count(txin.prevout.hash))
+                        continue;
                     if (!porphan)
                     {
                         // Use list for automatic deletion
                         vOrphan.push_back(COrphan(&tx));
                         porphan = &vOrphan.back();
+                        porphan->dPriority = dPriority;
+                        porphan->dFeePerKb = dFeePerKb;
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
+                    if (porphan->setDependsOn.insert(txin.prevout.hash).second)
+                        mapDependers[txin.prevout.hash].push_back(porphan);
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                if (porphan)
+                    continue;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = mempool.mapInfo[hash].nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
+            {
+                // Once the block is about full, stop rather than walk the rest of the pool
+                if (nBlockSize + 1000 >= nBlockMaxSize && ++nTooLarge >= 50)
+                    break;
                 continue;
+            }
 
             // Legacy limits on sigOps:
             unsigned int nTxSigOps = tx.GetLegacySigOpCount();
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
-            // Skip free transactions if we're past the minimum block size:
+            // Skip free transactions if we're past the minimum block size;
+            // everything after this one pays less:
             if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            {
+                if (nBlockSize >= nBlockMinSize)
+                    break;
                 continue;
+            }
 
             // Prioritize by fee once past the priority size or we run out of high-priority
             // transactions:
@@ -4580,6 +6085,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
                 std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                pindex = &mempool.setTxByFee;
+                rit = pindex->rbegin();
             }
 
             if (!tx.HaveInputs(view))
@@ -4596,7 +6103,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 continue;
 
             CTxUndo txundo;
-            uint256 hash = tx.GetHash();
             tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
 
             // Added
@@ -4607,6 +6113,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            setInBlock.insert(hash);
 
             if (fPrintPriority)
             {
@@ -4631,9 +6138,12 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 }
             }
         }
+        if (fBenchmark)
+            printf("- Select %"PRIszu" of %"PRIszu" pool transactions: %.2fms\n", setSeen.size(), mempool.mapTx.size(), 0.001 * (GetTimeMicros() - nStart));
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
+        nLastBlockTxSeen = setSeen.size();
         printf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
 
         pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees, pindexPrev->GetBlockHash());
@@ -4733,12 +6243,59 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 }
 
 
+// Nonces hashed per call to the multi-buffer hybrid hash; a multiple of the
+// widest smix kernel, and small enough that the miner still notices new
+// blocks quickly at the slowest parameter rows.
+static const unsigned int MINER_BATCH_SIZE = 8;
+
+bool ScanHybridHash(CBlockHeader* pblock, HybridScryptMidstate& midstate, const uint256& hashTarget, unsigned int nMaxHashes, unsigned int& nHashesDone, uint256& hashFound)
+{
+    // The first scrypt stage only covers the first 68 header bytes, so it is
+    // redone only when a new merkle root or target comes in
+    bool fMidstate = hybridScryptHash256_prepare(BEGIN(pblock->nVersion), pblock->nBits, midstate);
+
+    // Consecutive nonces of the header, serialized back to back
+    char pheaders[MINER_BATCH_SIZE * 80];
+    uint256 hashes[MINER_BATCH_SIZE];
+
+    nHashesDone = 0;
+    while (nHashesDone < nMaxHashes)
+    {
+        unsigned int nCount = std::min(MINER_BATCH_SIZE, nMaxHashes - nHashesDone);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            memcpy(&pheaders[i * 80], BEGIN(pblock->nVersion), 80);
+            *(unsigned int*)&pheaders[i * 80 + 76] = pblock->nNonce + i;
+        }
+
+        // Same hash as CBlock::GetPoWHash, without filling the validation cache
+        if (fMidstate)
+            hybridScryptHash256_finish_batch(midstate, pheaders, BEGIN(hashes[0]), nCount);
+        else
+            hybridScryptHash256_batch(pheaders, BEGIN(hashes[0]), nCount, pblock->nBits, false);
+
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            if (hashes[i] <= hashTarget)
+            {
+                pblock->nNonce += i;
+                nHashesDone += i + 1;
+                hashFound = hashes[i];
+                return true;
+            }
+        }
+        pblock->nNonce += nCount;
+        nHashesDone += nCount;
+    }
+    return false;
+}
+
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
 	//printf("GetPoWHash() - 4\n");
 
     uint256 hash = pblock->GetPoWHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     if (hash > hashTarget) {
         printf("Mediterraneancoin RPCMiner:\n");
@@ -4790,6 +6347,11 @@ void static LitecoinMiner(CWallet *pwallet)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    // Map this thread's scrypt scratch arena up front rather than on the first hash
+    if (scrypt_thread_arena() == NULL)
+        printf("LitecoinMiner : could not preallocate scrypt scratch memory\n");
+    HybridScryptMidstate midstate;
+
     try { loop {
         while (vNodes.empty())
             MilliSleep(1000);
@@ -4809,74 +6371,49 @@ void static LitecoinMiner(CWallet *pwallet)
         printf("Running LitecoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
-        //
-        // Pre-build hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-        //unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
-
-
         //
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         loop
         {
             unsigned int nHashesDone = 0;
+            uint256 hashFound;
 
-            uint256 thash;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
-            loop
+            if (ScanHybridHash(pblock, midstate, hashTarget, MINER_BATCH_SIZE, nHashesDone, hashFound))
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
-
-                if (thash <= hashTarget)
-                {
-                    // Found a solution
-                    SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
-                    SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
-                }
+                // Found a solution
+                SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                CheckWork(pblock, *pwallet, reservekey);
+                SetThreadPriority(THREAD_PRIORITY_LOWEST);
                 pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
-                    break;
             }
 
-            // Meter hashes/sec
-            static int64 nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
+            // Meter hybrid hashes/sec.  A batch takes long enough that
+            // taking the lock for every one costs nothing, and keeps the
+            // counter exact with several miner threads.
             {
                 static CCriticalSection cs;
+                static int64 nHashCounter;
+                LOCK(cs);
+                if (nHPSTimerStart == 0)
                 {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
+                    nHPSTimerStart = GetTimeMillis();
+                    nHashCounter = 0;
+                }
+                else
+                    nHashCounter += nHashesDone;
+                if (GetTimeMillis() - nHPSTimerStart > 4000)
+                {
+                    dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
+                    nHPSTimerStart = GetTimeMillis();
+                    nHashCounter = 0;
+                    static int64 nLogTime;
+                    if (GetTime() - nLogTime > 30 * 60)
                     {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64 nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
+                        nLogTime = GetTime();
+                        printf("hashmeter %6.1f hash/s\n", dHashesPerSec);
                     }
                 }
             }
@@ -4894,12 +6431,10 @@ void static LitecoinMiner(CWallet *pwallet)
 
             // Update nTime every few seconds
             pblock->UpdateTime(pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
             if (fTestNet)
             {
                 // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = uint256().SetCompact(pblock->nBits);
             }
         }
     } }
@@ -4994,10 +6529,9 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        mapHeaderIndex.clear();
+        blockindexarena.Clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
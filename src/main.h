@@ -6,6 +6,7 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "muhash.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
@@ -13,7 +14,11 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
+class CBlockHeader;
 class CBlock;
 class CBlockIndex;
 class CKeyItem;
@@ -24,6 +29,7 @@ class CInv;
 class CNode;
 
 struct CBlockIndexWorkComparator;
+struct CCoinsStatsDelta;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 
@@ -66,6 +72,20 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of threads evaluating the scrypt lanes of one PoW hash */
+static const int MAX_SCRYPTLANE_THREADS = 16;
+/** Maximum number of threads checking the proof of work of received blocks */
+static const int MAX_BLOCKVERIFY_THREADS = 16;
+/** The maximum number of headers in a "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks that can be requested from a single peer at once */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks from a single peer that can wait for verification; its further "block" messages are left unread */
+static const int MAX_BLOCKS_VERIFYING_PER_PEER = 4;
+/** How far past the active chain tip blocks are downloaded; blocks further ahead are not kept in memory */
+static const int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Seconds after which a peer that has not delivered a block we requested is disconnected */
+static const int BLOCK_DOWNLOAD_TIMEOUT = 120;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -80,8 +100,16 @@ extern CScript COINBASE_FLAGS;
 
 
 
+/** Block hashes are already uniformly distributed, so part of one is a good bucket hash */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
+extern BlockMap mapHeaderIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -90,8 +118,10 @@ extern uint256 nBestChainWork;
 extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern CBlockIndex* pindexBestHeader;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
+extern uint64 nLastBlockTxSeen;
 extern uint64 nLastBlockSize;
 extern const std::string strMessageMagic;
 extern double dHashesPerSec;
@@ -102,10 +132,13 @@ extern std::set<CWallet*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
 extern bool fImporting;
 extern bool fReindex;
+extern bool fImportSkipPoW;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
+extern int nScryptLaneThreads;
+extern int nBlockVerifyThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 
 // Settings
 extern int64 nTransactionFee;
@@ -134,8 +167,8 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block; fChecked if CheckBlock already passed */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -144,6 +177,8 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Whether proof-of-work may be skipped for an imported block at nHeight (-importskippow) */
+bool SkipImportPoW(int nHeight);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -158,10 +193,18 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Hand the received blocks whose proof of work has been checked to ProcessBlock; returns whether there were any */
+bool ProcessVerifiedBlocks();
+/** Sleep up to nMilliseconds, waking early when a received block has been checked */
+void WaitForVerifiedBlocks(int64 nMilliseconds);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Hand the blocks requested from a node that is going away to other nodes; requires cs_main */
+void FinalizeNode(CNode* pnode);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking the proof of work of received blocks */
+void ThreadBlockVerify();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
@@ -171,6 +214,9 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
+/** Hash nonces of a header starting at its nNonce until one meets hashTarget; on success nNonce is the solution.
+    midstate carries the first scrypt stage from one call to the next. */
+bool ScanHybridHash(CBlockHeader* pblock, HybridScryptMidstate& midstate, const uint256& hashTarget, unsigned int nMaxHashes, unsigned int& nHashesDone, uint256& hashFound);
 /** Check mined block */
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -899,6 +945,14 @@ public:
  *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
  *  - height = 120891
  */
+/** Approximate memory the allocator takes for a block of nSize bytes: 16-byte chunks with a pointer-sized header */
+static inline size_t MallocUsage(size_t nSize)
+{
+    if (nSize == 0)
+        return 0;
+    return ((nSize + sizeof(void*) + 15) >> 4) << 4;
+}
+
 class CCoins
 {
 public:
@@ -1095,6 +1149,14 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory held by the outputs, as allocated
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = MallocUsage(vout.capacity() * sizeof(CTxOut));
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += MallocUsage(out.scriptPubKey.capacity());
+        return nUsage;
+    }
 };
 
 /** Closure representing one script verification
@@ -1107,14 +1169,18 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    boost::shared_ptr<const CSignatureHashCache> pcache; // shared by the checks of one transaction
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache> &pcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pcache(pcacheIn) { }
 
     bool operator()() const;
+    // Leaves the signature of a pay-to-pubkey(-hash) spend to be verified with those of other checks
+    bool operator()(CSignatureBatch &batch) const;
 
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
@@ -1122,6 +1188,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pcache.swap(check.pcache);
     }
 };
 
@@ -1490,7 +1557,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(const CDiskBlockPos &pos)
+    bool ReadFromDisk(const CDiskBlockPos &pos, bool fCheckPOW = true)
     {
         SetNull();
 
@@ -1509,7 +1576,7 @@ public:
 
         //printf("GetPoWHash() - 3\n");
         // Check the header
-        if (!CheckProofOfWork(GetPoWHash(), nBits))
+        if (fCheckPOW && !CheckProofOfWork(GetPoWHash(), nBits))
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -1545,11 +1612,13 @@ public:
     /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
      *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
      *  will be true if no problems were found. Otherwise, the return value will be false in case
-     *  of problems. Note that in any case, coins may be modified. */
-    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
+     *  of problems. Note that in any case, coins may be modified. If pdelta is provided, the
+     *  change to the unspent output statistics is added to it. */
+    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL, CCoinsStatsDelta *pdelta = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins,
+    // adding the change to the statistics to pdelta if provided
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, CCoinsStatsDelta *pdelta = NULL);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -1650,6 +1719,11 @@ enum BlockStatus {
  * main/longest chain.  A blockindex may have multiple pprev pointing back
  * to it, but pnext will only point forward to the longest branch, or will
  * be null if the block is not part of the longest chain.
+ *
+ * Blocks whose header has been validated but whose transactions have not
+ * been downloaded yet are kept in mapHeaderIndex instead of mapBlockIndex.
+ * When the block arrives, its entry moves over to mapBlockIndex, so the
+ * headers built on top of it keep pointing at it.
  */
 class CBlockIndex
 {
@@ -1663,6 +1737,9 @@ public:
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
+    // (memory only) pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -1701,6 +1778,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1717,11 +1795,12 @@ public:
         nNonce         = 0;
     }
 
-    CBlockIndex(CBlockHeader& block)
+    CBlockIndex(const CBlockHeader& block)
     {
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1779,13 +1858,19 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        uint256 bnTarget;
+        bool fNegative;
+        bool fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // We need to compute 2**256 / (bnTarget+1), but we can't represent 2**256
+        // as it's too large for a uint256. However, as 2**256 is at least as large
+        // as bnTarget+1, it is equal to ((2**256 - bnTarget - 1) / (bnTarget+1)) + 1,
+        // or ~bnTarget / (bnTarget+1) + 1.
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
 
     bool IsInMainChain() const
@@ -1828,6 +1913,13 @@ public:
         return pindex->GetMedianTimePast();
     }
 
+    // Set pskip; pprev and nHeight must be set, and pprev's pskip built
+    void BuildSkip();
+
+    // Efficiently find an ancestor of this block; NULL if nHeight is out of range
+    CBlockIndex* GetAncestor(int nHeight);
+    const CBlockIndex* GetAncestor(int nHeight) const;
+
     /**
      * Returns true if there are nRequired or more blocks of minVersion or above
      * in the last nToCheck blocks, starting at pstart and going backwards.
@@ -1849,6 +1941,44 @@ public:
     }
 };
 
+/** The blocks of the main chain, indexed by height (protected by cs_main) */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    // The block at nHeight, or NULL if out of range
+    CBlockIndex *operator[](int nHeight) const {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    CBlockIndex *Tip() const {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    int Height() const {
+        return vChain.size() - 1;
+    }
+
+    bool Contains(const CBlockIndex *pindex) const {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    // Make pindex the tip; only the entries that changed are rewritten
+    void SetTip(CBlockIndex *pindex);
+
+    // The last block of the chain that is also an ancestor of pindex
+    CBlockIndex *FindFork(CBlockIndex *pindex) const;
+};
+
+extern CChain chainActive;
+
+/** The last common ancestor of two blocks */
+CBlockIndex *LastCommonAncestor(CBlockIndex *pa, CBlockIndex *pb);
+
 struct CBlockIndexWorkComparator
 {
     bool operator()(CBlockIndex *pa, CBlockIndex *pb) {
@@ -2010,7 +2140,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2046,8 +2176,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -2061,7 +2190,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2080,7 +2209,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2096,7 +2225,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2123,6 +2252,27 @@ public:
 
 
 
+/** Fee and priority of a memory pool transaction, for block template assembly */
+class CTxMemPoolInfo
+{
+public:
+    unsigned int nTxSize;
+    double dFeePerKb;
+    // Value of the inputs confirmed in the chain, and that value weighted by the confirmation height
+    double dChainValue;
+    double dChainValueHeight;
+    // Key in the priority index
+    double dPriority;
+
+    CTxMemPoolInfo() : nTxSize(1), dFeePerKb(0), dChainValue(0), dChainValueHeight(0), dPriority(0) {}
+
+    // Priority in a block on top of height nHeight: sum(valuein * age) / txsize
+    double GetPriority(int nHeight) const
+    {
+        return (dChainValue * (nHeight + 1) - dChainValueHeight) / nTxSize;
+    }
+};
+
 class CTxMemPool
 {
 public:
@@ -2130,6 +2280,17 @@ public:
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Indexes of mapTx for CreateNewBlock, ordered by fee per kB and by
+    // priority on top of nPriorityHeight; addUnchecked and remove keep them
+    // up to date, so a block template does not need to scan the pool.
+    typedef std::set<std::pair<double, uint256> > txindex_t;
+    std::map<uint256, CTxMemPoolInfo> mapInfo;
+    txindex_t setTxByFee;
+    txindex_t setTxByPriority;
+    int nPriorityHeight;
+
+    CTxMemPool() : nPriorityHeight(-1) {}
+
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
     bool remove(const CTransaction &tx, bool fRecursive = false);
@@ -2137,6 +2298,8 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
+    /** Re-key the priority index for blocks on top of height nHeight */
+    void UpdatePriorityIndex(int nHeight);
 
     unsigned long size()
     {
@@ -2153,23 +2316,103 @@ public:
     {
         return mapTx[hash];
     }
+
+private:
+    void addInfo(const uint256& hash, const CTransaction& tx);
+    void removeInfo(const uint256& hash);
+    void updateSpenders(const uint256& hash, unsigned int nOutputs);
 };
 
 extern CTxMemPool mempool;
 
+/** Change in the statistics of the unspent output set */
+struct CCoinsStatsDelta
+{
+    int64 nTransactions;
+    int64 nTransactionOutputs;
+    int64 nSerializedSize;
+    int64 nTotalAmount;
+    CMuHash3072 hashSet;        // of the unspent outputs with their coin metadata
+
+    CCoinsStatsDelta() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    // Account for the coins of txid changing from coinsOld to coinsNew
+    void Update(const uint256 &txid, const CCoins &coinsOld, const CCoins &coinsNew, BN_CTX *pctx);
+    CCoinsStatsDelta &Combine(const CCoinsStatsDelta &delta, BN_CTX *pctx);
+};
+
 struct CCoinsStats
 {
     int nHeight;
     uint256 hashBlock;
     uint64 nTransactions;
     uint64 nTransactionOutputs;
-    uint64 nSerializedSize;
-    uint256 hashSerialized;
+    uint64 nSerializedSize;     // as one record per transaction, whatever the database layout
+    uint256 hashSerialized;     // hashSet.Finalize()
     int64 nTotalAmount;
+    CMuHash3072 hashSet;
 
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+
+    void Apply(const CCoinsStatsDelta &delta, BN_CTX *pctx);
+};
+
+/** A CCoins held in a CCoinsViewCache */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char flags;
+    size_t nUsage;      // coins.DynamicMemoryUsage() when the entry was last accounted
+    // Outputs the view below has unspent, so that a store keeping one record
+    // per output only writes the ones that changed: bit i for output
+    // i < BASE_BITS, and the size of its vout
+    uint64 nBaseUnspent;
+    unsigned int nBaseOutputs;
+
+    static const unsigned int BASE_BITS = 64;
+
+    enum Flags {
+        DIRTY = (1 << 0), // differs from the view below the cache
+        FRESH = (1 << 1), // the view below has no unspent outputs for this txid
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0), nUsage(0), nBaseUnspent(0), nBaseOutputs(0) {}
+
+    void SetBase(const CCoins &coinsBase) {
+        nBaseUnspent = 0;
+        nBaseOutputs = coinsBase.vout.size();
+        for (unsigned int i = 0; i < nBaseOutputs && i < BASE_BITS; i++)
+            if (!coinsBase.vout[i].IsNull())
+                nBaseUnspent |= (uint64)1 << i;
+    }
+
+    // Whether output i may be unspent in the view below; exact for i < BASE_BITS
+    bool IsBaseUnspent(unsigned int i) const {
+        return i < BASE_BITS ? ((nBaseUnspent >> i) & 1) : i < nBaseOutputs;
+    }
 };
 
+/** Hashes txids for the coins cache, with a per-map random salt so that
+    transactions cannot be made to collide in its buckets */
+class CCoinsKeyHasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CCoinsKeyHasher();
+    size_t operator()(const uint256 &key) const {
+        uint64 a, b;
+        memcpy(&a, key.begin(), 8);
+        memcpy(&b, key.begin() + 8, 8);
+        uint64 h = (a ^ k0) * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ (h >> 29) ^ b ^ k1) * 0xBF58476D1CE4E5B9ULL;
+        return h ^ (h >> 32);
+    }
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2177,6 +2420,10 @@ public:
     // Retrieve the CCoins (unspent transaction outputs) for a given txid
     virtual bool GetCoins(const uint256 &txid, CCoins &coins);
 
+    // Retrieve the CCoins for several txids at once; vFound[i] tells whether vCoins[i] was found.
+    // Views that can look them up in parallel override this.
+    virtual void GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound);
+
     // Modify the CCoins for a given txid
     virtual bool SetCoins(const uint256 &txid, const CCoins &coins);
 
@@ -2190,8 +2437,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock) with the
+    // DIRTY entries of mapCoins; their coins may be taken out of the map
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2214,7 +2462,7 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2223,24 +2471,38 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+    // Memory used by the entries, as of their last accounting
+    size_t nCacheUsage;
+    // Entries handed out by modifiable reference since the last accounting
+    std::vector<CCoinsCacheEntry*> vModified;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins);
+    void GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+
+    // Bring the CCoins of txids that are not cached yet into the cache, in one
+    // request to the base view
+    void PrefetchCoins(const std::vector<uint256> &vTxids);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is written back on Flush. Changes through the reference are
+    // accounted on the next GetCacheUsage, BatchWrite or Flush; do not keep it past those.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a read-only reference to a CCoins, which is not written back
+    // unless it is modified through another call. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -2248,8 +2510,52 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the memory used by the cache, in bytes
+    size_t GetCacheUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator InsertCoins(const uint256 &txid);
+    void UpdateUsage(CCoinsCacheEntry &entry);
+    void UpdateModifiedUsage();
+};
+
+/** CCoinsView that writes the batches flushed into it to its base on a
+    background thread.  A batch stays readable from memory until it is
+    written, so the cache above can be emptied and refilled without waiting
+    for the disk. */
+class CCoinsViewWriter : public CCoinsViewBacked
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    // The batch being written, and the block it brings the base to
+    CCoinsMap mapWriting;
+    CBlockIndex *pindexWriting;
+    bool fWriting;
+    bool fFailed;
+    bool fQuit;
+    boost::thread thread;
+
+    void ThreadWrite();
+    bool WaitIdle(boost::unique_lock<boost::mutex> &lock);
+
+public:
+    CCoinsViewWriter(CCoinsView &baseIn);
+    ~CCoinsViewWriter();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    void GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    // Takes over the entries of mapCoins; returns false if the previous batch failed to write
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+
+    // Wait until the pending batch is written; false if writing it failed
+    bool Sync();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -2268,6 +2574,35 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Statistics of the unspent output set at the tip, kept up to date block by
+    block once they have been asked for.  The first request scans a snapshot
+    of the coin database; blocks connected meanwhile are replayed on top. */
+class CCoinsStatsCache
+{
+private:
+    enum { STATS_NONE, STATS_SCANNING, STATS_READY };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    int nState;
+    CCoinsStats statsTip;
+    bool fFinal;                // statsTip.hashSerialized is up to date
+    // Tip after each change made while scanning, and the change
+    std::vector<std::pair<CBlockIndex*, CCoinsStatsDelta> > vJournal;
+
+public:
+    CCoinsStatsCache() : nState(STATS_NONE), fFinal(false) {}
+
+    // Whether changes to the tip must be passed to Update (call with cs_main held)
+    bool IsTracking();
+    // The coins at the tip, now pindexNew, changed by delta (call with cs_main held)
+    void Update(const CCoinsStatsDelta &delta, CBlockIndex *pindexNew);
+    // Statistics at the current tip; does not need cs_main
+    bool Get(CCoinsStats &stats);
+};
+
+extern CCoinsStatsCache coinsstats;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
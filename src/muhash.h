@@ -0,0 +1,92 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MUHASH_H
+#define BITCOIN_MUHASH_H
+
+#include <vector>
+#include <openssl/sha.h>
+
+#include "bignum.h"
+#include "hash.h"
+#include "uint256.h"
+
+/** Hash of a set, which does not depend on the order in which elements are
+ *  inserted and allows removing them again.
+ *
+ *  Every element is mapped to a number modulo the 3072-bit prime
+ *  2^3072 - 1103717, and the set hash is their product. Removed elements are
+ *  multiplied into a separate denominator, so only the final hash needs a
+ *  modular inverse. Two of these can be combined, which lets parts of a set
+ *  be hashed independently.
+ */
+class CMuHash3072
+{
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+    static const CBigNum &Prime()
+    {
+        static const CBigNum bnPrime = (CBigNum(1) << 3072) - CBigNum(1103717);
+        return bnPrime;
+    }
+
+    // Expand a 256-bit hash to a number below the prime
+    static CBigNum ToNumber(const uint256 &hash)
+    {
+        std::vector<unsigned char> vch(384);
+        unsigned char pchBlock[36];
+        memcpy(pchBlock, hash.begin(), 32);
+        for (unsigned int i = 0; i < 12; i++) {
+            pchBlock[32] = i;
+            pchBlock[33] = pchBlock[34] = pchBlock[35] = 0;
+            SHA256(pchBlock, sizeof(pchBlock), &vch[i * 32]);
+        }
+        // keep it positive and below 2^3071
+        vch[383] &= 0x7f;
+        CBigNum bn;
+        bn.setvch(vch);
+        return bn;
+    }
+
+public:
+    CMuHash3072() : bnNumerator(1), bnDenominator(1) {}
+
+    void Insert(const uint256 &hash, BN_CTX *pctx)
+    {
+        bnNumerator.MulMod(ToNumber(hash), Prime(), pctx);
+    }
+
+    void Remove(const uint256 &hash, BN_CTX *pctx)
+    {
+        bnDenominator.MulMod(ToNumber(hash), Prime(), pctx);
+    }
+
+    // Union with another set
+    CMuHash3072 &Combine(const CMuHash3072 &b, BN_CTX *pctx)
+    {
+        bnNumerator.MulMod(b.bnNumerator, Prime(), pctx);
+        bnDenominator.MulMod(b.bnDenominator, Prime(), pctx);
+        return *this;
+    }
+
+    // Undo a Combine with b
+    CMuHash3072 &Separate(const CMuHash3072 &b, BN_CTX *pctx)
+    {
+        bnNumerator.MulMod(b.bnDenominator, Prime(), pctx);
+        bnDenominator.MulMod(b.bnNumerator, Prime(), pctx);
+        return *this;
+    }
+
+    uint256 Finalize() const
+    {
+        CAutoBN_CTX pctx;
+        CBigNum bn = bnNumerator;
+        bn.MulMod(bnDenominator.InverseMod(Prime()), Prime(), pctx);
+        std::vector<unsigned char> vch = bn.getvch();
+        return Hash(vch.begin(), vch.end());
+    }
+};
+
+#endif
@@ -82,15 +82,15 @@ unsigned short GetListenPort()
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
 }
 
-void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     // Filter out duplicate requests
-    if (pindexBegin == pindexLastGetBlocksBegin && hashEnd == hashLastGetBlocksEnd)
+    if (pindexBegin == pindexLastGetHeadersBegin && hashEnd == hashLastGetHeadersEnd)
         return;
-    pindexLastGetBlocksBegin = pindexBegin;
-    hashLastGetBlocksEnd = hashEnd;
+    pindexLastGetHeadersBegin = pindexBegin;
+    hashLastGetHeadersEnd = hashEnd;
 
-    PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+    PushMessage("getheaders", CBlockLocator(pindexBegin), hashEnd);
 }
 
 // find 'best' local address for a particular peer
@@ -799,7 +799,15 @@ void ThreadSocketHandler()
                             {
                                 TRY_LOCK(pnode->cs_inventory, lockInv);
                                 if (lockInv)
-                                    fDelete = true;
+                                {
+                                    // its block downloads go to other nodes
+                                    TRY_LOCK(cs_main, lockMain);
+                                    if (lockMain)
+                                    {
+                                        FinalizeNode(pnode);
+                                        fDelete = true;
+                                    }
+                                }
                             }
                         }
                     }
@@ -1650,7 +1658,7 @@ void ThreadMessageHandler()
                     if (!ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                    if (pnode->nSendSize < SendBufferSize() && pnode->nBlocksVerifying < MAX_BLOCKS_VERIFYING_PER_PEER)
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
@@ -1676,8 +1684,11 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
+        if (ProcessVerifiedBlocks())
+            fSleep = false;
+
         if (fSleep)
-            MilliSleep(100);
+            WaitForVerifiedBlocks(100);
     }
 }
 
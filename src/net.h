@@ -209,11 +209,16 @@ protected:
 
 public:
     uint256 hashContinue;
-    CBlockIndex* pindexLastGetBlocksBegin;
-    uint256 hashLastGetBlocksEnd;
+    CBlockIndex* pindexLastGetHeadersBegin;
+    uint256 hashLastGetHeadersEnd;
     int nStartingHeight;
     bool fStartSync;
 
+    // block download, protected by cs_main
+    CBlockIndex* pindexBestKnownBlock;              // the best header this peer is known to have
+    std::map<uint256, int64> mapBlocksInTransit;    // blocks requested from this peer, and when
+    int nBlocksVerifying;                           // blocks received waiting for verification, protected by cs_vNodes
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -252,10 +257,12 @@ public:
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
-        pindexLastGetBlocksBegin = 0;
-        hashLastGetBlocksEnd = 0;
+        pindexLastGetHeadersBegin = 0;
+        hashLastGetHeadersEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        pindexBestKnownBlock = NULL;
+        nBlocksVerifying = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
@@ -607,7 +614,7 @@ public:
         }
     }
 
-    void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
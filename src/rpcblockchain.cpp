@@ -189,12 +189,14 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gettxoutsetinfo\n"
-            "Returns statistics about the unspent transaction output set.");
+            "Returns statistics about the unspent transaction output set.\n"
+            "hash_serialized is a hash of the set that does not depend on the database layout.\n"
+            "The first call scans the coin database; later ones are answered from memory.");
 
     Object ret;
 
     CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
+    if (coinsstats.Get(stats)) {
         ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
@@ -7,10 +7,14 @@
 #include "db.h"
 #include "init.h"
 #include "bitcoinrpc.h"
+#include "sigcache.h"
 
 using namespace json_spirit;
 using namespace std;
 
+// Protects the cached blocks of getwork and getworkex
+static CCriticalSection cs_getwork;
+
 // Return average network hashes per second based on the last 'lookup' blocks,
 // or from the last difficulty change if 'lookup' is nonpositive.
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
@@ -162,6 +166,51 @@ Value getmininginfo(const Array& params, bool fHelp)
 }
 
 
+Value getpowcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getpowcacheinfo\n"
+            "Returns an object containing statistics of the proof-of-work hash cache.");
+
+    ScryptHashCacheStats stats;
+    hybridScryptHash256CacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",          (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (uint64_t)stats.nMisses));
+    obj.push_back(Pair("entries",       (int)stats.nEntries));
+    obj.push_back(Pair("capacity",      (int)stats.nCapacity));
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",       nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return obj;
+}
+
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing statistics of the signature cache.");
+
+    SignatureCacheStats stats;
+    GetSignatureCache().GetStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",          (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (uint64_t)stats.nMisses));
+    obj.push_back(Pair("inserts",       (uint64_t)stats.nInserts));
+    obj.push_back(Pair("evictions",     (uint64_t)stats.nEvictions));
+    obj.push_back(Pair("erased",        (uint64_t)stats.nErased));
+    obj.push_back(Pair("entries",       (int)stats.nEntries));
+    obj.push_back(Pair("capacity",      (int)stats.nCapacity));
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",       nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return obj;
+}
+
+
 Value getworkex(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -179,8 +228,9 @@ Value getworkex(const Array& params, bool fHelp)
     if (pMiningKey == NULL)
     	throw JSONRPCError(RPC_CLIENT_SERVER_NOT_RUNNING, "startup option '-server=true' is required!");
 
+    LOCK(cs_getwork);
     typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
+    static mapNewBlock_t mapNewBlock;    // protected by cs_getwork
     static vector<CBlockTemplate*> vNewBlockTemplate;
     static CReserveKey reservekey(pwalletMain);
 
@@ -239,7 +289,7 @@ Value getworkex(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         CTransaction coinbaseTx = pblock->vtx[0];
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
@@ -322,8 +372,9 @@ Value getwork(const Array& params, bool fHelp)
     if (pMiningKey == NULL)
     	throw JSONRPCError(RPC_CLIENT_SERVER_NOT_RUNNING, "startup option '-server=true' is required!");
 
+    LOCK(cs_getwork);
     typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
+    static mapNewBlock_t mapNewBlock;    // protected by cs_getwork
     static vector<CBlockTemplate*> vNewBlockTemplate;
 
     if (params.size() == 0)
@@ -381,7 +432,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -540,7 +591,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     static Array aMutable;
     if (aMutable.empty())
@@ -78,6 +78,7 @@ Value getinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
     }
     obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("headers",       pindexBestHeader ? pindexBestHeader->nHeight : -1));
     obj.push_back(Pair("timeoffset",    (boost::int64_t)GetTimeOffset()));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
@@ -1220,10 +1221,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
+        CBlockIndex *block = chainActive[target_height];
 
         lastblock = block ? block->GetBlockHash() : 0;
     }
@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -13,33 +12,300 @@ using namespace boost;
 #include "bignum.h"
 #include "key.h"
 #include "main.h"
+#include "sigcache.h"
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+typedef vector<unsigned char> valtype;
+
+namespace {
+
+/** A value on the script stack. Values of up to nInlineSize bytes, which
+ *  covers signatures, public keys and hashes, are kept in the object itself.
+ *  Longer ones are allocated, and shared between copies, as a value is only
+ *  ever replaced as a whole; so copying never allocates either.
+ */
+class CStackValue
+{
+private:
+    struct CHeapValue
+    {
+        unsigned int nRefCount;
+        unsigned int nCapacity;
 
+        unsigned char *data() { return (unsigned char*)(this + 1); }
+    };
 
+    static const unsigned int nInlineSize = 80;
+    unsigned int nSize;
+    bool fHeap;
+    union
+    {
+        unsigned char chInline[nInlineSize];
+        CHeapValue *pheap;
+    };
 
-typedef vector<unsigned char> valtype;
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
+    void Release()
+    {
+        if (fHeap && --pheap->nRefCount == 0)
+            delete[] (unsigned char*)pheap;
+        fHeap = false;
+    }
+
+    void AssignHeap(const unsigned char *pbegin, unsigned int n);
+
+    void Share(const CStackValue &b)
+    {
+        // b's value before our own, which may hold the last reference to it
+        b.pheap->nRefCount++;
+        Release();
+        pheap = b.pheap;
+        fHeap = true;
+        nSize = b.nSize;
+    }
+
+    void CopyInline(const CStackValue &b)
+    {
+        Release();
+        memcpy(chInline, b.chInline, b.nSize);
+        nSize = b.nSize;
+    }
+
+public:
+    CStackValue() : nSize(0), fHeap(false) { }
+
+    CStackValue(const unsigned char *pbegin, const unsigned char *pend) : nSize(0), fHeap(false)
+    {
+        assign(pbegin, pend);
+    }
+
+    explicit CStackValue(const valtype &vch) : nSize(0), fHeap(false)
+    {
+        if (!vch.empty())
+            assign(&vch[0], &vch[0] + vch.size());
+    }
+
+    CStackValue(const CStackValue &b) : nSize(0), fHeap(false)
+    {
+        if (b.fHeap)
+            Share(b);
+        else
+            CopyInline(b);
+    }
+
+    ~CStackValue()
+    {
+        Release();
+    }
+
+    CStackValue &operator=(const CStackValue &b)
+    {
+        if (this == &b)
+            return *this;
+        if (b.fHeap)
+            Share(b);
+        else
+            CopyInline(b);
+        return *this;
+    }
+
+    void assign(const unsigned char *pbegin, const unsigned char *pend)
+    {
+        unsigned int n = pend - pbegin;
+        if (n > nInlineSize)
+            AssignHeap(pbegin, n);
+        else if (fHeap)
+        {
+            // pbegin can point into the value released
+            unsigned char chTmp[nInlineSize];
+            std::copy(pbegin, pend, chTmp);
+            Release();
+            std::copy(chTmp, chTmp + n, chInline);
+        }
+        else
+            memmove(chInline, pbegin, n);
+        nSize = n;
+    }
+
+    const unsigned char *begin() const { return fHeap ? pheap->data() : chInline; }
+    const unsigned char *end() const { return begin() + nSize; }
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    const unsigned char &operator[](unsigned int i) const { return begin()[i]; }
+    unsigned char back() const { return begin()[nSize - 1]; }
+
+    friend bool operator==(const CStackValue &a, const CStackValue &b)
+    {
+        return a.nSize == b.nSize && memcmp(a.begin(), b.begin(), a.nSize) == 0;
+    }
+
+    friend void swap(CStackValue &a, CStackValue &b)
+    {
+        unsigned char chTmp[nInlineSize];
+        memcpy(chTmp, a.chInline, nInlineSize);
+        memcpy(a.chInline, b.chInline, nInlineSize);
+        memcpy(b.chInline, chTmp, nInlineSize);
+        std::swap(a.nSize, b.nSize);
+        std::swap(a.fHeap, b.fHeap);
+    }
+};
+
+void CStackValue::AssignHeap(const unsigned char *pbegin, unsigned int n)
+{
+    if (fHeap && pheap->nRefCount == 1 && pheap->nCapacity >= n)
+    {
+        memmove(pheap->data(), pbegin, n);
+        return;
+    }
+    CHeapValue *pnew = (CHeapValue*)new unsigned char[sizeof(CHeapValue) + n];
+    pnew->nRefCount = 1;
+    pnew->nCapacity = n;
+    memcpy(pnew->data(), pbegin, n);
+    Release();
+    pheap = pnew;
+    fHeap = true;
+}
+
+typedef vector<CStackValue> CScriptStack;
+
+/** The nesting of IF/ELSE/ENDIF. Only whether all branches entered are taken
+ *  matters, so this keeps the depth and the first branch not taken, instead
+ *  of a vector<bool> to allocate and search at every opcode.
+ */
+class CConditionStack
+{
+private:
+    static const unsigned int NO_FALSE = ~0U;
+    unsigned int nSize;
+    unsigned int nFirstFalse;
+
+public:
+    CConditionStack() : nSize(0), nFirstFalse(NO_FALSE) { }
 
+    bool empty() const { return nSize == 0; }
+    bool all_true() const { return nFirstFalse == NO_FALSE; }
 
-CBigNum CastToBigNum(const valtype& vch)
+    void push_back(bool f)
+    {
+        if (!f && nFirstFalse == NO_FALSE)
+            nFirstFalse = nSize;
+        nSize++;
+    }
+
+    void pop_back()
+    {
+        assert(nSize > 0);
+        if (nFirstFalse == --nSize)
+            nFirstFalse = NO_FALSE;
+    }
+
+    void toggle_top()
+    {
+        // Below a branch not taken, the value of the top does not matter
+        assert(nSize > 0);
+        if (nFirstFalse == NO_FALSE)
+            nFirstFalse = nSize - 1;
+        else if (nFirstFalse == nSize - 1)
+            nFirstFalse = NO_FALSE;
+    }
+};
+
+/** An opcode and the value it pushes, if any */
+struct CScriptOp
 {
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+    opcodetype opcode;
+    unsigned int nSize;
+    const unsigned char *pchValue;
+    CScript::const_iterator pcNext; // just after the opcode
+};
+
+/** A script decoded before it runs. Standard scripts have few enough
+ *  opcodes to be held without allocating.
+ */
+class CDecodedScript
+{
+private:
+    static const unsigned int nInlineOps = 24;
+    CScriptOp opsInline[nInlineOps];
+    vector<CScriptOp> vOps; // all of them, when there are more
+    unsigned int nOps;
+
+public:
+    CDecodedScript() : nOps(0) { }
+
+    /** Decode up to the first opcode that fails the script as soon as it is
+     *  read: one that does not parse, a push over MAX_SCRIPT_ELEMENT_SIZE or
+     *  a disabled opcode. Returns whether there is none. */
+    bool Decode(const CScript &script);
+
+    unsigned int size() const { return nOps; }
+    const CScriptOp &operator[](unsigned int i) const { return vOps.empty() ? opsInline[i] : vOps[i]; }
+};
+
+bool CDecodedScript::Decode(const CScript &script)
+{
+    CScript::const_iterator pc = script.begin();
+    while (pc < script.end())
+    {
+        CScriptOp op;
+        CScript::const_iterator pvalue;
+        if (!script.GetOp(pc, op.opcode, pvalue, op.nSize))
+            return false;
+        if (op.nSize > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+
+        if (op.opcode == OP_CAT ||
+            op.opcode == OP_SUBSTR ||
+            op.opcode == OP_LEFT ||
+            op.opcode == OP_RIGHT ||
+            op.opcode == OP_INVERT ||
+            op.opcode == OP_AND ||
+            op.opcode == OP_OR ||
+            op.opcode == OP_XOR ||
+            op.opcode == OP_2MUL ||
+            op.opcode == OP_2DIV ||
+            op.opcode == OP_MUL ||
+            op.opcode == OP_DIV ||
+            op.opcode == OP_MOD ||
+            op.opcode == OP_LSHIFT ||
+            op.opcode == OP_RSHIFT)
+            return false; // Disabled opcodes.
+
+        op.pchValue = &script[0] + (pvalue - script.begin());
+        op.pcNext = pc;
+        if (nOps < nInlineOps)
+            opsInline[nOps] = op;
+        else
+        {
+            if (vOps.empty())
+            {
+                // Every opcode takes at least a byte
+                vOps.reserve(nInlineOps + (script.end() - pc) + 1);
+                vOps.assign(opsInline, opsInline + nInlineOps);
+            }
+            vOps.push_back(op);
+        }
+        nOps++;
+    }
+    return true;
+}
+
+}
+
+static bool CheckSig(const CStackValue &vchSig, const CStackValue &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *pcache, CSignatureBatch *pbatch);
+
+
+static const unsigned char chTrue = 1;
+static const CStackValue vchFalse;
+static const CStackValue vchTrue(&chTrue, &chTrue + 1);
+
+
+CScriptNum CastToNum(const CStackValue& vch)
+{
+    return CScriptNum(vch.begin(), vch.size());
 }
 
-bool CastToBool(const valtype& vch)
+bool CastToBool(const CStackValue& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
     {
@@ -62,13 +328,26 @@ bool CastToBool(const valtype& vch)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
     stack.pop_back();
 }
 
+static inline void pushstack(CScriptStack& stack, const unsigned char *pbegin, const unsigned char *pend)
+{
+    // Copy the value in place, rather than into a temporary first
+    stack.push_back(CStackValue());
+    stack.back().assign(pbegin, pend);
+}
+
+static inline void pushnum(CScriptStack& stack, const CScriptNum& bn)
+{
+    unsigned char pch[CScriptNum::nMaxEncodedSize];
+    pushstack(stack, pch, pch + bn.Encode(pch));
+}
+
 
 const char* GetTxnOutputType(txnouttype t)
 {
@@ -227,7 +506,7 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool IsCanonicalPubKey(const valtype &vchPubKey) {
+static bool IsCanonicalPubKey(const CStackValue &vchPubKey) {
     if (vchPubKey.size() < 33)
         return error("Non-canonical public key: too short");
     if (vchPubKey[0] == 0x04) {
@@ -242,7 +521,7 @@ bool IsCanonicalPubKey(const valtype &vchPubKey) {
     return true;
 }
 
-bool IsCanonicalSignature(const valtype &vchSig) {
+static bool IsCanonicalSignature(const CStackValue &vchSig) {
     // See https://bitcointalk.org/index.php?topic=8392.msg127623#msg127623
     // A canonical signature exists of: <30> <total len> <02> <len R> <R> <02> <len S> <S> <hashtype>
     // Where R and S are not negative (their first byte has its highest bit not set), and not
@@ -289,56 +568,64 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool IsCanonicalPubKey(const valtype &vchPubKey) {
+    return IsCanonicalPubKey(CStackValue(vchPubKey));
+}
+
+bool IsCanonicalSignature(const valtype &vchSig) {
+    return IsCanonicalSignature(CStackValue(vchSig));
+}
+
+/** The part of script that signatures hash: from pbegincodehash on, without
+ *  the pushes of the signatures from pbeginSig to pendSig, since there's no
+ *  way for a signature to sign itself. Usually that is all of script, which
+ *  is returned then; otherwise the copy is made in scriptCodeRet.
+ */
+static const CScript &GetScriptCode(const CScript &script, CScript::const_iterator pbegincodehash,
+                                    CScriptStack::const_iterator pbeginSig, CScriptStack::const_iterator pendSig,
+                                    CScript &scriptCodeRet)
+{
+    bool fCopy = (pbegincodehash != script.begin());
+    for (CScriptStack::const_iterator it = pbeginSig; !fCopy && it != pendSig; it++)
+        fCopy = (search(pbegincodehash, script.end(), it->begin(), it->end()) != script.end());
+    if (!fCopy)
+        return script;
+
+    scriptCodeRet.assign(pbegincodehash, script.end());
+    // From the top of the stack down
+    for (CScriptStack::const_iterator it = pendSig; it != pbeginSig; )
+    {
+        --it;
+        scriptCodeRet.FindAndDelete(CScript(valtype(it->begin(), it->end())));
+    }
+    return scriptCodeRet;
+}
+
+static bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache, CSignatureBatch *pbatch)
 {
-    CAutoBN_CTX pctx;
-    CScript::const_iterator pc = script.begin();
-    CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
-    opcodetype opcode;
-    valtype vchPushValue;
-    vector<bool> vfExec;
-    vector<valtype> altstack;
+    CConditionStack vfExec;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
+    CDecodedScript ops;
+    bool fDecoded = ops.Decode(script);
     int nOpCount = 0;
     bool fStrictEncodings = flags & SCRIPT_VERIFY_STRICTENC;
 
     try
     {
-        while (pc < pend)
+        for (unsigned int iop = 0; iop < ops.size(); iop++)
         {
-            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+            const CScriptOp& op = ops[iop];
+            opcodetype opcode = op.opcode;
+            bool fExec = vfExec.all_true();
 
-            //
-            // Read instruction
-            //
-            if (!script.GetOp(pc, opcode, vchPushValue))
-                return false;
-            if (vchPushValue.size() > MAX_SCRIPT_ELEMENT_SIZE)
-                return false;
             if (opcode > OP_16 && ++nOpCount > 201)
                 return false;
 
-            if (opcode == OP_CAT ||
-                opcode == OP_SUBSTR ||
-                opcode == OP_LEFT ||
-                opcode == OP_RIGHT ||
-                opcode == OP_INVERT ||
-                opcode == OP_AND ||
-                opcode == OP_OR ||
-                opcode == OP_XOR ||
-                opcode == OP_2MUL ||
-                opcode == OP_2DIV ||
-                opcode == OP_MUL ||
-                opcode == OP_DIV ||
-                opcode == OP_MOD ||
-                opcode == OP_LSHIFT ||
-                opcode == OP_RSHIFT)
-                return false; // Disabled opcodes.
-
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                pushstack(stack, op.pchValue, op.pchValue + op.nSize);
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -364,8 +651,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -387,7 +674,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        CStackValue& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -401,7 +688,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
-                    vfExec.back() = !vfExec.back();
+                    vfExec.toggle_top();
                 }
                 break;
 
@@ -437,11 +724,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 // Stack ops
                 //
+                // Values are moved with swap and copied in place, so that
+                // none of these allocate for values kept inline.
+                //
                 case OP_TOALTSTACK:
                 {
                     if (stack.size() < 1)
                         return false;
-                    altstack.push_back(stacktop(-1));
+                    altstack.push_back(CStackValue());
+                    swap(altstacktop(-1), stacktop(-1));
                     popstack(stack);
                 }
                 break;
@@ -450,7 +741,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (altstack.size() < 1)
                         return false;
-                    stack.push_back(altstacktop(-1));
+                    stack.push_back(CStackValue());
+                    swap(stacktop(-1), altstacktop(-1));
                     popstack(altstack);
                 }
                 break;
@@ -470,10 +762,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-2));
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -482,12 +772,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
-                    stack.push_back(vch3);
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
+                    stack.push_back(stacktop(-3));
                 }
                 break;
 
@@ -496,23 +783,21 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    stack.push_back(stacktop(-4));
+                    stack.push_back(stacktop(-4));
                 }
                 break;
 
                 case OP_2ROT:
                 {
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
+                    //  x3 x4 x1 x2 x5 x6  after the first two swaps
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
-                    stack.erase(stack.end()-6, stack.end()-4);
-                    stack.push_back(vch1);
-                    stack.push_back(vch2);
+                    swap(stacktop(-6), stacktop(-4));
+                    swap(stacktop(-5), stacktop(-3));
+                    swap(stacktop(-4), stacktop(-2));
+                    swap(stacktop(-3), stacktop(-1));
                 }
                 break;
 
@@ -531,17 +816,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    if (CastToBool(stacktop(-1)))
+                        stack.push_back(stacktop(-1));
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stack.size());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -559,8 +843,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-1));
                 }
                 break;
 
@@ -569,7 +852,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2)
                     if (stack.size() < 2)
                         return false;
-                    stack.erase(stack.end() - 2);
+                    swap(stacktop(-2), stacktop(-1));
+                    popstack(stack);
                 }
                 break;
 
@@ -578,8 +862,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
-                    stack.push_back(vch);
+                    stack.push_back(stacktop(-2));
                 }
                 break;
 
@@ -590,14 +873,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CastToNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
-                        stack.erase(stack.end()-n-1);
-                    stack.push_back(vch);
+                    {
+                        // Bubble xn up to the top
+                        for (int i = -n-1; i < -1; i++)
+                            swap(stacktop(i), stacktop(i+1));
+                    }
+                    else
+                        stack.push_back(stacktop(-n-1));
                 }
                 break;
 
@@ -625,10 +912,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_TUCK:
                 {
                     // (x1 x2 -- x2 x1 x2)
+                    //  x1 x2 x2  after the copy
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
-                    stack.insert(stack.end()-2, vch);
+                    stack.push_back(stacktop(-1));
+                    swap(stacktop(-3), stacktop(-2));
                 }
                 break;
 
@@ -638,8 +926,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum bn(stacktop(-1).size());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -654,8 +942,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    CStackValue& vch1 = stacktop(-2);
+                    CStackValue& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -689,19 +977,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn = CastToNum(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
+                    case OP_1ADD:       bn = bn + CScriptNum(1); break;
+                    case OP_1SUB:       bn = bn - CScriptNum(1); break;
                     case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_ABS:        if (bn < CScriptNum(0)) bn = -bn; break;
+                    case OP_NOT:        bn = CScriptNum(bn == CScriptNum(0)); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != CScriptNum(0)); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -722,9 +1010,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1 = CastToNum(stacktop(-2));
+                    CScriptNum bn2 = CastToNum(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -735,22 +1023,22 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != CScriptNum(0) && bn2 != CScriptNum(0)); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != CScriptNum(0) || bn2 != CScriptNum(0)); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -767,9 +1055,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1 = CastToNum(stacktop(-3));
+                    CScriptNum bn2 = CastToNum(stacktop(-2));
+                    CScriptNum bn3 = CastToNum(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -791,33 +1079,34 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CStackValue& vch = stacktop(-1);
+                    unsigned char pchHash[32];
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint160 hash160 = Hash160(vch.begin(), vch.end());
+                        memcpy(pchHash, &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    // Replaces the input in place
+                    vch.assign(pchHash, pchHash + nHashSize);
                 }
                 break;
 
                 case OP_CODESEPARATOR:
                 {
                     // Hash starts after the code separator
-                    pbegincodehash = pc;
+                    pbegincodehash = op.pcNext;
                 }
                 break;
 
@@ -828,22 +1117,21 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    CStackValue& vchSig    = stacktop(-2);
+                    CStackValue& vchPubKey = stacktop(-1);
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
                     //PrintHex(vchPubKey.begin(), vchPubKey.end(), "pubkey: %s\n");
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signature, since there's no way for a signature to sign itself
-                    scriptCode.FindAndDelete(CScript(vchSig));
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signature
+                    CScript scriptCodeCopy;
+                    const CScript& scriptCode = GetScriptCode(script, pbegincodehash, stack.end() - 2, stack.end() - 1, scriptCodeCopy);
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache, pbatch);
 
                     popstack(stack);
                     popstack(stack);
@@ -867,7 +1155,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CastToNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -878,7 +1166,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CastToNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -886,26 +1174,21 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    // Subset of script starting at the most recent codeseparator
-                    CScript scriptCode(pbegincodehash, pend);
-
-                    // Drop the signatures, since there's no way for a signature to sign itself
-                    for (int k = 0; k < nSigsCount; k++)
-                    {
-                        valtype& vchSig = stacktop(-isig-k);
-                        scriptCode.FindAndDelete(CScript(vchSig));
-                    }
+                    // Subset of script starting at the most recent codeseparator,
+                    // without the signatures
+                    CScript scriptCodeCopy;
+                    const CScript& scriptCode = GetScriptCode(script, pbegincodehash, stack.end() - isig - nSigsCount + 1, stack.end() - isig + 1, scriptCodeCopy);
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        CStackValue& vchSig    = stacktop(-isig);
+                        CStackValue& vchPubKey = stacktop(-ikey);
 
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache, NULL);
 
                         if (fOk) {
                             isig++;
@@ -948,6 +1231,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
         return false;
     }
 
+    // Stopped at an opcode that fails the script when read
+    if (!fDecoded)
+        return false;
 
     if (!vfExec.empty())
         return false;
@@ -955,6 +1241,21 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache, CSignatureBatch *pbatch)
+{
+    CScriptStack stackEval;
+    stackEval.reserve(stack.size());
+    BOOST_FOREACH(const valtype& vch, stack)
+        stackEval.push_back(CStackValue(vch));
+    bool fRet = EvalScript(stackEval, script, txTo, nIn, flags, nHashType, pcache, pbatch);
+    // Whatever the outcome, as callers may look at what is left
+    stack.resize(stackEval.size());
+    for (unsigned int i = 0; i < stack.size(); i++)
+        stack[i].assign(stackEval[i].begin(), stackEval[i].end());
+    return fRet;
+}
+
+
 
 
 
@@ -963,147 +1264,198 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+namespace {
+
+/** Writes scriptCode as the scriptSig of the input being signed. Its
+ *  OP_CODESEPARATORs are dropped, which only needs a copy of it when the
+ *  byte occurs at all. */
+template<typename S>
+void SerializeScriptCode(S &s, const CScript &scriptCode)
 {
-    if (nIn >= txTo.vin.size())
-    {
-        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+    if (std::find(scriptCode.begin(), scriptCode.end(), (unsigned char)OP_CODESEPARATOR) == scriptCode.end()) {
+        s << scriptCode;
+        return;
     }
-    CTransaction txTmp(txTo);
-
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    CScript scriptTmp(scriptCode);
+    scriptTmp.FindAndDelete(CScript(OP_CODESEPARATOR));
+    s << scriptTmp;
+}
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+/** Serializes txTo the way SignatureHash sees it when signing input nIn,
+ *  without copying it. */
+class CTransactionSignatureSerializer
+{
+private:
+    const CTransaction &txTo;
+    const CScript &scriptCode;
+    const unsigned int nIn;
+    const bool fAnyoneCanPay;
+    const bool fHashSingle;
+    const bool fHashNone;
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+public:
+    CTransactionSignatureSerializer(const CTransaction &txToIn, const CScript &scriptCodeIn, unsigned int nInIn, int nHashTypeIn) :
+        txTo(txToIn), scriptCode(scriptCodeIn), nIn(nInIn),
+        fAnyoneCanPay(!!(nHashTypeIn & SIGHASH_ANYONECANPAY)),
+        fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
+        fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
+
+    template<typename S>
+    void SerializeInput(S &s, unsigned int nInput) const
     {
-        // Wildcard payee
-        txTmp.vout.clear();
-
+        // With SIGHASH_ANYONECANPAY only the input being signed is left
+        if (fAnyoneCanPay)
+            nInput = nIn;
+        const CTxIn &txin = txTo.vin[nInput];
+        s << txin.prevout;
+        // Blank out other inputs' signatures
+        if (nInput == nIn)
+            SerializeScriptCode(s, scriptCode);
+        else
+            s << CScript();
         // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        if (nInput != nIn && (fHashSingle || fHashNone))
+            s << (unsigned int)0;
+        else
+            s << txin.nSequence;
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
-    {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
-        {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
-        }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+    template<typename S>
+    void SerializeOutput(S &s, unsigned int nOutput) const
+    {
+        // With SIGHASH_SINGLE, only lock-in the txout payee at same index as txin
+        if (fHashSingle && nOutput != nIn)
+            s << CTxOut();
+        else
+            s << txTo.vout[nOutput];
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    template<typename S>
+    void Serialize(S &s, int nType, int nVersion) const
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        s << txTo.nVersion;
+        unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+        WriteCompactSize(s, nInputs);
+        for (unsigned int nInput = 0; nInput < nInputs; nInput++)
+            SerializeInput(s, nInput);
+        // With SIGHASH_NONE the payee is a wildcard
+        unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+        WriteCompactSize(s, nOutputs);
+        for (unsigned int nOutput = 0; nOutput < nOutputs; nOutput++)
+            SerializeOutput(s, nOutput);
+        s << txTo.nLockTime;
     }
+};
 
-    // Serialize and hash
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << txTmp << nHashType;
-    return ss.GetHash();
 }
 
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txTo)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+    vnInputBegin.reserve(txTo.vin.size() + 1);
+    BOOST_FOREACH(const CTxIn &txin, txTo.vin) {
+        vnInputBegin.push_back(ss.size());
+        ss << txin.prevout << CScript() << txin.nSequence;
+    }
+    vnInputBegin.push_back(ss.size());
+    ss << txTo.vout << txTo.nLockTime;
+    vchBlank.assign(ss.begin(), ss.end());
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    vMidstate.reserve(txTo.vin.size());
+    unsigned int nPos = 0;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        SHA256_Update(&ctx, &vchBlank[nPos], vnInputBegin[i] - nPos);
+        nPos = vnInputBegin[i];
+        vMidstate.push_back(ctx);
+    }
+}
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
-
-class CSignatureCache
+bool CSignatureHashCache::SignatureHash(uint256 &hashRet, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType) const
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE || (nHashType & SIGHASH_ANYONECANPAY))
+        return false;
+    if (nIn >= vMidstate.size())
+        return false;
 
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+    // Everything up to the input being signed is hashed already, and what
+    // follows it is the same for every input
+    CHashWriter ss(SER_GETHASH, 0, vMidstate[nIn]);
+    const CTxIn &txin = txTo.vin[nIn];
+    ss << txin.prevout;
+    SerializeScriptCode(ss, scriptCode);
+    ss << txin.nSequence;
+    unsigned int nPos = vnInputBegin[nIn + 1];
+    ss.write((const char*)&vchBlank[nPos], vchBlank.size() - nPos);
+    ss << nHashType;
+    hashRet = ss.GetHash();
+    return true;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache)
+{
+    if (nIn >= txTo.vin.size())
+    {
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    // Check for invalid use of SIGHASH_SINGLE
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+        if (nIn >= txTo.vout.size())
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+            return 1;
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
     }
-};
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
-{
-    static CSignatureCache signatureCache;
+    uint256 hash;
+    if (pcache && pcache->SignatureHash(hash, scriptCode, txTo, nIn, nHashType))
+        return hash;
+
+    // Wrapper to serialize only the necessary parts of the transaction being signed
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+
+    // Serialize and hash
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return ss.GetHash();
+}
+
 
-    CPubKey pubkey(vchPubKey);
+static bool CheckSig(const CStackValue &vchSigIn, const CStackValue &vchPubKey, const CScript &scriptCode,
+                     const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *pcache, CSignatureBatch *pbatch)
+{
+    CPubKey pubkey(vchPubKey.begin(), vchPubKey.end());
     if (!pubkey.IsValid())
         return false;
 
     // Hash type is one byte tacked on to the end of the signature
-    if (vchSig.empty())
+    if (vchSigIn.empty())
         return false;
     if (nHashType == 0)
-        nHashType = vchSig.back();
-    else if (nHashType != vchSig.back())
+        nHashType = vchSigIn.back();
+    else if (nHashType != vchSigIn.back())
         return false;
-    vchSig.pop_back();
+    valtype vchSig(vchSigIn.begin(), vchSigIn.end() - 1);
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pcache);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures checked for a block are not needed again; let them make
+    // room for those of new transactions
+    CSignatureCache &signatureCache = GetSignatureCache();
+    if (signatureCache.Get(sighash, vchSig, pubkey, flags & SCRIPT_VERIFY_NOCACHE))
         return true;
 
+    if (pbatch)
+        return pbatch->Add(sighash, vchSig, pubkey, !(flags & SCRIPT_VERIFY_NOCACHE));
+
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
@@ -1113,6 +1465,64 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
     return true;
 }
 
+bool CSignatureBatch::Add(const uint256 &hash, std::vector<unsigned char> &vchSig, const CPubKey &pubkey, bool fCache)
+{
+#ifdef USE_SECP256K1
+    // Decode now, so that only the arithmetic is left for Verify(); with
+    // -checksecp256k1 every signature goes through CPubKey::Verify instead
+    if (!fCheckSecp256k1) {
+        vChecks.push_back(CSecp256k1Check());
+        CSecp256k1Check &check = vChecks.back();
+        if (vchSig.empty() || !check.sig.Parse(&vchSig[0], vchSig.size()) ||
+            !check.pubkey.Parse(pubkey.begin(), pubkey.size())) {
+            vChecks.pop_back();
+            return false;
+        }
+        check.hash = hash;
+    }
+#endif
+    vEntries.push_back(CEntry());
+    CEntry &entry = vEntries.back();
+    entry.hash = hash;
+    entry.vchSig.swap(vchSig);
+    entry.pubkey = pubkey;
+    entry.fCache = fCache;
+    return true;
+}
+
+bool CSignatureBatch::Verify()
+{
+    bool fOk = true;
+#ifdef USE_SECP256K1
+    if (vChecks.size() == vEntries.size()) {
+        // Whether or not the batch holds, every signature has its own result
+        Secp256k1VerifyBatch(vChecks);
+        for (unsigned int i = 0; i < vEntries.size(); i++) {
+            const CEntry &entry = vEntries[i];
+            if (!vChecks[i].fValid) {
+                fOk = error("CSignatureBatch::Verify() : signature %u of %u invalid for %s", i, (unsigned int)vEntries.size(), entry.hash.ToString().c_str());
+                break;
+            }
+            if (entry.fCache)
+                GetSignatureCache().Set(entry.hash, entry.vchSig, entry.pubkey);
+        }
+        Clear();
+        return fOk;
+    }
+#endif
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        const CEntry &entry = vEntries[i];
+        if (!entry.pubkey.Verify(entry.hash, entry.vchSig)) {
+            fOk = error("CSignatureBatch::Verify() : signature %u of %u invalid for %s", i, (unsigned int)vEntries.size(), entry.hash.ToString().c_str());
+            break;
+        }
+        if (entry.fCache)
+            GetSignatureCache().Set(entry.hash, entry.vchSig, entry.pubkey);
+    }
+    Clear();
+    return fOk;
+}
+
 
 
 
@@ -1475,14 +1885,21 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache *pcache, CSignatureBatch *pbatch)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    // Deferring a signature is only safe where it being invalid fails the script
+    if (pbatch && !(scriptPubKey.IsPayToSingleKey() && scriptSig.IsPushOnly()))
+        pbatch = NULL;
+
+    CScriptStack stack, stackCopy;
+    // Enough for standard scripts, whose values mostly stay inline
+    stack.reserve(16);
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache, pbatch))
         return false;
-    if (flags & SCRIPT_VERIFY_P2SH)
+    bool fP2SH = (flags & SCRIPT_VERIFY_P2SH) && scriptPubKey.IsPayToScriptHash();
+    if (fP2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache, pbatch))
         return false;
     if (stack.empty())
         return false;
@@ -1491,7 +1908,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         return false;
 
     // Additional validation for spend-to-script-hash transactions:
-    if ((flags & SCRIPT_VERIFY_P2SH) && scriptPubKey.IsPayToScriptHash())
+    if (fP2SH)
     {
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
@@ -1501,11 +1918,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         // an empty stack and the EvalScript above would return false.
         assert(!stackCopy.empty());
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const CStackValue& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache, NULL))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1599,7 +2016,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, 0))
+            if (CheckSig(CStackValue(sig), CStackValue(pubkey), scriptPubKey, txTo, nIn, 0, 0, NULL, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -1740,6 +2157,20 @@ bool CScript::IsPayToScriptHash() const
             this->at(22) == OP_EQUAL);
 }
 
+bool CScript::IsPayToSingleKey() const
+{
+    // Extra-fast test for pay-to-pubkey-hash and pay-to-pubkey CScripts:
+    if (this->size() == 25)
+        return (this->at(0) == OP_DUP &&
+                this->at(1) == OP_HASH160 &&
+                this->at(2) == 0x14 &&
+                this->at(23) == OP_EQUALVERIFY &&
+                this->at(24) == OP_CHECKSIG);
+    return ((this->size() == 35 && this->at(0) == 33) ||
+            (this->size() == 67 && this->at(0) == 65)) &&
+           this->back() == OP_CHECKSIG;
+}
+
 bool CScript::HasCanonicalPushes() const
 {
     const_iterator pc = begin();
@@ -10,9 +10,11 @@
 
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
+#include <openssl/sha.h>
 
 #include "keystore.h"
 #include "bignum.h"
+#include "secp256k1.h"
 
 class CCoins;
 class CTransaction;
@@ -212,6 +214,99 @@ enum opcodetype
 const char* GetOpName(opcodetype opcode);
 
 
+/** Number on the script stack, as the numeric opcodes take and leave them.
+ *  Operands are at most nMaxNumSize bytes: the magnitude, little endian, with
+ *  the sign in the top bit of the last byte. Results can be a byte longer;
+ *  they are pushed the same way but cannot be operands again. That all fits
+ *  an int64, so unlike CBigNum this does not allocate.
+ */
+class CScriptNum
+{
+private:
+    int64 nValue;
+
+    void Decode(const unsigned char *pch, unsigned int nSize)
+    {
+        if (nSize > nMaxNumSize)
+            throw std::runtime_error("CScriptNum() : overflow");
+        nValue = 0;
+        if (nSize == 0)
+            return;
+        for (unsigned int i = 0; i < nSize; i++)
+            nValue |= (int64)pch[i] << (8 * i);
+        // Can be negative zero
+        if (pch[nSize - 1] & 0x80)
+            nValue = -(nValue & ~((int64)0x80 << (8 * (nSize - 1))));
+    }
+
+public:
+    static const unsigned int nMaxNumSize = 4;
+
+    explicit CScriptNum(int64 n) : nValue(n) { }
+
+    /** Decode an operand; throws if it is longer than nMaxNumSize bytes */
+    CScriptNum(const unsigned char *pch, unsigned int nSize)
+    {
+        Decode(pch, nSize);
+    }
+
+    explicit CScriptNum(const std::vector<unsigned char> &vch)
+    {
+        Decode(vch.empty() ? NULL : &vch[0], vch.size());
+    }
+
+    /** Clamped to the range of int, as CBigNum::getint */
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    int64 getint64() const { return nValue; }
+
+    /** Write the shortest encoding, which CBigNum::getvch gives as well (0 is
+     *  empty), to pch and return its size; at most nMaxEncodedSize bytes */
+    static const unsigned int nMaxEncodedSize = 9;
+    unsigned int Encode(unsigned char *pch) const
+    {
+        uint64 n = nValue < 0 ? -(uint64)nValue : nValue;
+        unsigned int nSize = 0;
+        while (n) {
+            pch[nSize++] = n & 0xff;
+            n >>= 8;
+        }
+        if (nSize == 0)
+            return 0;
+        // The top bit is the sign; add a byte if the magnitude needs it
+        if (pch[nSize - 1] & 0x80)
+            pch[nSize++] = nValue < 0 ? 0x80 : 0;
+        else if (nValue < 0)
+            pch[nSize - 1] |= 0x80;
+        return nSize;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        unsigned char pch[nMaxEncodedSize];
+        return std::vector<unsigned char>(pch, pch + Encode(pch));
+    }
+
+    CScriptNum operator-() const { return CScriptNum(-nValue); }
+    CScriptNum operator+(const CScriptNum &b) const { return CScriptNum(nValue + b.nValue); }
+    CScriptNum operator-(const CScriptNum &b) const { return CScriptNum(nValue - b.nValue); }
+
+    friend bool operator==(const CScriptNum &a, const CScriptNum &b) { return a.nValue == b.nValue; }
+    friend bool operator!=(const CScriptNum &a, const CScriptNum &b) { return a.nValue != b.nValue; }
+    friend bool operator<(const CScriptNum &a, const CScriptNum &b)  { return a.nValue < b.nValue; }
+    friend bool operator>(const CScriptNum &a, const CScriptNum &b)  { return a.nValue > b.nValue; }
+    friend bool operator<=(const CScriptNum &a, const CScriptNum &b) { return a.nValue <= b.nValue; }
+    friend bool operator>=(const CScriptNum &a, const CScriptNum &b) { return a.nValue >= b.nValue; }
+};
+
+
 
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
@@ -423,11 +518,12 @@ public:
         return GetOp2(pc, opcodeRet, NULL);
     }
 
-    bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
+    /** Like GetOp, but point at the pushed data instead of copying it */
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, const_iterator& pvalueRet, unsigned int& nSizeRet) const
     {
         opcodeRet = OP_INVALIDOPCODE;
-        if (pvchRet)
-            pvchRet->clear();
+        pvalueRet = pc;
+        nSizeRet = 0;
         if (pc >= end())
             return false;
 
@@ -467,8 +563,8 @@ public:
             }
             if (end() - pc < 0 || (unsigned int)(end() - pc) < nSize)
                 return false;
-            if (pvchRet)
-                pvchRet->assign(pc, pc + nSize);
+            pvalueRet = pc;
+            nSizeRet = nSize;
             pc += nSize;
         }
 
@@ -476,6 +572,16 @@ public:
         return true;
     }
 
+    bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
+    {
+        const_iterator pvalue;
+        unsigned int nSize;
+        bool fRet = GetOp(pc, opcodeRet, pvalue, nSize);
+        if (pvchRet)
+            pvchRet->assign(pvalue, pvalue + nSize);
+        return fRet;
+    }
+
     // Encode/decode small integers:
     static int DecodeOP_N(opcodetype opcode)
     {
@@ -533,6 +639,11 @@ public:
 
     bool IsPayToScriptHash() const;
 
+    // Whether this is a plain pay-to-pubkey or pay-to-pubkey-hash script,
+    // which a push-only scriptSig satisfies exactly when its one signature
+    // is valid.
+    bool IsPayToSingleKey() const;
+
     // Called by CTransaction::IsStandard and P2SH VerifyScript (which makes it consensus-critical).
     bool IsPushOnly() const
     {
@@ -670,8 +781,63 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** What the signature hashes of all inputs of a transaction have in common:
+ *  its serialization with every scriptSig blanked, and the SHA256 state at
+ *  the start of each input in it. With it the SIGHASH_ALL hash of an input
+ *  skips hashing everything before that input again.
+ *  Immutable once built, so checks on several threads can share one.
+ */
+class CSignatureHashCache
+{
+private:
+    std::vector<unsigned char> vchBlank;
+    std::vector<unsigned int> vnInputBegin; // offset of each input in vchBlank, and where the inputs end
+    std::vector<SHA256_CTX> vMidstate;      // state after hashing vchBlank up to each input
+
+public:
+    CSignatureHashCache(const CTransaction& txTo);
+
+    /** Hash for the hash types the cache covers; returns false for the others */
+    bool SignatureHash(uint256 &hashRet, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType) const;
+};
+
+/** Signatures whose check CheckSig left for later, to be verified together.
+ *  OP_CHECKSIG counts a deferred signature as valid, so only scripts that
+ *  fail whenever their signature is invalid may defer it; see
+ *  CScript::IsPayToSingleKey. Verify() then decides for all of them.
+ */
+class CSignatureBatch
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        std::vector<unsigned char> vchSig;
+        CPubKey pubkey;
+        bool fCache; // store in the signature cache once verified
+    };
+    std::vector<CEntry> vEntries;
+    std::vector<CSecp256k1Check> vChecks; // vEntries decoded, with USE_SECP256K1
+
+public:
+    /** Defer the check of vchSig (which is swapped out); false if it can already be told invalid */
+    bool Add(const uint256 &hash, std::vector<unsigned char> &vchSig, const CPubKey &pubkey, bool fCache);
+
+    /** Verify and forget the deferred signatures; false if any is invalid */
+    bool Verify();
+
+    void Clear() {
+        vEntries.clear();
+        vChecks.clear();
+    }
+
+    unsigned int size() const {
+        return vEntries.size();
+    }
+};
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache = NULL);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache = NULL, CSignatureBatch *pbatch = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -681,7 +847,7 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache = NULL, CSignatureBatch *pbatch = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+#include "scrypt.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+// V blocks are 128r bytes, so they are always a whole number of 32-byte
+// lanes; move them with 256-bit loads/stores.  The salsa20/8 core itself is
+// a 4x4 matrix and keeps working on 128-bit rows (VEX encoded).
+
+static inline void smix_blkcpy(__m128i *dest, const __m128i *src, size_t n)
+{
+	__m256i *D = (__m256i *)dest;
+	const __m256i *S = (const __m256i *)src;
+	size_t i;
+
+	for (i = 0; i < n / 2; i++)
+		_mm256_storeu_si256(&D[i], _mm256_loadu_si256(&S[i]));
+}
+
+static inline void smix_blkxor(__m128i *dest, const __m128i *src, size_t n)
+{
+	__m256i *D = (__m256i *)dest;
+	const __m256i *S = (const __m256i *)src;
+	size_t i;
+
+	for (i = 0; i < n / 2; i++)
+		_mm256_storeu_si256(&D[i], _mm256_xor_si256(_mm256_loadu_si256(&D[i]), _mm256_loadu_si256(&S[i])));
+}
+
+// The multi-buffer kernel puts eight instances in each 256-bit register.
+typedef __m256i smix_nvec;
+#define SMIX_NWAY 8
+#define SMIX_NADD(a, b) _mm256_add_epi32(a, b)
+#define SMIX_NXOR(a, b) _mm256_xor_si256(a, b)
+#define SMIX_NROTL(a, n) _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+
+#include "scrypt-smix.h"
+
+void scrypt_smix_avx2(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY)
+{
+	smix_simd(B, r, N, V, XY);
+}
+
+void scrypt_smix_avx2_8way(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY)
+{
+	smix_nway(B, r, N, V, XY);
+}
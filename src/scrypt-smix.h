@@ -0,0 +1,419 @@
+/*
+ * Copyright 2009 Colin Percival, 2011 ArtForz, 2012-2013 pooler
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file was originally written by Colin Percival as part of the Tarsnap
+ * online backup system.
+ */
+
+#ifndef SCRYPT_SMIX_H
+#define SCRYPT_SMIX_H
+
+/*
+ * SIMD version of the variable-parameter scrypt core (smix), shared by the
+ * SSE2 and AVX2 translation units.  Each 64-byte salsa20/8 block is kept in
+ * four __m128i registers in "diagonal" order, so the column and row rounds
+ * only need a shuffle between them.  The includer defines
+ *
+ *   static inline void smix_blkcpy(__m128i *dest, const __m128i *src, size_t n);
+ *   static inline void smix_blkxor(__m128i *dest, const __m128i *src, size_t n);
+ *
+ * (n counted in 16-byte words, always a multiple of 8) before including this
+ * file, which lets each instruction set move the 128r-byte V blocks with its
+ * widest registers.
+ */
+
+#include "scrypt.h"
+#include <stdint.h>
+
+#include <emmintrin.h>
+
+static inline void xor_salsa8_sse2(__m128i B[4], const __m128i Bx[4])
+{
+	__m128i X0, X1, X2, X3;
+	__m128i T;
+	int i;
+
+	X0 = B[0] = _mm_xor_si128(B[0], Bx[0]);
+	X1 = B[1] = _mm_xor_si128(B[1], Bx[1]);
+	X2 = B[2] = _mm_xor_si128(B[2], Bx[2]);
+	X3 = B[3] = _mm_xor_si128(B[3], Bx[3]);
+
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on "columns". */
+		T = _mm_add_epi32(X0, X3);
+		X1 = _mm_xor_si128(X1, _mm_slli_epi32(T, 7));
+		X1 = _mm_xor_si128(X1, _mm_srli_epi32(T, 25));
+		T = _mm_add_epi32(X1, X0);
+		X2 = _mm_xor_si128(X2, _mm_slli_epi32(T, 9));
+		X2 = _mm_xor_si128(X2, _mm_srli_epi32(T, 23));
+		T = _mm_add_epi32(X2, X1);
+		X3 = _mm_xor_si128(X3, _mm_slli_epi32(T, 13));
+		X3 = _mm_xor_si128(X3, _mm_srli_epi32(T, 19));
+		T = _mm_add_epi32(X3, X2);
+		X0 = _mm_xor_si128(X0, _mm_slli_epi32(T, 18));
+		X0 = _mm_xor_si128(X0, _mm_srli_epi32(T, 14));
+
+		/* Rearrange data. */
+		X1 = _mm_shuffle_epi32(X1, 0x93);
+		X2 = _mm_shuffle_epi32(X2, 0x4E);
+		X3 = _mm_shuffle_epi32(X3, 0x39);
+
+		/* Operate on "rows". */
+		T = _mm_add_epi32(X0, X1);
+		X3 = _mm_xor_si128(X3, _mm_slli_epi32(T, 7));
+		X3 = _mm_xor_si128(X3, _mm_srli_epi32(T, 25));
+		T = _mm_add_epi32(X3, X0);
+		X2 = _mm_xor_si128(X2, _mm_slli_epi32(T, 9));
+		X2 = _mm_xor_si128(X2, _mm_srli_epi32(T, 23));
+		T = _mm_add_epi32(X2, X3);
+		X1 = _mm_xor_si128(X1, _mm_slli_epi32(T, 13));
+		X1 = _mm_xor_si128(X1, _mm_srli_epi32(T, 19));
+		T = _mm_add_epi32(X1, X2);
+		X0 = _mm_xor_si128(X0, _mm_slli_epi32(T, 18));
+		X0 = _mm_xor_si128(X0, _mm_srli_epi32(T, 14));
+
+		/* Rearrange data. */
+		X1 = _mm_shuffle_epi32(X1, 0x39);
+		X2 = _mm_shuffle_epi32(X2, 0x4E);
+		X3 = _mm_shuffle_epi32(X3, 0x93);
+	}
+
+	B[0] = _mm_add_epi32(B[0], X0);
+	B[1] = _mm_add_epi32(B[1], X1);
+	B[2] = _mm_add_epi32(B[2], X2);
+	B[3] = _mm_add_epi32(B[3], X3);
+}
+
+/**
+ * blockmix_salsa8_simd(Bin, Bout, X, r):
+ * Compute Bout = BlockMix_{salsa20/8, r}(Bin).  The input Bin must be 128r
+ * bytes in length; the output Bout must also be the same size.  The
+ * temporary space X must be 64 bytes.
+ */
+static inline void blockmix_salsa8_simd(const __m128i *Bin, __m128i *Bout, __m128i *X, size_t r)
+{
+	size_t i;
+
+	/* 1: X <-- B_{2r - 1} */
+	X[0] = Bin[8 * r - 4];
+	X[1] = Bin[8 * r - 3];
+	X[2] = Bin[8 * r - 2];
+	X[3] = Bin[8 * r - 1];
+
+	/* 2: for i = 0 to 2r - 1 do */
+	for (i = 0; i < r; i++) {
+		/* 3: X <-- H(X \xor B_i) */
+		xor_salsa8_sse2(X, &Bin[i * 8]);
+
+		/* 4: Y_i <-- X */
+		/* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+		Bout[i * 4 + 0] = X[0];
+		Bout[i * 4 + 1] = X[1];
+		Bout[i * 4 + 2] = X[2];
+		Bout[i * 4 + 3] = X[3];
+
+		/* 3: X <-- H(X \xor B_i) */
+		xor_salsa8_sse2(X, &Bin[i * 8 + 4]);
+
+		/* 4: Y_i <-- X */
+		/* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+		Bout[(r + i) * 4 + 0] = X[0];
+		Bout[(r + i) * 4 + 1] = X[1];
+		Bout[(r + i) * 4 + 2] = X[2];
+		Bout[(r + i) * 4 + 3] = X[3];
+	}
+}
+
+/**
+ * integerify_simd(B, r):
+ * Return the result of parsing B_{2r-1} as a little-endian integer.  In the
+ * diagonal layout word 1 of a block is stored at position 13.
+ */
+static inline uint64_t integerify_simd(const __m128i *B, size_t r)
+{
+	const uint32_t *X = (const uint32_t *)&B[8 * r - 4];
+
+	return (((uint64_t)(X[13]) << 32) + X[0]);
+}
+
+/**
+ * smix_simd(B, r, N, V, XY):
+ * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length; the
+ * temporary storage V must be 128rN bytes in length; the temporary storage
+ * XY must be 256r + 64 bytes in length.  V and XY must be 16-byte aligned.
+ * The value N must be a power of 2 greater than 1.
+ */
+static inline void smix_simd(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY)
+{
+	__m128i *X = (__m128i *)XY;
+	__m128i *Y = (__m128i *)(XY + 128 * r);
+	__m128i *Z = (__m128i *)(XY + 256 * r);
+	__m128i *V128 = (__m128i *)V;
+	uint32_t *X32 = (uint32_t *)X;
+	uint64_t i, j;
+	size_t k, n;
+
+	/* 1: X <-- B, shuffled into diagonal order */
+	for (k = 0; k < 2 * r; k++) {
+		for (n = 0; n < 16; n++)
+			X32[k * 16 + n] = le32dec(&B[(k * 16 + (n * 5 % 16)) * 4]);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 3: V_i <-- X */
+		smix_blkcpy(&V128[i * 8 * r], X, 8 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8_simd(X, Y, Z, r);
+
+		/* 3: V_i <-- X */
+		smix_blkcpy(&V128[(i + 1) * 8 * r], Y, 8 * r);
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8_simd(Y, X, Z, r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify_simd(X, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		smix_blkxor(X, &V128[j * 8 * r], 8 * r);
+		blockmix_salsa8_simd(X, Y, Z, r);
+
+		/* 7: j <-- Integerify(X) mod N */
+		j = integerify_simd(Y, r) & (N - 1);
+
+		/* 8: X <-- H(X \xor V_j) */
+		smix_blkxor(Y, &V128[j * 8 * r], 8 * r);
+		blockmix_salsa8_simd(Y, X, Z, r);
+	}
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 2 * r; k++) {
+		for (n = 0; n < 16; n++)
+			le32enc(&B[(k * 16 + (n * 5 % 16)) * 4], X32[k * 16 + n]);
+	}
+}
+
+#if defined(SMIX_NWAY)
+/*
+ * Multi-buffer smix.  SMIX_NWAY independent instances with the same N and r
+ * are evaluated together, word-sliced: vector w of a block holds word w of
+ * every instance, one instance per 32-bit lane, so salsa20/8 runs on sixteen
+ * vectors without any shuffling and the instances hide each other's memory
+ * latency.  The includer defines the vector type smix_nvec and
+ *
+ *   SMIX_NADD(a, b), SMIX_NXOR(a, b), SMIX_NROTL(a, n)
+ *
+ * on it, with n a constant.
+ */
+
+#define SMIX_NQR(a, b, c, n) a = SMIX_NXOR(a, SMIX_NROTL(SMIX_NADD(b, c), n))
+
+static inline void xor_salsa8_nway(smix_nvec B[16], const smix_nvec Bx[16])
+{
+	smix_nvec x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = B[ 0] = SMIX_NXOR(B[ 0], Bx[ 0]);
+	x01 = B[ 1] = SMIX_NXOR(B[ 1], Bx[ 1]);
+	x02 = B[ 2] = SMIX_NXOR(B[ 2], Bx[ 2]);
+	x03 = B[ 3] = SMIX_NXOR(B[ 3], Bx[ 3]);
+	x04 = B[ 4] = SMIX_NXOR(B[ 4], Bx[ 4]);
+	x05 = B[ 5] = SMIX_NXOR(B[ 5], Bx[ 5]);
+	x06 = B[ 6] = SMIX_NXOR(B[ 6], Bx[ 6]);
+	x07 = B[ 7] = SMIX_NXOR(B[ 7], Bx[ 7]);
+	x08 = B[ 8] = SMIX_NXOR(B[ 8], Bx[ 8]);
+	x09 = B[ 9] = SMIX_NXOR(B[ 9], Bx[ 9]);
+	x10 = B[10] = SMIX_NXOR(B[10], Bx[10]);
+	x11 = B[11] = SMIX_NXOR(B[11], Bx[11]);
+	x12 = B[12] = SMIX_NXOR(B[12], Bx[12]);
+	x13 = B[13] = SMIX_NXOR(B[13], Bx[13]);
+	x14 = B[14] = SMIX_NXOR(B[14], Bx[14]);
+	x15 = B[15] = SMIX_NXOR(B[15], Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SMIX_NQR(x04, x00, x12,  7);  SMIX_NQR(x09, x05, x01,  7);
+		SMIX_NQR(x14, x10, x06,  7);  SMIX_NQR(x03, x15, x11,  7);
+
+		SMIX_NQR(x08, x04, x00,  9);  SMIX_NQR(x13, x09, x05,  9);
+		SMIX_NQR(x02, x14, x10,  9);  SMIX_NQR(x07, x03, x15,  9);
+
+		SMIX_NQR(x12, x08, x04, 13);  SMIX_NQR(x01, x13, x09, 13);
+		SMIX_NQR(x06, x02, x14, 13);  SMIX_NQR(x11, x07, x03, 13);
+
+		SMIX_NQR(x00, x12, x08, 18);  SMIX_NQR(x05, x01, x13, 18);
+		SMIX_NQR(x10, x06, x02, 18);  SMIX_NQR(x15, x11, x07, 18);
+
+		/* Operate on rows. */
+		SMIX_NQR(x01, x00, x03,  7);  SMIX_NQR(x06, x05, x04,  7);
+		SMIX_NQR(x11, x10, x09,  7);  SMIX_NQR(x12, x15, x14,  7);
+
+		SMIX_NQR(x02, x01, x00,  9);  SMIX_NQR(x07, x06, x05,  9);
+		SMIX_NQR(x08, x11, x10,  9);  SMIX_NQR(x13, x12, x15,  9);
+
+		SMIX_NQR(x03, x02, x01, 13);  SMIX_NQR(x04, x07, x06, 13);
+		SMIX_NQR(x09, x08, x11, 13);  SMIX_NQR(x14, x13, x12, 13);
+
+		SMIX_NQR(x00, x03, x02, 18);  SMIX_NQR(x05, x04, x07, 18);
+		SMIX_NQR(x10, x09, x08, 18);  SMIX_NQR(x15, x14, x13, 18);
+	}
+	B[ 0] = SMIX_NADD(B[ 0], x00);
+	B[ 1] = SMIX_NADD(B[ 1], x01);
+	B[ 2] = SMIX_NADD(B[ 2], x02);
+	B[ 3] = SMIX_NADD(B[ 3], x03);
+	B[ 4] = SMIX_NADD(B[ 4], x04);
+	B[ 5] = SMIX_NADD(B[ 5], x05);
+	B[ 6] = SMIX_NADD(B[ 6], x06);
+	B[ 7] = SMIX_NADD(B[ 7], x07);
+	B[ 8] = SMIX_NADD(B[ 8], x08);
+	B[ 9] = SMIX_NADD(B[ 9], x09);
+	B[10] = SMIX_NADD(B[10], x10);
+	B[11] = SMIX_NADD(B[11], x11);
+	B[12] = SMIX_NADD(B[12], x12);
+	B[13] = SMIX_NADD(B[13], x13);
+	B[14] = SMIX_NADD(B[14], x14);
+	B[15] = SMIX_NADD(B[15], x15);
+}
+
+/**
+ * blockmix_salsa8_nway(Bin, Bout, X, r):
+ * Compute Bout = BlockMix_{salsa20/8, r}(Bin) for every instance.  Bin and
+ * Bout are 32r vectors; the temporary space X must be 16 vectors.
+ */
+static inline void blockmix_salsa8_nway(const smix_nvec *Bin, smix_nvec *Bout, smix_nvec *X, size_t r)
+{
+	size_t i, k;
+
+	/* 1: X <-- B_{2r - 1} */
+	for (k = 0; k < 16; k++)
+		X[k] = Bin[(2 * r - 1) * 16 + k];
+
+	/* 2: for i = 0 to 2r - 1 do */
+	for (i = 0; i < r; i++) {
+		/* 3: X <-- H(X \xor B_i) */
+		xor_salsa8_nway(X, &Bin[i * 32]);
+
+		/* 4: Y_i <-- X */
+		/* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+		for (k = 0; k < 16; k++)
+			Bout[i * 16 + k] = X[k];
+
+		/* 3: X <-- H(X \xor B_i) */
+		xor_salsa8_nway(X, &Bin[i * 32 + 16]);
+
+		/* 4: Y_i <-- X */
+		/* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+		for (k = 0; k < 16; k++)
+			Bout[(r + i) * 16 + k] = X[k];
+	}
+}
+
+/**
+ * smix_nway_xor_vj(X, V, r, N):
+ * Step 8 of smix for every instance: X <-- X \xor V_j with j taken from the
+ * instance's own Integerify(X) mod N.  N must not exceed 2^32, so the low
+ * word of B_{2r-1} is all of the index that matters.
+ */
+static inline void smix_nway_xor_vj(smix_nvec *X, const smix_nvec *V, size_t r, uint64_t N)
+{
+	uint32_t *X32 = (uint32_t *)X;
+	const uint32_t *V32 = (const uint32_t *)V;
+	const uint32_t *Vj;
+	size_t k, n;
+
+	for (n = 0; n < SMIX_NWAY; n++) {
+		Vj = &V32[(X32[(2 * r - 1) * 16 * SMIX_NWAY + n] & (N - 1)) * 32 * r * SMIX_NWAY + n];
+		for (k = 0; k < 32 * r; k++)
+			X32[k * SMIX_NWAY + n] ^= Vj[k * SMIX_NWAY];
+	}
+}
+
+/**
+ * smix_nway(B, r, N, V, XY):
+ * Compute B[n] = SMix_r(B[n], N) for the SMIX_NWAY instances B[0] ...
+ * B[SMIX_NWAY - 1], each 128r bytes in length.  The temporary storage V
+ * must be SMIX_NWAY * 128rN bytes in length and XY SMIX_NWAY * (256r + 64)
+ * bytes, both aligned to the vector size.  The value N must be a power of 2
+ * greater than 1 and at most 2^32.
+ */
+static inline void smix_nway(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY)
+{
+	smix_nvec *X = (smix_nvec *)XY;
+	smix_nvec *Y = &X[32 * r];
+	smix_nvec *Z = &Y[32 * r];
+	smix_nvec *Vv = (smix_nvec *)V;
+	uint32_t *X32 = (uint32_t *)X;
+	uint64_t i;
+	size_t k, n;
+
+	/* 1: X <-- B, one instance per lane */
+	for (k = 0; k < 32 * r; k++) {
+		for (n = 0; n < SMIX_NWAY; n++)
+			X32[k * SMIX_NWAY + n] = le32dec(&B[n][k * 4]);
+	}
+
+	/* 2: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 3: V_i <-- X */
+		for (k = 0; k < 32 * r; k++)
+			Vv[i * 32 * r + k] = X[k];
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8_nway(X, Y, Z, r);
+
+		/* 3: V_i <-- X */
+		for (k = 0; k < 32 * r; k++)
+			Vv[(i + 1) * 32 * r + k] = Y[k];
+
+		/* 4: X <-- H(X) */
+		blockmix_salsa8_nway(Y, X, Z, r);
+	}
+
+	/* 6: for i = 0 to N - 1 do */
+	for (i = 0; i < N; i += 2) {
+		/* 7: j <-- Integerify(X) mod N */
+		/* 8: X <-- H(X \xor V_j) */
+		smix_nway_xor_vj(X, Vv, r, N);
+		blockmix_salsa8_nway(X, Y, Z, r);
+
+		/* 7: j <-- Integerify(X) mod N */
+		/* 8: X <-- H(X \xor V_j) */
+		smix_nway_xor_vj(Y, Vv, r, N);
+		blockmix_salsa8_nway(Y, X, Z, r);
+	}
+
+	/* 10: B' <-- X */
+	for (k = 0; k < 32 * r; k++) {
+		for (n = 0; n < SMIX_NWAY; n++)
+			le32enc(&B[n][k * 4], X32[k * SMIX_NWAY + n]);
+	}
+}
+#endif // SMIX_NWAY
+
+#endif
@@ -35,63 +35,31 @@
 
 #include <emmintrin.h>
 
-static inline void xor_salsa8_sse2(__m128i B[4], const __m128i Bx[4])
+static inline void smix_blkcpy(__m128i *dest, const __m128i *src, size_t n)
 {
-	__m128i X0, X1, X2, X3;
-	__m128i T;
-	int i;
-
-	X0 = B[0] = _mm_xor_si128(B[0], Bx[0]);
-	X1 = B[1] = _mm_xor_si128(B[1], Bx[1]);
-	X2 = B[2] = _mm_xor_si128(B[2], Bx[2]);
-	X3 = B[3] = _mm_xor_si128(B[3], Bx[3]);
-
-	for (i = 0; i < 8; i += 2) {
-		/* Operate on "columns". */
-		T = _mm_add_epi32(X0, X3);
-		X1 = _mm_xor_si128(X1, _mm_slli_epi32(T, 7));
-		X1 = _mm_xor_si128(X1, _mm_srli_epi32(T, 25));
-		T = _mm_add_epi32(X1, X0);
-		X2 = _mm_xor_si128(X2, _mm_slli_epi32(T, 9));
-		X2 = _mm_xor_si128(X2, _mm_srli_epi32(T, 23));
-		T = _mm_add_epi32(X2, X1);
-		X3 = _mm_xor_si128(X3, _mm_slli_epi32(T, 13));
-		X3 = _mm_xor_si128(X3, _mm_srli_epi32(T, 19));
-		T = _mm_add_epi32(X3, X2);
-		X0 = _mm_xor_si128(X0, _mm_slli_epi32(T, 18));
-		X0 = _mm_xor_si128(X0, _mm_srli_epi32(T, 14));
-
-		/* Rearrange data. */
-		X1 = _mm_shuffle_epi32(X1, 0x93);
-		X2 = _mm_shuffle_epi32(X2, 0x4E);
-		X3 = _mm_shuffle_epi32(X3, 0x39);
-
-		/* Operate on "rows". */
-		T = _mm_add_epi32(X0, X1);
-		X3 = _mm_xor_si128(X3, _mm_slli_epi32(T, 7));
-		X3 = _mm_xor_si128(X3, _mm_srli_epi32(T, 25));
-		T = _mm_add_epi32(X3, X0);
-		X2 = _mm_xor_si128(X2, _mm_slli_epi32(T, 9));
-		X2 = _mm_xor_si128(X2, _mm_srli_epi32(T, 23));
-		T = _mm_add_epi32(X2, X3);
-		X1 = _mm_xor_si128(X1, _mm_slli_epi32(T, 13));
-		X1 = _mm_xor_si128(X1, _mm_srli_epi32(T, 19));
-		T = _mm_add_epi32(X1, X2);
-		X0 = _mm_xor_si128(X0, _mm_slli_epi32(T, 18));
-		X0 = _mm_xor_si128(X0, _mm_srli_epi32(T, 14));
-
-		/* Rearrange data. */
-		X1 = _mm_shuffle_epi32(X1, 0x39);
-		X2 = _mm_shuffle_epi32(X2, 0x4E);
-		X3 = _mm_shuffle_epi32(X3, 0x93);
-	}
+	size_t i;
 
-	B[0] = _mm_add_epi32(B[0], X0);
-	B[1] = _mm_add_epi32(B[1], X1);
-	B[2] = _mm_add_epi32(B[2], X2);
-	B[3] = _mm_add_epi32(B[3], X3);
+	for (i = 0; i < n; i++)
+		dest[i] = src[i];
 }
 
+static inline void smix_blkxor(__m128i *dest, const __m128i *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dest[i] = _mm_xor_si128(dest[i], src[i]);
+}
+
+// Four instances per register for the multi-buffer kernel.
+typedef __m128i smix_nvec;
+#define SMIX_NWAY 4
+#define SMIX_NADD(a, b) _mm_add_epi32(a, b)
+#define SMIX_NXOR(a, b) _mm_xor_si128(a, b)
+#define SMIX_NROTL(a, n) _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+
+#include "scrypt-smix.h"
+
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad)
 {
 	uint8_t B[128];
@@ -134,3 +102,13 @@ void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchp
 
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
+
+void scrypt_smix_sse2(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY)
+{
+	smix_simd(B, r, N, V, XY);
+}
+
+void scrypt_smix_sse2_4way(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY)
+{
+	smix_nway(B, r, N, V, XY);
+}
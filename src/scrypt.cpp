@@ -31,6 +31,7 @@
 
 #include "scrypt.h"
 #include "util.h"
+#include "sync.h"
 #include <stdlib.h>
 
 
@@ -44,12 +45,23 @@
 #include <openssl/sha.h>
 #include <errno.h>
 
+#ifndef WIN32
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include <boost/foreach.hpp>
+#include <boost/thread/tss.hpp>
+
+#include "checkqueue.h"
+
 static void blkcpy(uint8_t *, uint8_t *, size_t);
 static void blkxor(uint8_t *, uint8_t *, size_t);
 static void salsa20_8(uint8_t[64]);
 static void blockmix_salsa8(uint8_t *, uint8_t *, size_t);
 static uint64_t integerify(uint8_t *, size_t);
-static void smix(uint8_t *, size_t, uint64_t, uint8_t *, uint8_t *);
 
 
 
@@ -330,7 +342,7 @@ static double dataFinal [][4] = {
 
 
 
-#if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
+#if defined(USE_SSE2) && (!defined(USE_SSE2_ALWAYS) || defined(USE_AVX2))
 #ifdef _MSC_VER
 // MSVC 64bit is unable to use inline asm
 #include <intrin.h>
@@ -627,14 +639,68 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
 
+// smix kernel used by crypto_scrypt; upgraded by scrypt_detect_sse2() when the CPU allows
+#if defined(USE_SSE2_ALWAYS)
+void (*scrypt_smix_detected)(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY) = &scrypt_smix_sse2;
+#else
+void (*scrypt_smix_detected)(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY) = &scrypt_smix_generic;
+#endif
+
+// multi-buffer smix kernel, if any
+#if defined(USE_SSE2_ALWAYS)
+int scrypt_smix_nway = 4;
+void (*scrypt_smix_nway_detected)(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY) = &scrypt_smix_sse2_4way;
+#else
+int scrypt_smix_nway = 1;
+void (*scrypt_smix_nway_detected)(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY) = NULL;
+#endif
+
 #if defined(USE_SSE2)
 // By default, set to generic scrypt function. This will prevent crash in case when scrypt_detect_sse2() wasn't called
 void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad) = &scrypt_1024_1_1_256_sp_generic;
 
+#if defined(USE_AVX2)
+int scrypt_cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int x86cpuid[4];
+    __cpuid(x86cpuid, 0);
+    if (x86cpuid[0] < 7)
+        return 0;
+    __cpuid(x86cpuid, 1);
+    // OSXSAVE and AVX
+    if (!(x86cpuid[2] & (1 << 27)) || !(x86cpuid[2] & (1 << 28)))
+        return 0;
+    // the OS must save the YMM state
+    if ((_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(x86cpuid, 7, 0);
+    return (x86cpuid[1] & (1 << 5)) != 0;
+#else // _MSC_VER
+    unsigned int eax, ebx, ecx, edx, xcr0, xcr0_hi;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid(1, eax, ebx, ecx, edx);
+    // OSXSAVE and AVX
+    if (!(ecx & (1 << 27)) || !(ecx & (1 << 28)))
+        return 0;
+    // the OS must save the YMM state
+    __asm__ __volatile__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0 & 6) != 6)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 5)) != 0;
+#endif // _MSC_VER
+}
+#endif // USE_AVX2
+
 void scrypt_detect_sse2()
 {
 #if defined(USE_SSE2_ALWAYS)
     printf("scrypt: using scrypt-sse2 as built.\n");
+    scrypt_smix_detected = &scrypt_smix_sse2;
+    scrypt_smix_nway = 4;
+    scrypt_smix_nway_detected = &scrypt_smix_sse2_4way;
 #else // USE_SSE2_ALWAYS
     // 32bit x86 Linux or Windows, detect cpuid features
     unsigned int cpuid_edx=0;
@@ -652,14 +718,29 @@ void scrypt_detect_sse2()
     if (cpuid_edx & 1<<26)
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_sse2;
+        scrypt_smix_detected = &scrypt_smix_sse2;
+        scrypt_smix_nway = 4;
+        scrypt_smix_nway_detected = &scrypt_smix_sse2_4way;
         printf("scrypt: using scrypt-sse2 as detected.\n");
     }
     else
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_generic;
+        scrypt_smix_detected = &scrypt_smix_generic;
+        scrypt_smix_nway = 1;
+        scrypt_smix_nway_detected = NULL;
         printf("scrypt: using scrypt-generic, SSE2 unavailable.\n");
     }
 #endif // USE_SSE2_ALWAYS
+#if defined(USE_AVX2)
+    if (scrypt_cpu_has_avx2())
+    {
+        scrypt_smix_detected = &scrypt_smix_avx2;
+        scrypt_smix_nway = 8;
+        scrypt_smix_nway_detected = &scrypt_smix_avx2_8way;
+        printf("scrypt: using scrypt-avx2 smix as detected.\n");
+    }
+#endif // USE_AVX2
 }
 #endif
 
@@ -671,9 +752,125 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 
 //////
 
-static unsigned int cachedNBits;
-static char cachedInput[80];
-static char cachedOutput[32];
+int hybridScryptParamCount()
+{
+	return sizeof(dataFinal) / sizeof(dataFinal[0]);
+}
+
+int hybridScryptParamRow(unsigned int nBits)
+{
+	// larger targets (bigger compact size) select cheaper rows
+	return hybridScryptParamCount() - 1 - (int)(nBits >> 24);
+}
+
+void hybridScryptParams(int row, uint64_t &N, uint32_t &r, uint32_t &p)
+{
+	N = 1024 * (uint64_t)dataFinal[row][0];
+	r = (uint32_t)dataFinal[row][1];
+	p = (uint32_t)dataFinal[row][2];
+}
+
+// hybridScryptHash256 result cache.
+//
+// The same header is hashed several times on its way through the node
+// (CheckBlock, CheckWork, AcceptBlock via ReadFromDisk, relay, block printing),
+// and every evaluation costs two memory-hard scrypt passes.  Results are kept
+// in a small set-associative cache keyed by (header, nBits).  The cache is
+// split in shards, each guarded by its own lock, so miner threads, RPC workers
+// and the message handler only contend when they hit the same shard; entries
+// are only ever copied in and out while the shard lock is held, so a reader
+// can never observe a half-written entry.
+
+static const unsigned int POW_CACHE_SHARDS = 16;
+static const unsigned int POW_CACHE_WAYS = 32;
+
+struct CPoWHashCacheEntry
+{
+	bool fValid;
+	unsigned int nBits;
+	uint64_t nLastUsed;
+	char input[80];
+	char output[32];
+};
+
+struct CPoWHashCacheShard
+{
+	CCriticalSection cs;
+	uint64_t nClock;
+	uint64_t nHits;
+	uint64_t nMisses;
+	CPoWHashCacheEntry entries[POW_CACHE_WAYS];
+
+	CPoWHashCacheShard() : nClock(0), nHits(0), nMisses(0)
+	{
+		memset(entries, 0, sizeof(entries));
+	}
+};
+
+static CPoWHashCacheShard powHashCache[POW_CACHE_SHARDS];
+
+static CPoWHashCacheShard &PoWHashCacheShard(const char *input, unsigned int nBits)
+{
+	// nonce and the tail of the merkle root are the fastest-changing parts
+	// of a header, mix them to spread consecutive work units over the shards
+	uint32_t h = le32dec(&input[76]) ^ le32dec(&input[64]) ^ nBits;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return powHashCache[h % POW_CACHE_SHARDS];
+}
+
+static bool PoWHashCacheLookup(const char *input, unsigned int nBits, char *output)
+{
+	CPoWHashCacheShard &shard = PoWHashCacheShard(input, nBits);
+	LOCK(shard.cs);
+	for (unsigned int i = 0; i < POW_CACHE_WAYS; i++) {
+		CPoWHashCacheEntry &entry = shard.entries[i];
+		if (entry.fValid && entry.nBits == nBits && !memcmp(entry.input, input, 80)) {
+			entry.nLastUsed = ++shard.nClock;
+			memcpy(output, entry.output, 32);
+			shard.nHits++;
+			return true;
+		}
+	}
+	shard.nMisses++;
+	return false;
+}
+
+static void PoWHashCacheInsert(const char *input, unsigned int nBits, const char *output)
+{
+	CPoWHashCacheShard &shard = PoWHashCacheShard(input, nBits);
+	LOCK(shard.cs);
+	CPoWHashCacheEntry *pentry = &shard.entries[0];
+	for (unsigned int i = 0; i < POW_CACHE_WAYS; i++) {
+		CPoWHashCacheEntry &entry = shard.entries[i];
+		if (entry.fValid && entry.nBits == nBits && !memcmp(entry.input, input, 80))
+			return; // another thread computed it meanwhile
+		if (!entry.fValid || (pentry->fValid && entry.nLastUsed < pentry->nLastUsed))
+			pentry = &entry;
+	}
+	pentry->fValid = true;
+	pentry->nBits = nBits;
+	pentry->nLastUsed = ++shard.nClock;
+	memcpy(pentry->input, input, 80);
+	memcpy(pentry->output, output, 32);
+}
+
+void hybridScryptHash256CacheStats(ScryptHashCacheStats &stats)
+{
+	stats.nHits = 0;
+	stats.nMisses = 0;
+	stats.nEntries = 0;
+	stats.nCapacity = POW_CACHE_SHARDS * POW_CACHE_WAYS;
+	for (unsigned int n = 0; n < POW_CACHE_SHARDS; n++) {
+		CPoWHashCacheShard &shard = powHashCache[n];
+		LOCK(shard.cs);
+		stats.nHits += shard.nHits;
+		stats.nMisses += shard.nMisses;
+		for (unsigned int i = 0; i < POW_CACHE_WAYS; i++)
+			if (shard.entries[i].fValid)
+				stats.nEntries++;
+	}
+}
 
 #define DEBUG_POWALGO 0
 
@@ -702,26 +899,221 @@ void hybridScryptHash256Test() {
 }
 */
 
-void hybridScryptHash256(const char *input, char *output, unsigned int nBits) {
+// Both scrypt stages of the hybrid hash use the data as password and salt.
+// They run on the calling thread's arena, so the miner and the validation
+// threads do not go through malloc/munmap for every header.
+static int hybrid_crypto_scrypt(const uint8_t *data, size_t datalen,
+		uint64_t N, uint32_t r, uint32_t p, uint8_t *buf, size_t buflen)
+{
+	scrypt_arena *arena = scrypt_thread_arena();
+	if (arena == NULL)
+		return crypto_scrypt(data, datalen, data, datalen, N, r, p, buf, buflen);
+	return crypto_scrypt_arena(arena, data, datalen, data, datalen, N, r, p, buf, buflen);
+}
 
-	if (cachedNBits == nBits && !memcmp(input, cachedInput, 80 * sizeof(char))) {
-		if (DEBUG_POWALGO) {
-			printf("hybridScryptHash256: cached result returned!\n");
+// Largest V the multi-buffer kernel may use; rows needing more per instance
+// are batched one lane at a time rather than growing every thread arena.
+static const uint64_t SCRYPT_NWAY_MAX_V = 32 * 1024 * 1024;
+
+// Both scrypt stages for count inputs at once.  All p lanes of all inputs
+// are independent, so they are fed to the multi-buffer smix kernel
+// scrypt_smix_nway at a time; the few left over run through the one-way
+// kernel.  PBKDF2 stays per input.
+static int hybrid_crypto_scrypt_batch(const uint8_t *const *data, size_t datalen, size_t count,
+		uint64_t N, uint32_t r, uint32_t p, uint8_t *const *buf, size_t buflen)
+{
+	scrypt_arena *arena = scrypt_thread_arena();
+	size_t nLanes = count * p;
+	size_t laneSize = 128 * r;
+	size_t i, k;
+	int ways = scrypt_smix_nway;
+	uint8_t *lanes[SCRYPT_MAX_NWAY];
+
+	if (ways < 2 || N < 2 || N > ((uint64_t)1 << 32) ||
+	    laneSize * N * ways > SCRYPT_NWAY_MAX_V || nLanes < (size_t)ways)
+		ways = 1;
+
+	if (arena == NULL || scrypt_arena_reserve_nway(arena, N, r, nLanes, ways)) {
+		for (i = 0; i < count; i++) {
+			if (hybrid_crypto_scrypt(data[i], datalen, N, r, p, buf[i], buflen))
+				return (-1);
 		}
+		return (0);
+	}
 
-		memcpy(output, cachedOutput, 32 * sizeof(char));
+	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
+	for (i = 0; i < count; i++)
+		PBKDF2_SHA256(data[i], datalen, data[i], datalen, 1, &arena->B[i * p * laneSize], p * laneSize);
+
+	/* 2: for i = 0 to p - 1 do, for every input */
+	i = 0;
+	if (ways > 1) {
+		for (; i + ways <= nLanes; i += ways) {
+			for (k = 0; k < (size_t)ways; k++)
+				lanes[k] = &arena->B[(i + k) * laneSize];
+			scrypt_smix_nway_detected(lanes, r, N, arena->V, arena->XY);
+		}
+	}
+	for (; i < nLanes; i++) {
+		if (N > 1)
+			scrypt_smix_detected(&arena->B[i * laneSize], r, N, arena->V, arena->XY);
+		else
+			scrypt_smix_generic(&arena->B[i * laneSize], r, N, arena->V, arena->XY);
+	}
+
+	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
+	for (i = 0; i < count; i++)
+		PBKDF2_SHA256(data[i], datalen, &arena->B[i * p * laneSize], p * laneSize, 1, buf[i], buflen);
+
+	return (0);
+}
+
+// SHA256d and second scrypt stage for n headers whose first stage is done:
+// S80 holds n buffers of 80 bytes, each xor(H68, scrypt(H68)) followed by
+// bytes 68..79 of its header.  Writes hash k to outputs[k].
+static int hybrid_second_stage_batch(const uint8_t *S80, size_t n,
+		uint64_t N, uint32_t r, uint32_t p, char *const *outputs)
+{
+	std::vector<uint8_t> vSc256(n * 32);
+	std::vector<uint256> vS256(n);
+	std::vector<const uint8_t *> vIn(n);
+	std::vector<uint8_t *> vOut(n);
+
+	// s256 = hash256(S68nonce)
+	for (size_t k = 0; k < n; k++) {
+		vS256[k] = Hash(&S80[k * 80], &S80[k * 80 + 80]);
+		vIn[k] = vS256[k].begin();
+		vOut[k] = &vSc256[k * 32];
+	}
+
+	// sc256 = scrypt (s256, s256, ...., 32) for every header
+	if (hybrid_crypto_scrypt_batch(&vIn[0], 32, n, N, r, p, &vOut[0], 32))
+		return (-1);
+
+	// finalHash = xor(s256, and(sc256, mask))
+	for (size_t k = 0; k < n; k++) {
+		uint256 mask;
+		vS256[k].countTopmostZeroBits(mask);
+		for (size_t i = 0; i < 32; i++)
+			outputs[k][i] = vS256[k].begin()[i] ^ (vSc256[k * 32 + i] & mask.begin()[i]);
+	}
+
+	return (0);
+}
+
+static bool hybridScryptHash256_nocache(const char *input, char *output, unsigned int nBits);
 
+// Hash one header after a batch failed, through the cache only if the caller uses it
+static void hybridScryptHash256_fallback(const char *input, char *output, unsigned int nBits, bool fCache) {
+	if (fCache)
+		hybridScryptHash256(input, output, nBits);
+	else
+		hybridScryptHash256_nocache(input, output, nBits);
+}
+
+void hybridScryptHash256_batch(const char *headers, char *outputs, unsigned int count, unsigned int nBits, bool fCache) {
+
+	std::vector<unsigned int> vMiss;
+	vMiss.reserve(count);
+	for (unsigned int i = 0; i < count; i++) {
+		if (!fCache || !PoWHashCacheLookup(&headers[i * 80], nBits, &outputs[i * 32]))
+			vMiss.push_back(i);
+	}
+	if (vMiss.empty())
 		return;
+
+	uint64_t N;
+	uint32_t rParam, pParam;
+	hybridScryptParams(hybridScryptParamRow(nBits), N, rParam, pParam);
+
+	size_t n = vMiss.size();
+	std::vector<uint8_t> vS80(n * 80);
+	std::vector<const uint8_t *> vIn(n);
+	std::vector<uint8_t *> vOut(n);
+	std::vector<char *> vOutputs(n);
+
+	// S68 = scrypt (H68, H68, ...., 68) for every header
+	for (size_t k = 0; k < n; k++) {
+		vIn[k] = (const uint8_t *) &headers[vMiss[k] * 80];
+		vOut[k] = &vS80[k * 80];
+		vOutputs[k] = &outputs[vMiss[k] * 32];
+	}
+	if (hybrid_crypto_scrypt_batch(&vIn[0], 68, n, N, rParam, pParam, &vOut[0], 68)) {
+		BOOST_FOREACH(unsigned int i, vMiss)
+			hybridScryptHash256_fallback(&headers[i * 80], &outputs[i * 32], nBits, fCache);
+		return;
+	}
+
+	// S68 = xor(H68, S68), bytes 68..79 of the header appended
+	for (size_t k = 0; k < n; k++) {
+		blkxor(vOut[k], (uint8_t *) vIn[k], 68);
+		memcpy(&vOut[k][68], &vIn[k][68], 12);
+	}
+
+	if (hybrid_second_stage_batch(&vS80[0], n, N, rParam, pParam, &vOutputs[0])) {
+		BOOST_FOREACH(unsigned int i, vMiss)
+			hybridScryptHash256_fallback(&headers[i * 80], &outputs[i * 32], nBits, fCache);
+		return;
+	}
+
+	if (fCache) {
+		for (size_t k = 0; k < n; k++)
+			PoWHashCacheInsert(&headers[vMiss[k] * 80], nBits, vOutputs[k]);
+	}
+}
+
+bool hybridScryptHash256_prepare(const char *header, unsigned int nBits, HybridScryptMidstate &midstate) {
+
+	if (midstate.fValid && midstate.nBits == nBits && memcmp(midstate.H68, header, 68) == 0)
+		return true;
+
+	uint64_t N;
+	uint32_t rParam, pParam;
+	hybridScryptParams(hybridScryptParamRow(nBits), N, rParam, pParam);
+
+	midstate.fValid = false;
+	memcpy(midstate.H68, header, 68);
+	if (hybrid_crypto_scrypt(midstate.H68, 68, N, rParam, pParam, midstate.S68, 68))
+		return false;
+
+	// S68 = xor(H68, S68)
+	blkxor(midstate.S68, midstate.H68, 68);
+	midstate.nBits = nBits;
+	midstate.fValid = true;
+
+	return true;
+}
+
+void hybridScryptHash256_finish_batch(const HybridScryptMidstate &midstate, const char *headers, char *outputs, unsigned int count) {
+
+	assert(midstate.fValid);
+
+	uint64_t N;
+	uint32_t rParam, pParam;
+	hybridScryptParams(hybridScryptParamRow(midstate.nBits), N, rParam, pParam);
+
+	std::vector<uint8_t> vS80(count * 80);
+	std::vector<char *> vOutputs(count);
+	for (unsigned int k = 0; k < count; k++) {
+		memcpy(&vS80[k * 80], midstate.S68, 68);
+		memcpy(&vS80[k * 80 + 68], &headers[k * 80 + 68], 12);
+		vOutputs[k] = &outputs[k * 32];
 	}
 
-	cachedNBits = nBits;
-	memcpy(cachedInput, input, 80 * sizeof(char));
+	if (hybrid_second_stage_batch(&vS80[0], count, N, rParam, pParam, &vOutputs[0])) {
+		for (unsigned int k = 0; k < count; k++)
+			hybridScryptHash256_nocache(&headers[k * 80], &outputs[k * 32], midstate.nBits);
+	}
+}
 
-	//
+// hybridScryptHash256 without the result cache; false if scrypt could not get
+// its scratch memory, with output set to the all-ones hash, which no target
+// accepts
+static bool hybridScryptHash256_nocache(const char *input, char *output, unsigned int nBits) {
 
 	int nSize = nBits >> 24;
 
-	int pos = /*sizeof(dataFinal)*/ 271 - 1 - nSize;
+	int pos = hybridScryptParamRow(nBits);
 
 	int multiplier = dataFinal[pos][0];
 	int rParam = dataFinal[pos][1];
@@ -749,8 +1141,11 @@ void hybridScryptHash256(const char *input, char *output, unsigned int nBits) {
 	uint8_t S68[80];
 
 	// S68 = scrypt (H68, H68, ...., 68) (len=68)
-	crypto_scrypt(H68, 68, H68, 68,
-			1024 * multiplier, rParam, pParam, &S68[0], 68);
+	if (hybrid_crypto_scrypt(H68, 68,
+			1024 * multiplier, rParam, pParam, &S68[0], 68)) {
+		memset(output, 0xff, 32);
+		return false;
+	}
 
 	if (DEBUG_POWALGO) {
 		printf("scrypt(1): ");
@@ -810,8 +1205,11 @@ void hybridScryptHash256(const char *input, char *output, unsigned int nBits) {
 	// byte [] sc256 = SCrypt.scryptJ(s256, s256, ....,  32);
 	uint8_t sc256[32];
 
-	crypto_scrypt((uint8_t * ) s256.begin(), 32, (uint8_t * ) s256.begin(), 32,
-			1024 * multiplier, rParam, pParam, &sc256[0], 32);
+	if (hybrid_crypto_scrypt((uint8_t * ) s256.begin(), 32,
+			1024 * multiplier, rParam, pParam, &sc256[0], 32)) {
+		memset(output, 0xff, 32);
+		return false;
+	}
 
 	if (DEBUG_POWALGO) {
 		printf("scrypt(2): ");
@@ -846,7 +1244,22 @@ void hybridScryptHash256(const char *input, char *output, unsigned int nBits) {
 		printf("hash: %s\n", ((uint256 * ) output)->GetHex().c_str());
 	}
 
-	memcpy(cachedOutput , output , 32 * sizeof(char));
+	return true;
+}
+
+void hybridScryptHash256(const char *input, char *output, unsigned int nBits) {
+
+	if (PoWHashCacheLookup(input, nBits, output)) {
+		if (DEBUG_POWALGO) {
+			printf("hybridScryptHash256: cached result returned!\n");
+		}
+
+		return;
+	}
+
+	// a failed hash is not kept, the next lookup tries again
+	if (hybridScryptHash256_nocache(input, output, nBits))
+		PoWHashCacheInsert(input, nBits, output);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -973,13 +1386,13 @@ integerify(uint8_t * B, size_t r)
 }
 
 /**
- * smix(B, r, N, V, XY):
+ * scrypt_smix_generic(B, r, N, V, XY):
  * Compute B = SMix_r(B, N).  The input B must be 128r bytes in length; the
  * temporary storage V must be 128rN bytes in length; the temporary storage
  * XY must be 256r bytes in length.  The value N must be a power of 2.
  */
-static void
-smix(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
+void
+scrypt_smix_generic(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
 {
 	uint8_t * X = XY;
 	uint8_t * Y = &XY[128 * r];
@@ -1012,17 +1425,283 @@ smix(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
 	blkcpy(B, X, 128 * r);
 }
 
+/*
+ * Scrypt scratch arenas.
+ *
+ * All working memory of one crypto_scrypt evaluation (V, XY and B) lives in a
+ * single anonymous mapping.  An arena only ever grows, so once it has been
+ * sized for the largest parameter set it serves every later call without
+ * touching the allocator.
+ */
+
+static int scrypt_arena_hugepages = 0;
+
+void
+scrypt_set_hugepages(int enable)
+{
+	scrypt_arena_hugepages = enable;
+}
+
+#define SCRYPT_ARENA_ALIGN(x) (((x) + 63) & ~(size_t)(63))
+#define SCRYPT_HUGEPAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+static void *
+scrypt_region_alloc(size_t *size, int hugepages)
+{
+	void * region;
+
+#ifdef WIN32
+	region = VirtualAlloc(NULL, *size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	return (region);
+#else
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		/* Explicit huge pages need a reserved pool; fall through if there is none. */
+		size_t hugesize = (*size + SCRYPT_HUGEPAGE_SIZE - 1) & ~(SCRYPT_HUGEPAGE_SIZE - 1);
+		region = mmap(NULL, hugesize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (region != MAP_FAILED) {
+			*size = hugesize;
+			return (region);
+		}
+	}
+#endif
+	region = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+		return (NULL);
+#ifdef MADV_HUGEPAGE
+	if (hugepages)
+		madvise(region, *size, MADV_HUGEPAGE);
+#endif
+	return (region);
+#endif
+}
+
+static void
+scrypt_region_free(void * region, size_t size)
+{
+#ifdef WIN32
+	VirtualFree(region, 0, MEM_RELEASE);
+#else
+	munmap(region, size);
+#endif
+}
+
+void
+scrypt_arena_init(scrypt_arena * arena)
+{
+	memset(arena, 0, sizeof(scrypt_arena));
+}
+
+void
+scrypt_arena_free(scrypt_arena * arena)
+{
+	if (arena->region != NULL)
+		scrypt_region_free(arena->region, arena->size);
+	scrypt_arena_init(arena);
+}
+
 /**
- * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
- * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
- * p, buflen) and write the result into buf.  The parameters r, p, and buflen
- * must satisfy r * p < 2^30 and buflen <= (2^32 - 1) * 32.  The parameter N
- * must be a power of 2.
+ * scrypt_arena_reserve(arena, N, r, p):
+ * Make sure the arena can hold the working memory of crypto_scrypt_arena
+ * with parameters N, r and p.  Return 0 on success; or -1 on error.
+ */
+int
+scrypt_arena_reserve(scrypt_arena * arena, uint64_t N, uint32_t r, uint32_t p)
+{
+	return (scrypt_arena_reserve_nway(arena, N, r, p, 1));
+}
+
+/**
+ * scrypt_arena_reserve_nway(arena, N, r, nLanes, ways):
+ * Make sure the arena can hold nLanes lanes of B and the V and XY areas of a
+ * ways-way smix kernel with parameters N and r.  Return 0 on success; or -1
+ * on error.
+ */
+int
+scrypt_arena_reserve_nway(scrypt_arena * arena, uint64_t N, uint32_t r, size_t nLanes, int ways)
+{
+	size_t Vsize = SCRYPT_ARENA_ALIGN(128 * r * N * ways);
+	size_t XYsize = SCRYPT_ARENA_ALIGN((256 * r + 64) * ways);
+	size_t Bsize = SCRYPT_ARENA_ALIGN(128 * r * nLanes);
+	size_t size;
+	void * region;
+
+	if (arena->region != NULL && Vsize <= arena->Vsize &&
+	    XYsize <= arena->XYsize && Bsize <= arena->Bsize)
+		return (0);
+
+	/* Never shrink any of the three areas. */
+	if (Vsize < arena->Vsize)
+		Vsize = arena->Vsize;
+	if (XYsize < arena->XYsize)
+		XYsize = arena->XYsize;
+	if (Bsize < arena->Bsize)
+		Bsize = arena->Bsize;
+
+	size = Vsize + XYsize + Bsize;
+	if ((region = scrypt_region_alloc(&size, scrypt_arena_hugepages)) == NULL) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	if (arena->region != NULL)
+		scrypt_region_free(arena->region, arena->size);
+	arena->region = region;
+	arena->size = size;
+	arena->V = (uint8_t *)region;
+	arena->Vsize = Vsize;
+	arena->XY = arena->V + Vsize;
+	arena->XYsize = XYsize;
+	arena->B = arena->XY + XYsize;
+	arena->Bsize = Bsize;
+
+	return (0);
+}
+
+static void
+scrypt_thread_arena_cleanup(scrypt_arena * arena)
+{
+	scrypt_arena_free(arena);
+	delete arena;
+}
+
+static boost::thread_specific_ptr<scrypt_arena> scrypt_thread_arena_ptr(&scrypt_thread_arena_cleanup);
+
+/**
+ * scrypt_thread_arena():
+ * Return the calling thread's arena, sized on first use for the most
+ * demanding row of the hybrid parameter table so that later difficulty
+ * changes never cause it to be reallocated.  Return NULL if the memory could
+ * not be obtained.
+ */
+scrypt_arena *
+scrypt_thread_arena()
+{
+	scrypt_arena * arena = scrypt_thread_arena_ptr.get();
+	size_t i;
+
+	if (arena != NULL)
+		return (arena);
+
+	arena = new scrypt_arena;
+	scrypt_arena_init(arena);
+	for (i = 0; i < sizeof(dataFinal) / sizeof(dataFinal[0]); i++) {
+		if (scrypt_arena_reserve(arena, 1024 * (uint64_t)dataFinal[i][0],
+		    (uint32_t)dataFinal[i][1], (uint32_t)dataFinal[i][2])) {
+			scrypt_thread_arena_cleanup(arena);
+			return (NULL);
+		}
+	}
+	scrypt_thread_arena_ptr.reset(arena);
+
+	return (arena);
+}
+
+/*
+ * Parallel scrypt lanes.
+ *
+ * The p lanes of crypto_scrypt (B_0 ... B_{p-1}) are independent.  When
+ * -scryptpar is set, a small pool of worker threads evaluates them
+ * concurrently, each lane running on the executing thread's own arena for V
+ * and XY.  The pool is driven by one crypto_scrypt call at a time; a caller
+ * finding it busy simply runs its lanes serially.
+ */
+
+class CScryptLane
+{
+private:
+	uint8_t * B;
+	size_t r;
+	uint64_t N;
+
+public:
+	CScryptLane() : B(NULL), r(0), N(0) {}
+	CScryptLane(uint8_t * BIn, size_t rIn, uint64_t NIn) : B(BIn), r(rIn), N(NIn) {}
+
+	bool operator()()
+	{
+		scrypt_arena * arena = scrypt_thread_arena();
+		scrypt_arena local;
+
+		if (arena == NULL || scrypt_arena_reserve(arena, N, r, 1)) {
+			/* Out of memory for the thread arena: try a one-shot one. */
+			scrypt_arena_init(&local);
+			if (scrypt_arena_reserve(&local, N, r, 1))
+				return false;
+			scrypt_smix_detected(B, r, N, local.V, local.XY);
+			scrypt_arena_free(&local);
+			return true;
+		}
+		scrypt_smix_detected(B, r, N, arena->V, arena->XY);
+		return true;
+	}
+
+	void swap(CScryptLane &check)
+	{
+		std::swap(B, check.B);
+		std::swap(r, check.r);
+		std::swap(N, check.N);
+	}
+};
+
+static CCheckQueue<CScryptLane> scryptlanequeue(1);
+static CCriticalSection cs_scryptlanequeue;
+static int nScryptLaneThreads = 0;
+
+void
+scrypt_set_lane_threads(int nThreads)
+{
+	nScryptLaneThreads = nThreads;
+}
+
+void
+ThreadScryptLanes()
+{
+	RenameThread("mediterraneancoin-scryptlane");
+	scryptlanequeue.Thread();
+}
+
+/**
+ * scrypt_smix_lanes(B, r, N, p):
+ * Run the smix of all p lanes of B on the lane pool.  Return 1 if the lanes
+ * were computed (with ok set to whether they all succeeded), or 0 if the
+ * pool is disabled or in use by another caller.
+ */
+static int
+scrypt_smix_lanes(uint8_t * B, size_t r, uint64_t N, uint32_t p, bool &ok)
+{
+	uint32_t i;
+
+	if (nScryptLaneThreads == 0 || p < 2 || N < 2)
+		return (0);
+
+	TRY_LOCK(cs_scryptlanequeue, lockLanes);
+	if (!lockLanes)
+		return (0);
+
+	std::vector<CScryptLane> vLanes;
+	vLanes.reserve(p);
+	for (i = 0; i < p; i++)
+		vLanes.push_back(CScryptLane(&B[i * 128 * r], r, N));
+
+	CCheckQueueControl<CScryptLane> control(&scryptlanequeue);
+	control.Add(vLanes);
+	ok = control.Wait();
+
+	return (1);
+}
+
+/**
+ * crypto_scrypt_arena(arena, passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
+ * Like crypto_scrypt, but take the working memory from the given arena,
+ * growing it if necessary.
  *
  * Return 0 on success; or -1 on error.
  */
 int
-crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
+crypto_scrypt_arena(scrypt_arena * arena, const uint8_t * passwd, size_t passwdlen,
     const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
     uint8_t * buf, size_t buflen)
 {
@@ -1035,16 +1714,16 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #if SIZE_MAX > UINT32_MAX
 	if (buflen > (((uint64_t)(1) << 32) - 1) * 32) {
 		errno = EFBIG;
-		goto err0;
+		return (-1);
 	}
 #endif
 	if ((uint64_t)(r) * (uint64_t)(p) >= (1 << 30)) {
 		errno = EFBIG;
-		goto err0;
+		return (-1);
 	}
 	if (((N & (N - 1)) != 0) || (N == 0)) {
 		errno = EINVAL;
-		goto err0;
+		return (-1);
 	}
 	if ((r > SIZE_MAX / 128 / p) ||
 #if SIZE_MAX / 256 <= UINT32_MAX
@@ -1052,47 +1731,67 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #endif
 	    (N > SIZE_MAX / 128 / r)) {
 		errno = ENOMEM;
-		goto err0;
+		return (-1);
 	}
 
-	/* Allocate memory. */
-	if ((B = (uint8_t *) malloc(128 * r * p)) == NULL)
-		goto err0;
-	if ((XY = (uint8_t *) malloc(256 * r)) == NULL)
-		goto err1;
-	if ((V = (uint8_t *) malloc(128 * r * N)) == NULL)
-		goto err2;
+	/* Get memory from the arena. */
+	if (scrypt_arena_reserve(arena, N, r, p))
+		return (-1);
+	B = arena->B;
+	XY = arena->XY;
+	V = arena->V;
 
 	/* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
 	PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, B, p * 128 * r);
 
-	/* 2: for i = 0 to p - 1 do */
-	for (i = 0; i < p; i++) {
-		/* 3: B_i <-- MF(B_i, N) */
-		smix(&B[i * 128 * r], r, N, V, XY);
+	/*
+	 * 2: for i = 0 to p - 1 do
+	 * Preferably on the lane pool.  B was reserved for all p lanes above,
+	 * so a lane run on this thread's arena cannot make it move.
+	 */
+	bool fLanesOk = true;
+	if (!scrypt_smix_lanes(B, r, N, p, fLanesOk)) {
+		for (i = 0; i < p; i++) {
+			/* 3: B_i <-- MF(B_i, N) */
+			if (N > 1)
+				scrypt_smix_detected(&B[i * 128 * r], r, N, V, XY);
+			else
+				scrypt_smix_generic(&B[i * 128 * r], r, N, V, XY);
+		}
+	} else if (!fLanesOk) {
+		errno = ENOMEM;
+		return (-1);
 	}
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
 	PBKDF2_SHA256(passwd, passwdlen, B, p * 128 * r, 1, buf, buflen);
 
-	/* Free memory. */
-	free(V);
-	free(XY);
-	free(B);
-
 	/* Success! */
 	return (0);
-
-err2:
-	free(XY);
-err1:
-	free(B);
-err0:
-	/* Failure! */
-	return (-1);
 }
 
+/**
+ * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
+ * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
+ * p, buflen) and write the result into buf.  The parameters r, p, and buflen
+ * must satisfy r * p < 2^30 and buflen <= (2^32 - 1) * 32.  The parameter N
+ * must be a power of 2.
+ *
+ * Return 0 on success; or -1 on error.
+ */
+int
+crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t N, uint32_t r, uint32_t p,
+    uint8_t * buf, size_t buflen)
+{
+	scrypt_arena arena;
+	int rc;
 
+	/* One-shot arena, released before returning. */
+	scrypt_arena_init(&arena);
+	rc = crypto_scrypt_arena(&arena, passwd, passwdlen, salt, saltlen,
+	    N, r, p, buf, buflen);
+	scrypt_arena_free(&arena);
 
-
-
+	return (rc);
+}
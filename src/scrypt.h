@@ -18,6 +18,49 @@
 int crypto_scrypt(const uint8_t *, size_t, const uint8_t *, size_t, uint64_t,
     uint32_t, uint32_t, uint8_t *, size_t);
 
+/**
+ * Reusable working memory for crypto_scrypt_arena.  V, XY and B are carved
+ * out of a single mapping which only grows, so an arena that has been sized
+ * for the largest parameter set in use never allocates again.
+ */
+typedef struct {
+    void *region;
+    size_t size;
+    uint8_t *V;
+    size_t Vsize;
+    uint8_t *XY;
+    size_t XYsize;
+    uint8_t *B;
+    size_t Bsize;
+} scrypt_arena;
+
+void scrypt_arena_init(scrypt_arena *arena);
+int scrypt_arena_reserve(scrypt_arena *arena, uint64_t N, uint32_t r, uint32_t p);
+/** Like scrypt_arena_reserve, for nLanes lanes of 128r bytes run through a ways-way smix kernel */
+int scrypt_arena_reserve_nway(scrypt_arena *arena, uint64_t N, uint32_t r, size_t nLanes, int ways);
+void scrypt_arena_free(scrypt_arena *arena);
+
+/** Per-thread arena sized for every hybridScryptHash256 parameter set, or NULL if out of memory */
+scrypt_arena *scrypt_thread_arena();
+
+/** Back new arena mappings with huge pages where the OS supports it */
+void scrypt_set_hugepages(int enable);
+
+/**
+ * Evaluate the p lanes of each crypto_scrypt call concurrently on the lane
+ * pool.  nThreads counts the calling thread; ThreadScryptLanes() must be
+ * running on nThreads - 1 threads.  0 disables the pool.
+ */
+void scrypt_set_lane_threads(int nThreads);
+void ThreadScryptLanes();
+
+/**
+ * crypto_scrypt_arena(arena, passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
+ * Same as crypto_scrypt, with the working memory taken from arena.
+ */
+int crypto_scrypt_arena(scrypt_arena *, const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint32_t, uint32_t, uint8_t *, size_t);
+
 
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
@@ -27,7 +70,81 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 
 void hybridScryptHash256(const char *input, char *output, unsigned int nBits);
 
+/**
+ * Hash count block headers of 80 bytes each, stored back to back in headers,
+ * with the same nBits, writing count results of 32 bytes to outputs.  The
+ * results are those of hybridScryptHash256; the scrypt lanes of all headers
+ * are run through the multi-buffer smix kernel.  Miners sweeping nonces pass
+ * fCache = false so they do not flush the result cache used by validation.
+ */
+void hybridScryptHash256_batch(const char *headers, char *outputs, unsigned int count, unsigned int nBits, bool fCache = true);
+
+/**
+ * First scrypt stage of hybridScryptHash256.  It only depends on the first
+ * 68 header bytes (H68) and on nBits, which selects the scrypt parameters,
+ * so it is shared by every nNonce and nTime of one work unit.
+ */
+struct HybridScryptMidstate
+{
+    bool fValid;
+    unsigned int nBits;
+    uint8_t H68[68];
+    uint8_t S68[68];    // xor(H68, scrypt(H68))
+
+    HybridScryptMidstate() : fValid(false), nBits(0) {}
+};
+
+/**
+ * Make midstate hold the first stage for the first 68 bytes of header at
+ * nBits, computing it only if they changed.  Return false on error.
+ */
+bool hybridScryptHash256_prepare(const char *header, unsigned int nBits, HybridScryptMidstate &midstate);
+/**
+ * hybridScryptHash256 of count headers laid out as for
+ * hybridScryptHash256_batch, all starting with midstate.H68 and hashed at
+ * midstate.nBits.  Only SHA256d and the second scrypt stage run per header.
+ * The results are not cached.
+ */
+void hybridScryptHash256_finish_batch(const HybridScryptMidstate &midstate, const char *headers, char *outputs, unsigned int count);
+
+/** Number of rows of the hybridScryptHash256 scrypt parameter table */
+int hybridScryptParamCount();
+/** Row of the parameter table selected by a compact target */
+int hybridScryptParamRow(unsigned int nBits);
+/** scrypt parameters (N, r, p) of one row of the parameter table */
+void hybridScryptParams(int row, uint64_t &N, uint32_t &r, uint32_t &p);
+
+/** Counters of the hybridScryptHash256 result cache */
+struct ScryptHashCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    unsigned int nEntries;
+    unsigned int nCapacity;
+};
+
+void hybridScryptHash256CacheStats(ScryptHashCacheStats &stats);
+
+
 
+/**
+ * SMix kernels for crypto_scrypt with arbitrary N and r.  All of them give
+ * identical results; V must be 128*r*N bytes and XY 256*r + 64 bytes, both
+ * 16-byte aligned.  scrypt_smix_detected points to the fastest one the CPU
+ * supports once scrypt_detect_sse2() has run.
+ */
+void scrypt_smix_generic(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
+extern void (*scrypt_smix_detected)(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
+
+/**
+ * Multi-buffer smix kernel: runs scrypt_smix_nway instances with the same N
+ * and r at once.  V must be scrypt_smix_nway * 128rN bytes and XY
+ * scrypt_smix_nway * (256r + 64) bytes, both 32-byte aligned, and N at most
+ * 2^32.  scrypt_smix_nway is 1 and the kernel NULL when the CPU has none.
+ */
+static const int SCRYPT_MAX_NWAY = 8;
+extern int scrypt_smix_nway;
+extern void (*scrypt_smix_nway_detected)(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
 
 #if defined(USE_SSE2)
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
@@ -39,6 +156,13 @@ void hybridScryptHash256(const char *input, char *output, unsigned int nBits);
 
 void scrypt_detect_sse2();
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
+void scrypt_smix_sse2(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
+void scrypt_smix_sse2_4way(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
+#if defined(USE_AVX2)
+int scrypt_cpu_has_avx2();
+void scrypt_smix_avx2(uint8_t *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
+void scrypt_smix_avx2_8way(uint8_t *const *B, size_t r, uint64_t N, uint8_t *V, uint8_t *XY);
+#endif
 extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad);
 #else
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
@@ -0,0 +1,998 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <algorithm>
+#include <string.h>
+#include <openssl/bn.h>
+#include <openssl/ecdsa.h>
+
+#include "secp256k1.h"
+
+// anonymous namespace with the field, scalar and group arithmetic
+namespace {
+
+//
+// Field elements: integers modulo p = 2^256 - 2^32 - 977, as 8 little endian
+// 32-bit words. Results are below 2^256 but not necessarily below p; only
+// FeNormalize brings them into [0, p).
+//
+struct CFieldElem
+{
+    uint32_t n[8];
+};
+
+// 2^256 mod p
+static const uint64 FE_C = 0x1000003D1ULL;
+
+static const CFieldElem FE_P = {{0xFFFFFC2F, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF}};
+// cube root of unity, beta^3 = 1
+static const CFieldElem FE_BETA = {{0x719501EE, 0xC1396C28, 0x12F58995, 0x9CF04975, 0xAC3434E9, 0x6E64479E, 0x657C0710, 0x7AE96A2B}};
+
+// Add v at word i, returning the carry out of the top word
+static inline uint32_t FeAddAt(uint32_t *r, int i, uint64 v)
+{
+    for (; i < 8 && v; i++) {
+        v += r[i];
+        r[i] = (uint32_t)v;
+        v >>= 32;
+    }
+    return (uint32_t)v;
+}
+
+// r += c * 2^256, modulo p
+static inline void FeAddCarry(uint32_t *r, uint32_t c)
+{
+    while (c)
+        c = FeAddAt(r, 0, (uint64)c * 977) + FeAddAt(r, 1, c);
+}
+
+static inline void FeSetInt(CFieldElem &r, uint32_t a)
+{
+    memset(r.n, 0, sizeof(r.n));
+    r.n[0] = a;
+}
+
+static inline void FeAdd(CFieldElem &r, const CFieldElem &a, const CFieldElem &b)
+{
+    uint64 t = 0;
+    for (int i = 0; i < 8; i++) {
+        t += (uint64)a.n[i] + b.n[i];
+        r.n[i] = (uint32_t)t;
+        t >>= 32;
+    }
+    FeAddCarry(r.n, (uint32_t)t);
+}
+
+static inline void FeSub(CFieldElem &r, const CFieldElem &a, const CFieldElem &b)
+{
+    int64 t = 0;
+    for (int i = 0; i < 8; i++) {
+        t += (int64)a.n[i] - b.n[i];
+        r.n[i] = (uint32_t)t;
+        t >>= 32;
+    }
+    // on a borrow the result is 2^256 too high: take off 2^256 - p
+    while (t) {
+        t = 0;
+        int64 s = (int64)r.n[0] - (int64)(FE_C & 0xFFFFFFFF);
+        r.n[0] = (uint32_t)s;
+        s >>= 32;
+        s += (int64)r.n[1] - 1;
+        r.n[1] = (uint32_t)s;
+        s >>= 32;
+        for (int i = 2; i < 8 && s; i++) {
+            s += r.n[i];
+            r.n[i] = (uint32_t)s;
+            s >>= 32;
+        }
+        t = s;
+    }
+}
+
+static inline void FeMulInt(CFieldElem &r, const CFieldElem &a, uint32_t k)
+{
+    uint64 t = 0;
+    for (int i = 0; i < 8; i++) {
+        t += (uint64)a.n[i] * k;
+        r.n[i] = (uint32_t)t;
+        t >>= 32;
+    }
+    FeAddCarry(r.n, (uint32_t)t);
+}
+
+// Reduce a 512-bit product modulo p
+static inline void FeReduce(CFieldElem &r, const uint32_t *t)
+{
+    // t = lo + hi * 2^256 = lo + hi * 977 + hi * 2^32
+    uint32_t u[10];
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++) {
+        c += (uint64)t[i] + (uint64)t[8 + i] * 977;
+        u[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    u[8] = (uint32_t)c;
+    c = 0;
+    for (int i = 0; i < 8; i++) {
+        c += (uint64)u[i + 1] + t[8 + i];
+        u[i + 1] = (uint32_t)c;
+        c >>= 32;
+    }
+    u[9] = (uint32_t)c;
+    // and once more for the (at most 35) bits above 2^256
+    uint64 h = u[8] | ((uint64)u[9] << 32);
+    memcpy(r.n, u, sizeof(r.n));
+    FeAddCarry(r.n, FeAddAt(r.n, 0, h * 977) + FeAddAt(r.n, 1, h));
+}
+
+static inline void FeMul(CFieldElem &r, const CFieldElem &a, const CFieldElem &b)
+{
+    uint32_t t[16];
+    memset(t, 0, sizeof(t));
+    for (int i = 0; i < 8; i++) {
+        uint64 c = 0;
+        for (int j = 0; j < 8; j++) {
+            c += (uint64)a.n[i] * b.n[j] + t[i + j];
+            t[i + j] = (uint32_t)c;
+            c >>= 32;
+        }
+        t[i + 8] = (uint32_t)c;
+    }
+    FeReduce(r, t);
+}
+
+static inline void FeSqr(CFieldElem &r, const CFieldElem &a)
+{
+    // the cross products once, doubled, then the squares
+    uint32_t t[16];
+    memset(t, 0, sizeof(t));
+    for (int i = 0; i < 8; i++) {
+        uint64 c = 0;
+        for (int j = i + 1; j < 8; j++) {
+            c += (uint64)a.n[i] * a.n[j] + t[i + j];
+            t[i + j] = (uint32_t)c;
+            c >>= 32;
+        }
+        t[i + 8] = (uint32_t)c;
+    }
+    uint32_t nTop = 0;
+    for (int i = 0; i < 16; i++) {
+        uint32_t nNext = t[i] >> 31;
+        t[i] = (t[i] << 1) | nTop;
+        nTop = nNext;
+    }
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++) {
+        uint64 sq = (uint64)a.n[i] * a.n[i];
+        c += (uint64)t[2 * i] + (uint32_t)sq;
+        t[2 * i] = (uint32_t)c;
+        c >>= 32;
+        c += (uint64)t[2 * i + 1] + (sq >> 32);
+        t[2 * i + 1] = (uint32_t)c;
+        c >>= 32;
+    }
+    FeReduce(r, t);
+}
+
+// Bring into [0, p)
+static inline void FeNormalize(CFieldElem &a)
+{
+    // a >= p exactly when a + (2^256 - p) carries out of 256 bits
+    CFieldElem t = a;
+    if (FeAddAt(t.n, 0, FE_C & 0xFFFFFFFF) + FeAddAt(t.n, 1, 1))
+        a = t;
+}
+
+static inline bool FeIsZero(const CFieldElem &a)
+{
+    CFieldElem t = a;
+    FeNormalize(t);
+    uint32_t z = 0;
+    for (int i = 0; i < 8; i++)
+        z |= t.n[i];
+    return z == 0;
+}
+
+static inline bool FeEqual(const CFieldElem &a, const CFieldElem &b)
+{
+    CFieldElem t;
+    FeSub(t, a, b);
+    return FeIsZero(t);
+}
+
+static inline bool FeIsOdd(const CFieldElem &a)
+{
+    CFieldElem t = a;
+    FeNormalize(t);
+    return t.n[0] & 1;
+}
+
+static inline void FeNegate(CFieldElem &r, const CFieldElem &a)
+{
+    CFieldElem zero;
+    FeSetInt(zero, 0);
+    FeSub(r, zero, a);
+}
+
+// Decode 32 big endian bytes; false if the number is not below p
+static inline bool FeSetBytes(CFieldElem &r, const unsigned char *pch)
+{
+    for (int i = 0; i < 8; i++)
+        r.n[i] = ((uint32_t)pch[31 - 4 * i]) | ((uint32_t)pch[30 - 4 * i] << 8) |
+                 ((uint32_t)pch[29 - 4 * i] << 16) | ((uint32_t)pch[28 - 4 * i] << 24);
+    CFieldElem t = r;
+    return !(FeAddAt(t.n, 0, FE_C & 0xFFFFFFFF) + FeAddAt(t.n, 1, 1));
+}
+
+// a^e for a 256-bit exponent
+static void FePow(CFieldElem &r, const CFieldElem &a, const uint32_t *e)
+{
+    CFieldElem x;
+    FeSetInt(x, 1);
+    for (int i = 255; i >= 0; i--) {
+        FeSqr(x, x);
+        if ((e[i / 32] >> (i % 32)) & 1)
+            FeMul(x, x, a);
+    }
+    r = x;
+}
+
+static void FeInv(CFieldElem &r, const CFieldElem &a)
+{
+    // p - 2
+    static const uint32_t e[8] = {0xFFFFFC2D, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+    FePow(r, a, e);
+}
+
+// A square root of a, if there is one
+static bool FeSqrt(CFieldElem &r, const CFieldElem &a)
+{
+    // (p + 1) / 4
+    static const uint32_t e[8] = {0xBFFFFF0C, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x3FFFFFFF};
+    CFieldElem x, x2;
+    FePow(x, a, e);
+    FeSqr(x2, x);
+    if (!FeEqual(x2, a))
+        return false;
+    r = x;
+    return true;
+}
+
+//
+// Scalars: integers modulo the group order n, as 8 little endian 32-bit
+// words, always below n.
+//
+struct CScalar
+{
+    uint32_t d[8];
+};
+
+static const uint32_t SC_N[8] = {0xD0364141, 0xBFD25E8C, 0xAF48A03B, 0xBAAEDCE6, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+// 2^256 - n
+static const uint32_t SC_NC[5] = {0x2FC9BEBF, 0x402DA173, 0x50B75FC4, 0x45512319, 0x1};
+
+static inline bool ScGreaterEqualN(const uint32_t *a)
+{
+    for (int i = 7; i >= 0; i--) {
+        if (a[i] != SC_N[i])
+            return a[i] > SC_N[i];
+    }
+    return true;
+}
+
+static inline void ScSubN(uint32_t *a)
+{
+    int64 t = 0;
+    for (int i = 0; i < 8; i++) {
+        t += (int64)a[i] - SC_N[i];
+        a[i] = (uint32_t)t;
+        t >>= 32;
+    }
+}
+
+static inline bool ScIsZero(const CScalar &a)
+{
+    uint32_t z = 0;
+    for (int i = 0; i < 8; i++)
+        z |= a.d[i];
+    return z == 0;
+}
+
+// Decode 32 big endian bytes, reduced modulo n; returns whether that changed them
+static inline bool ScSetBytes(CScalar &r, const unsigned char *pch)
+{
+    for (int i = 0; i < 8; i++)
+        r.d[i] = ((uint32_t)pch[31 - 4 * i]) | ((uint32_t)pch[30 - 4 * i] << 8) |
+                 ((uint32_t)pch[29 - 4 * i] << 16) | ((uint32_t)pch[28 - 4 * i] << 24);
+    if (!ScGreaterEqualN(r.d))
+        return false;
+    ScSubN(r.d);
+    return true;
+}
+
+// Reduce an up to 512-bit number modulo n
+static void ScReduce(CScalar &r, const uint32_t *t)
+{
+    uint32_t x[17], y[17];
+    memcpy(x, t, 16 * sizeof(uint32_t));
+    x[16] = 0;
+    for (;;) {
+        int nLen = 17;
+        while (nLen > 8 && x[nLen - 1] == 0)
+            nLen--;
+        if (nLen <= 8)
+            break;
+        // x = lo + hi * 2^256 = lo + hi * (2^256 - n)
+        memset(y, 0, sizeof(y));
+        memcpy(y, x, 8 * sizeof(uint32_t));
+        for (int i = 8; i < nLen; i++) {
+            uint64 c = 0;
+            int k = i - 8;
+            for (int j = 0; j < 5; j++, k++) {
+                c += (uint64)x[i] * SC_NC[j] + y[k];
+                y[k] = (uint32_t)c;
+                c >>= 32;
+            }
+            for (; c && k < 17; k++) {
+                c += y[k];
+                y[k] = (uint32_t)c;
+                c >>= 32;
+            }
+        }
+        memcpy(x, y, sizeof(x));
+    }
+    if (ScGreaterEqualN(x))
+        ScSubN(x);
+    memcpy(r.d, x, sizeof(r.d));
+}
+
+static inline void ScMul512(uint32_t *t, const CScalar &a, const CScalar &b)
+{
+    memset(t, 0, 16 * sizeof(uint32_t));
+    for (int i = 0; i < 8; i++) {
+        uint64 c = 0;
+        for (int j = 0; j < 8; j++) {
+            c += (uint64)a.d[i] * b.d[j] + t[i + j];
+            t[i + j] = (uint32_t)c;
+            c >>= 32;
+        }
+        t[i + 8] = (uint32_t)c;
+    }
+}
+
+static inline void ScMul(CScalar &r, const CScalar &a, const CScalar &b)
+{
+    uint32_t t[16];
+    ScMul512(t, a, b);
+    ScReduce(r, t);
+}
+
+static inline void ScAdd(CScalar &r, const CScalar &a, const CScalar &b)
+{
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++) {
+        c += (uint64)a.d[i] + b.d[i];
+        r.d[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    if (c) {
+        // 2^256 too high, add 2^256 - n and drop the carry
+        uint64 t = 0;
+        for (int i = 0; i < 8; i++) {
+            t += (uint64)r.d[i] + (i < 5 ? SC_NC[i] : 0);
+            r.d[i] = (uint32_t)t;
+            t >>= 32;
+        }
+    } else if (ScGreaterEqualN(r.d)) {
+        ScSubN(r.d);
+    }
+}
+
+static inline void ScNegate(CScalar &r, const CScalar &a)
+{
+    if (ScIsZero(a)) {
+        r = a;
+        return;
+    }
+    int64 t = 0;
+    for (int i = 0; i < 8; i++) {
+        t += (int64)SC_N[i] - a.d[i];
+        r.d[i] = (uint32_t)t;
+        t >>= 32;
+    }
+}
+
+// Whether a is above n / 2, that is, closer to n than to 0
+static inline bool ScIsHigh(const CScalar &a)
+{
+    static const uint32_t nHalf[8] = {0x681B20A0, 0xDFE92F46, 0x57A4501D, 0x5D576E73, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0x7FFFFFFF};
+    for (int i = 7; i >= 0; i--) {
+        if (a.d[i] != nHalf[i])
+            return a.d[i] > nHalf[i];
+    }
+    return false;
+}
+
+static void ScInv(CScalar &r, const CScalar &a)
+{
+    // n - 2
+    static const uint32_t e[8] = {0xD036413F, 0xBFD25E8C, 0xAF48A03B, 0xBAAEDCE6, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+    CScalar x;
+    memset(x.d, 0, sizeof(x.d));
+    x.d[0] = 1;
+    for (int i = 255; i >= 0; i--) {
+        ScMul(x, x, x);
+        if ((e[i / 32] >> (i % 32)) & 1)
+            ScMul(x, x, a);
+    }
+    r = x;
+}
+
+// round(a * b / 2^384)
+static inline void ScMulShift384(CScalar &r, const CScalar &a, const CScalar &b)
+{
+    uint32_t t[16];
+    ScMul512(t, a, b);
+    memset(r.d, 0, sizeof(r.d));
+    uint64 c = t[11] >> 31;
+    for (int i = 0; i < 4; i++) {
+        c += t[12 + i];
+        r.d[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    r.d[4] = (uint32_t)c;
+}
+
+static const CScalar SC_LAMBDA = {{0x1B23BD72, 0xDF02967C, 0x20816678, 0x122E22EA, 0x8812645A, 0xA5261C02, 0xC05C30E0, 0x5363AD4C}};
+
+// k = k1 + k2 * lambda, with k1 and k2 of about 128 bits (or n minus that)
+static void ScSplitLambda(CScalar &k1, CScalar &k2, const CScalar &k)
+{
+    static const CScalar minus_b1 = {{0x0ABFE4C3, 0x6F547FA9, 0x010E8828, 0xE4437ED6, 0, 0, 0, 0}};
+    static const CScalar minus_b2 = {{0x3DB1562C, 0xD765CDA8, 0x0774346D, 0x8A280AC5, 0xFFFFFFFE, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF}};
+    static const CScalar g1 = {{0x45DBB031, 0xE893209A, 0x71E8CA7F, 0x3DAA8A14, 0x9284EB15, 0xE86C90E4, 0xA7D46BCD, 0x3086D221}};
+    static const CScalar g2 = {{0x8AC47F71, 0x1571B4AE, 0x9DF506C6, 0x221208AC, 0x0ABFE4C4, 0x6F547FA9, 0x010E8828, 0xE4437ED6}};
+    CScalar c1, c2;
+    ScMulShift384(c1, k, g1);
+    ScMulShift384(c2, k, g2);
+    ScMul(c1, c1, minus_b1);
+    ScMul(c2, c2, minus_b2);
+    ScAdd(k2, c1, c2);
+    ScMul(k1, k2, SC_LAMBDA);
+    ScNegate(k1, k1);
+    ScAdd(k1, k1, k);
+}
+
+// Width-w non-adjacent form of a (nonnegative) number of up to 8 words:
+// digits are zero or odd in (-2^(w-1), 2^(w-1)), and nonzero digits are
+// at least w apart. Returns the number of digits.
+static int Wnaf(int *pnDigit, const uint32_t *a, int w)
+{
+    uint32_t k[9];
+    memcpy(k, a, 8 * sizeof(uint32_t));
+    k[8] = 0;
+    int nDigits = 0;
+    for (;;) {
+        uint32_t z = 0;
+        for (int i = 0; i < 9; i++)
+            z |= k[i];
+        if (z == 0)
+            break;
+        int d = 0;
+        if (k[0] & 1) {
+            d = k[0] & ((1 << w) - 1);
+            if (d >= (1 << (w - 1)))
+                d -= (1 << w);
+            // k -= d
+            int64 t = (int64)k[0] - d;
+            k[0] = (uint32_t)t;
+            t >>= 32;
+            for (int i = 1; i < 9 && t; i++) {
+                t += k[i];
+                k[i] = (uint32_t)t;
+                t >>= 32;
+            }
+        }
+        pnDigit[nDigits++] = d;
+        for (int i = 0; i < 8; i++)
+            k[i] = (k[i] >> 1) | (k[i + 1] << 31);
+        k[8] >>= 1;
+    }
+    return nDigits;
+}
+
+//
+// Points. Affine points are never the point at infinity here; Jacobian
+// points (X, Y, Z) stand for (X / Z^2, Y / Z^3).
+//
+struct CPointAffine
+{
+    CFieldElem x, y;
+};
+
+struct CPointJacobian
+{
+    CFieldElem x, y, z;
+    bool fInfinity;
+};
+
+static inline void PointSetInfinity(CPointJacobian &r)
+{
+    r.fInfinity = true;
+}
+
+static inline void PointSetAffine(CPointJacobian &r, const CPointAffine &a)
+{
+    r.x = a.x;
+    r.y = a.y;
+    FeSetInt(r.z, 1);
+    r.fInfinity = false;
+}
+
+static void PointDouble(CPointJacobian &r, const CPointJacobian &a)
+{
+    // dbl-2009-l; secp256k1 has no point of order two, so Y is never zero
+    if (a.fInfinity) {
+        r.fInfinity = true;
+        return;
+    }
+    CFieldElem A, B, C, D, E, F, t;
+    FeSqr(A, a.x);
+    FeSqr(B, a.y);
+    FeSqr(C, B);
+    FeAdd(t, a.x, B);
+    FeSqr(t, t);
+    FeSub(t, t, A);
+    FeSub(t, t, C);
+    FeMulInt(D, t, 2);
+    FeMulInt(E, A, 3);
+    FeSqr(F, E);
+    FeMul(r.z, a.y, a.z);
+    FeMulInt(r.z, r.z, 2);
+    FeMulInt(t, D, 2);
+    FeSub(r.x, F, t);
+    FeSub(t, D, r.x);
+    FeMul(t, E, t);
+    FeMulInt(C, C, 8);
+    FeSub(r.y, t, C);
+    r.fInfinity = false;
+}
+
+// r = a + b; r may be a
+static void PointAddAffine(CPointJacobian &r, const CPointJacobian &a, const CPointAffine &b)
+{
+    // madd-2007-bl
+    if (a.fInfinity) {
+        PointSetAffine(r, b);
+        return;
+    }
+    CFieldElem Z1Z1, U2, S2, H, HH, I, J, R, V, t;
+    FeSqr(Z1Z1, a.z);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    FeSub(H, U2, a.x);
+    FeSub(R, S2, a.y);
+    if (FeIsZero(H)) {
+        if (FeIsZero(R))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeMulInt(R, R, 2);
+    FeSqr(HH, H);
+    FeMulInt(I, HH, 4);
+    FeMul(J, H, I);
+    FeMul(V, a.x, I);
+    FeAdd(t, a.z, H);
+    FeSqr(t, t);
+    FeSub(t, t, Z1Z1);
+    FeSub(r.z, t, HH);
+    FeMul(t, a.y, J);
+    FeMulInt(t, t, 2);
+    FeSqr(r.x, R);
+    FeSub(r.x, r.x, J);
+    FeSub(r.x, r.x, V);
+    FeSub(r.x, r.x, V);
+    FeSub(V, V, r.x);
+    FeMul(V, R, V);
+    FeSub(r.y, V, t);
+    r.fInfinity = false;
+}
+
+// r = a + b; r may be a
+static void PointAdd(CPointJacobian &r, const CPointJacobian &a, const CPointJacobian &b)
+{
+    // add-2007-bl
+    if (a.fInfinity) {
+        r = b;
+        return;
+    }
+    if (b.fInfinity) {
+        r = a;
+        return;
+    }
+    CFieldElem Z1Z1, Z2Z2, U1, U2, S1, S2, H, I, J, R, V, t;
+    FeSqr(Z1Z1, a.z);
+    FeSqr(Z2Z2, b.z);
+    FeMul(U1, a.x, Z2Z2);
+    FeMul(U2, b.x, Z1Z1);
+    FeMul(S1, a.y, b.z);
+    FeMul(S1, S1, Z2Z2);
+    FeMul(S2, b.y, a.z);
+    FeMul(S2, S2, Z1Z1);
+    FeSub(H, U2, U1);
+    FeSub(R, S2, S1);
+    if (FeIsZero(H)) {
+        if (FeIsZero(R))
+            PointDouble(r, a);
+        else
+            r.fInfinity = true;
+        return;
+    }
+    FeMulInt(R, R, 2);
+    FeMulInt(I, H, 2);
+    FeSqr(I, I);
+    FeMul(J, H, I);
+    FeMul(V, U1, I);
+    FeAdd(t, a.z, b.z);
+    FeSqr(t, t);
+    FeSub(t, t, Z1Z1);
+    FeSub(t, t, Z2Z2);
+    FeMul(r.z, t, H);
+    FeMul(t, S1, J);
+    FeMulInt(t, t, 2);
+    FeSqr(r.x, R);
+    FeSub(r.x, r.x, J);
+    FeSub(r.x, r.x, V);
+    FeSub(r.x, r.x, V);
+    FeSub(V, V, r.x);
+    FeMul(V, R, V);
+    FeSub(r.y, V, t);
+    r.fInfinity = false;
+}
+
+static void PointToAffine(CPointAffine &r, const CPointJacobian &a)
+{
+    CFieldElem zi, zi2, zi3;
+    FeInv(zi, a.z);
+    FeSqr(zi2, zi);
+    FeMul(zi3, zi2, zi);
+    FeMul(r.x, a.x, zi2);
+    FeMul(r.y, a.y, zi3);
+    FeNormalize(r.x);
+    FeNormalize(r.y);
+}
+
+static bool PointIsOnCurve(const CPointAffine &a)
+{
+    // y^2 = x^3 + 7
+    CFieldElem y2, x3, seven;
+    FeSqr(y2, a.y);
+    FeSqr(x3, a.x);
+    FeMul(x3, x3, a.x);
+    FeSetInt(seven, 7);
+    FeAdd(x3, x3, seven);
+    return FeEqual(y2, x3);
+}
+
+// Window of the tables of G and 2^128 * G, and of the public key
+static const int WINDOW_G = 8;
+static const int WINDOW_Q = 5;
+static const int TABLE_SIZE_G = 1 << (WINDOW_G - 2);
+static const int TABLE_SIZE_Q = 1 << (WINDOW_Q - 2);
+
+// Odd multiples 1, 3, 5, ... of G and of 2^128 * G
+class CGeneratorTables
+{
+public:
+    CPointAffine pointG[TABLE_SIZE_G];
+    CPointAffine point128[TABLE_SIZE_G];
+
+    static void Build(CPointAffine *pTable, const CPointJacobian &p)
+    {
+        CPointJacobian twice, x = p;
+        PointDouble(twice, p);
+        for (int i = 0; i < TABLE_SIZE_G; i++) {
+            PointToAffine(pTable[i], x);
+            PointAdd(x, x, twice);
+        }
+    }
+
+    CGeneratorTables()
+    {
+        static const unsigned char pchGx[32] = {
+            0x79,0xBE,0x66,0x7E,0xF9,0xDC,0xBB,0xAC,0x55,0xA0,0x62,0x95,0xCE,0x87,0x0B,0x07,
+            0x02,0x9B,0xFC,0xDB,0x2D,0xCE,0x28,0xD9,0x59,0xF2,0x81,0x5B,0x16,0xF8,0x17,0x98};
+        static const unsigned char pchGy[32] = {
+            0x48,0x3A,0xDA,0x77,0x26,0xA3,0xC4,0x65,0x5D,0xA4,0xFB,0xFC,0x0E,0x11,0x08,0xA8,
+            0xFD,0x17,0xB4,0x48,0xA6,0x85,0x54,0x19,0x9C,0x47,0xD0,0x8F,0xFB,0x10,0xD4,0xB8};
+        CPointAffine g;
+        FeSetBytes(g.x, pchGx);
+        FeSetBytes(g.y, pchGy);
+        CPointJacobian p;
+        PointSetAffine(p, g);
+        Build(pointG, p);
+        for (int i = 0; i < 128; i++)
+            PointDouble(p, p);
+        Build(point128, p);
+    }
+};
+
+static const CGeneratorTables &GetGeneratorTables()
+{
+    static const CGeneratorTables tables;
+    return tables;
+}
+
+static inline void AddDigitAffine(CPointJacobian &r, const CPointAffine *pTable, int d)
+{
+    if (d > 0) {
+        PointAddAffine(r, r, pTable[(d - 1) / 2]);
+    } else if (d < 0) {
+        CPointAffine neg;
+        neg.x = pTable[(-d - 1) / 2].x;
+        FeNegate(neg.y, pTable[(-d - 1) / 2].y);
+        PointAddAffine(r, r, neg);
+    }
+}
+
+static inline void AddDigit(CPointJacobian &r, const CPointJacobian *pTable, int d)
+{
+    if (d > 0) {
+        PointAdd(r, r, pTable[(d - 1) / 2]);
+    } else if (d < 0) {
+        CPointJacobian neg = pTable[(-d - 1) / 2];
+        FeNegate(neg.y, neg.y);
+        PointAdd(r, r, neg);
+    }
+}
+
+// Digits of a scalar taken as a signed number in (-n/2, n/2]; the sign is
+// carried by the digits
+static int WnafSigned(int *pnDigit, const CScalar &a, int w)
+{
+    if (!ScIsHigh(a))
+        return Wnaf(pnDigit, a.d, w);
+    CScalar neg;
+    ScNegate(neg, a);
+    int nDigits = Wnaf(pnDigit, neg.d, w);
+    for (int i = 0; i < nDigits; i++)
+        pnDigit[i] = -pnDigit[i];
+    return nDigits;
+}
+
+// Whether the x coordinate of u1 * G + u2 * Q, reduced modulo n, is r
+static bool VerifyPoint(const CScalar &u1, const CScalar &u2, const CPointAffine &q, const CScalar &r)
+{
+    const CGeneratorTables &tables = GetGeneratorTables();
+
+    // u1 * G = a * G + b * 2^128 * G
+    CScalar a, b;
+    memset(a.d, 0, sizeof(a.d));
+    memset(b.d, 0, sizeof(b.d));
+    memcpy(a.d, u1.d, 4 * sizeof(uint32_t));
+    memcpy(b.d, u1.d + 4, 4 * sizeof(uint32_t));
+
+    // u2 * Q = k1 * Q + k2 * lambda * Q
+    CScalar k1, k2;
+    ScSplitLambda(k1, k2, u2);
+
+    int wnafA[258], wnafB[258], wnaf1[258], wnaf2[258];
+    int nA = Wnaf(wnafA, a.d, WINDOW_G);
+    int nB = Wnaf(wnafB, b.d, WINDOW_G);
+    int n1 = WnafSigned(wnaf1, k1, WINDOW_Q);
+    int n2 = WnafSigned(wnaf2, k2, WINDOW_Q);
+
+    // odd multiples of Q, and their images lambda * (x, y) = (beta * x, y)
+    CPointJacobian tableQ[TABLE_SIZE_Q], tableLambdaQ[TABLE_SIZE_Q];
+    CPointJacobian twice;
+    PointSetAffine(tableQ[0], q);
+    PointDouble(twice, tableQ[0]);
+    for (int i = 1; i < TABLE_SIZE_Q; i++)
+        PointAdd(tableQ[i], tableQ[i - 1], twice);
+    for (int i = 0; i < TABLE_SIZE_Q; i++) {
+        tableLambdaQ[i] = tableQ[i];
+        FeMul(tableLambdaQ[i].x, tableQ[i].x, FE_BETA);
+    }
+
+    int nDigits = std::max(std::max(nA, nB), std::max(n1, n2));
+    CPointJacobian p;
+    PointSetInfinity(p);
+    for (int i = nDigits - 1; i >= 0; i--) {
+        PointDouble(p, p);
+        if (i < nA)
+            AddDigitAffine(p, tables.pointG, wnafA[i]);
+        if (i < nB)
+            AddDigitAffine(p, tables.point128, wnafB[i]);
+        if (i < n1)
+            AddDigit(p, tableQ, wnaf1[i]);
+        if (i < n2)
+            AddDigit(p, tableLambdaQ, wnaf2[i]);
+    }
+    if (p.fInfinity)
+        return false;
+
+    // Compare without leaving Jacobian coordinates: x = X / Z^2, so check
+    // r * Z^2 == X, and (r + n) * Z^2 == X when r + n is still below p
+    CFieldElem z2, xr, t;
+    FeSqr(z2, p.z);
+    memcpy(xr.n, r.d, sizeof(xr.n));
+    FeMul(t, xr, z2);
+    if (FeEqual(t, p.x))
+        return true;
+    uint64 c = 0;
+    for (int i = 0; i < 8; i++) {
+        c += (uint64)r.d[i] + SC_N[i];
+        xr.n[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    if (c)
+        return false;
+    CFieldElem xrn = xr;
+    FeNormalize(xrn);
+    if (memcmp(xrn.n, xr.n, sizeof(xr.n)) != 0)
+        return false; // r + n >= p
+    FeMul(t, xr, z2);
+    return FeEqual(t, p.x);
+}
+
+static void BigNumToBytes(unsigned char *pch32, const BIGNUM *bn)
+{
+    memset(pch32, 0, 32);
+    BN_bn2bin(bn, pch32 + 32 - BN_num_bytes(bn));
+}
+
+}
+
+bool CSecp256k1PubKey::Parse(const unsigned char *pch, unsigned int nSize)
+{
+    CPointAffine p;
+    if (nSize == 33 && (pch[0] == 0x02 || pch[0] == 0x03)) {
+        if (!FeSetBytes(p.x, pch + 1))
+            return false;
+        CFieldElem x3, seven;
+        FeSqr(x3, p.x);
+        FeMul(x3, x3, p.x);
+        FeSetInt(seven, 7);
+        FeAdd(x3, x3, seven);
+        if (!FeSqrt(p.y, x3))
+            return false;
+        if (FeIsOdd(p.y) != (pch[0] == 0x03))
+            FeNegate(p.y, p.y);
+    } else if (nSize == 65 && (pch[0] == 0x04 || pch[0] == 0x06 || pch[0] == 0x07)) {
+        if (!FeSetBytes(p.x, pch + 1) || !FeSetBytes(p.y, pch + 33))
+            return false;
+        // hybrid encodings repeat the parity of y in the first byte
+        if (pch[0] != 0x04 && FeIsOdd(p.y) != (pch[0] == 0x07))
+            return false;
+        if (!PointIsOnCurve(p))
+            return false;
+    } else {
+        return false;
+    }
+    FeNormalize(p.y);
+    memcpy(x, pch + 1, 32);
+    for (int i = 0; i < 8; i++) {
+        y[31 - 4 * i] = p.y.n[i];
+        y[30 - 4 * i] = p.y.n[i] >> 8;
+        y[29 - 4 * i] = p.y.n[i] >> 16;
+        y[28 - 4 * i] = p.y.n[i] >> 24;
+    }
+    return true;
+}
+
+bool CSecp256k1Signature::Parse(const unsigned char *pch, unsigned int nSize)
+{
+    const unsigned char *p = pch;
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &p, nSize);
+    if (sig == NULL)
+        return false;
+    const BIGNUM *bnR, *bnS;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ECDSA_SIG_get0(sig, &bnR, &bnS);
+#else
+    bnR = sig->r;
+    bnS = sig->s;
+#endif
+    bool fOk = true;
+#if OPENSSL_VERSION_NUMBER >= 0x100010bfL || (OPENSSL_VERSION_NUMBER >= 0x1000010fL && OPENSSL_VERSION_NUMBER < 0x10001000L)
+    // Since 1.0.0p and 1.0.1k, ECDSA_verify rejects encodings that do not
+    // reencode to the same bytes
+    unsigned char *pchDer = NULL;
+    int nDerSize = i2d_ECDSA_SIG(sig, &pchDer);
+    if (nDerSize != (int)nSize || memcmp(pch, pchDer, nSize) != 0)
+        fOk = false;
+    OPENSSL_free(pchDer);
+#endif
+    // 0 < r, s < n, as ECDSA_do_verify checks
+    CScalar sc;
+    if (fOk && (BN_is_zero(bnR) || BN_is_negative(bnR) || BN_num_bytes(bnR) > 32 ||
+                BN_is_zero(bnS) || BN_is_negative(bnS) || BN_num_bytes(bnS) > 32))
+        fOk = false;
+    if (fOk) {
+        BigNumToBytes(r, bnR);
+        BigNumToBytes(s, bnS);
+        if (ScSetBytes(sc, r) || ScSetBytes(sc, s))
+            fOk = false;
+    }
+    ECDSA_SIG_free(sig);
+    return fOk;
+}
+
+bool Secp256k1Verify(const uint256 &hash, const CSecp256k1Signature &sig, const CSecp256k1PubKey &pubkey)
+{
+    CScalar e, r, s, w, u1, u2;
+    ScSetBytes(e, hash.begin());
+    ScSetBytes(r, sig.r);
+    ScSetBytes(s, sig.s);
+    CPointAffine q;
+    FeSetBytes(q.x, pubkey.x);
+    FeSetBytes(q.y, pubkey.y);
+
+    ScInv(w, s);
+    ScMul(u1, e, w);
+    ScMul(u2, r, w);
+    return VerifyPoint(u1, u2, q, r);
+}
+
+bool Secp256k1VerifyBatch(std::vector<CSecp256k1Check> &vChecks)
+{
+    unsigned int nCount = vChecks.size();
+    if (nCount == 0)
+        return true;
+
+    // Invert all s at once (Montgomery's trick): with prefix products
+    // p[i] = s[0] * ... * s[i], 1 / s[i] = p[i-1] / p[i], and every 1 / p[i]
+    // follows from 1 / p[n-1] by multiplying back in s[n-1], s[n-2], ...
+    std::vector<CScalar> vPrefix(nCount);
+    CScalar s, inv;
+    for (unsigned int i = 0; i < nCount; i++) {
+        ScSetBytes(s, vChecks[i].sig.s);
+        if (i == 0)
+            vPrefix[i] = s;
+        else
+            ScMul(vPrefix[i], vPrefix[i - 1], s);
+    }
+    ScInv(inv, vPrefix[nCount - 1]);
+
+    bool fAllValid = true;
+    for (unsigned int i = nCount; i-- > 0; ) {
+        CSecp256k1Check &check = vChecks[i];
+        CScalar w, e, r, u1, u2;
+        if (i == 0) {
+            w = inv;
+        } else {
+            ScMul(w, inv, vPrefix[i - 1]);
+            ScSetBytes(s, check.sig.s);
+            ScMul(inv, inv, s);
+        }
+        ScSetBytes(e, check.hash.begin());
+        ScSetBytes(r, check.sig.r);
+        CPointAffine q;
+        FeSetBytes(q.x, check.pubkey.x);
+        FeSetBytes(q.y, check.pubkey.y);
+        ScMul(u1, e, w);
+        ScMul(u2, r, w);
+        check.fValid = VerifyPoint(u1, u2, q, r);
+        fAllValid &= check.fValid;
+    }
+    return fAllValid;
+}
+
+bool Secp256k1Verify(const uint256 &hash, const std::vector<unsigned char> &vchSig, const unsigned char *pchPubKey, unsigned int nPubKeySize)
+{
+    CSecp256k1PubKey pubkey;
+    if (!pubkey.Parse(pchPubKey, nPubKeySize))
+        return false;
+    CSecp256k1Signature sig;
+    if (vchSig.empty() || !sig.Parse(&vchSig[0], vchSig.size()))
+        return false;
+    return Secp256k1Verify(hash, sig, pubkey);
+}
+
+void Secp256k1Init()
+{
+    GetGeneratorTables();
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** ECDSA signature verification specific to the secp256k1 curve.
+ *
+ *  Field and scalar elements are fixed arrays of 32-bit words, and nothing
+ *  is allocated while verifying. u1*G + u2*Q is computed in one pass of
+ *  128 doublings: u1 is split in halves against precomputed wNAF tables of
+ *  G and 2^128*G, and u2 in two 128-bit halves through the curve's
+ *  endomorphism (x, y) -> (beta*x, y) = lambda*(x, y).
+ *
+ *  Signatures are still decoded by OpenSSL, exactly as ECDSA_verify does,
+ *  so the encodings accepted do not change with the backend.
+ */
+
+/** A public key decoded into a point on the curve */
+class CSecp256k1PubKey
+{
+public:
+    unsigned char x[32]; // big endian
+    unsigned char y[32];
+
+    /** Decode compressed, uncompressed or hybrid encodings, as OpenSSL does */
+    bool Parse(const unsigned char *pch, unsigned int nSize);
+};
+
+/** The (r, s) values of a DER encoded signature */
+class CSecp256k1Signature
+{
+public:
+    unsigned char r[32]; // big endian
+    unsigned char s[32];
+
+    /** Decode a signature, as ECDSA_verify does; fails for r or s out of range */
+    bool Parse(const unsigned char *pch, unsigned int nSize);
+};
+
+/** Verify a decoded signature of a 32-byte hash */
+bool Secp256k1Verify(const uint256 &hash, const CSecp256k1Signature &sig, const CSecp256k1PubKey &pubkey);
+
+/** One signature of a batch */
+class CSecp256k1Check
+{
+public:
+    uint256 hash;
+    CSecp256k1Signature sig;
+    CSecp256k1PubKey pubkey;
+    bool fValid; // set by Secp256k1VerifyBatch
+};
+
+/** Verify a batch of decoded signatures, sharing one modular inversion among
+ *  all of them. Returns whether all are valid; fValid tells which are not. */
+bool Secp256k1VerifyBatch(std::vector<CSecp256k1Check> &vChecks);
+
+/** Decode and verify; the same result as OpenSSL's ECDSA_verify */
+bool Secp256k1Verify(const uint256 &hash, const std::vector<unsigned char> &vchSig, const unsigned char *pchPubKey, unsigned int nPubKeySize);
+
+/** Build the tables of multiples of G; done on first use otherwise */
+void Secp256k1Init();
+
+#endif
@@ -0,0 +1,194 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <openssl/sha.h>
+
+#include "sigcache.h"
+#include "util.h"
+
+// Slots are accessed a 32-bit word at a time, so that lookups without the
+// shard lock are well-defined; see CSignatureCache
+
+static inline bool SlotMatches(const uint256 &slot, const uint256 &digest)
+{
+    const uint32_t *p = (const uint32_t*)slot.begin();
+    const uint32_t *q = (const uint32_t*)digest.begin();
+    for (unsigned int i = 0; i < 8; i++)
+        if (__atomic_load_n(&p[i], __ATOMIC_RELAXED) != q[i])
+            return false;
+    return true;
+}
+
+static inline bool SlotEmpty(const uint256 &slot)
+{
+    const uint32_t *p = (const uint32_t*)slot.begin();
+    for (unsigned int i = 0; i < 8; i++)
+        if (__atomic_load_n(&p[i], __ATOMIC_RELAXED) != 0)
+            return false;
+    return true;
+}
+
+static inline void StoreSlot(uint256 &slot, const uint256 &digest)
+{
+    uint32_t *p = (uint32_t*)slot.begin();
+    const uint32_t *q = (const uint32_t*)digest.begin();
+    for (unsigned int i = 0; i < 8; i++)
+        __atomic_store_n(&p[i], q[i], __ATOMIC_RELAXED);
+}
+
+static inline void Count(uint64 &n)
+{
+    __atomic_fetch_add(&n, 1, __ATOMIC_RELAXED);
+}
+
+CSignatureCache::CSignatureCache(unsigned int nEntries) : nSlotMask(0)
+{
+    salt = GetRandHash();
+    if (nEntries == 0)
+        return;
+    if (nEntries > SIGCACHE_MAX_ENTRIES)
+        nEntries = SIGCACHE_MAX_ENTRIES;
+    unsigned int nSlots = 1;
+    while (nSlots * SIGCACHE_SHARDS < nEntries)
+        nSlots <<= 1;
+    nSlotMask = nSlots - 1;
+    for (unsigned int n = 0; n < SIGCACHE_SHARDS; n++)
+        shards[n].vSlot.resize(nSlots);
+}
+
+uint256 CSignatureCache::Digest(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, salt.begin(), 32);
+    SHA256_Update(&ctx, hash.begin(), 32);
+    unsigned int nSigSize = vchSig.size();
+    SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+    if (nSigSize)
+        SHA256_Update(&ctx, &vchSig[0], nSigSize);
+    SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+    uint256 digest;
+    SHA256_Final(digest.begin(), &ctx);
+    // all zero marks an empty slot
+    if (digest == 0)
+        digest = 1;
+    return digest;
+}
+
+CSignatureCache::CShard &CSignatureCache::ShardOf(const uint256 &digest)
+{
+    return shards[((const uint32_t*)digest.begin())[0] % SIGCACHE_SHARDS];
+}
+
+void CSignatureCache::Slots(const uint256 &digest, unsigned int *pnSlot) const
+{
+    const uint32_t *p = (const uint32_t*)digest.begin();
+    for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
+        pnSlot[i] = p[1 + i] & nSlotMask;
+}
+
+bool CSignatureCache::Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey, bool fErase)
+{
+    uint256 digest = Digest(hash, vchSig, pubKey);
+    CShard &shard = ShardOf(digest);
+    if (shard.vSlot.empty())
+        return false;
+    unsigned int nSlot[SIGCACHE_WAYS];
+    Slots(digest, nSlot);
+    for (unsigned int i = 0; i < SIGCACHE_WAYS; i++) {
+        if (SlotMatches(shard.vSlot[nSlot[i]], digest)) {
+            Count(shard.nHits);
+            if (fErase) {
+                LOCK(shard.cs);
+                // it may have been moved meanwhile, in which case it stays
+                if (SlotMatches(shard.vSlot[nSlot[i]], digest)) {
+                    StoreSlot(shard.vSlot[nSlot[i]], 0);
+                    shard.nErased++;
+                }
+            }
+            return true;
+        }
+    }
+    Count(shard.nMisses);
+    return false;
+}
+
+void CSignatureCache::Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    uint256 digest = Digest(hash, vchSig, pubKey);
+    CShard &shard = ShardOf(digest);
+    if (shard.vSlot.empty())
+        return;
+
+    LOCK(shard.cs);
+    unsigned int nSlot[SIGCACHE_WAYS];
+    Slots(digest, nSlot);
+    for (unsigned int i = 0; i < SIGCACHE_WAYS; i++)
+        if (SlotMatches(shard.vSlot[nSlot[i]], digest))
+            return;
+    shard.nInserts++;
+
+    // Put the entry in a free slot; failing that, move an occupant to one
+    // of its other slots. The occupant is missing from the table until it
+    // is stored again, so a lookup racing with the move may miss it.
+    uint256 entry = digest;
+    for (unsigned int nMove = 0; nMove <= SIGCACHE_MAX_MOVES; nMove++) {
+        for (unsigned int i = 0; i < SIGCACHE_WAYS; i++) {
+            if (SlotEmpty(shard.vSlot[nSlot[i]])) {
+                StoreSlot(shard.vSlot[nSlot[i]], entry);
+                return;
+            }
+        }
+        if (nMove == SIGCACHE_MAX_MOVES)
+            break;
+        // Random so that nobody can make entries chase each other in a cycle
+        uint256 &slot = shard.vSlot[nSlot[GetRandInt(SIGCACHE_WAYS)]];
+        uint256 occupant = slot;
+        StoreSlot(slot, entry);
+        entry = occupant;
+        Slots(entry, nSlot);
+    }
+    shard.nEvictions++;
+}
+
+void CSignatureCache::GetStats(SignatureCacheStats &stats)
+{
+    stats.nHits = 0;
+    stats.nMisses = 0;
+    stats.nInserts = 0;
+    stats.nEvictions = 0;
+    stats.nErased = 0;
+    stats.nEntries = 0;
+    stats.nCapacity = 0;
+    for (unsigned int n = 0; n < SIGCACHE_SHARDS; n++) {
+        CShard &shard = shards[n];
+        LOCK(shard.cs);
+        stats.nHits += __atomic_load_n(&shard.nHits, __ATOMIC_RELAXED);
+        stats.nMisses += __atomic_load_n(&shard.nMisses, __ATOMIC_RELAXED);
+        stats.nInserts += shard.nInserts;
+        stats.nEvictions += shard.nEvictions;
+        stats.nErased += shard.nErased;
+        stats.nCapacity += shard.vSlot.size();
+        for (unsigned int i = 0; i < shard.vSlot.size(); i++)
+            if (!SlotEmpty(shard.vSlot[i]))
+                stats.nEntries++;
+    }
+}
+
+// -maxsigcachesize, within what the cache can hold
+static unsigned int GetSignatureCacheSize()
+{
+    int64 nEntries = std::max((int64)0, GetArg("-maxsigcachesize", 50000));
+    if (nEntries > CSignatureCache::SIGCACHE_MAX_ENTRIES)
+        nEntries = CSignatureCache::SIGCACHE_MAX_ENTRIES;
+    return nEntries;
+}
+
+CSignatureCache &GetSignatureCache()
+{
+    // DoS prevention: limit cache size. There are a maximum of 20,000
+    // signature operations per block, so 50,000 is a reasonable default;
+    // at 32 bytes an entry that is 2MB.
+    static CSignatureCache signatureCache(GetSignatureCacheSize());
+    return signatureCache;
+}
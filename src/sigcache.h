@@ -0,0 +1,85 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SIGCACHE_H
+#define BITCOIN_SIGCACHE_H
+
+#include <vector>
+
+#include "key.h"
+#include "sync.h"
+#include "uint256.h"
+
+/** Counters of a signature cache */
+struct SignatureCacheStats
+{
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nInserts;
+    uint64 nEvictions;      // entries dropped to make room for others
+    uint64 nErased;         // entries used up by a block
+    unsigned int nEntries;
+    unsigned int nCapacity;
+};
+
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ *  twice for every transaction (once when accepted into memory pool, and
+ *  again when accepted into the block chain).
+ *
+ *  Only a salted SHA256 digest of (signature hash, signature, public key) is
+ *  kept, in a fixed-size table split in shards. Every digest has
+ *  SIGCACHE_WAYS candidate slots in its shard; an insert into a full set
+ *  moves an occupant to one of its other slots, cuckoo style, and drops an
+ *  entry only when that does not free a slot after a few moves. The salt
+ *  keeps others from choosing which entries collide.
+ *
+ *  Lookups take no lock. Slots are read and written a word at a time, so a
+ *  lookup racing with an insert can see a mix of two digests, but the odds
+ *  of such a mix matching a third digest are negligible. Inserts and
+ *  erasures take the lock of their shard.
+ */
+class CSignatureCache
+{
+private:
+    static const unsigned int SIGCACHE_SHARDS = 16;
+    static const unsigned int SIGCACHE_WAYS = 4;
+    static const unsigned int SIGCACHE_MAX_MOVES = 8;
+
+    struct CShard
+    {
+        CCriticalSection cs;
+        uint64 nHits;
+        uint64 nMisses;
+        uint64 nInserts;
+        uint64 nEvictions;
+        uint64 nErased;
+        std::vector<uint256> vSlot;
+
+        CShard() : nHits(0), nMisses(0), nInserts(0), nEvictions(0), nErased(0) {}
+    };
+
+    uint256 salt;
+    unsigned int nSlotMask; // slots per shard, minus one
+    CShard shards[SIGCACHE_SHARDS];
+
+    uint256 Digest(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    CShard &ShardOf(const uint256 &digest);
+    void Slots(const uint256 &digest, unsigned int *pnSlot) const;
+
+public:
+    // Largest number of entries, 512MB; larger sizes are clamped to it
+    static const unsigned int SIGCACHE_MAX_ENTRIES = 1 << 24;
+
+    /** Room for at least nEntries signatures; 0 disables the cache */
+    CSignatureCache(unsigned int nEntries);
+
+    /** Whether the signature is known to be valid; with fErase it is forgotten */
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey, bool fErase = false);
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+    void GetStats(SignatureCacheStats &stats);
+};
+
+/** The cache CheckSig uses, sized by -maxsigcachesize on first use */
+CSignatureCache &GetSignatureCache();
+
+#endif
@@ -0,0 +1,726 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "main.h"
+#include "net.h"
+#include "scrypt.h"
+#include "bitcoinrpc.h"
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+using namespace boost;
+using namespace json_spirit;
+
+// Jobs kept for late shares; a clean job drops all of them
+static const unsigned int STRATUM_MAX_JOBS = 16;
+// Shares hashed together by a worker
+static const unsigned int STRATUM_SHARE_BATCH = 8;
+// Longest request line accepted from a client
+static const unsigned int STRATUM_MAX_LINE = 16 * 1024;
+// Replies queued for a client that does not read them
+static const unsigned int STRATUM_MAX_SEND_QUEUE = 1000;
+
+class CStratumJob
+{
+public:
+    string strId;
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate;
+    unsigned int nMinTime;
+    // Serialized coinbase before and after extranonce1 + extranonce2
+    vector<unsigned char> vchCoinb1;
+    vector<unsigned char> vchCoinb2;
+    vector<uint256> vMerkleBranch;
+    // mining.notify lines, indexed by the clean_jobs flag
+    string strNotify[2];
+    // Header hashes of accepted shares, protected by cs_stratum
+    set<uint256> setSubmitted;
+
+    CStratumJob(CBlockTemplate* pblocktemplateIn, unsigned int nId, const CBlockIndex* pindexPrev);
+};
+
+struct CStratumShare
+{
+    boost::shared_ptr<CStratumSession> session;
+    boost::shared_ptr<CStratumJob> job;
+    Value id;
+    CBlockHeader header;
+    vector<unsigned char> vchCoinbase;
+};
+
+static CCriticalSection cs_stratum;
+static deque<boost::shared_ptr<CStratumJob> > vStratumJobs;
+static list<boost::shared_ptr<CStratumSession> > lStratumSessions;
+static unsigned int nStratumJobId = 0;
+static unsigned int nStratumExtraNonce1 = 0;
+static CScript scriptStratumPayout;
+static double dStratumDifficulty = 1.0;
+static uint256 hashStratumShareTarget;
+
+static boost::mutex mutexStratumShares;
+static boost::condition_variable condStratumShares;
+static deque<CStratumShare> queueStratumShares;
+
+static boost::thread_group* stratumThreads = NULL;
+static asio::io_service* stratum_io_service = NULL;
+static asio::ip::tcp::acceptor* stratum_acceptor = NULL;
+
+static Array StratumError(int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+static string StratumNotification(const string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    return write_string(Value(notification), false);
+}
+
+static string StratumHex32(unsigned int n)
+{
+    return strprintf("%08x", n);
+}
+
+// Exactly 8 hex digits, big-endian
+static bool ParseStratumHex32(const Value& value, unsigned int& n)
+{
+    if (value.type() != str_type)
+        return false;
+    const string& str = value.get_str();
+    if (str.size() != 8 || !IsHex(str))
+        return false;
+    vector<unsigned char> vch = ParseHex(str);
+    n = (vch[0] << 24) | (vch[1] << 16) | (vch[2] << 8) | vch[3];
+    return true;
+}
+
+static void AppendStratumHex32(vector<unsigned char>& vch, unsigned int n)
+{
+    vch.push_back(n >> 24);
+    vch.push_back(n >> 16);
+    vch.push_back(n >> 8);
+    vch.push_back(n);
+}
+
+// Stratum sends the previous block hash as 8 words, each byte-swapped
+static string StratumPrevHash(const uint256& hash)
+{
+    const unsigned char* p = hash.begin();
+    string str;
+    for (int i = 0; i < 32; i += 4)
+        str += StratumHex32(p[i] | (p[i+1] << 8) | (p[i+2] << 16) | (p[i+3] << 24));
+    return str;
+}
+
+CStratumJob::CStratumJob(CBlockTemplate* pblocktemplateIn, unsigned int nId, const CBlockIndex* pindexPrev) : pblocktemplate(pblocktemplateIn)
+{
+    strId = strprintf("%x", nId);
+    nMinTime = pindexPrev->GetMedianTimePast() + 1;
+
+    // Leave room for both extranonces right after the height in the coinbase
+    CBlock& block = pblocktemplate->block;
+    CTransaction& txCoinbase = block.vtx[0];
+    int nHeight = pindexPrev->nHeight + 1;
+    const unsigned int nExtraNonceSize = STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE;
+    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << vector<unsigned char>(nExtraNonceSize, 0)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    // version, vin count, prevout, script length, height, push opcode
+    unsigned int nOffset = 4 + 1 + 36 + GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + (CScript() << nHeight).size() + 1;
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase << txCoinbase;
+    vector<unsigned char> vchCoinbase(ssCoinbase.begin(), ssCoinbase.end());
+    assert(nOffset + nExtraNonceSize <= vchCoinbase.size());
+    vchCoinb1.assign(vchCoinbase.begin(), vchCoinbase.begin() + nOffset);
+    vchCoinb2.assign(vchCoinbase.begin() + nOffset + nExtraNonceSize, vchCoinbase.end());
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    vMerkleBranch = block.GetMerkleBranch(0);
+
+    Array merkle;
+    BOOST_FOREACH(const uint256& hash, vMerkleBranch)
+        merkle.push_back(HexStr(hash.begin(), hash.end()));
+    for (int fClean = 0; fClean < 2; fClean++)
+    {
+        Array params;
+        params.push_back(strId);
+        params.push_back(StratumPrevHash(block.hashPrevBlock));
+        params.push_back(HexStr(vchCoinb1));
+        params.push_back(HexStr(vchCoinb2));
+        params.push_back(merkle);
+        params.push_back(StratumHex32(block.nVersion));
+        params.push_back(StratumHex32(block.nBits));
+        params.push_back(StratumHex32(block.nTime));
+        params.push_back(fClean != 0);
+        strNotify[fClean] = StratumNotification("mining.notify", params);
+    }
+}
+
+static boost::shared_ptr<CStratumJob> StratumFindJob(const string& strId)
+{
+    LOCK(cs_stratum);
+    BOOST_FOREACH(const boost::shared_ptr<CStratumJob>& job, vStratumJobs)
+        if (job->strId == strId)
+            return job;
+    return boost::shared_ptr<CStratumJob>();
+}
+
+uint256 StratumShareTarget(double dDifficulty)
+{
+    // Difficulty 1 is 0xffff * 2^208; keep 53 bits of the quotient
+    if (!(dDifficulty > 0))
+        return ~uint256(0);
+    double dTarget = 65535.0 / dDifficulty;
+    int nShift = 208;
+    while (dTarget < 4503599627370496.0 && nShift > 0) // 2^52
+    {
+        dTarget *= 2;
+        nShift--;
+    }
+    while (dTarget >= 9007199254740992.0) // 2^53
+    {
+        dTarget /= 2;
+        nShift++;
+    }
+    if (nShift + 53 > 256)
+        return ~uint256(0);
+    uint256 hashTarget((uint64)dTarget);
+    hashTarget <<= nShift;
+    return hashTarget;
+}
+
+CStratumSession::CStratumSession() : fSubscribed(false), fAuthorized(false)
+{
+    LOCK(cs_stratum);
+    nExtraNonce1 = nStratumExtraNonce1++;
+}
+
+void CStratumSession::Reply(const Value& id, const Value& result, const Value& error)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    Send(write_string(Value(reply), false));
+}
+
+void CStratumSession::Notify(const CStratumJob& job, bool fClean)
+{
+    Send(job.strNotify[fClean]);
+}
+
+void CStratumSession::HandleLine(const string& strLine)
+{
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+    {
+        Reply(Value::null, Value::null, StratumError(STRATUM_ERROR_OTHER, "Parse error"));
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value method = find_value(request, "method");
+    Value params = find_value(request, "params");
+    if (method.type() != str_type)
+    {
+        Reply(id, Value::null, StratumError(STRATUM_ERROR_OTHER, "Method must be a string"));
+        return;
+    }
+    Array paramsArray;
+    if (params.type() == array_type)
+        paramsArray = params.get_array();
+
+    const string& strMethod = method.get_str();
+    if (strMethod == "mining.subscribe")
+        Subscribe(id);
+    else if (strMethod == "mining.authorize")
+    {
+        fAuthorized = true;
+        Reply(id, true, Value::null);
+    }
+    else if (strMethod == "mining.submit")
+        Submit(id, paramsArray);
+    else
+        Reply(id, Value::null, StratumError(STRATUM_ERROR_OTHER, "Method not found"));
+}
+
+void CStratumSession::Subscribe(const Value& id)
+{
+    string strSessionId = StratumHex32(nExtraNonce1);
+    Array subscriptions;
+    Array subscription;
+    subscription.push_back("mining.set_difficulty");
+    subscription.push_back(strSessionId);
+    subscriptions.push_back(subscription);
+    subscription[0] = "mining.notify";
+    subscriptions.push_back(subscription);
+
+    Array result;
+    result.push_back(subscriptions);
+    result.push_back(strSessionId);
+    result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+    Reply(id, result, Value::null);
+
+    Array params;
+    params.push_back(dStratumDifficulty);
+    Send(StratumNotification("mining.set_difficulty", params));
+
+    boost::shared_ptr<CStratumJob> job;
+    {
+        LOCK(cs_stratum);
+        if (!fSubscribed)
+            lStratumSessions.push_back(shared_from_this());
+        fSubscribed = true;
+        if (!vStratumJobs.empty())
+            job = vStratumJobs.back();
+    }
+    if (job)
+        Notify(*job, true);
+}
+
+void CStratumSession::Submit(const Value& id, const Array& params)
+{
+    if (!fSubscribed)
+        return Reply(id, false, StratumError(STRATUM_ERROR_NOT_SUBSCRIBED, "Not subscribed"));
+    if (!fAuthorized)
+        return Reply(id, false, StratumError(STRATUM_ERROR_UNAUTHORIZED, "Unauthorized worker"));
+
+    // worker name, job id, extranonce2, ntime, nonce
+    unsigned int nExtraNonce2, nTime, nNonce;
+    if (params.size() < 5 || params[1].type() != str_type ||
+        !ParseStratumHex32(params[2], nExtraNonce2) ||
+        !ParseStratumHex32(params[3], nTime) ||
+        !ParseStratumHex32(params[4], nNonce))
+        return Reply(id, false, StratumError(STRATUM_ERROR_OTHER, "Invalid parameters"));
+
+    boost::shared_ptr<CStratumJob> job = StratumFindJob(params[1].get_str());
+    if (!job)
+        return Reply(id, false, StratumError(STRATUM_ERROR_JOB_NOT_FOUND, "Job not found"));
+    if (nTime < job->nMinTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        return Reply(id, false, StratumError(STRATUM_ERROR_OTHER, "ntime out of range"));
+
+    CStratumShare share;
+    share.session = shared_from_this();
+    share.job = job;
+    share.id = id;
+    share.vchCoinbase = job->vchCoinb1;
+    AppendStratumHex32(share.vchCoinbase, nExtraNonce1);
+    AppendStratumHex32(share.vchCoinbase, nExtraNonce2);
+    share.vchCoinbase.insert(share.vchCoinbase.end(), job->vchCoinb2.begin(), job->vchCoinb2.end());
+
+    const CBlock& block = job->pblocktemplate->block;
+    uint256 hashCoinbase = Hash(share.vchCoinbase.begin(), share.vchCoinbase.end());
+    share.header.nVersion = block.nVersion;
+    share.header.hashPrevBlock = block.hashPrevBlock;
+    share.header.hashMerkleRoot = CBlock::CheckMerkleBranch(hashCoinbase, job->vMerkleBranch, 0);
+    share.header.nTime = nTime;
+    share.header.nBits = block.nBits;
+    share.header.nNonce = nNonce;
+
+    {
+        LOCK(cs_stratum);
+        if (!job->setSubmitted.insert(share.header.GetHash()).second)
+            return Reply(id, false, StratumError(STRATUM_ERROR_DUPLICATE, "Duplicate share"));
+    }
+
+    // The reply is sent by the share worker
+    boost::unique_lock<boost::mutex> lock(mutexStratumShares);
+    queueStratumShares.push_back(share);
+    condStratumShares.notify_one();
+}
+
+bool StratumNewJob(bool fClean)
+{
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptStratumPayout);
+    if (!pblocktemplate)
+        return false;
+
+    const CBlockIndex* pindexPrev;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(pblocktemplate->block.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+        {
+            delete pblocktemplate;
+            return false;
+        }
+        pindexPrev = mi->second;
+    }
+
+    unsigned int nId;
+    {
+        LOCK(cs_stratum);
+        nId = nStratumJobId++;
+    }
+    boost::shared_ptr<CStratumJob> job(new CStratumJob(pblocktemplate, nId, pindexPrev));
+
+    list<boost::shared_ptr<CStratumSession> > lSessions;
+    {
+        LOCK(cs_stratum);
+        if (fClean)
+            vStratumJobs.clear();
+        vStratumJobs.push_back(job);
+        while (vStratumJobs.size() > STRATUM_MAX_JOBS)
+            vStratumJobs.pop_front();
+        lSessions = lStratumSessions;
+    }
+    BOOST_FOREACH(const boost::shared_ptr<CStratumSession>& session, lSessions)
+        session->Notify(*job, fClean);
+    return true;
+}
+
+void StratumRemoveSession(CStratumSession* session)
+{
+    LOCK(cs_stratum);
+    for (list<boost::shared_ptr<CStratumSession> >::iterator it = lStratumSessions.begin(); it != lStratumSessions.end(); ++it)
+    {
+        if (it->get() == session)
+        {
+            lStratumSessions.erase(it);
+            return;
+        }
+    }
+}
+
+static bool SubmitStratumBlock(const CStratumShare& share)
+{
+    CBlock block(share.job->pblocktemplate->block);
+    CDataStream ssCoinbase(share.vchCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase >> block.vtx[0];
+    block.nTime = share.header.nTime;
+    block.nNonce = share.header.nNonce;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    assert(block.GetHash() == share.header.GetHash());
+
+    printf("StratumServer:\n");
+    printf("proof-of-work found  \n  hash: %s  \n", block.GetPoWHash().GetHex().c_str());
+    block.print();
+
+    LOCK(cs_main);
+    if (block.hashPrevBlock != hashBestChain)
+        return error("StratumServer : generated block is stale");
+
+    CValidationState state;
+    if (!ProcessBlock(state, NULL, &block))
+        return error("StratumServer : ProcessBlock, block not accepted");
+    return true;
+}
+
+static void CheckStratumShares(const vector<CStratumShare>& vShares)
+{
+    // Shares of one batch share nBits and so the scrypt parameters
+    unsigned int nCount = vShares.size();
+    vector<char> vHeaders(nCount * 80);
+    vector<uint256> vHashes(nCount);
+    for (unsigned int i = 0; i < nCount; i++)
+        memcpy(&vHeaders[i * 80], BEGIN(vShares[i].header.nVersion), 80);
+    hybridScryptHash256_batch(&vHeaders[0], (char*)&vHashes[0], nCount, vShares[0].header.nBits, false);
+
+    uint256 hashBlockTarget = uint256().SetCompact(vShares[0].header.nBits);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        const CStratumShare& share = vShares[i];
+        if (vHashes[i] > hashStratumShareTarget && vHashes[i] > hashBlockTarget)
+        {
+            share.session->Reply(share.id, false, StratumError(STRATUM_ERROR_LOW_DIFFICULTY, "Low difficulty share"));
+            continue;
+        }
+        share.session->Reply(share.id, true, Value::null);
+        if (vHashes[i] <= hashBlockTarget)
+            SubmitStratumBlock(share);
+    }
+}
+
+void static ThreadStratumShares()
+{
+    RenameThread("bitcoin-stratumsh");
+    scrypt_thread_arena();
+
+    vector<CStratumShare> vShares;
+    loop
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexStratumShares);
+            while (queueStratumShares.empty())
+                condStratumShares.wait(lock);
+            unsigned int nBits = queueStratumShares.front().header.nBits;
+            deque<CStratumShare>::iterator it = queueStratumShares.begin();
+            while (it != queueStratumShares.end() && vShares.size() < STRATUM_SHARE_BATCH)
+            {
+                if (it->header.nBits == nBits)
+                {
+                    vShares.push_back(*it);
+                    it = queueStratumShares.erase(it);
+                }
+                else
+                    ++it;
+            }
+        }
+        CheckStratumShares(vShares);
+        vShares.clear();
+    }
+}
+
+void static ThreadStratumNotify()
+{
+    RenameThread("bitcoin-stratum");
+
+    CBlockIndex* pindexLast = NULL;
+    unsigned int nTransactionsUpdatedLast = 0;
+    int64 nLastJob = 0;
+    loop
+    {
+        MilliSleep(250);
+        if (IsInitialBlockDownload())
+            continue;
+        bool fConnected;
+        {
+            LOCK(cs_vNodes);
+            fConnected = !vNodes.empty();
+        }
+        if (!fConnected)
+            continue;
+
+        // New block: clean job at once; new transactions: refresh at most once a minute
+        CBlockIndex* pindexTip = pindexBest;
+        unsigned int nTransactionsUpdatedTip = nTransactionsUpdated;
+        bool fClean = (pindexTip != pindexLast);
+        if (fClean || (nTransactionsUpdatedTip != nTransactionsUpdatedLast && GetTime() - nLastJob > 60))
+        {
+            // If no job could be made, try again on the next pass
+            if (!StratumNewJob(fClean))
+                continue;
+            pindexLast = pindexTip;
+            nTransactionsUpdatedLast = nTransactionsUpdatedTip;
+            nLastJob = GetTime();
+        }
+    }
+}
+
+//
+// TCP transport
+//
+
+class CStratumConnection : public CStratumSession
+{
+public:
+    asio::io_service& io_service;
+    asio::ip::tcp::socket socket;
+    asio::ip::tcp::endpoint peer;
+
+    CStratumConnection(asio::io_service& io_serviceIn) : io_service(io_serviceIn), socket(io_serviceIn), bufRead(STRATUM_MAX_LINE)
+    {
+    }
+
+    void Start()
+    {
+        Read();
+    }
+
+    void Send(const string& strLine)
+    {
+        io_service.post(boost::bind(&CStratumConnection::QueueSend, This(), strLine + "\n"));
+    }
+
+private:
+    asio::streambuf bufRead;
+    // Only touched by the io thread
+    deque<string> queueSend;
+
+    boost::shared_ptr<CStratumConnection> This()
+    {
+        return boost::static_pointer_cast<CStratumConnection>(shared_from_this());
+    }
+
+    void Close()
+    {
+        StratumRemoveSession(this);
+        boost::system::error_code ec;
+        socket.close(ec);
+    }
+
+    void Read()
+    {
+        asio::async_read_until(socket, bufRead, '\n',
+            boost::bind(&CStratumConnection::HandleRead, This(), asio::placeholders::error));
+    }
+
+    void HandleRead(const boost::system::error_code& error)
+    {
+        // Also fails on a line longer than STRATUM_MAX_LINE
+        if (error)
+        {
+            Close();
+            return;
+        }
+        istream is(&bufRead);
+        string strLine;
+        getline(is, strLine);
+        HandleLine(strLine);
+        if (socket.is_open())
+            Read();
+    }
+
+    void QueueSend(const string& strData)
+    {
+        if (!socket.is_open())
+            return;
+        if (queueSend.size() >= STRATUM_MAX_SEND_QUEUE)
+        {
+            Close();
+            return;
+        }
+        queueSend.push_back(strData);
+        if (queueSend.size() == 1)
+            Write();
+    }
+
+    void Write()
+    {
+        asio::async_write(socket, asio::buffer(queueSend.front()),
+            boost::bind(&CStratumConnection::HandleWrite, This(), asio::placeholders::error));
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            Close();
+            return;
+        }
+        queueSend.pop_front();
+        if (!queueSend.empty())
+            Write();
+    }
+};
+
+static bool StratumClientAllowed(const asio::ip::address& address)
+{
+    if (address.is_v4() && (address.to_v4().to_ulong() & 0xff000000) == 0x7f000000)
+        return true;
+
+    const string strAddress = address.to_string();
+    const vector<string>& vAllow = mapMultiArgs["-stratumallowip"];
+    BOOST_FOREACH(string strAllow, vAllow)
+        if (WildcardMatch(strAddress, strAllow))
+            return true;
+    return false;
+}
+
+static void StratumListen();
+
+static void StratumAcceptHandler(boost::shared_ptr<CStratumConnection> conn, const boost::system::error_code& error)
+{
+    if (error == asio::error::operation_aborted || !stratum_acceptor->is_open())
+        return;
+    StratumListen();
+    if (error)
+        return;
+    if (!StratumClientAllowed(conn->peer.address()))
+    {
+        boost::system::error_code ec;
+        conn->socket.close(ec);
+        return;
+    }
+    conn->Start();
+}
+
+static void StratumListen()
+{
+    boost::shared_ptr<CStratumConnection> conn(new CStratumConnection(*stratum_io_service));
+    stratum_acceptor->async_accept(conn->socket, conn->peer,
+        boost::bind(&StratumAcceptHandler, conn, asio::placeholders::error));
+}
+
+void static ThreadStratumIO()
+{
+    RenameThread("bitcoin-stratumio");
+    stratum_io_service->run();
+}
+
+bool StartStratumServer(const CScript& scriptPayout, double dDifficulty, int nPort, int nThreads)
+{
+    assert(stratumThreads == NULL);
+    scriptStratumPayout = scriptPayout;
+    dStratumDifficulty = dDifficulty;
+    hashStratumShareTarget = StratumShareTarget(dDifficulty);
+
+    if (nPort != 0)
+    {
+        // Only listen on loopback unless other clients are allowed
+        stratum_io_service = new asio::io_service();
+        stratum_acceptor = new asio::ip::tcp::acceptor(*stratum_io_service);
+        asio::ip::address bindAddress = mapArgs.count("-stratumallowip") ? asio::ip::address_v4::any() : asio::ip::address_v4::loopback();
+        asio::ip::tcp::endpoint endpoint(bindAddress, nPort);
+        boost::system::error_code ec;
+        stratum_acceptor->open(endpoint.protocol(), ec);
+        if (!ec)
+            stratum_acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+        if (!ec)
+            stratum_acceptor->bind(endpoint, ec);
+        if (!ec)
+            stratum_acceptor->listen(asio::socket_base::max_connections, ec);
+        if (ec)
+        {
+            printf("StartStratumServer : unable to bind to port %d: %s\n", nPort, ec.message().c_str());
+            delete stratum_acceptor;
+            stratum_acceptor = NULL;
+            delete stratum_io_service;
+            stratum_io_service = NULL;
+            return false;
+        }
+        StratumListen();
+    }
+
+    stratumThreads = new boost::thread_group();
+    for (int i = 0; i < std::max(nThreads, 1); i++)
+        stratumThreads->create_thread(&ThreadStratumShares);
+    stratumThreads->create_thread(&ThreadStratumNotify);
+    if (stratum_io_service)
+        stratumThreads->create_thread(&ThreadStratumIO);
+    return true;
+}
+
+void StopStratumServer()
+{
+    if (stratumThreads == NULL)
+        return;
+
+    if (stratum_io_service)
+    {
+        boost::system::error_code ec;
+        stratum_acceptor->close(ec);
+        stratum_io_service->stop();
+    }
+    stratumThreads->interrupt_all();
+    stratumThreads->join_all();
+    delete stratumThreads;
+    stratumThreads = NULL;
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStratumShares);
+        queueStratumShares.clear();
+    }
+    {
+        LOCK(cs_stratum);
+        lStratumSessions.clear();
+        vStratumJobs.clear();
+    }
+    delete stratum_acceptor;
+    stratum_acceptor = NULL;
+    delete stratum_io_service;
+    stratum_io_service = NULL;
+}
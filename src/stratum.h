@@ -0,0 +1,84 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include "script.h"
+#include "json/json_spirit_value.h"
+
+#include <string>
+#include <boost/enable_shared_from_this.hpp>
+
+/*
+ * Stratum mining server: line-delimited JSON over TCP.
+ *
+ * One job is built per block template and cached; every subscribed client
+ * gets the same mining.notify for it.  A client owns all extranonce2 values
+ * under its own 4-byte extranonce1, and builds the coinbase as
+ * coinb1 + extranonce1 + extranonce2 + coinb2.  Merkle branch entries are
+ * raw hashes; prevhash is sent as 8 big-endian words; version, nbits, ntime
+ * and nonce as big-endian 32-bit hex, as pool software expects.
+ *
+ * Shares are checked by a pool of worker threads that run the hybrid PoW
+ * hash in batches; shares that also meet the block target are submitted
+ * with ProcessBlock.
+ */
+
+/** Error codes of mining.submit, as used by pool software */
+enum StratumErrorCode
+{
+    STRATUM_ERROR_OTHER          = 20,
+    STRATUM_ERROR_JOB_NOT_FOUND  = 21,
+    STRATUM_ERROR_DUPLICATE      = 22,
+    STRATUM_ERROR_LOW_DIFFICULTY = 23,
+    STRATUM_ERROR_UNAUTHORIZED   = 24,
+    STRATUM_ERROR_NOT_SUBSCRIBED = 25,
+};
+
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+
+class CStratumJob;
+
+/** One stratum client.  The transport delivers lines to HandleLine and implements Send. */
+class CStratumSession : public boost::enable_shared_from_this<CStratumSession>
+{
+public:
+    CStratumSession();
+    virtual ~CStratumSession() {}
+
+    /** Handle one JSON request from the client */
+    void HandleLine(const std::string& strLine);
+    /** Send a job to the client */
+    void Notify(const CStratumJob& job, bool fClean);
+    /** Send a JSON reply */
+    void Reply(const json_spirit::Value& id, const json_spirit::Value& result, const json_spirit::Value& error);
+    /** Queue one line of JSON (without newline) for the client; may be called from any thread */
+    virtual void Send(const std::string& strLine) = 0;
+
+    unsigned int GetExtraNonce1() const { return nExtraNonce1; }
+
+private:
+    unsigned int nExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+
+    void Subscribe(const json_spirit::Value& id);
+    void Submit(const json_spirit::Value& id, const json_spirit::Array& params);
+};
+
+/** Share target of a stratum difficulty; difficulty 1 is nBits 0x1d00ffff, as in getdifficulty */
+uint256 StratumShareTarget(double dDifficulty);
+/**
+ * Start the share workers and the job notifier, and listen on nPort if it
+ * is not 0.  Coinbases of all jobs pay to scriptPayout.
+ */
+bool StartStratumServer(const CScript& scriptPayout, double dDifficulty, int nPort, int nThreads);
+void StopStratumServer();
+/** Build a job from a new block template and send it to every client; fClean drops the older jobs */
+bool StratumNewJob(bool fClean);
+/** Forget a disconnected client */
+void StratumRemoveSession(CStratumSession* session);
+
+#endif
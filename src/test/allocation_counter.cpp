@@ -0,0 +1,52 @@
+// Global operator new and delete, counting allocations for script_tests.
+// They live in their own file so that no caller can inline them.
+#include <cstdlib>
+#include <new>
+
+#include "uint256.h"
+
+// Allocations made while fCountAllocations is set
+bool fCountAllocations = false;
+uint64 nAllocations = 0;
+
+static void *CountedAlloc(size_t nSize)
+{
+    if (fCountAllocations)
+        nAllocations++;
+    void *p = malloc(nSize ? nSize : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t nSize)
+{
+    return CountedAlloc(nSize);
+}
+
+void *operator new[](size_t nSize)
+{
+    return CountedAlloc(nSize);
+}
+
+void operator delete(void *p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+    free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void *p, size_t nSize) throw()
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t nSize) throw()
+{
+    free(p);
+}
+#endif
@@ -0,0 +1,462 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+using namespace std;
+
+// Coins view that stores everything in a map, as the database would
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    map<uint256, CCoins> mapCoins;
+    CBlockIndex *pindexBest;
+    unsigned int nWrites;
+    unsigned int nReads;
+    // Held by a test to stall BatchWrite
+    boost::mutex mutexWrite;
+
+    CCoinsViewTest() : pindexBest(NULL), nWrites(0), nReads(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        nReads++;
+        map<uint256, CCoins>::iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        return mapCoins.count(txid) > 0;
+    }
+
+    CBlockIndex *GetBestBlock() { return pindexBest; }
+
+    bool BatchWrite(CCoinsMap &mapIn, CBlockIndex *pindex)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWrite);
+        for (CCoinsMap::iterator it = mapIn.begin(); it != mapIn.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            nWrites++;
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+        }
+        pindexBest = pindex;
+        return true;
+    }
+};
+
+// Exposes the cache contents to check the memory accounting
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView &base) : CCoinsViewCache(base, true) {}
+
+    const CCoinsCacheEntry *GetEntry(const uint256 &txid) const
+    {
+        CCoinsMap::const_iterator it = cacheCoins.find(txid);
+        return it == cacheCoins.end() ? NULL : &it->second;
+    }
+
+    // The tracked usage must be the outputs plus the same overhead for every entry
+    void CheckUsage()
+    {
+        GetCacheUsage();
+        size_t nOutputs = 0;
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+            nOutputs += it->second.coins.DynamicMemoryUsage();
+        BOOST_REQUIRE(nCacheUsage >= nOutputs);
+        if (cacheCoins.empty()) {
+            BOOST_CHECK_EQUAL(nCacheUsage, 0u);
+        } else {
+            BOOST_CHECK_EQUAL((nCacheUsage - nOutputs) % cacheCoins.size(), 0u);
+            BOOST_CHECK((nCacheUsage - nOutputs) / cacheCoins.size() >= sizeof(CCoinsMap::value_type));
+        }
+    }
+};
+
+static CCoins RandomCoins(bool fCoinBase)
+{
+    CCoins coins;
+    coins.fCoinBase = fCoinBase;
+    coins.nHeight = GetRandInt(1000);
+    coins.nVersion = 1;
+    coins.vout.resize(1 + GetRandInt(4));
+    BOOST_FOREACH(CTxOut &out, coins.vout) {
+        out.nValue = 1 + GetRandInt(100000);
+        out.scriptPubKey = CScript() << OP_DUP << vector<unsigned char>(GetRandInt(40), 0x42);
+    }
+    return coins;
+}
+
+// Coins with a spent output in the middle, for the database tests. Per-output
+// records use the undo encoding, which keeps nVersion only for a nonzero height.
+static CCoins RandomDBCoins()
+{
+    CCoins coins = RandomCoins(GetRandInt(5) == 0);
+    coins.nHeight = 1 + GetRandInt(1000);
+    coins.vout.resize(3 + GetRandInt(4), coins.vout[0]);
+    coins.vout[1].SetNull();
+    return coins;
+}
+
+// Write coins to the database in one batch, as a cache flush would
+static void WriteDBCoins(CCoinsViewDB &db, const map<uint256, CCoins> &mapCoins)
+{
+    CCoinsMap mapWrite;
+    for (map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        CCoinsCacheEntry &entry = mapWrite[it->first];
+        entry.coins = it->second;
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+    }
+    BOOST_CHECK(db.BatchWrite(mapWrite, pindexGenesisBlock));
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+// Random changes through a stack of caches must give the same result as a plain map
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    CCoinsViewTest base;
+    map<uint256, CCoins> mapResult;
+    vector<uint256> vTxids;
+    for (int i = 0; i < 200; i++)
+        vTxids.push_back(GetRandHash());
+
+    for (int nRound = 0; nRound < 20; nRound++) {
+        CCoinsViewCacheTest tip(base);
+        for (int nBlock = 0; nBlock < 10; nBlock++) {
+            CCoinsViewCacheTest view(static_cast<CCoinsView&>(tip));
+            for (int i = 0; i < 100; i++) {
+                const uint256 &txid = vTxids[GetRandInt(vTxids.size())];
+                map<uint256, CCoins>::iterator it = mapResult.find(txid);
+                bool fHave = it != mapResult.end() && !it->second.IsPruned();
+                switch (GetRandInt(3)) {
+                case 0:
+                    // create coins, as a new transaction would
+                    if (!fHave) {
+                        CCoins coins = RandomCoins(GetRandInt(2) == 0);
+                        view.SetCoins(txid, coins);
+                        mapResult[txid] = coins;
+                    }
+                    break;
+                case 1:
+                    // spend an output
+                    if (fHave) {
+                        BOOST_REQUIRE(view.HaveCoins(txid));
+                        CCoins &coins = view.GetCoins(txid);
+                        BOOST_CHECK(coins == it->second);
+                        CTxInUndo undo;
+                        coins.Spend(COutPoint(txid, GetRandInt(coins.vout.size())), undo);
+                        it->second = coins;
+                    }
+                    break;
+                default:
+                    // read without modifying
+                    if (fHave)
+                        BOOST_CHECK(view.AccessCoins(txid) == it->second);
+                    else
+                        BOOST_CHECK(!view.HaveCoins(txid) || view.AccessCoins(txid).IsPruned());
+                    break;
+                }
+            }
+            view.CheckUsage();
+            BOOST_CHECK(view.Flush());
+            BOOST_CHECK_EQUAL(view.GetCacheSize(), 0u);
+        }
+        tip.CheckUsage();
+        BOOST_CHECK(tip.Flush());
+
+        // The base now holds exactly the unspent coins
+        for (map<uint256, CCoins>::iterator it = mapResult.begin(); it != mapResult.end(); it++) {
+            CCoins coins;
+            if (it->second.IsPruned())
+                BOOST_CHECK(!base.GetCoins(it->first, coins) || coins.IsPruned());
+            else
+                BOOST_CHECK(base.GetCoins(it->first, coins) && coins == it->second);
+        }
+    }
+}
+
+// Coins that are read but not modified are not written back
+BOOST_AUTO_TEST_CASE(coins_cache_dirty)
+{
+    CCoinsViewTest base;
+    uint256 txid = GetRandHash();
+    base.mapCoins[txid] = RandomCoins(false);
+
+    {
+        CCoinsViewCache view(base);
+        BOOST_CHECK(view.HaveCoins(txid));
+        BOOST_CHECK(view.AccessCoins(txid) == base.mapCoins[txid]);
+        BOOST_CHECK(view.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 0u);
+    }
+
+    // Coins created and spent in a cache never reach the cache below
+    {
+        CCoinsViewCache tip(base);
+        CCoinsViewCache view(tip, true);
+        uint256 txidNew = GetRandHash();
+        view.SetCoins(txidNew, RandomCoins(false));
+        view.GetCoins(txidNew) = CCoins();
+        BOOST_CHECK(view.Flush());
+        BOOST_CHECK_EQUAL(tip.GetCacheSize(), 0u);
+        BOOST_CHECK(tip.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 0u);
+    }
+
+    // Spending grows the write set; memory use follows the outputs
+    {
+        CCoinsViewCache view(base);
+        size_t nEmpty = view.GetCacheUsage();
+        BOOST_CHECK(view.HaveCoins(txid));
+        size_t nLoaded = view.GetCacheUsage();
+        BOOST_CHECK(nLoaded > nEmpty);
+        CCoins().swap(view.GetCoins(txid));
+        BOOST_CHECK(view.GetCacheUsage() < nLoaded);
+        BOOST_CHECK(view.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 1u);
+        BOOST_CHECK(!base.HaveCoins(txid));
+    }
+}
+
+// Prefetched coins are served from the cache, through every level
+BOOST_AUTO_TEST_CASE(coins_cache_prefetch)
+{
+    CCoinsViewTest base;
+    vector<uint256> vTxids;
+    for (int i = 0; i < 3; i++) {
+        vTxids.push_back(GetRandHash());
+        base.mapCoins[vTxids[i]] = RandomCoins(false);
+    }
+    uint256 txidMissing = GetRandHash();
+
+    CCoinsViewCache tip(base);
+    CCoinsViewCache view(tip, true);
+    BOOST_CHECK(view.HaveCoins(vTxids[0]));
+    BOOST_CHECK_EQUAL(base.nReads, 1u);
+
+    vector<uint256> vPrefetch(vTxids);
+    vPrefetch.push_back(txidMissing);
+    vPrefetch.push_back(vTxids[1]);
+    view.PrefetchCoins(vPrefetch);
+    BOOST_CHECK_EQUAL(base.nReads, 5u);
+    BOOST_CHECK_EQUAL(view.GetCacheSize(), 3u);
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 3u);
+
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(view.AccessCoins(vTxids[i]) == base.mapCoins[vTxids[i]]);
+    BOOST_CHECK(!view.HaveCoins(txidMissing));
+    BOOST_CHECK_EQUAL(base.nReads, 6u);
+}
+
+// The base records which outputs were unspent below, so only changes are written
+BOOST_AUTO_TEST_CASE(coins_cache_base)
+{
+    CCoinsViewTest base;
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomCoins(false);
+    coins.vout.resize(70, coins.vout[0]);
+    coins.vout[1].SetNull();
+    base.mapCoins[txid] = coins;
+
+    CCoinsViewCacheTest tip(base);
+    CCoinsViewCache view(tip, true);
+    CTxInUndo undo;
+    view.GetCoins(txid).Spend(COutPoint(txid, 2), undo);
+    BOOST_CHECK(view.Flush());
+
+    const CCoinsCacheEntry *pentry = tip.GetEntry(txid);
+    BOOST_REQUIRE(pentry != NULL);
+    BOOST_CHECK(pentry->IsBaseUnspent(0));
+    BOOST_CHECK(!pentry->IsBaseUnspent(1));
+    BOOST_CHECK(pentry->IsBaseUnspent(2));
+    BOOST_CHECK(!pentry->coins.IsAvailable(2));
+    BOOST_CHECK(pentry->IsBaseUnspent(69));
+    BOOST_CHECK(!pentry->IsBaseUnspent(70));
+}
+
+// The statistics of a set do not depend on how it was reached
+BOOST_AUTO_TEST_CASE(coins_stats_delta)
+{
+    CAutoBN_CTX pctx;
+    vector<pair<uint256, CCoins> > vCoins;
+    for (int i = 0; i < 20; i++)
+        vCoins.push_back(make_pair(GetRandHash(), RandomCoins(i % 5 == 0)));
+
+    CCoinsStatsDelta deltaForward;
+    int64 nSize = 0;
+    for (unsigned int i = 0; i < vCoins.size(); i++) {
+        deltaForward.Update(vCoins[i].first, CCoins(), vCoins[i].second, pctx);
+        nSize += 32 + ::GetSerializeSize(vCoins[i].second, SER_DISK, CLIENT_VERSION);
+    }
+    BOOST_CHECK_EQUAL(deltaForward.nTransactions, 20);
+    BOOST_CHECK_EQUAL(deltaForward.nSerializedSize, nSize);
+
+    // reverse order, spending and restoring an output on the way
+    CCoinsStatsDelta deltaBackward;
+    for (unsigned int i = vCoins.size(); i-- > 0;) {
+        const uint256 &txid = vCoins[i].first;
+        const CCoins &coins = vCoins[i].second;
+        deltaBackward.Update(txid, CCoins(), coins, pctx);
+        CCoins coinsSpent(coins);
+        CTxInUndo undo;
+        coinsSpent.Spend(COutPoint(txid, 0), undo);
+        deltaBackward.Update(txid, coins, coinsSpent, pctx);
+        deltaBackward.Update(txid, coinsSpent, coins, pctx);
+    }
+
+    CCoinsStats statsForward, statsBackward;
+    statsForward.Apply(deltaForward, pctx);
+    statsBackward.Apply(deltaBackward, pctx);
+    BOOST_CHECK_EQUAL(statsForward.nTransactions, statsBackward.nTransactions);
+    BOOST_CHECK_EQUAL(statsForward.nTransactionOutputs, statsBackward.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(statsForward.nSerializedSize, statsBackward.nSerializedSize);
+    BOOST_CHECK_EQUAL(statsForward.nTotalAmount, statsBackward.nTotalAmount);
+    BOOST_CHECK(statsForward.hashSet.Finalize() == statsBackward.hashSet.Finalize());
+
+    // spending any output changes the hash
+    CCoinsStatsDelta deltaSpend;
+    CCoins coinsSpent(vCoins[3].second);
+    CTxInUndo undo;
+    coinsSpent.Spend(COutPoint(vCoins[3].first, 0), undo);
+    deltaSpend.Update(vCoins[3].first, vCoins[3].second, coinsSpent, pctx);
+    statsBackward.Apply(deltaSpend, pctx);
+    BOOST_CHECK(statsForward.hashSet.Finalize() != statsBackward.hashSet.Finalize());
+    BOOST_CHECK_EQUAL(statsBackward.nTotalAmount, statsForward.nTotalAmount - vCoins[3].second.vout[0].nValue);
+
+    // and removing everything gives the hash of the empty set
+    CCoinsStatsDelta deltaEmpty;
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        deltaEmpty.Update(vCoins[i].first, vCoins[i].second, CCoins(), pctx);
+    statsForward.Apply(deltaEmpty, pctx);
+    BOOST_CHECK_EQUAL(statsForward.nTransactions, 0u);
+    BOOST_CHECK_EQUAL(statsForward.nSerializedSize, 0u);
+    BOOST_CHECK(statsForward.hashSet.Finalize() == CMuHash3072().Finalize());
+}
+
+// Flushed coins stay readable while the writer thread stores them
+BOOST_AUTO_TEST_CASE(coins_writer)
+{
+    CCoinsViewTest base;
+    CBlockIndex index;
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomCoins(false);
+    {
+        CCoinsViewWriter writer(base);
+        CCoinsViewCache tip(writer);
+        {
+            boost::unique_lock<boost::mutex> lock(base.mutexWrite);
+            tip.SetCoins(txid, coins);
+            tip.SetBestBlock(&index);
+            BOOST_CHECK(tip.Flush());
+            BOOST_CHECK_EQUAL(tip.GetCacheSize(), 0u);
+
+            // not on disk yet, but visible through the writer
+            BOOST_CHECK(!base.HaveCoins(txid));
+            BOOST_CHECK(base.GetBestBlock() == NULL);
+            BOOST_CHECK(writer.GetBestBlock() == &index);
+            BOOST_CHECK(tip.AccessCoins(txid) == coins);
+        }
+        BOOST_CHECK(writer.Sync());
+        BOOST_CHECK(base.HaveCoins(txid));
+        BOOST_CHECK(base.GetBestBlock() == &index);
+        BOOST_CHECK(writer.GetBestBlock() == &index);
+
+        // A batch still pending on destruction is written
+        tip.GetCoins(txid) = CCoins();
+        BOOST_CHECK(tip.Flush());
+    }
+    BOOST_CHECK(!base.HaveCoins(txid));
+}
+
+
+// Per-output records read back as the coins written, as outputs are spent
+BOOST_AUTO_TEST_CASE(coins_db_peroutput)
+{
+    CCoinsViewDB db(1 << 20, true);
+    BOOST_CHECK(db.SetPerOutput(true));
+    uint256 txid = GetRandHash();
+    CCoins coins = RandomDBCoins();
+    CCoins coinsRead;
+    BOOST_CHECK(db.SetCoins(txid, coins));
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+    BOOST_CHECK(!coinsRead.IsAvailable(1));
+
+    // spending the last output shortens the coins read back
+    coins.Spend(coins.vout.size() - 1);
+    BOOST_CHECK(db.SetCoins(txid, coins));
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+
+    // a flush only writes the outputs that changed
+    {
+        CCoinsViewCache view(db);
+        view.GetCoins(txid).Spend(0);
+        BOOST_CHECK(view.Flush());
+    }
+    coins.Spend(0);
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+    BOOST_CHECK(db.HaveCoins(txid));
+
+    // once pruned, no record is left
+    for (unsigned int i = coins.vout.size(); i-- > 0;)
+        coins.Spend(i);
+    BOOST_CHECK(coins.IsPruned());
+    BOOST_CHECK(db.SetCoins(txid, coins));
+    BOOST_CHECK(!db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(!db.HaveCoins(txid));
+}
+
+// Converting between the layouts keeps every coin and the statistics; more
+// transactions than fit in one conversion batch
+BOOST_AUTO_TEST_CASE(coins_db_convert)
+{
+    CCoinsViewDB db(1 << 22, true);
+    map<uint256, CCoins> mapCoins;
+    for (int i = 0; i < 12000; i++)
+        mapCoins[GetRandHash()] = RandomDBCoins();
+    WriteDBCoins(db, mapCoins);
+
+    CCoinsStats statsTx;
+    BOOST_REQUIRE(db.GetStats(statsTx));
+    BOOST_CHECK_EQUAL(statsTx.nTransactions, 12000u);
+
+    for (int nPass = 0; nPass < 2; nPass++) {
+        bool fPerOutput = (nPass == 0);
+        BOOST_CHECK(db.SetPerOutput(fPerOutput));
+        BOOST_CHECK(db.IsPerOutput() == fPerOutput);
+
+        unsigned int nMismatch = 0;
+        for (map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            CCoins coinsRead;
+            if (!db.GetCoins(it->first, coinsRead) || coinsRead != it->second)
+                nMismatch++;
+        }
+        BOOST_CHECK_EQUAL(nMismatch, 0u);
+
+        // records left in the other layout would be counted twice
+        CCoinsStats stats;
+        BOOST_REQUIRE(db.GetStats(stats));
+        BOOST_CHECK(stats.hashBlock == statsTx.hashBlock);
+        BOOST_CHECK_EQUAL(stats.nTransactions, statsTx.nTransactions);
+        BOOST_CHECK_EQUAL(stats.nTransactionOutputs, statsTx.nTransactionOutputs);
+        BOOST_CHECK_EQUAL(stats.nSerializedSize, statsTx.nSerializedSize);
+        BOOST_CHECK_EQUAL(stats.nTotalAmount, statsTx.nTotalAmount);
+        BOOST_CHECK(stats.hashSerialized == statsTx.hashSerialized);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -205,6 +205,160 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         delete tx;
 }
 
+BOOST_AUTO_TEST_CASE(mempool_template_index)
+{
+    CTxMemPoolInfo info;
+    info.nTxSize = 250;
+    info.dChainValue = 10 * COIN;
+    info.dChainValueHeight = 10.0 * COIN * 5;
+    BOOST_CHECK(info.GetPriority(9) == 10.0 * COIN * (9 - 5 + 1) / 250);
+
+    // A pool transaction funds a child that pays a fee of 1 coin
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout.hash = 1;
+    txParent.vin[0].prevout.n = 0;
+    txParent.vin[0].scriptSig = CScript() << OP_1;
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = 50 * COIN;
+    txParent.vout[0].scriptPubKey = CScript() << OP_1;
+    uint256 hashParent = txParent.GetHash();
+    CTransaction txChild(txParent);
+    txChild.vin[0].prevout.hash = hashParent;
+    txChild.vout[0].nValue = 49 * COIN;
+    uint256 hashChild = txChild.GetHash();
+    unsigned int nChildSize = ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION);
+
+    LOCK(mempool.cs);
+    mempool.addUnchecked(hashChild, txChild);
+    BOOST_CHECK(mempool.mapInfo[hashChild].dFeePerKb < 0);
+
+    // Adding the parent updates the child that spends it
+    mempool.addUnchecked(hashParent, txParent);
+    BOOST_CHECK_EQUAL(mempool.mapInfo[hashChild].nTxSize, nChildSize);
+    BOOST_CHECK(mempool.mapInfo[hashChild].dFeePerKb == double(COIN) / (double(nChildSize)/1000.0));
+    BOOST_CHECK_EQUAL(mempool.setTxByFee.size(), 2U);
+    BOOST_CHECK(mempool.setTxByFee.rbegin()->second == hashChild);
+
+    // Neither has confirmed inputs
+    mempool.UpdatePriorityIndex(pindexBest->nHeight);
+    BOOST_CHECK_EQUAL(mempool.setTxByPriority.size(), 2U);
+    BOOST_CHECK(mempool.mapInfo[hashChild].dPriority == 0);
+
+    // The child stays when its parent leaves, and loses the parent's value
+    mempool.remove(txParent);
+    BOOST_CHECK(!mempool.mapInfo.count(hashParent));
+    BOOST_CHECK_EQUAL(mempool.setTxByFee.size(), 1U);
+    BOOST_CHECK_EQUAL(mempool.setTxByPriority.size(), 1U);
+    BOOST_CHECK(mempool.mapInfo[hashChild].dFeePerKb < 0);
+
+    mempool.addUnchecked(hashParent, txParent);
+    mempool.remove(txParent, true);
+    BOOST_CHECK(mempool.mapTx.empty());
+    BOOST_CHECK(mempool.mapInfo.empty());
+    BOOST_CHECK(mempool.setTxByFee.empty());
+    BOOST_CHECK(mempool.setTxByPriority.empty());
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_large_mempool)
+{
+    // 10000 transactions with different fees spending the outputs of a
+    // confirmed transaction
+    const unsigned int nTx = 10000;
+    uint256 hashFund = GetRandHash();
+    CCoins coinsFund;
+    coinsFund.nVersion = 1;
+    coinsFund.nHeight = pindexBest->nHeight;
+    coinsFund.vout.resize(nTx);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        coinsFund.vout[i].nValue = COIN;
+        coinsFund.vout[i].scriptPubKey = CScript() << OP_1;
+    }
+    pcoinsTip->SetCoins(hashFund, coinsFund);
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hashFund;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        tx.vin[0].prevout.n = i;
+        tx.vout[0].nValue = COIN - (i + 1) * 1000;
+        mempool.addUnchecked(tx.GetHash(), tx);
+    }
+    BOOST_CHECK_EQUAL(mempool.setTxByFee.size(), nTx);
+
+    // Fill a 100kB block by fee alone; the transactions all have the same size
+    mapArgs["-blockmaxsize"] = "100000";
+    mapArgs["-blockprioritysize"] = "0";
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nSelected = (100000 - 1000 - 1) / nTxSize;
+
+    // The second template reuses the priority index of the first
+    CBlockTemplate *pblocktemplate;
+    int64 nStart = GetTimeMicros();
+    BOOST_REQUIRE(pblocktemplate = CreateNewBlock(CScript() << OP_1));
+    delete pblocktemplate;
+    int64 nFirst = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    BOOST_REQUIRE(pblocktemplate = CreateNewBlock(CScript() << OP_1));
+    int64 nSecond = GetTimeMicros() - nStart;
+    BOOST_TEST_MESSAGE(strprintf("CreateNewBlock with %u pool transactions: %.2fms, then %.2fms",
+                                 nTx, 0.001 * nFirst, 0.001 * nSecond));
+
+    // The best paying transactions, best first, and only about a block's
+    // worth of the pool looked at
+    const CBlock &block = pblocktemplate->block;
+    BOOST_CHECK_EQUAL(block.vtx.size(), nSelected + 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        BOOST_CHECK_EQUAL(block.vtx[i].vin[0].prevout.n, nTx - i);
+        BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[i], (int64)(nTx - i + 1) * 1000);
+    }
+    BOOST_CHECK(nLastBlockTxSeen >= nSelected);
+    BOOST_CHECK(nLastBlockTxSeen <= nSelected + 50);
+    delete pblocktemplate;
+
+    mapArgs.erase("-blockmaxsize");
+    mapArgs.erase("-blockprioritysize");
+    pcoinsTip->SetCoins(hashFund, CCoins());
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(hybrid_miner_scan)
+{
+    // The miner must search with the consensus hash: a share it finds has to
+    // be reproduced by GetPoWHash, which is what CheckProofOfWork is fed.
+    // The block target itself is far too hard to hit here, so search for a
+    // share at an easy target instead.
+    CBlock header;
+    header.nVersion = 2;
+    header.hashPrevBlock = Hash(BEGIN(header.nVersion), END(header.nVersion));
+    header.hashMerkleRoot = Hash(BEGIN(header.hashPrevBlock), END(header.hashPrevBlock));
+    header.nTime = 1380000000;
+    header.nBits = CBigNum(~uint256(0) >> 23).GetCompact();
+    header.nNonce = 0;
+
+    uint256 hashShareTarget = ~uint256(0) >> 2;
+    HybridScryptMidstate midstate;
+    uint256 hashFound;
+    unsigned int nHashesDone = 0;
+    BOOST_REQUIRE(ScanHybridHash(&header, midstate, hashShareTarget, 64, nHashesDone, hashFound));
+    BOOST_CHECK(nHashesDone == header.nNonce + 1);
+    BOOST_CHECK(hashFound <= hashShareTarget);
+    BOOST_CHECK(header.GetPoWHash() == hashFound);
+
+    // Nothing meets a zero target: every nonce is tried and skipped
+    unsigned int nNonce = header.nNonce;
+    BOOST_CHECK(!ScanHybridHash(&header, midstate, 0, 8, nHashesDone, hashFound));
+    BOOST_CHECK(nHashesDone == 8);
+    BOOST_CHECK(header.nNonce == nNonce + 8);
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
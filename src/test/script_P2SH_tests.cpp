@@ -12,7 +12,7 @@
 using namespace std;
 
 // Test routines internal to script.cpp:
-extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache);
 
 // Helpers:
 static std::vector<unsigned char>
@@ -19,7 +19,7 @@ using namespace std;
 using namespace json_spirit;
 using namespace boost::algorithm;
 
-extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache);
 
 static const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
 
@@ -117,6 +117,19 @@ read_json(const std::string& filename)
     return v.get_array();
 }
 
+// Allocations made while fCountAllocations is set, see allocation_counter.cpp
+extern bool fCountAllocations;
+extern uint64 nAllocations;
+
+// Number of opcodes EvalScript reads from script, executed or not
+static unsigned int CountOps(const CScript &script)
+{
+    unsigned int nOps = 0;
+    opcodetype opcode;
+    for (CScript::const_iterator pc = script.begin(); pc < script.end() && script.GetOp(pc, opcode); nOps++);
+    return nOps;
+}
+
 BOOST_AUTO_TEST_SUITE(script_tests)
 
 BOOST_AUTO_TEST_CASE(script_valid)
@@ -171,6 +184,104 @@ BOOST_AUTO_TEST_CASE(script_invalid)
     }
 }
 
+BOOST_AUTO_TEST_CASE(script_valid_allocations)
+{
+    // How often the interpreter allocates per opcode, over script_valid.json
+    Array tests = read_json("script_valid.json");
+    vector<pair<CScript, CScript> > vScripts;
+    uint64 nOps = 0;
+    BOOST_FOREACH(Value& tv, tests)
+    {
+        Array test = tv.get_array();
+        if (test.size() < 2)
+            continue;
+        CScript scriptSig = ParseScript(test[0].get_str());
+        CScript scriptPubKey = ParseScript(test[1].get_str());
+        nOps += CountOps(scriptSig) + CountOps(scriptPubKey);
+        if (scriptPubKey.IsPayToScriptHash()) {
+            // the serialized script runs too
+            vector<unsigned char> vch, vchLast;
+            opcodetype opcode;
+            for (CScript::const_iterator pc = scriptSig.begin(); pc < scriptSig.end() && scriptSig.GetOp(pc, opcode, vch);)
+                vchLast.swap(vch);
+            nOps += CountOps(CScript(vchLast.begin(), vchLast.end()));
+        }
+        vScripts.push_back(make_pair(scriptSig, scriptPubKey));
+    }
+
+    CTransaction tx;
+    static const int nRounds = 20;
+    int64 nStart = GetTimeMicros();
+    nAllocations = 0;
+    fCountAllocations = true;
+    for (int n = 0; n < nRounds; n++)
+        for (unsigned int i = 0; i < vScripts.size(); i++)
+            VerifyScript(vScripts[i].first, vScripts[i].second, tx, 0, flags, SIGHASH_NONE);
+    fCountAllocations = false;
+    int64 nTime = GetTimeMicros() - nStart;
+    nOps *= nRounds;
+
+    BOOST_TEST_MESSAGE(strprintf("script_valid.json: %"PRI64u" opcodes, %"PRI64u" allocations (%.3f per opcode), %.1fns per opcode",
+                                 nOps, nAllocations, (double)nAllocations / nOps, nTime * 1000.0 / nOps));
+}
+
+// Allocations made by VerifyScript
+static uint64 CountVerifyAllocations(const CScript &scriptSig, const CScript &scriptPubKey)
+{
+    CTransaction tx;
+    nAllocations = 0;
+    fCountAllocations = true;
+    bool fValid = VerifyScript(scriptSig, scriptPubKey, tx, 0, flags, SIGHASH_NONE);
+    fCountAllocations = false;
+    BOOST_CHECK(fValid);
+    return nAllocations;
+}
+
+BOOST_AUTO_TEST_CASE(script_small_values_allocations)
+{
+    // Small values and arithmetic don't allocate: a longer script with the
+    // same stack depth allocates exactly as much as a short one, as long as
+    // both fit the decoder's inline opcodes
+    CScript scriptSig = CScript() << OP_1;
+    CScript scriptShort = CScript() << OP_1 << OP_ADD << OP_2 << OP_EQUAL;
+    CScript scriptLong;
+    for (int i = 0; i < 5; i++)
+        scriptLong << OP_1 << OP_ADD << OP_DUP << OP_DROP;
+    scriptLong << OP_6 << OP_EQUAL;
+    uint64 nShort = CountVerifyAllocations(scriptSig, scriptShort);
+    BOOST_CHECK_EQUAL(CountVerifyAllocations(scriptSig, scriptShort), nShort);
+    BOOST_CHECK_EQUAL(CountVerifyAllocations(scriptSig, scriptLong), nShort);
+}
+
+BOOST_AUTO_TEST_CASE(script_num)
+{
+    // CScriptNum encodes and decodes numbers as CBigNum does
+    static const int64 values[] = { 0, 1, -1, 2, 127, 128, -127, -128, 255, 256, -255, -256, 32767, 32768, -32768,
+                                    0x7fffff, 0x800000, -0x800000, 0x7fffffff, -0x7fffffff, 0x80000000LL,
+                                    0xfffffffeLL, 0xffffffffLL, -0xffffffffLL, 0x100000000LL };
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        vector<unsigned char> vch = CBigNum(values[i]).getvch();
+        BOOST_CHECK(CScriptNum(values[i]).getvch() == vch);
+        if (vch.size() <= CScriptNum::nMaxNumSize)
+            BOOST_CHECK_EQUAL(CScriptNum(vch).getint64(), values[i]);
+        else
+            BOOST_CHECK_THROW(CScriptNum(vch).getint64(), std::runtime_error);
+    }
+
+    // Operands need not be minimal, and can be negative zero
+    for (int i = 0; i < 1000; i++)
+    {
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vch(hash.begin(), hash.begin() + hash.begin()[31] % 5);
+        if (!vch.empty() && hash.begin()[30] & 1)
+            vch.back() &= 0x80;
+        CBigNum bn(vch);
+        BOOST_CHECK(CScriptNum(vch).getvch() == bn.getvch());
+        BOOST_CHECK_EQUAL(CScriptNum(vch).getint(), bn.getint());
+    }
+}
+
 BOOST_AUTO_TEST_CASE(script_PushData)
 {
     // Check that PUSHDATA1, PUSHDATA2, and PUSHDATA4 create the same value on
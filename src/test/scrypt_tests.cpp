@@ -30,4 +30,246 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(hybridscrypt_hashtest)
+{
+    // Reference hashes for a fixed header at several targets, each target selecting another parameter row
+    #define HYBRIDCOUNT 4
+    const char* headerhex = "030a11181f262d343b424950575e656c737a81888f969da4abb2b9c0c7ced5dce3eaf1f8ff060d141b222930373e454c535a61686f767d848b9299a0a7aeb5bcc3cad1d8dfe6edf4%08x171e252c";
+    const unsigned int nBits[HYBRIDCOUNT] = { 0x1b00ffff, 0x1c00ffff, 0x1d00ffff, 0x1e00ffff };
+    const char* expected[HYBRIDCOUNT] = { "a95e4e2cde53168e898f816521613b242ea165c9b40f6e95b569d0a71f7756a3", "1671d198e21fc746958b788f99dade9fa522fcc086acec4892c22549fcfb43a8", "6ced8178ea3910bbfecca83695acff05973d7fe006ab65076abd73fc6cc99329", "34cd823d4f914959cbbc5b239e9d1b8cfadafea052277945dbee67028372c5f6" };
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    for (int i = 0; i < HYBRIDCOUNT; i++) {
+        // nBits is stored little-endian in the header
+        std::vector<unsigned char> header = ParseHex(strprintf(headerhex, ByteReverse(nBits[i])));
+        uint256 hash;
+        hybridScryptHash256((const char*)&header[0], BEGIN(hash), nBits[i]);
+        BOOST_CHECK_EQUAL(hash.ToString().c_str(), expected[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_smix_kernels)
+{
+    // Every SIMD kernel must match the scalar smix bit for bit on every parameter row
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    scrypt_arena arena;
+    scrypt_arena_init(&arena);
+    for (int row = 0; row < hybridScryptParamCount(); row++) {
+        uint64_t N;
+        uint32_t r, p;
+        hybridScryptParams(row, N, r, p);
+        BOOST_REQUIRE(scrypt_arena_reserve(&arena, N, r, p) == 0);
+
+        std::vector<uint8_t> input(128 * r);
+        for (unsigned int i = 0; i < input.size(); i++)
+            input[i] = (uint8_t)(i * 31 + row);
+
+        std::vector<uint8_t> expected = input;
+        scrypt_smix_generic(&expected[0], r, N, arena.V, arena.XY);
+
+        std::vector<uint8_t> result = input;
+        scrypt_smix_detected(&result[0], r, N, arena.V, arena.XY);
+        BOOST_CHECK(result == expected);
+#if defined(USE_SSE2)
+        result = input;
+        scrypt_smix_sse2(&result[0], r, N, arena.V, arena.XY);
+        BOOST_CHECK(result == expected);
+#if defined(USE_AVX2)
+        if (scrypt_cpu_has_avx2()) {
+            result = input;
+            scrypt_smix_avx2(&result[0], r, N, arena.V, arena.XY);
+            BOOST_CHECK(result == expected);
+        }
+#endif
+#endif
+    }
+    scrypt_arena_free(&arena);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_smix_nway_kernels)
+{
+    // The multi-buffer kernels must match the scalar smix for every instance, on a sample of rows
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    std::vector<std::pair<int, void (*)(uint8_t *const *, size_t, uint64_t, uint8_t *, uint8_t *)> > kernels;
+    if (scrypt_smix_nway > 1)
+        kernels.push_back(std::make_pair(scrypt_smix_nway, scrypt_smix_nway_detected));
+#if defined(USE_SSE2)
+    kernels.push_back(std::make_pair(4, &scrypt_smix_sse2_4way));
+#if defined(USE_AVX2)
+    if (scrypt_cpu_has_avx2())
+        kernels.push_back(std::make_pair(8, &scrypt_smix_avx2_8way));
+#endif
+#endif
+    scrypt_arena arena;
+    scrypt_arena_init(&arena);
+    for (int row = 0; row < hybridScryptParamCount(); row += 30) {
+        uint64_t N;
+        uint32_t r, p;
+        hybridScryptParams(row, N, r, p);
+
+        for (unsigned int k = 0; k < kernels.size(); k++) {
+            int ways = kernels[k].first;
+            BOOST_REQUIRE(scrypt_arena_reserve_nway(&arena, N, r, ways, ways) == 0);
+
+            std::vector<uint8_t> input(128 * r * ways);
+            for (unsigned int i = 0; i < input.size(); i++)
+                input[i] = (uint8_t)(i * 7 + row);
+
+            std::vector<uint8_t> expected = input;
+            for (int n = 0; n < ways; n++)
+                scrypt_smix_generic(&expected[n * 128 * r], r, N, arena.V, arena.XY);
+
+            std::vector<uint8_t> result = input;
+            uint8_t *lanes[SCRYPT_MAX_NWAY];
+            for (int n = 0; n < ways; n++)
+                lanes[n] = &result[n * 128 * r];
+            kernels[k].second(lanes, r, N, arena.V, arena.XY);
+            BOOST_CHECK(result == expected);
+        }
+    }
+    scrypt_arena_free(&arena);
+}
+
+BOOST_AUTO_TEST_CASE(hybridscrypt_batch)
+{
+    // Consecutive nonces hashed in one batch, against hybridScryptHash256 results
+    #define BATCHCOUNT 6
+    const char* headerhex = "030a11181f262d343b424950575e656c737a81888f969da4abb2b9c0c7ced5dce3eaf1f8ff060d141b222930373e454c535a61686f767d848b9299a0a7aeb5bcc3cad1d8dfe6edf4%08x%08x";
+    const unsigned int nBits = 0x1c00ffff;
+    const char* expected[BATCHCOUNT] = { "140a68e0f781c5ee0e3bad720fc88e77f37ab098ad6d6a0f780471fefef2c8e8", "5f0f034523145c45c95766b6a4ab36d220b4e5d6e4cb4779653b4bceedef24d3", "52a258f3bf1b56d56883aee7c34c02435b18678e364905ccdb5266cd135f3ccb", "9133f54a97d5457f092857dd4e8e32a24b6bbcc8a647f3c73371e5f910bfb4d6", "6a1e24889136a30c8a58395b86e37a94fa1763905203b01bfd159696c62c3601", "59d1d834f04f37373172fdbedca878e89d952b67925cf740bc77ea56feae0f50" };
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    std::vector<unsigned char> headers;
+    for (unsigned int nNonce = 0; nNonce < BATCHCOUNT; nNonce++) {
+        std::vector<unsigned char> header = ParseHex(strprintf(headerhex, ByteReverse(nBits), nNonce));
+        headers.insert(headers.end(), header.begin(), header.end());
+    }
+
+    uint256 hashes[BATCHCOUNT];
+    hybridScryptHash256_batch((const char*)&headers[0], BEGIN(hashes[0]), BATCHCOUNT, nBits);
+    for (int i = 0; i < BATCHCOUNT; i++)
+        BOOST_CHECK_EQUAL(hashes[i].ToString().c_str(), expected[i]);
+
+    // now every header is cached; single hashes must agree
+    for (int i = 0; i < BATCHCOUNT; i++) {
+        uint256 hash;
+        hybridScryptHash256((const char*)&headers[i * 80], BEGIN(hash), nBits);
+        BOOST_CHECK(hash == hashes[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hybridscrypt_midstate)
+{
+    // Nonce and time sweeps reuse the first stage; results match full hashes
+    const char* headerhex = "030a11181f262d343b424950575e656c737a81888f969da4abb2b9c0c7ced5dce3eaf1f8ff060d141b222930373e454c535a61686f767d848b9299a0a7aeb5bcc3cad1d8%08x%08x%08x";
+    const unsigned int nBits = 0x1d00ffff;
+#if defined(USE_SSE2)
+    scrypt_detect_sse2();
+#endif
+    HybridScryptMidstate midstate;
+    for (unsigned int nTime = 0; nTime < 2; nTime++) {
+        std::vector<unsigned char> headers;
+        for (unsigned int nNonce = 0; nNonce < 3; nNonce++) {
+            std::vector<unsigned char> header = ParseHex(strprintf(headerhex, nTime, ByteReverse(nBits), nNonce));
+            headers.insert(headers.end(), header.begin(), header.end());
+        }
+
+        BOOST_REQUIRE(hybridScryptHash256_prepare((const char*)&headers[0], nBits, midstate));
+        uint256 hashes[3];
+        hybridScryptHash256_finish_batch(midstate, (const char*)&headers[0], BEGIN(hashes[0]), 3);
+        for (int i = 0; i < 3; i++) {
+            uint256 hash;
+            hybridScryptHash256((const char*)&headers[i * 80], BEGIN(hash), nBits);
+            BOOST_CHECK(hash == hashes[i]);
+        }
+    }
+
+    // another prefix must not be served from the old midstate
+    std::vector<unsigned char> header = ParseHex(strprintf(headerhex, 0, ByteReverse(nBits), 0));
+    header[0] ^= 1;
+    BOOST_REQUIRE(hybridScryptHash256_prepare((const char*)&header[0], nBits, midstate));
+    BOOST_CHECK(memcmp(midstate.H68, &header[0], 68) == 0);
+    uint256 hash1, hash2;
+    hybridScryptHash256_finish_batch(midstate, (const char*)&header[0], BEGIN(hash1), 1);
+    hybridScryptHash256((const char*)&header[0], BEGIN(hash2), nBits);
+    BOOST_CHECK(hash1 == hash2);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_arena_test)
+{
+    // scrypt("password", "NaCl", N=1024, r=8, p=16, 64) from the scrypt paper
+    const char* expected = "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640";
+    uint8_t buf[64];
+
+    BOOST_CHECK(crypto_scrypt((const uint8_t*)"password", 8, (const uint8_t*)"NaCl", 4, 1024, 8, 16, buf, 64) == 0);
+    BOOST_CHECK_EQUAL(HexStr(buf, buf + 64), expected);
+
+    scrypt_arena arena;
+    scrypt_arena_init(&arena);
+    for (int i = 0; i < 2; i++) {
+        memset(buf, 0, sizeof(buf));
+        BOOST_CHECK(crypto_scrypt_arena(&arena, (const uint8_t*)"password", 8, (const uint8_t*)"NaCl", 4, 1024, 8, 16, buf, 64) == 0);
+        BOOST_CHECK_EQUAL(HexStr(buf, buf + 64), expected);
+    }
+
+    // a smaller parameter set must be served from the existing mapping
+    void* region = arena.region;
+    BOOST_CHECK(scrypt_arena_reserve(&arena, 512, 4, 2) == 0);
+    BOOST_CHECK(arena.region == region);
+    scrypt_arena_free(&arena);
+    BOOST_CHECK(arena.region == NULL);
+
+    scrypt_arena* threadArena = scrypt_thread_arena();
+    BOOST_CHECK(threadArena != NULL);
+    BOOST_CHECK(scrypt_thread_arena() == threadArena);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_parallel_lanes)
+{
+    // Lanes evaluated on the pool must give the same result as the serial loop
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(&ThreadScryptLanes);
+
+    uint8_t serial[64], parallel[64];
+    scrypt_set_lane_threads(0);
+    BOOST_CHECK(crypto_scrypt((const uint8_t*)"password", 8, (const uint8_t*)"NaCl", 4, 1024, 8, 16, serial, 64) == 0);
+    scrypt_set_lane_threads(4);
+    BOOST_CHECK(crypto_scrypt((const uint8_t*)"password", 8, (const uint8_t*)"NaCl", 4, 1024, 8, 16, parallel, 64) == 0);
+    scrypt_set_lane_threads(0);
+    BOOST_CHECK(memcmp(serial, parallel, sizeof(serial)) == 0);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(hybridscrypt_cache)
+{
+    std::vector<unsigned char> header = ParseHex("020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659");
+    unsigned int nBits = 0x1b47c7ea;
+
+    ScryptHashCacheStats before, after;
+    hybridScryptHash256CacheStats(before);
+
+    uint256 hash1, hash2;
+    hybridScryptHash256((const char*)&header[0], BEGIN(hash1), nBits);
+    hybridScryptHash256((const char*)&header[0], BEGIN(hash2), nBits);
+    BOOST_CHECK(hash1 == hash2);
+
+    hybridScryptHash256CacheStats(after);
+    BOOST_CHECK(after.nHits >= before.nHits + 1);
+    BOOST_CHECK(after.nEntries >= 1 && after.nEntries <= after.nCapacity);
+
+    // nBits is part of the key: a different target selects other scrypt parameters
+    uint256 hash3;
+    hybridScryptHash256((const char*)&header[0], BEGIN(hash3), 0x1c47c7ea);
+    BOOST_CHECK(hash3 != hash1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
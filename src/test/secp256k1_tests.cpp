@@ -0,0 +1,433 @@
+#include <string>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include "json/json_spirit_writer_template.h"
+
+#include "main.h"
+#include "secp256k1.h"
+#include "util.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// In script_tests.cpp
+extern Array read_json(const std::string& filename);
+extern CScript ParseScript(string s);
+extern uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache);
+
+// What CPubKey::Verify does with OpenSSL
+static bool OpenSSLVerify(const uint256 &hash, const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char *pbegin = &vchPubKey[0];
+    bool fValid = false;
+    if (o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()))
+        fValid = !vchSig.empty() && ECDSA_verify(0, hash.begin(), 32, &vchSig[0], vchSig.size(), pkey) == 1;
+    EC_KEY_free(pkey);
+    return fValid;
+}
+
+static bool Secp256k1Verify(const uint256 &hash, const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey)
+{
+    return Secp256k1Verify(hash, vchSig, &vchPubKey[0], vchPubKey.size());
+}
+
+static vector<unsigned char> GetPubKey(EC_KEY *pkey, bool fCompressed)
+{
+    EC_KEY_set_conv_form(pkey, fCompressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED);
+    vector<unsigned char> vch(i2o_ECPublicKey(pkey, NULL));
+    unsigned char *pbegin = &vch[0];
+    i2o_ECPublicKey(pkey, &pbegin);
+    return vch;
+}
+
+static vector<unsigned char> Sign(EC_KEY *pkey, const uint256 &hash)
+{
+    vector<unsigned char> vchSig(ECDSA_size(pkey));
+    unsigned int nSize = 0;
+    ECDSA_sign(0, hash.begin(), 32, &vchSig[0], &nSize, pkey);
+    vchSig.resize(nSize);
+    return vchSig;
+}
+
+// The same signature with s replaced by n - s, which is just as valid
+static vector<unsigned char> NegateS(const vector<unsigned char> &vchSig)
+{
+    const unsigned char *pbegin = &vchSig[0];
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &pbegin, vchSig.size());
+    BIGNUM *order = BN_new();
+    BN_hex2bn(&order, "FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    const BIGNUM *r, *s;
+    ECDSA_SIG_get0(sig, &r, &s);
+    BIGNUM *s2 = BN_new();
+    BN_sub(s2, order, s);
+    ECDSA_SIG_set0(sig, BN_dup(r), s2);
+#else
+    BN_sub(sig->s, order, sig->s);
+#endif
+    vector<unsigned char> vch(i2d_ECDSA_SIG(sig, NULL));
+    unsigned char *p = &vch[0];
+    i2d_ECDSA_SIG(sig, &p);
+    BN_free(order);
+    ECDSA_SIG_free(sig);
+    return vch;
+}
+
+// Check every signature found in the scripts against every public key found
+// there, for the scriptPubKey and for a P2SH redeem script, with both backends
+static unsigned int CompareScripts(const CTransaction &tx, unsigned int nIn, const CScript &scriptSig, const CScript &scriptPubKey, const string &strTest)
+{
+    vector<vector<unsigned char> > vSig, vPubKey;
+    vector<CScript> vScriptCode;
+    vScriptCode.push_back(scriptPubKey);
+    const CScript *pscripts[] = {&scriptSig, &scriptPubKey, NULL};
+    for (int i = 0; pscripts[i]; i++) {
+        CScript::const_iterator pc = pscripts[i]->begin();
+        opcodetype opcode;
+        vector<unsigned char> vch;
+        while (pc < pscripts[i]->end() && pscripts[i]->GetOp(pc, opcode, vch)) {
+            if (vch.size() == 33 || vch.size() == 65)
+                vPubKey.push_back(vch);
+            if (vch.size() > 8 && vch.size() < 80 && i == 0)
+                vSig.push_back(vch);
+            if (i == 0 && !vch.empty()) {
+                CScript redeem(vch.begin(), vch.end());
+                vScriptCode.push_back(redeem);
+                CScript::const_iterator pc2 = redeem.begin();
+                vector<unsigned char> vch2;
+                while (pc2 < redeem.end() && redeem.GetOp(pc2, opcode, vch2))
+                    if (vch2.size() == 33 || vch2.size() == 65)
+                        vPubKey.push_back(vch2);
+            }
+        }
+    }
+
+    unsigned int nCompared = 0;
+    BOOST_FOREACH(const vector<unsigned char> &vchSigHashType, vSig) {
+        vector<unsigned char> vchSig(vchSigHashType.begin(), vchSigHashType.end() - 1);
+        BOOST_FOREACH(const CScript &scriptCode, vScriptCode) {
+            uint256 hash = tx.vin.empty() ? uint256(1) : SignatureHash(scriptCode, tx, nIn, vchSigHashType.back(), NULL);
+            BOOST_FOREACH(const vector<unsigned char> &vchPubKey, vPubKey) {
+                if (!CPubKey(vchPubKey).IsValid())
+                    continue;
+                BOOST_CHECK_MESSAGE(Secp256k1Verify(hash, vchSig, vchPubKey) == OpenSSLVerify(hash, vchSig, vchPubKey), strTest);
+                nCompared++;
+            }
+        }
+    }
+    return nCompared;
+}
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_random)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    unsigned int nValid = 0;
+    for (int i = 0; i < 200; i++) {
+        BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+        uint256 hash = GetRandHash();
+        // small and large hashes exercise the reduction modulo n
+        if (i % 20 == 1)
+            hash = uint256(i);
+        else if (i % 20 == 2)
+            hash = ~uint256(i);
+        vector<unsigned char> vchPubKey = GetPubKey(pkey, i % 2 == 0);
+        vector<unsigned char> vchSig = Sign(pkey, hash);
+
+        BOOST_CHECK(Secp256k1Verify(hash, vchSig, vchPubKey));
+        BOOST_CHECK(Secp256k1Verify(hash, NegateS(vchSig), vchPubKey));
+        nValid++;
+
+        // hybrid encoding of the same key
+        vector<unsigned char> vchHybrid = GetPubKey(pkey, false);
+        vchHybrid[0] = 0x06 | (vchHybrid[64] & 1);
+        BOOST_CHECK_EQUAL(Secp256k1Verify(hash, vchSig, vchHybrid), OpenSSLVerify(hash, vchSig, vchHybrid));
+        vchHybrid[0] ^= 1;
+        BOOST_CHECK_EQUAL(Secp256k1Verify(hash, vchSig, vchHybrid), OpenSSLVerify(hash, vchSig, vchHybrid));
+
+        // any change is a bad signature, or a bad encoding
+        uint256 hashOther = hash;
+        *(hashOther.begin() + GetRandInt(32)) ^= 1 << GetRandInt(8);
+        BOOST_CHECK(!Secp256k1Verify(hashOther, vchSig, vchPubKey));
+        vector<unsigned char> vchSigOther = vchSig;
+        vchSigOther[GetRandInt(vchSig.size())] ^= 1 << GetRandInt(8);
+        BOOST_CHECK_EQUAL(Secp256k1Verify(hash, vchSigOther, vchPubKey), OpenSSLVerify(hash, vchSigOther, vchPubKey));
+        vector<unsigned char> vchPubKeyOther = vchPubKey;
+        vchPubKeyOther[1 + GetRandInt(vchPubKey.size() - 1)] ^= 1 << GetRandInt(8);
+        BOOST_CHECK(!Secp256k1Verify(hash, vchSig, vchPubKeyOther));
+        BOOST_CHECK(!OpenSSLVerify(hash, vchSig, vchPubKeyOther));
+        vchSigOther = vchSig;
+        vchSigOther.push_back(0);
+        BOOST_CHECK_EQUAL(Secp256k1Verify(hash, vchSigOther, vchPubKey), OpenSSLVerify(hash, vchSigOther, vchPubKey));
+    }
+    EC_KEY_free(pkey);
+    BOOST_CHECK_EQUAL(nValid, 200U);
+
+    // random x coordinates, about half of them on the curve
+    for (int i = 0; i < 100; i++) {
+        uint256 x = GetRandHash();
+        vector<unsigned char> vchPubKey(1, 0x02 | (i & 1));
+        vchPubKey.insert(vchPubKey.end(), x.begin(), x.end());
+        vector<unsigned char> vchSig = ParseHex("3006020101020101");
+        BOOST_CHECK_EQUAL(Secp256k1Verify(x, vchSig, vchPubKey), OpenSSLVerify(x, vchSig, vchPubKey));
+        CSecp256k1PubKey pubkey;
+        EC_KEY *pkeyParsed = EC_KEY_new_by_curve_name(NID_secp256k1);
+        const unsigned char *pbegin = &vchPubKey[0];
+        BOOST_CHECK_EQUAL(pubkey.Parse(&vchPubKey[0], vchPubKey.size()), o2i_ECPublicKey(&pkeyParsed, &pbegin, vchPubKey.size()) != NULL);
+        EC_KEY_free(pkeyParsed);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_encodings)
+{
+    CSecp256k1Signature sig;
+    // r and s must be in [1, n - 1]
+    BOOST_CHECK(sig.Parse(&ParseHex("3006020101020101")[0], 8));
+    BOOST_CHECK(!sig.Parse(&ParseHex("3006020100020101")[0], 8));
+    BOOST_CHECK(!sig.Parse(&ParseHex("3006020101020100")[0], 8));
+    BOOST_CHECK(!sig.Parse(&ParseHex("30060201ff020101")[0], 8));
+    vector<unsigned char> vchN = ParseHex("3026022100FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141020101");
+    BOOST_CHECK(!sig.Parse(&vchN[0], vchN.size()));
+    vchN[vchN.size() - 4] = 0x40;
+    BOOST_CHECK(sig.Parse(&vchN[0], vchN.size()));
+    BOOST_CHECK(!sig.Parse(&ParseHex("3005020101020101")[0], 8));
+
+    CSecp256k1PubKey pubkey;
+    // G, in every encoding
+    vector<unsigned char> vchG = ParseHex("0479BE667EF9DCBBAC55A06295CE870B07029BFCDB2DCE28D959F2815B16F81798483ADA7726A3C4655DA4FBFC0E1108A8FD17B448A68554199C47D08FFB10D4B8");
+    BOOST_CHECK(pubkey.Parse(&vchG[0], 65));
+    BOOST_CHECK(HexStr(pubkey.y, pubkey.y + 32) == HexStr(vchG.begin() + 33, vchG.end()));
+    vchG[0] = 0x06;
+    BOOST_CHECK(pubkey.Parse(&vchG[0], 65));
+    vchG[0] = 0x07;
+    BOOST_CHECK(!pubkey.Parse(&vchG[0], 65));
+    vchG[0] = 0x05;
+    BOOST_CHECK(!pubkey.Parse(&vchG[0], 65));
+    vchG[0] = 0x02;
+    BOOST_CHECK(pubkey.Parse(&vchG[0], 33));
+    BOOST_CHECK(HexStr(pubkey.y, pubkey.y + 32) == HexStr(vchG.begin() + 33, vchG.end()));
+    vchG[0] = 0x03;
+    BOOST_CHECK(pubkey.Parse(&vchG[0], 33));
+    BOOST_CHECK(HexStr(pubkey.y, pubkey.y + 32) != HexStr(vchG.begin() + 33, vchG.end()));
+    BOOST_CHECK(!pubkey.Parse(&vchG[0], 65));
+
+    // coordinates must be below p
+    vector<unsigned char> vchP = ParseHex("02FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F");
+    BOOST_CHECK(!pubkey.Parse(&vchP[0], 33));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_script_vectors)
+{
+    // Every signature and public key of the script and transaction tests,
+    // in every combination, valid or not
+    unsigned int nCompared = 0;
+    const char *pszScriptFiles[] = {"script_valid.json", "script_invalid.json", NULL};
+    for (int i = 0; pszScriptFiles[i]; i++) {
+        Array tests = read_json(pszScriptFiles[i]);
+        BOOST_FOREACH(Value& tv, tests) {
+            Array test = tv.get_array();
+            if (test.size() < 2)
+                continue;
+            CTransaction tx;
+            nCompared += CompareScripts(tx, 0, ParseScript(test[0].get_str()), ParseScript(test[1].get_str()), write_string(tv, false));
+        }
+    }
+
+    const char *pszTxFiles[] = {"tx_valid.json", "tx_invalid.json", NULL};
+    for (int i = 0; pszTxFiles[i]; i++) {
+        Array tests = read_json(pszTxFiles[i]);
+        BOOST_FOREACH(Value& tv, tests) {
+            Array test = tv.get_array();
+            if (test[0].type() != array_type || test.size() != 3)
+                continue;
+            map<COutPoint, CScript> mapprevOutScriptPubKeys;
+            BOOST_FOREACH(Value& input, test[0].get_array()) {
+                Array vinput = input.get_array();
+                mapprevOutScriptPubKeys[COutPoint(uint256(vinput[0].get_str()), vinput[1].get_int())] = ParseScript(vinput[2].get_str());
+            }
+            CDataStream stream(ParseHex(test[1].get_str()), SER_NETWORK, PROTOCOL_VERSION);
+            CTransaction tx;
+            stream >> tx;
+            for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+                nCompared += CompareScripts(tx, nIn, tx.vin[nIn].scriptSig, mapprevOutScriptPubKeys[tx.vin[nIn].prevout], write_string(tv, false));
+        }
+    }
+    BOOST_CHECK(nCompared > 100);
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_batch)
+{
+    // A batch gives the same answers as checking one by one
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    vector<CSecp256k1Check> vChecks;
+    vector<bool> vExpected;
+    for (int i = 0; i < 50; i++) {
+        BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+        vector<unsigned char> vchPubKey = GetPubKey(pkey, i % 2 == 0);
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig = Sign(pkey, hash);
+        // every fifth signature is for another hash
+        if (i % 5 == 3)
+            hash = GetRandHash();
+        vChecks.push_back(CSecp256k1Check());
+        CSecp256k1Check &check = vChecks.back();
+        check.hash = hash;
+        BOOST_REQUIRE(check.sig.Parse(&vchSig[0], vchSig.size()));
+        BOOST_REQUIRE(check.pubkey.Parse(&vchPubKey[0], vchPubKey.size()));
+        vExpected.push_back(Secp256k1Verify(hash, check.sig, check.pubkey));
+        BOOST_CHECK_EQUAL(vExpected.back(), i % 5 != 3);
+    }
+    EC_KEY_free(pkey);
+
+    BOOST_CHECK(!Secp256k1VerifyBatch(vChecks));
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+        BOOST_CHECK_EQUAL(vChecks[i].fValid, vExpected[i]);
+
+    vector<CSecp256k1Check> vValid;
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+        if (vExpected[i])
+            vValid.push_back(vChecks[i]);
+    BOOST_CHECK(Secp256k1VerifyBatch(vValid));
+    vValid.resize(1);
+    BOOST_CHECK(Secp256k1VerifyBatch(vValid));
+    vValid.clear();
+    BOOST_CHECK(Secp256k1VerifyBatch(vValid));
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_script_batch)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+    vector<unsigned char> vchPubKey = GetPubKey(pkey, true);
+
+    CTransaction txFrom;
+    txFrom.vout.resize(3);
+    txFrom.vout[0].scriptPubKey << OP_DUP << OP_HASH160 << Hash160(vchPubKey) << OP_EQUALVERIFY << OP_CHECKSIG;
+    txFrom.vout[1].scriptPubKey << vchPubKey << OP_CHECKSIG;
+    txFrom.vout[2].scriptPubKey << vchPubKey << OP_CHECKSIG << OP_NOT;
+    BOOST_CHECK(txFrom.vout[0].scriptPubKey.IsPayToSingleKey());
+    BOOST_CHECK(txFrom.vout[1].scriptPubKey.IsPayToSingleKey());
+    BOOST_CHECK(!txFrom.vout[2].scriptPubKey.IsPayToSingleKey());
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vin[0].prevout.hash = txFrom.GetHash();
+    txTo.vout[0].nValue = 1;
+
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_NOCACHE;
+    CSignatureBatch batch;
+    for (int n = 0; n < 3; n++) {
+        const CScript &scriptPubKey = txFrom.vout[n].scriptPubKey;
+        txTo.vin[0].prevout.n = n;
+        vector<unsigned char> vchSig = Sign(pkey, SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL, NULL));
+        vector<unsigned char> vchBadSig = Sign(pkey, GetRandHash());
+        vchSig.push_back(SIGHASH_ALL);
+        vchBadSig.push_back(SIGHASH_ALL);
+
+        CScript scriptSig, scriptBadSig;
+        scriptSig << vchSig;
+        scriptBadSig << vchBadSig;
+        if (n == 0) {
+            scriptSig << vchPubKey;
+            scriptBadSig << vchPubKey;
+        }
+
+        if (n < 2) {
+            // the signature is left to the batch, which catches a bad one
+            BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0, NULL, &batch));
+            BOOST_CHECK_EQUAL(batch.size(), 1U);
+            BOOST_CHECK(batch.Verify());
+            BOOST_CHECK_EQUAL(batch.size(), 0U);
+            BOOST_CHECK(VerifyScript(scriptBadSig, scriptPubKey, txTo, 0, flags, 0, NULL, &batch));
+            BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0, NULL, &batch));
+            BOOST_CHECK_EQUAL(batch.size(), 2U);
+            BOOST_CHECK(!batch.Verify());
+            BOOST_CHECK(!VerifyScript(scriptBadSig, scriptPubKey, txTo, 0, flags, 0));
+
+            // a scriptSig that is not push only is checked on the spot
+            CScript scriptNotPushOnly = scriptBadSig;
+            scriptNotPushOnly << OP_NOP;
+            BOOST_CHECK(!VerifyScript(scriptNotPushOnly, scriptPubKey, txTo, 0, flags, 0, NULL, &batch));
+            BOOST_CHECK_EQUAL(batch.size(), 0U);
+        } else {
+            // where a bad signature can make the script succeed nothing is deferred
+            BOOST_CHECK(VerifyScript(scriptBadSig, scriptPubKey, txTo, 0, flags, 0, NULL, &batch));
+            BOOST_CHECK(!VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0, NULL, &batch));
+            BOOST_CHECK_EQUAL(batch.size(), 0U);
+        }
+    }
+    EC_KEY_free(pkey);
+}
+
+#ifdef USE_SECP256K1
+BOOST_AUTO_TEST_CASE(secp256k1_pubkey_check)
+{
+    // CPubKey::Verify checked against OpenSSL agrees on the transaction tests
+    uint64 nMismatches = nSecp256k1Mismatches;
+    fCheckSecp256k1 = true;
+    Array tests = read_json("tx_valid.json");
+    BOOST_FOREACH(Value& tv, tests) {
+        Array test = tv.get_array();
+        if (test[0].type() != array_type || test.size() != 3)
+            continue;
+        map<COutPoint, CScript> mapprevOutScriptPubKeys;
+        BOOST_FOREACH(Value& input, test[0].get_array()) {
+            Array vinput = input.get_array();
+            mapprevOutScriptPubKeys[COutPoint(uint256(vinput[0].get_str()), vinput[1].get_int())] = ParseScript(vinput[2].get_str());
+        }
+        CDataStream stream(ParseHex(test[1].get_str()), SER_NETWORK, PROTOCOL_VERSION);
+        CTransaction tx;
+        stream >> tx;
+        unsigned int flags = SCRIPT_VERIFY_NOCACHE | (test[2].get_bool() ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE);
+        // whether they pass depends on the DER parser of the OpenSSL version
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+            VerifyScript(tx.vin[nIn].scriptSig, mapprevOutScriptPubKeys[tx.vin[nIn].prevout], tx, nIn, flags, 0);
+    }
+    fCheckSecp256k1 = false;
+    BOOST_CHECK_EQUAL(nSecp256k1Mismatches, nMismatches);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(secp256k1_speed)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    BOOST_REQUIRE(EC_KEY_generate_key(pkey));
+    vector<unsigned char> vchPubKey = GetPubKey(pkey, true);
+    vector<uint256> vHash;
+    vector<vector<unsigned char> > vSig;
+    for (int i = 0; i < 200; i++) {
+        vHash.push_back(GetRandHash());
+        vSig.push_back(Sign(pkey, vHash.back()));
+    }
+    EC_KEY_free(pkey);
+    Secp256k1Init();
+
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        BOOST_CHECK(OpenSSLVerify(vHash[i], vSig[i], vchPubKey));
+    int64 nOpenSSL = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        BOOST_CHECK(Secp256k1Verify(vHash[i], vSig[i], vchPubKey));
+    int64 nSecp256k1 = GetTimeMicros() - nStart;
+
+    vector<CSecp256k1Check> vChecks(vHash.size());
+    for (unsigned int i = 0; i < vHash.size(); i++) {
+        vChecks[i].hash = vHash[i];
+        vChecks[i].sig.Parse(&vSig[i][0], vSig[i].size());
+        vChecks[i].pubkey.Parse(&vchPubKey[0], vchPubKey.size());
+    }
+    nStart = GetTimeMicros();
+    BOOST_CHECK(Secp256k1VerifyBatch(vChecks));
+    int64 nBatch = GetTimeMicros() - nStart;
+    BOOST_TEST_MESSAGE(strprintf("%u signatures: OpenSSL %.2fms, secp256k1 %.2fms, in one batch %.2fms",
+                                 (unsigned int)vHash.size(), nOpenSSL * 0.001, nSecp256k1 * 0.001, nBatch * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
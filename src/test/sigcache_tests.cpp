@@ -0,0 +1,135 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "sigcache.h"
+#include "util.h"
+
+static std::vector<unsigned char> RandomSig()
+{
+    uint256 r = GetRandHash(), s = GetRandHash();
+    std::vector<unsigned char> vchSig(r.begin(), r.end());
+    vchSig.insert(vchSig.end(), s.begin(), s.end());
+    return vchSig;
+}
+
+static CPubKey RandomPubKey()
+{
+    uint256 x = GetRandHash();
+    std::vector<unsigned char> vch(1, 0x02);
+    vch.insert(vch.end(), x.begin(), x.end());
+    return CPubKey(vch);
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_basic)
+{
+    CSignatureCache cache(1000);
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig = RandomSig();
+    CPubKey pubkey = RandomPubKey();
+
+    BOOST_CHECK(!cache.Get(hash, vchSig, pubkey));
+    cache.Set(hash, vchSig, pubkey);
+    BOOST_CHECK(cache.Get(hash, vchSig, pubkey));
+
+    // any part of the key differing is a miss
+    BOOST_CHECK(!cache.Get(GetRandHash(), vchSig, pubkey));
+    BOOST_CHECK(!cache.Get(hash, RandomSig(), pubkey));
+    BOOST_CHECK(!cache.Get(hash, vchSig, RandomPubKey()));
+    std::vector<unsigned char> vchShort(vchSig.begin(), vchSig.end() - 1);
+    BOOST_CHECK(!cache.Get(hash, vchShort, pubkey));
+
+    // a block uses up the entry
+    BOOST_CHECK(cache.Get(hash, vchSig, pubkey, true));
+    BOOST_CHECK(!cache.Get(hash, vchSig, pubkey));
+
+    SignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits, 2U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 6U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 1U);
+    BOOST_CHECK_EQUAL(stats.nErased, 1U);
+    BOOST_CHECK_EQUAL(stats.nEntries, 0U);
+    BOOST_CHECK(stats.nCapacity >= 1000);
+
+    // disabled
+    CSignatureCache cacheOff(0);
+    cacheOff.Set(hash, vchSig, pubkey);
+    BOOST_CHECK(!cacheOff.Get(hash, vchSig, pubkey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_load)
+{
+    CSignatureCache cache(4096);
+    SignatureCacheStats stats;
+    cache.GetStats(stats);
+    unsigned int nCapacity = stats.nCapacity;
+
+    // moving entries around keeps a table of 4 ways nearly full before any is dropped
+    std::vector<uint256> vHash;
+    std::vector<unsigned char> vchSig = RandomSig();
+    CPubKey pubkey = RandomPubKey();
+    for (unsigned int i = 0; i < nCapacity * 9 / 10; i++) {
+        vHash.push_back(GetRandHash());
+        cache.Set(vHash.back(), vchSig, pubkey);
+    }
+    unsigned int nFound = 0;
+    BOOST_FOREACH(const uint256 &hash, vHash)
+        if (cache.Get(hash, vchSig, pubkey))
+            nFound++;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, nFound);
+    BOOST_CHECK_EQUAL(stats.nEntries + stats.nEvictions, stats.nInserts);
+    BOOST_CHECK(nFound >= vHash.size() * 98 / 100);
+
+    // overfilling drops entries but never exceeds the table
+    for (unsigned int i = 0; i < nCapacity; i++)
+        cache.Set(GetRandHash(), vchSig, pubkey);
+    cache.GetStats(stats);
+    BOOST_CHECK(stats.nEntries <= nCapacity);
+    BOOST_CHECK(stats.nEntries > nCapacity * 9 / 10);
+    BOOST_CHECK_EQUAL(stats.nEntries + stats.nEvictions, stats.nInserts);
+}
+
+static void SigCacheWorker(CSignatureCache *pcache, const std::vector<uint256> *pvHash, const std::vector<unsigned char> *pvchSig, const CPubKey *ppubkey, int *pnFalse)
+{
+    for (unsigned int i = 0; i < pvHash->size(); i++) {
+        pcache->Set((*pvHash)[i], *pvchSig, *ppubkey);
+        // a hash nobody inserts must never be found
+        if (pcache->Get(~(*pvHash)[i], *pvchSig, *ppubkey))
+            (*pnFalse)++;
+        pcache->Get((*pvHash)[i / 2], *pvchSig, *ppubkey, i % 3 == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_threads)
+{
+    CSignatureCache cache(2048);
+    std::vector<unsigned char> vchSig = RandomSig();
+    CPubKey pubkey = RandomPubKey();
+
+    static const int nThreads = 4;
+    std::vector<uint256> vHash[nThreads];
+    int nFalse[nThreads];
+    boost::thread_group threads;
+    for (int n = 0; n < nThreads; n++) {
+        for (unsigned int i = 0; i < 20000; i++)
+            vHash[n].push_back(GetRandHash());
+        nFalse[n] = 0;
+        threads.create_thread(boost::bind(&SigCacheWorker, &cache, &vHash[n], &vchSig, &pubkey, &nFalse[n]));
+    }
+    threads.join_all();
+
+    for (int n = 0; n < nThreads; n++)
+        BOOST_CHECK_EQUAL(nFalse[n], 0);
+    SignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nInserts, (uint64)nThreads * 20000);
+    BOOST_CHECK_EQUAL(stats.nHits + stats.nMisses, (uint64)nThreads * 40000);
+    BOOST_CHECK(stats.nEntries <= stats.nCapacity);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+// Old script.cpp SignatureHash function, which copies the transaction
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    if (nIn >= txTo.vin.size())
+        return 1;
+    CTransaction txTmp(txTo);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        unsigned int nOut = nIn;
+        if (nOut >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nOut+1);
+        for (unsigned int i = 0; i < nOut; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return ss.GetHash();
+}
+
+static void RandomScript(CScript &script)
+{
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = GetRandInt(10);
+    for (int i=0; i<ops; i++)
+        script << oplist[GetRandInt(sizeof(oplist)/sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction &tx, bool fSingle, int nMaxIns = 4, int nMaxOuts = 4)
+{
+    tx.nVersion = GetRandInt(0x7fffffff);
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (GetRandInt(2)) ? GetRandInt(0x7fffffff) : 0;
+    int ins = (GetRandInt(nMaxIns)) + 1;
+    int outs = fSingle ? ins : (GetRandInt(nMaxOuts)) + 1;
+    for (int in = 0; in < ins; in++) {
+        tx.vin.push_back(CTxIn());
+        CTxIn &txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = GetRandInt(4);
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (GetRandInt(2)) ? GetRandInt(0x7fffffff) : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++) {
+        tx.vout.push_back(CTxOut());
+        CTxOut &txout = tx.vout.back();
+        txout.nValue = GetRandInt(100000000);
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+BOOST_AUTO_TEST_CASE(sighash_test)
+{
+    int nRandomTests = 50000;
+
+    for (int i=0; i<nRandomTests; i++) {
+        int nHashType = GetRandInt(0x7fffffff);
+        CTransaction txTo;
+        RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        int nIn = GetRandInt(txTo.vin.size());
+        CSignatureHashCache cache(txTo);
+
+        uint256 sho = SignatureHashOld(scriptCode, txTo, nIn, nHashType);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType) == sho);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &cache) == sho);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType & ~0xff, &cache) == SignatureHashOld(scriptCode, txTo, nIn, nHashType & ~0xff));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sighash_all_inputs)
+{
+    // Every input of one transaction against the same cache, as CheckInputs does
+    CTransaction txTo;
+    RandomTransaction(txTo, false, 300, 300);
+    CSignatureHashCache cache(txTo);
+    CScript scriptCode;
+    for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++) {
+        RandomScript(scriptCode);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, SIGHASH_ALL, &cache) == SignatureHashOld(scriptCode, txTo, nIn, SIGHASH_ALL));
+    }
+    // Out of range inputs and outputs give the same special hash as before
+    BOOST_CHECK(SignatureHash(scriptCode, txTo, txTo.vin.size(), SIGHASH_ALL, &cache) == 1);
+    txTo.vout.resize(1);
+    BOOST_CHECK(SignatureHash(scriptCode, txTo, 1, SIGHASH_SINGLE) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(sighash_benchmark)
+{
+    // A consolidation transaction: 2000 inputs, 2 outputs, every input signed with SIGHASH_ALL
+    CTransaction txTo;
+    txTo.vin.resize(2000);
+    txTo.vout.resize(2);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        txTo.vin[i].prevout = COutPoint(GetRandHash(), 0);
+        txTo.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+    }
+    CScript scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    uint256 hashOld = 0, hashNew = 0;
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        hashOld ^= SignatureHashOld(scriptCode, txTo, i, SIGHASH_ALL);
+    int64 nOld = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CSignatureHashCache cache(txTo);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        hashNew ^= SignatureHash(scriptCode, txTo, i, SIGHASH_ALL, &cache);
+    int64 nNew = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(hashOld == hashNew);
+    BOOST_TEST_MESSAGE(strprintf("SignatureHash of %"PRIszu" inputs: %.2fms copying the transaction, %.2fms with CSignatureHashCache",
+                                 txTo.vin.size(), nOld * 0.001, nNew * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
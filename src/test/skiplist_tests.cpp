@@ -0,0 +1,80 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = GetRandInt(SKIPLIST_LENGTH - 1);
+        int to = GetRandInt(from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(chain_fork_test)
+{
+    // a main chain of 1000 blocks, and a branch off it at height 500
+    std::vector<CBlockIndex> vMain(1000), vBranch(600);
+    for (int i=0; i<1000; i++) {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = (i == 0) ? NULL : &vMain[i - 1];
+        vMain[i].BuildSkip();
+    }
+    for (int i=0; i<600; i++) {
+        vBranch[i].nHeight = 501 + i;
+        vBranch[i].pprev = (i == 0) ? &vMain[500] : &vBranch[i - 1];
+        vBranch[i].BuildSkip();
+    }
+
+    BOOST_CHECK(LastCommonAncestor(&vMain[999], &vBranch[599]) == &vMain[500]);
+    BOOST_CHECK(LastCommonAncestor(&vBranch[10], &vMain[300]) == &vMain[300]);
+    BOOST_CHECK(LastCommonAncestor(&vMain[700], &vMain[999]) == &vMain[700]);
+
+    CChain chain;
+    chain.SetTip(&vMain[999]);
+    BOOST_CHECK_EQUAL(chain.Height(), 999);
+    BOOST_CHECK(chain[500] == &vMain[500]);
+    BOOST_CHECK(chain[1000] == NULL);
+    BOOST_CHECK(chain.FindFork(&vBranch[599]) == &vMain[500]);
+
+    // switching to the branch rewrites the entries above the fork only
+    chain.SetTip(&vBranch[599]);
+    BOOST_CHECK(chain.Tip() == &vBranch[599]);
+    BOOST_CHECK(chain[500] == &vMain[500]);
+    BOOST_CHECK(chain[501] == &vBranch[0]);
+    BOOST_CHECK(chain.Contains(&vBranch[300]));
+    BOOST_CHECK(!chain.Contains(&vMain[501]));
+
+    chain.SetTip(&vMain[100]);
+    BOOST_CHECK_EQUAL(chain.Height(), 100);
+    BOOST_CHECK(chain.Tip() == &vMain[100]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
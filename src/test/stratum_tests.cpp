@@ -0,0 +1,196 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "scrypt.h"
+#include "stratum.h"
+#include "bitcoinrpc.h"
+
+using namespace std;
+using namespace json_spirit;
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+// Stands in for a pool connection: collects everything the server sends
+class CTestStratumSession : public CStratumSession
+{
+public:
+    void Send(const string& strLine)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vLines.push_back(strLine);
+        cond.notify_all();
+    }
+
+    Object Receive()
+    {
+        string strLine;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (vLines.empty())
+                if (!cond.timed_wait(lock, boost::posix_time::seconds(60)))
+                    throw runtime_error("no reply from the stratum server");
+            strLine = vLines.front();
+            vLines.pop_front();
+        }
+        Value value;
+        BOOST_REQUIRE(read_string(strLine, value));
+        BOOST_REQUIRE(value.type() == obj_type);
+        return value.get_obj();
+    }
+
+    // Error code of a reply, or 0 if it succeeded
+    int ReceiveError()
+    {
+        Object reply = Receive();
+        Value error = find_value(reply, "error");
+        if (error.type() == null_type)
+        {
+            BOOST_CHECK(find_value(reply, "result") == Value(true));
+            return 0;
+        }
+        BOOST_CHECK(!(find_value(reply, "result") == Value(true)));
+        return error.get_array()[0].get_int();
+    }
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    deque<string> vLines;
+};
+
+static string Submit(const string& strJob, unsigned int nExtraNonce2, unsigned int nTime, unsigned int nNonce)
+{
+    return strprintf("{\"id\":4,\"method\":\"mining.submit\",\"params\":[\"worker\",\"%s\",\"%08x\",\"%08x\",\"%08x\"]}",
+                     strJob.c_str(), nExtraNonce2, nTime, nNonce);
+}
+
+static unsigned int ParseHex32(const Value& value)
+{
+    return strtoul(value.get_str().c_str(), NULL, 16);
+}
+
+BOOST_AUTO_TEST_CASE(stratum_share_target)
+{
+    uint256 hashDiff1 = CBigNum().SetCompact(0x1d00ffff).getuint256();
+    BOOST_CHECK(StratumShareTarget(1.0) == hashDiff1);
+    BOOST_CHECK(StratumShareTarget(2.0) == hashDiff1 >> 1);
+    BOOST_CHECK(StratumShareTarget(1.0 / 1024) == hashDiff1 << 10);
+    BOOST_CHECK(StratumShareTarget(1e-30) == ~uint256(0));
+    BOOST_CHECK(StratumShareTarget(0) == ~uint256(0));
+}
+
+BOOST_AUTO_TEST_CASE(stratum_session)
+{
+    const double dDifficulty = 1e-9;
+    uint256 hashShareTarget = StratumShareTarget(dDifficulty);
+    BOOST_REQUIRE(StartStratumServer(CScript() << OP_TRUE, dDifficulty, 0, 2));
+    BOOST_REQUIRE(StratumNewJob(true));
+
+    boost::shared_ptr<CTestStratumSession> session(new CTestStratumSession());
+    session->HandleLine(Submit("0", 0, 0, 0));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_NOT_SUBSCRIBED);
+    session->HandleLine("not json");
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_OTHER);
+
+    // Subscription: reply, difficulty, then the current job
+    session->HandleLine("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}");
+    Object reply = session->Receive();
+    BOOST_CHECK(find_value(reply, "error").type() == null_type);
+    Array result = find_value(reply, "result").get_array();
+    BOOST_REQUIRE(result.size() == 3);
+    string strExtraNonce1 = result[1].get_str();
+    BOOST_CHECK_EQUAL(strExtraNonce1, strprintf("%08x", session->GetExtraNonce1()));
+    BOOST_CHECK_EQUAL(result[2].get_int(), (int)STRATUM_EXTRANONCE2_SIZE);
+
+    Object notification = session->Receive();
+    BOOST_CHECK_EQUAL(find_value(notification, "method").get_str(), "mining.set_difficulty");
+    BOOST_CHECK_EQUAL(find_value(notification, "params").get_array()[0].get_real(), dDifficulty);
+
+    notification = session->Receive();
+    BOOST_REQUIRE_EQUAL(find_value(notification, "method").get_str(), "mining.notify");
+    Array params = find_value(notification, "params").get_array();
+    BOOST_REQUIRE(params.size() == 9);
+    BOOST_CHECK(params[8] == Value(true));
+
+    session->HandleLine(Submit(params[0].get_str(), 0, ParseHex32(params[7]), 0));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_UNAUTHORIZED);
+    session->HandleLine("{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"worker\",\"x\"]}");
+    BOOST_CHECK_EQUAL(session->ReceiveError(), 0);
+
+    // Build the header as a pool client would
+    string strJob = params[0].get_str();
+    const unsigned int nExtraNonce2 = 1;
+    vector<unsigned char> vchCoinbase = ParseHex(params[2].get_str());
+    vector<unsigned char> vchExtraNonce = ParseHex(strExtraNonce1 + strprintf("%08x", nExtraNonce2));
+    vector<unsigned char> vchCoinb2 = ParseHex(params[3].get_str());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce.begin(), vchExtraNonce.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchCoinb2.begin(), vchCoinb2.end());
+
+    CTransaction txCoinbase;
+    CDataStream(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION) >> txCoinbase;
+    BOOST_CHECK(txCoinbase.IsCoinBase());
+    BOOST_CHECK(txCoinbase.vout[0].scriptPubKey == CScript() << OP_TRUE);
+
+    uint256 hashMerkleRoot = txCoinbase.GetHash();
+    BOOST_FOREACH(const Value& branch, params[4].get_array())
+    {
+        vector<unsigned char> vch = ParseHex(branch.get_str());
+        BOOST_REQUIRE(vch.size() == 32);
+        uint256 hash;
+        memcpy(hash.begin(), &vch[0], 32);
+        hashMerkleRoot = Hash(BEGIN(hashMerkleRoot), END(hashMerkleRoot), BEGIN(hash), END(hash));
+    }
+
+    vector<unsigned char> vchPrevHash = ParseHex(params[1].get_str());
+    BOOST_REQUIRE(vchPrevHash.size() == 32);
+    for (int i = 0; i < 32; i += 4)
+        reverse(vchPrevHash.begin() + i, vchPrevHash.begin() + i + 4);
+
+    CBlock header;
+    header.nVersion = ParseHex32(params[5]);
+    memcpy(header.hashPrevBlock.begin(), &vchPrevHash[0], 32);
+    header.hashMerkleRoot = hashMerkleRoot;
+    header.nTime = ParseHex32(params[7]);
+    header.nBits = ParseHex32(params[6]);
+    header.nNonce = 0;
+    BOOST_CHECK(header.hashPrevBlock == hashBestChain);
+
+    // A share is accepted once
+    HybridScryptMidstate midstate;
+    uint256 hashFound;
+    unsigned int nHashesDone = 0;
+    BOOST_REQUIRE(ScanHybridHash(&header, midstate, hashShareTarget, 64, nHashesDone, hashFound));
+    session->HandleLine(Submit(strJob, nExtraNonce2, header.nTime, header.nNonce));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), 0);
+    session->HandleLine(Submit(strJob, nExtraNonce2, header.nTime, header.nNonce));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_DUPLICATE);
+
+    // A nonce that misses the share target
+    do
+        header.nNonce++;
+    while (header.GetPoWHash() <= hashShareTarget);
+    session->HandleLine(Submit(strJob, nExtraNonce2, header.nTime, header.nNonce));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_LOW_DIFFICULTY);
+
+    session->HandleLine(Submit("zz", nExtraNonce2, header.nTime, header.nNonce));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_JOB_NOT_FOUND);
+    session->HandleLine(Submit(strJob, nExtraNonce2, 0, header.nNonce));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_OTHER);
+
+    // A clean job makes the old one stale
+    BOOST_REQUIRE(StratumNewJob(true));
+    notification = session->Receive();
+    BOOST_REQUIRE_EQUAL(find_value(notification, "method").get_str(), "mining.notify");
+    params = find_value(notification, "params").get_array();
+    BOOST_CHECK(params[0].get_str() != strJob);
+    BOOST_CHECK(params[8] == Value(true));
+    session->HandleLine(Submit(strJob, nExtraNonce2 + 1, header.nTime, header.nNonce));
+    BOOST_CHECK_EQUAL(session->ReceiveError(), STRATUM_ERROR_JOB_NOT_FOUND);
+
+    StratumRemoveSession(session.get());
+    StopStratumServer();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,6 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
+#include "bignum.h"
 #include "uint256.h"
+#include "util.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +17,175 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_arithmetic)
+{
+    uint256 num1("0x123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+    uint256 num2("0x89abcdef01234567");
+    BOOST_CHECK_EQUAL(num1.bits(), 249U);
+    BOOST_CHECK_EQUAL(uint256(0).bits(), 0U);
+    BOOST_CHECK_EQUAL(uint256(1).bits(), 1U);
+
+    // the quotient leaves a remainder below the divisor
+    uint256 quot = num1 / num2;
+    CBigNum bnRem = CBigNum(num1) - CBigNum(quot) * CBigNum(num2);
+    BOOST_CHECK(bnRem >= 0 && bnRem < CBigNum(num2));
+    BOOST_CHECK((CBigNum(num1) / CBigNum(num2)).getuint256() == quot);
+    BOOST_CHECK((CBigNum(num1) * 1000).getuint256() == num1 * 1000);
+    BOOST_CHECK(num1 / num1 == 1);
+    BOOST_CHECK(num2 / num1 == 0);
+    BOOST_CHECK_THROW(num1 / uint256(0), uint_error);
+
+    // SetCompact agrees with CBigNum for the values it can represent
+    unsigned int vCompact[] = {0, 0x00123456, 0x01123456, 0x02123456, 0x03123456, 0x04123456, 0x05009234, 0x1d00ffff, 0x1e0fffff, 0x20123456};
+    for (unsigned int i = 0; i < sizeof(vCompact) / sizeof(vCompact[0]); i++) {
+        bool fNegative, fOverflow;
+        uint256 num;
+        num.SetCompact(vCompact[i], &fNegative, &fOverflow);
+        BOOST_CHECK(!fNegative && !fOverflow);
+        BOOST_CHECK(num == CBigNum().SetCompact(vCompact[i]).getuint256());
+
+        // block work as CBigNum computed it
+        if (num != 0) {
+            uint256 work = (~num / (num + 1)) + 1;
+            BOOST_CHECK(work == ((CBigNum(1) << 256) / (CBigNum(num) + 1)).getuint256());
+        }
+    }
+    bool fNegative, fOverflow;
+    uint256().SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(fNegative && !fOverflow);
+    uint256().SetCompact(0xff123456, &fNegative, &fOverflow);
+    BOOST_CHECK(!fNegative && fOverflow);
+}
+
+// A random value of random width, so that all limbs and compact sizes are hit
+static uint256 RandomNum()
+{
+    return GetRandHash() >> GetRandInt(256);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_compact_properties)
+{
+    for (int i = 0; i < 10000; i++) {
+        // any compact value decodes like CBigNum, unless it is negative or beyond 256 bits
+        unsigned int nCompact = (GetRandInt(35) << 24) | GetRandInt(0x01000000);
+        bool fNegative, fOverflow;
+        uint256 num;
+        num.SetCompact(nCompact, &fNegative, &fOverflow);
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, (fNegative ? -bn : bn) > CBigNum(~uint256(0)));
+        if (!fNegative && !fOverflow) {
+            BOOST_CHECK(num == bn.getuint256());
+            BOOST_CHECK_EQUAL(num.GetCompact(), bn.GetCompact());
+        }
+
+        // and any number encodes like CBigNum
+        num = RandomNum();
+        BOOST_CHECK_EQUAL(num.GetCompact(), CBigNum(num).GetCompact());
+        BOOST_CHECK_EQUAL(num.GetCompact(true), (-CBigNum(num)).GetCompact());
+        BOOST_CHECK(uint256().SetCompact(num.GetCompact()) == CBigNum().SetCompact(num.GetCompact()).getuint256());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(uint256_arithmetic_properties)
+{
+    for (int i = 0; i < 10000; i++) {
+        uint256 a = RandomNum();
+        uint256 b = RandomNum();
+        CBigNum bnA(a), bnB(b);
+
+        BOOST_CHECK_EQUAL(a < b, bnA < bnB);
+        BOOST_CHECK_EQUAL(a == b, bnA == bnB);
+        // products are truncated to 256 bits, as getuint256 does
+        BOOST_CHECK((a * b) == (bnA * bnB).getuint256());
+        BOOST_CHECK((a * (uint32_t)b.Get64()) == (bnA * CBigNum((uint32_t)b.Get64())).getuint256());
+        if (b != 0)
+            BOOST_CHECK((a / b) == (bnA / bnB).getuint256());
+
+        // multiplying and dividing by 64-bit values round trips
+        uint64 n = (GetRand(0x100000000ULL) << 32) | GetRand(0x100000000ULL) | 1;
+        uint256 c = a >> 64;
+        BOOST_CHECK((c * uint256(n)) / uint256(n) == c);
+    }
+}
+
+// The target computations of ComputeMinWork and GetNextWorkRequired, with both types
+BOOST_AUTO_TEST_CASE(uint256_retarget)
+{
+    const uint256 bnLimit = ~uint256(0) >> 23;
+    const CBigNum bnLimitOld(bnLimit);
+    const int64 nTargetTimespan = 6 * 60 * 60;
+    for (int i = 0; i < 10000; i++) {
+        unsigned int nBits = (bnLimit >> GetRandInt(200)).GetCompact();
+        int64 nTimespan = nTargetTimespan / 4 + GetRandInt(nTargetTimespan * 4 - nTargetTimespan / 4 + 1);
+
+        uint256 bnNew;
+        bnNew.SetCompact(nBits);
+        bnNew *= uint256(nTimespan);
+        bnNew /= uint256(nTargetTimespan);
+        if (bnNew > bnLimit)
+            bnNew = bnLimit;
+        CBigNum bnOld;
+        bnOld.SetCompact(nBits);
+        bnOld *= nTimespan;
+        bnOld /= nTargetTimespan;
+        if (bnOld > bnLimitOld)
+            bnOld = bnLimitOld;
+        BOOST_CHECK_EQUAL(bnNew.GetCompact(), bnOld.GetCompact());
+
+        int64 nTime = GetRandInt(nTargetTimespan * 400);
+        uint256 bnMin;
+        bnMin.SetCompact(nBits);
+        CBigNum bnMinOld;
+        bnMinOld.SetCompact(nBits);
+        for (int64 n = nTime; n > 0 && bnMin < bnLimit; n -= nTargetTimespan * 4) {
+            bnMin *= 4;
+            bnMinOld *= 4;
+        }
+        if (bnMin > bnLimit)
+            bnMin = bnLimit;
+        if (bnMinOld > bnLimitOld)
+            bnMinOld = bnLimitOld;
+        BOOST_CHECK_EQUAL(bnMin.GetCompact(), bnMinOld.GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(uint256_pow_benchmark)
+{
+    // The range check and hash comparison of CheckProofOfWork, done the old
+    // way and the new way on the same headers
+    const unsigned int N = 100000;
+    const uint256 bnLimit = ~uint256(0) >> 23;
+    const CBigNum bnLimitOld(bnLimit);
+    std::vector<uint256> vHash(N);
+    std::vector<unsigned int> vBits(N);
+    for (unsigned int i = 0; i < N; i++) {
+        vBits[i] = (bnLimit >> GetRandInt(32)).GetCompact();
+        vHash[i] = GetRandHash() >> 23;
+    }
+
+    unsigned int nValidOld = 0, nValidNew = 0;
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < N; i++) {
+        CBigNum bnTarget;
+        bnTarget.SetCompact(vBits[i]);
+        if (bnTarget > 0 && bnTarget <= bnLimitOld && vHash[i] <= bnTarget.getuint256())
+            nValidOld++;
+    }
+    int64 nOld = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < N; i++) {
+        bool fNegative, fOverflow;
+        uint256 bnTarget;
+        bnTarget.SetCompact(vBits[i], &fNegative, &fOverflow);
+        if (!fNegative && !fOverflow && bnTarget != 0 && bnTarget <= bnLimit && vHash[i] <= bnTarget)
+            nValidNew++;
+    }
+    int64 nNew = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nValidOld, nValidNew);
+    BOOST_TEST_MESSAGE(strprintf("%u proof-of-work checks: %.2fms with CBigNum, %.2fms with uint256",
+                                 N, 0.001 * nOld, 0.001 * nNew));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
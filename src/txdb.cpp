@@ -6,6 +6,8 @@
 #include "txdb.h"
 #include "main.h"
 #include "hash.h"
+#include "checkqueue.h"
+#include "init.h"
 
 using namespace std;
 
@@ -20,20 +22,181 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+/** Key of an unspent output in the per-output layout: 'o', the txid and the
+    output index big-endian, so that the outputs of a transaction are
+    adjacent and in order */
+class COutputKey
+{
+public:
+    uint256 txid;
+    unsigned int n;
+
+    COutputKey() : txid(0), n(0) {}
+    COutputKey(const uint256 &txidIn, unsigned int nIn) : txid(txidIn), n(nIn) {}
+
+    static const unsigned int SIZE = 37;
+
+    // Parse a database key; false if it is not an output key
+    bool FromSlice(const leveldb::Slice &slKey) {
+        if (slKey.size() != SIZE || slKey.data()[0] != 'o')
+            return false;
+        const unsigned char *p = (const unsigned char*)slKey.data();
+        memcpy(txid.begin(), p + 1, 32);
+        n = ((unsigned int)p[33] << 24) | ((unsigned int)p[34] << 16) | ((unsigned int)p[35] << 8) | p[36];
+        return true;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return SIZE;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned char buf[SIZE];
+        buf[0] = 'o';
+        memcpy(buf + 1, txid.begin(), 32);
+        buf[33] = n >> 24;
+        buf[34] = n >> 16;
+        buf[35] = n >> 8;
+        buf[36] = n;
+        s.write((const char*)buf, SIZE);
+    }
+};
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), fPerOutput(false) {
+    unsigned char nLayout = 0;
+    if (db.Read('L', nLayout))
+        fPerOutput = (nLayout == 1);
+}
+
+// Outputs are stored with their transaction's metadata, in the compact form of undo data
+bool CCoinsViewDB::ReadOutputs(const uint256 &txid, CCoins &coins) {
+    coins = CCoins();
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << COutputKey(txid, 0);
+    bool fFound = false;
+    leveldb::Iterator *pcursor = db.NewIterator();
+    try {
+        for (pcursor->Seek(leveldb::Slice(&ssKey[0], ssKey.size())); pcursor->Valid(); pcursor->Next()) {
+            COutputKey key;
+            if (!key.FromSlice(pcursor->key()) || key.txid != txid)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CTxInUndo output;
+            ssValue >> output;
+            if (key.n >= coins.vout.size())
+                coins.vout.resize(key.n + 1);
+            coins.vout[key.n] = output.txout;
+            coins.fCoinBase = output.fCoinBase;
+            coins.nHeight = output.nHeight;
+            coins.nVersion = output.nVersion;
+            fFound = true;
+        }
+    } catch (std::exception &e) {
+        fFound = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
+    delete pcursor;
+    return fFound;
+}
+
+void CCoinsViewDB::BatchWriteOutputs(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry) {
+    const CCoins &coins = entry.coins;
+    unsigned int nOutputs = std::max((unsigned int)coins.vout.size(), entry.nBaseOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        bool fUnspent = coins.IsAvailable(i);
+        bool fBaseUnspent = entry.IsBaseUnspent(i);
+        // beyond BASE_BITS the base is not known exactly, so unspent outputs are rewritten
+        if (fUnspent && (!fBaseUnspent || i >= CCoinsCacheEntry::BASE_BITS))
+            batch.Write(COutputKey(txid, i), CTxInUndo(coins.vout[i], coins.fCoinBase, coins.nHeight, coins.nVersion));
+        else if (!fUnspent && fBaseUnspent)
+            batch.Erase(COutputKey(txid, i));
+    }
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
+    if (fPerOutput)
+        return ReadOutputs(txid, coins);
     return db.Read(make_pair('c', txid), coins); 
 }
 
+/** Closure reading the coins of one txid from the coin database */
+class CCoinsRead
+{
+private:
+    CCoinsViewDB *pview;
+    uint256 txid;
+    CCoins *pcoins;
+    char *pfFound;
+
+public:
+    CCoinsRead() : pview(NULL), pcoins(NULL), pfFound(NULL) {}
+    CCoinsRead(CCoinsViewDB &view, const uint256 &txidIn, CCoins &coins, char &fFound) :
+        pview(&view), txid(txidIn), pcoins(&coins), pfFound(&fFound) {}
+
+    bool operator()() {
+        try {
+            *pfFound = pview->GetCoins(txid, *pcoins);
+        } catch (std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+
+    void swap(CCoinsRead &read) {
+        std::swap(pview, read.pview);
+        std::swap(txid, read.txid);
+        std::swap(pcoins, read.pcoins);
+        std::swap(pfFound, read.pfFound);
+    }
+};
+
+static CCheckQueue<CCoinsRead> coinsreadqueue(4);
+
+void ThreadCoinsRead() {
+    RenameThread("bitcoin-coinsrd");
+    coinsreadqueue.Thread();
+}
+
+// Only used with cs_main held, so the queue has a single master
+void CCoinsViewDB::GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound) {
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), 0);
+    if (nScriptCheckThreads && vTxids.size() > 1) {
+        CCheckQueueControl<CCoinsRead> control(&coinsreadqueue);
+        std::vector<CCoinsRead> vReads;
+        vReads.reserve(vTxids.size());
+        for (unsigned int i = 0; i < vTxids.size(); i++)
+            vReads.push_back(CCoinsRead(*this, vTxids[i], vCoins[i], vFound[i]));
+        control.Add(vReads);
+        if (control.Wait())
+            return;
+        // a read failed; redo them here, so that the error is reported as for a single read
+    }
+    for (unsigned int i = 0; i < vTxids.size(); i++)
+        vFound[i] = GetCoins(vTxids[i], vCoins[i]);
+}
+
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
     CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
+    if (fPerOutput) {
+        CCoinsCacheEntry entry;
+        CCoins coinsOld;
+        if (ReadOutputs(txid, coinsOld))
+            entry.SetBase(coinsOld);
+        entry.coins = coins;
+        BatchWriteOutputs(batch, txid, entry);
+    } else {
+        BatchWriteCoins(batch, txid, coins);
+    }
     return db.WriteBatch(batch);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
+    if (fPerOutput) {
+        CCoins coins;
+        return ReadOutputs(txid, coins);
+    }
     return db.Exists(make_pair('c', txid)); 
 }
 
@@ -41,7 +204,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -53,15 +216,27 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    unsigned int nChanged = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // coins that were created and spent in the cache were never written
+        if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+            continue;
+        if (fPerOutput)
+            BatchWriteOutputs(batch, it->first, it->second);
+        else
+            BatchWriteCoins(batch, it->first, it->second.coins);
+        nChanged++;
+    }
+    // The best block marker goes last, in the same atomic batch: after a
+    // crash the database is either at the old block or at the new one
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
+    printf("Committing %u changed transactions (out of %u) to coin database...\n", nChanged, (unsigned int)mapCoins.size());
     return db.WriteBatch(batch);
 }
 
@@ -111,57 +286,246 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
+// The coins are scanned in this many ranges of the first txid byte
+static const unsigned int STATS_RANGES = 64;
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
+/** A scan of the coin database snapshot, shared by the threads running it */
+class CStatsScan
+{
+public:
+    CLevelDB &db;
+    const leveldb::Snapshot *psnapshot;
+    boost::mutex mutex;
+    unsigned int nNextRange;
+    bool fOk;
+    CCoinsStatsDelta total;
+
+    CStatsScan(CLevelDB &dbIn) : db(dbIn), psnapshot(dbIn.GetSnapshot()), nNextRange(0), fOk(true) {}
+    ~CStatsScan() { db.ReleaseSnapshot(psnapshot); }
+};
+
+// Add the records of layout chType whose txid starts with a byte in [nBegin, nEnd)
+static void ScanStatsRange(CStatsScan &scan, char chType, unsigned int nBegin, unsigned int nEnd, CCoinsStatsDelta &delta, BN_CTX *pctx) {
+    leveldb::Iterator *pcursor = scan.db.NewIterator(scan.psnapshot);
+    char pchStart[2] = {chType, (char)nBegin};
+    // outputs of the transaction being collected, in the per-output layout
+    uint256 txhashOutputs;
+    CCoins coinsOutputs;
+    bool fOutputs = false;
+    for (pcursor->Seek(leveldb::Slice(pchStart, 2)); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() < 2 || slKey.data()[0] != chType || (unsigned char)slKey.data()[1] >= nEnd)
+            break;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        if (chType == 'c') {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chKey;
+            uint256 txhash;
+            ssKey >> chKey >> txhash;
+            CCoins coins;
+            ssValue >> coins;
+            delta.Update(txhash, CCoins(), coins, pctx);
+        } else {
+            COutputKey key;
+            if (!key.FromSlice(slKey))
+                throw std::runtime_error("invalid output key");
+            if (fOutputs && key.txid != txhashOutputs) {
+                delta.Update(txhashOutputs, CCoins(), coinsOutputs, pctx);
+                coinsOutputs = CCoins();
+            }
+            txhashOutputs = key.txid;
+            fOutputs = true;
+            CTxInUndo output;
+            ssValue >> output;
+            if (key.n >= coinsOutputs.vout.size())
+                coinsOutputs.vout.resize(key.n + 1);
+            coinsOutputs.vout[key.n] = output.txout;
+            coinsOutputs.fCoinBase = output.fCoinBase;
+            coinsOutputs.nHeight = output.nHeight;
+            coinsOutputs.nVersion = output.nVersion;
+        }
+    }
+    delete pcursor;
+    if (fOutputs)
+        delta.Update(txhashOutputs, CCoins(), coinsOutputs, pctx);
+}
+
+// Take ranges off the scan until none are left. The set hash and the totals
+// do not depend on the order, so each thread keeps its own and they are
+// combined at the end.
+static void ThreadStatsScan(CStatsScan *pscan) {
+    RenameThread("bitcoin-stats");
+    CAutoBN_CTX pctx;
+    CCoinsStatsDelta delta;
+    bool fOk = true;
+    loop {
+        unsigned int nRange;
+        {
+            boost::unique_lock<boost::mutex> lock(pscan->mutex);
+            if (!pscan->fOk || pscan->nNextRange == STATS_RANGES)
+                break;
+            nRange = pscan->nNextRange++;
+        }
+        if (ShutdownRequested()) {
+            fOk = false;
+            break;
+        }
+        unsigned int nBegin = nRange * 256 / STATS_RANGES, nEnd = (nRange + 1) * 256 / STATS_RANGES;
         try {
+            // both layouts, as a conversion may have been interrupted
+            ScanStatsRange(*pscan, 'c', nBegin, nEnd, delta, pctx);
+            ScanStatsRange(*pscan, 'o', nBegin, nEnd, delta, pctx);
+        } catch (std::exception &e) {
+            error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            fOk = false;
+            break;
+        }
+    }
+    boost::unique_lock<boost::mutex> lock(pscan->mutex);
+    pscan->fOk = pscan->fOk && fOk;
+    pscan->total.Combine(delta, pctx);
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    CStatsScan scan(db);
+
+    // the best block as of the snapshot
+    leveldb::Iterator *pcursor = db.NewIterator(scan.psnapshot);
+    pcursor->Seek(leveldb::Slice("B", 1));
+    bool fBest = pcursor->Valid() && pcursor->key() == leveldb::Slice("B", 1);
+    if (fBest) {
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+        try {
+            ssValue >> stats.hashBlock;
+        } catch (std::exception &e) {
+            fBest = false;
+        }
+    }
+    delete pcursor;
+    if (!fBest)
+        return error("%s() : no best block", __PRETTY_FUNCTION__);
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return error("%s() : best block not in the index", __PRETTY_FUNCTION__);
+        stats.nHeight = mi->second->nHeight;
+    }
+
+    int nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, 16));
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadStatsScan, &scan));
+    threadGroup.join_all();
+    if (!scan.fOk)
+        return false;
+
+    CAutoBN_CTX pctx;
+    stats.nTransactions = 0;
+    stats.nTransactionOutputs = 0;
+    stats.nSerializedSize = 0;
+    stats.nTotalAmount = 0;
+    stats.hashSet = CMuHash3072();
+    stats.Apply(scan.total, pctx);
+    stats.hashSerialized = stats.hashSet.Finalize();
+    return true;
+}
+
+// Write a conversion batch and start a new one
+bool static WriteConvertBatch(CLevelDB &db, CLevelDBBatch &batch, unsigned int &nBatch, uint64 &nConverted) {
+    if (!db.WriteBatch(batch))
+        return false;
+    batch.Clear();
+    nConverted += nBatch;
+    nBatch = 0;
+    printf("Converted %"PRI64u" transactions in the coin database...\n", nConverted);
+    return true;
+}
+
+// Rewrite the records of layout chFrom in the current one. Each batch holds
+// whole transactions, so a transaction is never in both layouts.
+bool CCoinsViewDB::ConvertRecords(char chFrom) {
+    leveldb::Iterator *pcursor = db.NewIterator();
+    CLevelDBBatch batch;
+    unsigned int nBatch = 0;
+    uint64 nConverted = 0;
+    uint256 txhashOutputs;
+    CCoinsCacheEntry entry;
+    bool fOutputs = false;
+    bool fOk = true;
+    try {
+        for (pcursor->Seek(std::string(1, chFrom)); pcursor->Valid(); pcursor->Next()) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
+            if (slKey.size() == 0 || slKey.data()[0] != chFrom)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            if (chFrom == 'c') {
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
                 uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+                ssKey >> chType >> txhash;
+                CCoinsCacheEntry entryTx;
+                ssValue >> entryTx.coins;
+                batch.Erase(make_pair('c', txhash));
+                BatchWriteOutputs(batch, txhash, entryTx);
+                nBatch++;
+                if (nBatch >= 10000 && !(fOk = WriteConvertBatch(db, batch, nBatch, nConverted)))
+                    break;
+            } else {
+                COutputKey key;
+                if (!key.FromSlice(slKey))
+                    break;
+                if (fOutputs && key.txid != txhashOutputs) {
+                    BatchWriteCoins(batch, txhashOutputs, entry.coins);
+                    entry.coins = CCoins();
+                    nBatch++;
+                    // cut between transactions, before the first output of this one is erased
+                    if (nBatch >= 10000 && !(fOk = WriteConvertBatch(db, batch, nBatch, nConverted)))
+                        break;
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                txhashOutputs = key.txid;
+                fOutputs = true;
+                CTxInUndo output;
+                ssValue >> output;
+                if (key.n >= entry.coins.vout.size())
+                    entry.coins.vout.resize(key.n + 1);
+                entry.coins.vout[key.n] = output.txout;
+                entry.coins.fCoinBase = output.fCoinBase;
+                entry.coins.nHeight = output.nHeight;
+                entry.coins.nVersion = output.nVersion;
+                batch.Erase(key);
             }
-            pcursor->Next();
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
+        if (fOk && fOutputs && !entry.coins.vout.empty()) {
+            BatchWriteCoins(batch, txhashOutputs, entry.coins);
+            nBatch++;
+        }
+    } catch (std::exception &e) {
+        delete pcursor;
+        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
     }
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    if (!fOk || !db.WriteBatch(batch))
+        return false;
+    nConverted += nBatch;
+    if (nConverted)
+        printf("Converted %"PRI64u" transactions in the coin database\n", nConverted);
     return true;
 }
 
+bool CCoinsViewDB::SetPerOutput(bool fPerOutputIn) {
+    // Record the layout first, so that an interrupted conversion is finished on the next start
+    fPerOutput = fPerOutputIn;
+    unsigned char nLayout = fPerOutput ? 1 : 0;
+    if (!db.Write('L', nLayout))
+        return false;
+    return ConvertRecords(fPerOutput ? 'c' : 'o');
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
@@ -185,6 +549,70 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+// Block index records read from the database before deserializing them together
+static const unsigned int BLOCKINDEX_BATCH_SIZE = 50000;
+
+static void ThreadDeserializeBlockIndex(const std::vector<std::string> *pvValues, std::vector<CDiskBlockIndex> *pvIndex, unsigned int nBegin, unsigned int nEnd, char *pfOk) {
+    try {
+        for (unsigned int i = nBegin; i < nEnd; i++) {
+            const std::string &strValue = (*pvValues)[i];
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> (*pvIndex)[i];
+        }
+    } catch (std::exception &e) {
+        *pfOk = false;
+    }
+}
+
+// Deserialize a batch of records on all cores, then link them into mapBlockIndex
+static bool LoadBlockIndexBatch(const std::vector<uint256> &vHashes, const std::vector<std::string> &vValues) {
+    std::vector<CDiskBlockIndex> vIndex(vValues.size());
+    int nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, 8));
+    if (vValues.size() < 1000)
+        nThreads = 1;
+    std::vector<char> vOk(nThreads, true);
+    if (nThreads == 1) {
+        ThreadDeserializeBlockIndex(&vValues, &vIndex, 0, vValues.size(), &vOk[0]);
+    } else {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadDeserializeBlockIndex, &vValues, &vIndex,
+                i * vValues.size() / nThreads, (i + 1) * vValues.size() / nThreads, &vOk[i]));
+        threadGroup.join_all();
+    }
+    for (int i = 0; i < nThreads; i++)
+        if (!vOk[i])
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        const CDiskBlockIndex &diskindex = vIndex[i];
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(vHashes[i]);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nDataPos       = diskindex.nDataPos;
+        pindexNew->nUndoPos       = diskindex.nUndoPos;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+        pindexNew->nStatus        = diskindex.nStatus;
+        pindexNew->nTx            = diskindex.nTx;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && vHashes[i] == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex())
+            return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+    }
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -193,51 +621,38 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    // Load mapBlockIndex. The records are keyed by block hash, so it is
+    // taken from the key rather than hashed again from the header.
+    std::vector<uint256> vHashes;
+    std::vector<std::string> vValues;
+    vHashes.reserve(BLOCKINDEX_BATCH_SIZE);
+    vValues.reserve(BLOCKINDEX_BATCH_SIZE);
+    bool fOk = true;
+    while (fOk) {
         boost::this_thread::interruption_point();
-        try {
+        bool fRecord = pcursor->Valid();
+        if (fRecord) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
+            // if shutdown requested or finished loading block index
+            fRecord = slKey.size() == 33 && slKey.data()[0] == 'b';
+            if (fRecord) {
+                uint256 hash;
+                memcpy(hash.begin(), slKey.data() + 1, 32);
+                vHashes.push_back(hash);
                 leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
+                vValues.push_back(std::string(slValue.data(), slValue.size()));
                 pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
+        if (vValues.size() == BLOCKINDEX_BATCH_SIZE || (!fRecord && !vValues.empty())) {
+            fOk = LoadBlockIndexBatch(vHashes, vValues);
+            vHashes.clear();
+            vValues.clear();
+        }
+        if (!fRecord)
+            break;
     }
     delete pcursor;
 
-    return true;
+    return fOk;
 }
@@ -13,18 +13,36 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+    // Whether coins are stored one record per unspent output ('o') rather
+    // than one per transaction ('c'). Reads only look at this layout, so the
+    // other one must be converted by SetPerOutput before the view is used.
+    bool fPerOutput;
+
+    bool ReadOutputs(const uint256 &txid, CCoins &coins);
+    void BatchWriteOutputs(CLevelDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry);
+    bool ConvertRecords(char chFrom);
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
+    void GetCoinsMulti(const std::vector<uint256> &vTxids, std::vector<CCoins> &vCoins, std::vector<char> &vFound);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+
+    // Switch to the per-output or the per-transaction layout, converting the
+    // records still in the other one; an interrupted conversion resumes here
+    bool SetPerOutput(bool fPerOutputIn);
+    bool IsPerOutput() const { return fPerOutput; }
 };
 
+/** Run an instance of the coin database reading thread */
+void ThreadCoinsRead();
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDB
 {
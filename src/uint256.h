@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,10 @@ typedef unsigned long long  uint64;
 
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
+class uint_error : public std::runtime_error {
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
 
 
 /** Base class without constructors for uint256 and uint160.
@@ -180,6 +185,73 @@ public:
     }
 
 
+    base_uint& operator*=(uint32_t b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    base_uint& operator*=(const base_uint& b)
+    {
+        base_uint a = *this;
+        *this = 0;
+        for (int j = 0; j < WIDTH; j++) {
+            uint64 carry = 0;
+            for (int i = 0; i + j < WIDTH; i++) {
+                uint64 n = carry + pn[i + j] + (uint64)a.pn[j] * b.pn[i];
+                pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        return *this;
+    }
+
+    base_uint& operator/=(const base_uint& b)
+    {
+        base_uint div = b;     // make a copy, so we can shift
+        base_uint num = *this; // make a copy, so we can subtract
+        *this = 0;             // the quotient
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0)
+            throw uint_error("Division by zero");
+        if (div_bits > num_bits) // the result is certainly 0
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift; // shift so that div and num align
+        while (shift >= 0) {
+            if (num >= div) {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31)); // set a bit of the result
+            }
+            div >>= 1; // shift back
+            shift--;
+        }
+        // num now contains the remainder of the division
+        return *this;
+    }
+
+    // Position of the highest bit set plus one, or zero if the value is zero
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH-1; pos >= 0; pos--) {
+            if (pn[pos]) {
+                for (int nbits = 31; nbits > 0; nbits--) {
+                    if (pn[pos] & (1U << nbits))
+                        return 32*pos + nbits + 1;
+                }
+                return 32*pos + 1;
+            }
+        }
+        return 0;
+    }
+
     base_uint& operator++()
     {
         // prefix operator
@@ -649,6 +721,51 @@ public:
         else
             *this = 0;
     }
+
+    // Set from the compact representation used for nBits, as CBigNum::SetCompact does:
+    // a one byte base-256 exponent followed by a sign bit and a 23-bit mantissa
+    uint256& SetCompact(unsigned int nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3) {
+            nWord >>= 8*(3-nSize);
+            *this = nWord;
+        } else {
+            *this = nWord;
+            *this <<= 8*(nSize-3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    // Inverse of SetCompact, as CBigNum::GetCompact does. The mantissa is kept
+    // below 0x00800000 so that the sign bit is only set for negative values.
+    unsigned int GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3) {
+            nCompact = Get64() << 8*(3-nSize);
+        } else {
+            uint256 bn = *this;
+            bn >>= 8*(nSize-3);
+            nCompact = bn.Get64();
+        }
+        if (nCompact & 0x00800000) {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        if (fNegative && (nCompact & 0x007fffff) != 0)
+            nCompact |= 0x00800000;
+        return nCompact;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }
@@ -663,6 +780,9 @@ inline const uint256 operator&(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { return uint256(a) |= b; }
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
+inline const uint256 operator/(const base_uint256& a, const base_uint256& b) { return uint256(a) /= b; }
+inline const uint256 operator*(const base_uint256& a, uint32_t b)            { return uint256(a) *= b; }
+inline const uint256 operator*(const base_uint256& a, const base_uint256& b) { return uint256(a) *= b; }
 
 inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }